@@ -0,0 +1,568 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-balance btrfs-dev-balance.c \
+ *     ../lib/btrfs-bench.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem, with
+ * a second device for the convert filters:
+ *
+ * qemu-img create -f raw test-disk.img 4G
+ * qemu-img create -f raw test-device.img 4G
+ * sudo losetup -f test-disk.img
+ * sudo losetup -f test-device.img
+ * sudo mkfs -t btrfs -d single /dev/loopX /dev/loopY
+ * sudo mount /dev/loopX /mnt
+ *
+ * After finishing with the loop devices, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX /dev/loopY
+ */
+
+/*
+ * Filtered balance cost. Before every run -n files of -s bytes are
+ * written and every other one is deleted again, which leaves the data
+ * block groups about half used. Each -F filter set then runs one
+ * BTRFS_IOC_BALANCE_V2 over the data block groups while
+ * BTRFS_IOC_BALANCE_PROGRESS is polled every -i ms:
+ *
+ * sudo ./btrfs-dev-balance  -F usage=30  -F usage=70  -F devid=2 \
+ *     -F convert=raid1,soft
+ *
+ * Filters are usage=N or usage=MIN..MAX, devid=N, limit=N,
+ * convert=single|dup|raid0|raid1|raid10|raid5|raid6|raid1c3|raid1c4
+ * and soft. With -p ms, every filter set is also started once more on
+ * freshly fragmented data, paused with BTRFS_BALANCE_CTL_PAUSE after
+ * -p ms, resumed, and cancelled after another -p ms, timing how long
+ * the balance takes to honour each request; a balance that finished
+ * before a request could land shows '-' instead. After every convert
+ * filter set the data is converted back to the profile it started
+ * with (untimed), so each set starts from the same layout.
+ */
+
+#define MAX_ROUNDS 16
+/* Data, metadata, system and global reserve, a few profiles each. */
+#define SPACE_SLOTS 32
+
+struct profile_name {
+    const char *name;
+    __u64 flags;
+};
+
+static const struct profile_name profiles[] = {
+    { "single", BTRFS_AVAIL_ALLOC_BIT_SINGLE },
+    { "dup", BTRFS_BLOCK_GROUP_DUP },
+    { "raid0", BTRFS_BLOCK_GROUP_RAID0 },
+    { "raid1", BTRFS_BLOCK_GROUP_RAID1 },
+    { "raid10", BTRFS_BLOCK_GROUP_RAID10 },
+    { "raid5", BTRFS_BLOCK_GROUP_RAID5 },
+    { "raid6", BTRFS_BLOCK_GROUP_RAID6 },
+    { "raid1c3", BTRFS_BLOCK_GROUP_RAID1C3 },
+    { "raid1c4", BTRFS_BLOCK_GROUP_RAID1C4 },
+};
+
+struct balance_round {
+    const char *spec;
+    struct btrfs_balance_args filter;
+    __u64 elapsed;
+    __u64 completed;
+    __u64 considered;
+    __u64 pause_ns;
+    __u64 cancel_ns;
+};
+
+/* BTRFS_IOC_BALANCE_V2 blocks, so it runs in its own thread. */
+struct balance_run {
+    pthread_t thread;
+    int volume_fd;
+    struct btrfs_ioctl_balance_args args;
+    int ret;
+    int error;
+    /* Set once the ioctl returned, before the thread exits. */
+    int done;
+};
+
+struct progress_sampler {
+    int volume_fd;
+    __u64 last_completed;
+    __u64 last_ns;
+};
+
+static int parse_filter(const char *spec, struct btrfs_balance_args *filter)
+{
+    char *copy = strdup(spec);
+    char *tok;
+    char *save = NULL;
+    unsigned int i;
+    int ret = 0;
+
+    memset(filter, 0, sizeof(*filter));
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && ret == 0;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(tok, '=');
+
+        if (value != NULL)
+            *value++ = '\0';
+
+        if (strcmp(tok, "soft") == 0) {
+            filter->flags |= BTRFS_BALANCE_ARGS_SOFT;
+        }
+        else if (value == NULL) {
+            ret = -1;
+        }
+        else if (strcmp(tok, "usage") == 0 && strstr(value, "..") != NULL) {
+            filter->usage_min = strtoul(value, NULL, 10);
+            filter->usage_max = strtoul(strstr(value, "..") + 2, NULL, 10);
+            filter->flags |= BTRFS_BALANCE_ARGS_USAGE_RANGE;
+        }
+        else if (strcmp(tok, "usage") == 0) {
+            filter->usage = strtoull(value, NULL, 10);
+            filter->flags |= BTRFS_BALANCE_ARGS_USAGE;
+        }
+        else if (strcmp(tok, "devid") == 0) {
+            filter->devid = strtoull(value, NULL, 10);
+            filter->flags |= BTRFS_BALANCE_ARGS_DEVID;
+        }
+        else if (strcmp(tok, "limit") == 0) {
+            filter->limit = strtoull(value, NULL, 10);
+            filter->flags |= BTRFS_BALANCE_ARGS_LIMIT;
+        }
+        else if (strcmp(tok, "convert") == 0) {
+            for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+                if (strcmp(value, profiles[i].name) == 0)
+                    break;
+            }
+
+            if (i == sizeof(profiles) / sizeof(profiles[0])) {
+                ret = -1;
+            }
+            else {
+                filter->target = profiles[i].flags;
+                filter->flags |= BTRFS_BALANCE_ARGS_CONVERT;
+            }
+        }
+        else {
+            ret = -1;
+        }
+    }
+
+    if (ret < 0)
+        fprintf(stderr, "invalid balance filter: %s\n", spec);
+
+    free(copy);
+
+    return ret;
+}
+
+static void remove_files(const char *dir, int files)
+{
+    char path[BENCH_PATH_MAX];
+    int i;
+
+    for (i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/frag-%d", dir, i);
+        unlink(path);
+    }
+}
+
+/* Leave every data block group about half full. */
+static int fragment(int volume_fd, const char *dir, int files,
+                    __u64 file_size)
+{
+    char path[BENCH_PATH_MAX];
+    int i;
+
+    remove_files(dir, files);
+
+    if (syncfs(volume_fd) < 0 ||
+        bench_populate(dir, "frag", files, files * file_size) < 0 ||
+        syncfs(volume_fd) < 0) {
+        return -1;
+    }
+
+    for (i = 1; i < files; i += 2) {
+        snprintf(path, sizeof(path), "%s/frag-%d", dir, i);
+        unlink(path);
+    }
+
+    if (syncfs(volume_fd) < 0) {
+        perror("syncfs");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *balance_thread(void *data)
+{
+    struct balance_run *run = data;
+
+    run->ret = BENCH_IOCTL(run->volume_fd, BTRFS_IOC_BALANCE_V2, &run->args);
+    run->error = errno;
+    __atomic_store_n(&run->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static int balance_start(struct balance_run *run, int volume_fd,
+                         const struct btrfs_balance_args *filter, __u64 flags)
+{
+    memset(run, 0, sizeof(*run));
+    run->volume_fd = volume_fd;
+    run->args.flags = BTRFS_BALANCE_DATA | flags;
+
+    if (filter != NULL)
+        run->args.data = *filter;
+
+    if (pthread_create(&run->thread, NULL, balance_thread, run) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns 0 when the balance finished, 1 when paused or cancelled. */
+static int balance_join(struct balance_run *run)
+{
+    pthread_join(run->thread, NULL);
+
+    if (run->ret < 0 && run->error == ECANCELED)
+        return 1;
+
+    if (run->ret < 0) {
+        errno = run->error;
+        perror("ioctl BTRFS_IOC_BALANCE_V2");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void sample_progress(__u64 elapsed_ns, void *data)
+{
+    struct progress_sampler *sampler = data;
+    struct btrfs_ioctl_balance_args args;
+    double rate = 0;
+
+    memset(&args, 0, sizeof(args));
+
+    /* ENOTCONN until the balance thread got going, or after it ended. */
+    if (BENCH_IOCTL(sampler->volume_fd, BTRFS_IOC_BALANCE_PROGRESS,
+                    &args) < 0)
+        return;
+
+    if (sampler->last_ns != 0 &&
+        args.stat.completed >= sampler->last_completed)
+        rate = (args.stat.completed - sampler->last_completed) /
+               ((elapsed_ns - sampler->last_ns) / 1e9);
+
+    sampler->last_completed = args.stat.completed;
+    sampler->last_ns = elapsed_ns;
+
+    printf("%.3f,%llu,%llu,%llu,%.2f\n", elapsed_ns / 1e9,
+           args.stat.expected, args.stat.considered, args.stat.completed,
+           rate);
+    fflush(stdout);
+}
+
+static int run_balance(int volume_fd, struct balance_round *round,
+                       __u64 interval_ms)
+{
+    struct progress_sampler sampler = {0};
+    struct balance_run run;
+    struct bench_ticker ticker;
+    __u64 start;
+
+    sampler.volume_fd = volume_fd;
+
+    printf("\n%s\nelapsed_s,expected,considered,completed,chunks_s\n",
+           round->spec);
+
+    start = bench_now_ns();
+
+    if (balance_start(&run, volume_fd, &round->filter, 0) < 0)
+        return -1;
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL,
+                           sample_progress, &sampler) < 0) {
+        balance_join(&run);
+        return -1;
+    }
+
+    if (balance_join(&run) != 0) {
+        bench_ticker_stop(&ticker);
+        return -1;
+    }
+
+    round->elapsed = bench_now_ns() - start;
+    bench_ticker_stop(&ticker);
+
+    round->completed = run.args.stat.completed;
+    round->considered = run.args.stat.considered;
+
+    return 0;
+}
+
+/*
+ * Both controls block until the balance thread has stopped at a chunk
+ * boundary, so the ioctl time is the response latency. ENOTCONN means
+ * no balance is running: either @run has not reached the kernel yet,
+ * in which case the request is retried, or it already finished, which
+ * returns 1 and leaves @elapsed alone.
+ */
+static int balance_ctl(int volume_fd, struct balance_run *run, int cmd,
+                       __u64 *elapsed)
+{
+    for (;;) {
+        __u64 start = bench_now_ns();
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_BALANCE_CTL,
+                        (void *)(long)cmd) == 0) {
+            *elapsed = bench_now_ns() - start;
+            return 0;
+        }
+
+        if (errno != ENOTCONN) {
+            perror("ioctl BTRFS_IOC_BALANCE_CTL");
+            return -1;
+        }
+
+        if (__atomic_load_n(&run->done, __ATOMIC_ACQUIRE))
+            return 1;
+
+        usleep(1000);
+    }
+}
+
+static int run_pause_cancel(int volume_fd, struct balance_round *round,
+                            __u64 delay_ms)
+{
+    struct balance_run run;
+    int ret;
+
+    if (balance_start(&run, volume_fd, &round->filter, 0) < 0)
+        return -1;
+
+    usleep(delay_ms * 1000);
+
+    ret = balance_ctl(volume_fd, &run, BTRFS_BALANCE_CTL_PAUSE,
+                      &round->pause_ns);
+
+    if (ret < 0) {
+        balance_join(&run);
+        return -1;
+    }
+
+    /* Finished before the pause arrived: nothing left to cancel. */
+    if (balance_join(&run) != 1)
+        return 0;
+
+    if (balance_start(&run, volume_fd, NULL, BTRFS_BALANCE_RESUME) < 0)
+        return -1;
+
+    usleep(delay_ms * 1000);
+
+    ret = balance_ctl(volume_fd, &run, BTRFS_BALANCE_CTL_CANCEL,
+                      &round->cancel_ns);
+    balance_join(&run);
+
+    return ret < 0 ? -1 : 0;
+}
+
+/* The data profile holding the most space, as a balance convert target. */
+static int data_profile(int volume_fd, __u64 *profile)
+{
+    struct {
+        struct btrfs_ioctl_space_args args;
+        struct btrfs_ioctl_space_info spaces[SPACE_SLOTS];
+    } space;
+    __u64 best = 0;
+    __u64 i;
+
+    memset(&space, 0, sizeof(space));
+    space.args.space_slots = SPACE_SLOTS;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SPACE_INFO, &space) < 0) {
+        perror("ioctl BTRFS_IOC_SPACE_INFO");
+        return -1;
+    }
+
+    *profile = BTRFS_AVAIL_ALLOC_BIT_SINGLE;
+
+    for (i = 0; i < space.args.total_spaces && i < SPACE_SLOTS; i++) {
+        const struct btrfs_ioctl_space_info *info = &space.spaces[i];
+
+        if (!(info->flags & BTRFS_BLOCK_GROUP_DATA) ||
+            info->total_bytes <= best)
+            continue;
+
+        best = info->total_bytes;
+        *profile = info->flags & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+
+        if (*profile == 0)
+            *profile = BTRFS_AVAIL_ALLOC_BIT_SINGLE;
+    }
+
+    return 0;
+}
+
+/*
+ * Undo a convert filter set, including a convert that was cancelled
+ * half way. soft skips the chunks that already have @profile.
+ */
+static int restore_profile(int volume_fd, __u64 profile)
+{
+    struct btrfs_balance_args filter;
+    struct balance_run run;
+
+    memset(&filter, 0, sizeof(filter));
+    filter.target = profile;
+    filter.flags = BTRFS_BALANCE_ARGS_CONVERT | BTRFS_BALANCE_ARGS_SOFT;
+
+    if (balance_start(&run, volume_fd, &filter, 0) < 0)
+        return -1;
+
+    return balance_join(&run) == 0 ? 0 : -1;
+}
+
+static void print_ctl_ms(__u64 ns)
+{
+    if (ns == 0)
+        printf(" %10s", "-");
+    else
+        printf(" %10.1f", ns / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    struct balance_round rounds[MAX_ROUNDS];
+    char dir[BENCH_PATH_MAX];
+    __u64 profile;
+    __u64 file_size = 4ULL << 20;
+    __u64 interval_ms = 500;
+    __u64 delay_ms = 0;
+    int num_rounds = 0;
+    int files = 512;
+    int volume_fd;
+    int opt;
+    int i;
+
+    memset(rounds, 0, sizeof(rounds));
+
+    while ((opt = getopt(argc, argv, "F:n:s:i:p:")) != -1) {
+        switch (opt) {
+        case 'F':
+            if (num_rounds == MAX_ROUNDS ||
+                parse_filter(optarg, &rounds[num_rounds].filter) < 0) {
+                return 1;
+            }
+
+            rounds[num_rounds++].spec = optarg;
+            break;
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 's':
+            file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            delay_ms = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-F filter,...]... [-n files] "
+                    "[-s file-size] [-i interval-ms] [-p pause-delay-ms]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_rounds == 0) {
+        rounds[0].spec = "usage=50";
+        parse_filter(rounds[0].spec, &rounds[0].filter);
+        num_rounds = 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (data_profile(volume_fd, &profile) < 0) {
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/balance-frag", bench_mnt_path());
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+
+    for (i = 0; i < num_rounds; i++) {
+        if (fragment(volume_fd, dir, files, file_size) < 0 ||
+            run_balance(volume_fd, &rounds[i], interval_ms) < 0) {
+            remove_files(dir, files);
+            return 1;
+        }
+
+        if (delay_ms > 0 &&
+            (fragment(volume_fd, dir, files, file_size) < 0 ||
+             run_pause_cancel(volume_fd, &rounds[i], delay_ms) < 0)) {
+            remove_files(dir, files);
+            return 1;
+        }
+
+        if ((rounds[i].filter.flags & BTRFS_BALANCE_ARGS_CONVERT) &&
+            restore_profile(volume_fd, profile) < 0) {
+            remove_files(dir, files);
+            return 1;
+        }
+    }
+
+    remove_files(dir, files);
+    rmdir(dir);
+
+    printf("\n%-24s %10s %10s %10s %10s %10s %10s\n", "filter", "considered",
+           "relocated", "seconds", "chunks/s", "pause-ms", "cancel-ms");
+
+    for (i = 0; i < num_rounds; i++) {
+        struct balance_round *r = &rounds[i];
+
+        printf("%-24s %10llu %10llu %10.2f %10.2f", r->spec,
+               r->considered, r->completed, r->elapsed / 1e9,
+               r->completed / (r->elapsed / 1e9));
+        print_ctl_ms(r->pause_ns);
+        print_ctl_ms(r->cancel_ns);
+        printf("\n");
+    }
+
+    close(volume_fd);
+
+    return 0;
+}
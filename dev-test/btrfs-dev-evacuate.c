@@ -0,0 +1,349 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-evacuate btrfs-dev-evacuate.c \
+ *     ../lib/btrfs-bench.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem and
+ * the devices that are going to be added to it:
+ *
+ * qemu-img create -f raw test-disk.img 4G
+ * qemu-img create -f raw test-device.img 4G
+ * sudo losetup -f test-disk.img
+ * sudo losetup -f test-device.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loopX /mnt
+ *
+ * After finishing with the loop devices, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX /dev/loopY
+ */
+
+/*
+ * Device evacuation cost. btrfs-dev-test removes devices from an empty
+ * filesystem, where removal has nothing to move. This one first fills
+ * the filesystem until -f percent of the existing devices' space is
+ * allocated, times BTRFS_IOC_ADD_DEV for every device given on the
+ * command line, and then removes device -r with BTRFS_IOC_RM_DEV_V2,
+ * which relocates every chunk on it:
+ *
+ * sudo ./btrfs-dev-evacuate  -f 60  -r 1  -i 500  /dev/loopY
+ *
+ * While the removal runs, bytes_used of every device is sampled with
+ * BTRFS_IOC_DEV_INFO each -i ms and printed as CSV together with the
+ * rate at which the removed device drains. The fill files are deleted
+ * afterwards unless -k is given; the added devices stay in the
+ * filesystem.
+ */
+
+#define MAX_DEVS 64
+#define FILL_STEP (256ULL << 20)
+#define FILL_FILES 4
+
+struct evac_sampler {
+    int volume_fd;
+    int num_devs;
+    __u64 devids[MAX_DEVS];
+    __u64 removed_devid;
+    __u64 last_used;
+    __u64 last_ns;
+    double peak_rate;
+};
+
+static int parse_devid(const char *arg, __u64 *devid)
+{
+    char *end;
+
+    *devid = strtoull(arg, &end, 10);
+
+    if (*end != '\0' || *devid == 0) {
+        fprintf(stderr, "invalid devid: %s\n", arg);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Returns 0 and fills @info, or -1 once the device is gone. */
+static int dev_info(int volume_fd, __u64 devid,
+                    struct btrfs_ioctl_dev_info_args *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->devid = devid;
+
+    return BENCH_IOCTL(volume_fd, BTRFS_IOC_DEV_INFO, info);
+}
+
+static int allocated_percent(int volume_fd, double *percent)
+{
+    struct btrfs_ioctl_dev_info_args *devs;
+    __u64 used = 0, total = 0;
+    int num_devs;
+    int i;
+
+    num_devs = bench_list_devices(volume_fd, &devs);
+
+    if (num_devs <= 0)
+        return -1;
+
+    for (i = 0; i < num_devs; i++) {
+        used += devs[i].bytes_used;
+        total += devs[i].total_bytes;
+    }
+
+    free(devs);
+    *percent = total ? 100.0 * used / total : 0;
+
+    return 0;
+}
+
+/*
+ * Write and sync FILL_STEP at a time until the chunk allocation of the
+ * existing devices reaches @percent. bytes_used counts allocated
+ * chunks, which is what the removal has to relocate.
+ */
+static int fill(int volume_fd, const char *dir, double percent, int *steps,
+                double *reached)
+{
+    char prefix[64];
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return -1;
+    }
+
+    for (;;) {
+        if (allocated_percent(volume_fd, reached) < 0)
+            return -1;
+
+        if (*reached >= percent)
+            return 0;
+
+        snprintf(prefix, sizeof(prefix), "fill-%d", (*steps)++);
+
+        if (bench_populate(dir, prefix, FILL_FILES, FILL_STEP) < 0)
+            return -1;
+
+        if (syncfs(volume_fd) < 0) {
+            perror("syncfs");
+            return -1;
+        }
+    }
+}
+
+static void remove_fill(const char *dir, int steps)
+{
+    char path[BENCH_PATH_MAX];
+    int i;
+    int j;
+
+    for (i = 0; i < steps; i++) {
+        for (j = 0; j < FILL_FILES; j++) {
+            snprintf(path, sizeof(path), "%s/fill-%d-%d", dir, i, j);
+            unlink(path);
+        }
+    }
+
+    rmdir(dir);
+}
+
+static void sample_devices(__u64 elapsed_ns, void *data)
+{
+    struct evac_sampler *sampler = data;
+    struct btrfs_ioctl_dev_info_args info;
+    double rate = 0;
+    int i;
+
+    printf("%.3f", elapsed_ns / 1e9);
+
+    for (i = 0; i < sampler->num_devs; i++) {
+        if (dev_info(sampler->volume_fd, sampler->devids[i], &info) < 0) {
+            printf(",");
+            continue;
+        }
+
+        printf(",%llu", info.bytes_used);
+
+        if (sampler->devids[i] != sampler->removed_devid)
+            continue;
+
+        /* Removal shrinks the device extents chunk by chunk. */
+        if (sampler->last_ns != 0 && info.bytes_used <= sampler->last_used)
+            rate = (sampler->last_used - info.bytes_used) / 1048576.0 /
+                   ((elapsed_ns - sampler->last_ns) / 1e9);
+
+        sampler->last_used = info.bytes_used;
+        sampler->last_ns = elapsed_ns;
+    }
+
+    if (rate > sampler->peak_rate)
+        sampler->peak_rate = rate;
+
+    printf(",%.1f\n", rate);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    struct btrfs_ioctl_vol_args_v2 rm_args = {0};
+    struct btrfs_ioctl_dev_info_args *devs;
+    struct btrfs_ioctl_dev_info_args info;
+    struct evac_sampler sampler = {0};
+    struct bench_ticker ticker;
+    char dir[BENCH_PATH_MAX];
+    double percent = 50;
+    double reached = 0;
+    __u64 interval_ms = 500;
+    __u64 removed_devid = 1;
+    __u64 relocated;
+    __u64 start, elapsed, fill_ns;
+    int keep = 0;
+    int steps = 0;
+    int ret = 1;
+    int volume_fd;
+    int num_devs;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "f:r:i:k")) != -1) {
+        switch (opt) {
+        case 'f':
+            percent = atof(optarg);
+            break;
+        case 'r':
+            if (parse_devid(optarg, &removed_devid) < 0)
+                return 1;
+            break;
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f fill-percent] [-r devid] "
+                    "[-i interval-ms] [-k] device...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "missing args\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (dev_info(volume_fd, removed_devid, &info) < 0) {
+        perror("ioctl BTRFS_IOC_DEV_INFO");
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/evacuate-fill", bench_mnt_path());
+    start = bench_now_ns();
+
+    if (fill(volume_fd, dir, percent, &steps, &reached) < 0) {
+        remove_fill(dir, steps);
+        return 1;
+    }
+
+    fill_ns = bench_now_ns() - start;
+    printf("filled to %.1f%% allocated in %.1f s (%llu MiB written)\n",
+           reached, fill_ns / 1e9,
+           steps * FILL_STEP / 1048576);
+
+    for (i = optind; i < argc; i++) {
+        struct btrfs_ioctl_vol_args args = {0};
+
+        strncpy(args.name, argv[i], BTRFS_PATH_NAME_MAX);
+        start = bench_now_ns();
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
+            perror("ioctl BTRFS_IOC_ADD_DEV");
+            goto out;
+        }
+
+        printf("add %s: %.1f ms\n", argv[i], (bench_now_ns() - start) / 1e6);
+    }
+
+    num_devs = bench_list_devices(volume_fd, &devs);
+
+    if (num_devs <= 0) {
+        goto out;
+    }
+
+    sampler.volume_fd = volume_fd;
+    sampler.removed_devid = removed_devid;
+    sampler.num_devs = num_devs < MAX_DEVS ? num_devs : MAX_DEVS;
+
+    printf("\nelapsed_s");
+
+    for (i = 0; i < sampler.num_devs; i++) {
+        sampler.devids[i] = devs[i].devid;
+        printf(",dev%llu_used", devs[i].devid);
+    }
+
+    printf(",drain_mib_s\n");
+    free(devs);
+
+    if (dev_info(volume_fd, removed_devid, &info) < 0) {
+        perror("ioctl BTRFS_IOC_DEV_INFO");
+        goto out;
+    }
+
+    relocated = info.bytes_used;
+    rm_args.flags = BTRFS_DEVICE_SPEC_BY_ID;
+    rm_args.devid = removed_devid;
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL, sample_devices,
+                           &sampler) < 0) {
+        goto out;
+    }
+
+    start = bench_now_ns();
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RM_DEV_V2, &rm_args) < 0) {
+        perror("ioctl BTRFS_IOC_RM_DEV_V2");
+        bench_ticker_stop(&ticker);
+        goto out;
+    }
+
+    elapsed = bench_now_ns() - start;
+    bench_ticker_stop(&ticker);
+
+    printf("\nremoved devid %llu: %llu MiB relocated in %.1f s, "
+           "%.1f MiB/s average, %.1f MiB/s peak\n",
+           removed_devid, relocated / 1048576, elapsed / 1e9,
+           relocated / 1048576.0 / (elapsed / 1e9), sampler.peak_rate);
+    ret = 0;
+
+out:
+    if (!keep)
+        remove_fill(dir, steps);
+
+    close(volume_fd);
+
+    return ret;
+}
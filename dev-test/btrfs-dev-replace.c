@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-workload.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-replace btrfs-dev-replace.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-workload.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem and
+ * the devices used as replace target and spare:
+ *
+ * qemu-img create -f raw test-disk.img 4G
+ * qemu-img create -f raw test-target.img 4G
+ * qemu-img create -f raw test-spare.img 4G
+ * sudo losetup -f test-disk.img
+ * sudo losetup -f test-target.img
+ * sudo losetup -f test-spare.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loopX /mnt
+ *
+ * After finishing with the loop devices, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX /dev/loopY /dev/loopZ
+ */
+
+/*
+ * Device replace against add+remove. -f bytes are written first, then
+ * a foreground workload (see lib/btrfs-workload) runs for a -d second
+ * baseline and during each evacuation:
+ *
+ *  1. BTRFS_IOC_DEV_REPLACE moves devid -r onto the first device
+ *     argument; BTRFS_IOC_DEV_REPLACE_STATUS is polled every -i ms.
+ *  2. If a spare device is given, it is added with BTRFS_IOC_ADD_DEV
+ *     and the same devid (now the replace target) is removed with
+ *     BTRFS_IOC_RM_DEV_V2, sampling its bytes_used instead.
+ *
+ * sudo ./btrfs-dev-replace  -r 1  -f 2147483648  -w randread  -t 4 \
+ *     /dev/loopY  /dev/loopZ
+ *
+ * Both phases print a CSV series of progress and MiB/s, and the
+ * foreground latency of each phase is printed next to the baseline.
+ * -a makes the replace avoid reading from the source device, as if it
+ * were failing. The fill files are removed afterwards unless -k is
+ * given.
+ */
+
+#define FILL_FILES 16
+
+struct evac_sampler {
+    int volume_fd;
+    const char *phase;
+    __u64 devid;
+    __u64 total;
+    __u64 last_done;
+    __u64 last_ns;
+    double peak_rate;
+};
+
+static void remove_fill(const char *dir)
+{
+    char path[BENCH_PATH_MAX];
+    int i;
+
+    for (i = 0; i < FILL_FILES; i++) {
+        if (snprintf(path, sizeof(path), "%s/fill-%d", dir,
+                     i) < (int)sizeof(path))
+            unlink(path);
+    }
+
+    rmdir(dir);
+}
+
+static int dev_info(int volume_fd, __u64 devid,
+                    struct btrfs_ioctl_dev_info_args *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->devid = devid;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_DEV_INFO, info) < 0) {
+        perror("ioctl BTRFS_IOC_DEV_INFO");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void sample_rate(struct evac_sampler *sampler, __u64 elapsed_ns,
+                        __u64 done, int permille)
+{
+    double rate = 0;
+
+    if (sampler->last_ns != 0 && done >= sampler->last_done)
+        rate = (done - sampler->last_done) / 1048576.0 /
+               ((elapsed_ns - sampler->last_ns) / 1e9);
+
+    if (rate > sampler->peak_rate)
+        sampler->peak_rate = rate;
+
+    sampler->last_done = done;
+    sampler->last_ns = elapsed_ns;
+
+    printf("%s,%.3f,%d,%llu,%.1f\n", sampler->phase, elapsed_ns / 1e9,
+           permille, done, rate);
+    fflush(stdout);
+}
+
+/* progress_1000 scaled by the bytes the source had allocated. */
+static void sample_replace(__u64 elapsed_ns, void *data)
+{
+    struct evac_sampler *sampler = data;
+    struct btrfs_ioctl_dev_replace_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.cmd = BTRFS_IOCTL_DEV_REPLACE_CMD_STATUS;
+
+    if (BENCH_IOCTL(sampler->volume_fd, BTRFS_IOC_DEV_REPLACE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_DEV_REPLACE");
+        return;
+    }
+
+    sample_rate(sampler, elapsed_ns,
+                sampler->total / 1000 * args.status.progress_1000,
+                args.status.progress_1000);
+}
+
+/* The removed device drains chunk by chunk. */
+static void sample_remove(__u64 elapsed_ns, void *data)
+{
+    struct evac_sampler *sampler = data;
+    struct btrfs_ioctl_dev_info_args info;
+    __u64 done;
+
+    memset(&info, 0, sizeof(info));
+    info.devid = sampler->devid;
+
+    if (BENCH_IOCTL(sampler->volume_fd, BTRFS_IOC_DEV_INFO, &info) < 0)
+        return;
+
+    done = sampler->total > info.bytes_used ?
+           sampler->total - info.bytes_used : 0;
+    sample_rate(sampler, elapsed_ns, done,
+                sampler->total ? done * 1000 / sampler->total : 1000);
+}
+
+static int run_replace(int volume_fd, __u64 devid, const char *target,
+                       int avoid_srcdev)
+{
+    struct btrfs_ioctl_dev_replace_args args;
+
+    memset(&args, 0, sizeof(args));
+    args.cmd = BTRFS_IOCTL_DEV_REPLACE_CMD_START;
+    args.start.srcdevid = devid;
+    args.start.cont_reading_from_srcdev_mode = avoid_srcdev ?
+        BTRFS_IOCTL_DEV_REPLACE_CONT_READING_FROM_SRCDEV_MODE_AVOID :
+        BTRFS_IOCTL_DEV_REPLACE_CONT_READING_FROM_SRCDEV_MODE_ALWAYS;
+    strncpy((char *)args.start.tgtdev_name, target,
+            BTRFS_DEVICE_PATH_NAME_MAX);
+
+    /* Blocks until the copy is done; the status is polled meanwhile. */
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_DEV_REPLACE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_DEV_REPLACE");
+        return -1;
+    }
+
+    if (args.result != BTRFS_IOCTL_DEV_REPLACE_RESULT_NO_ERROR) {
+        fprintf(stderr, "dev replace failed: result %llu\n", args.result);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_add_remove(int volume_fd, __u64 devid, const char *spare)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    struct btrfs_ioctl_vol_args_v2 rm_args = {0};
+
+    strncpy(args.name, spare, BTRFS_PATH_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
+        perror("ioctl BTRFS_IOC_ADD_DEV");
+        return -1;
+    }
+
+    rm_args.flags = BTRFS_DEVICE_SPEC_BY_ID;
+    rm_args.devid = devid;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RM_DEV_V2, &rm_args) < 0) {
+        perror("ioctl BTRFS_IOC_RM_DEV_V2");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Run one evacuation under the foreground workload with its sampler
+ * ticking. Returns the elapsed time or 0 on failure.
+ */
+static __u64 evacuate(int volume_fd, struct workload *workload,
+                      struct evac_sampler *sampler, bench_tick_cb cb,
+                      __u64 interval_ms, const char *device, int avoid)
+{
+    struct bench_ticker ticker;
+    __u64 start, elapsed;
+    int ret;
+
+    if (workload_start(workload) < 0)
+        return 0;
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL, cb,
+                           sampler) < 0) {
+        workload_stop(workload);
+        return 0;
+    }
+
+    start = bench_now_ns();
+
+    if (cb == sample_replace)
+        ret = run_replace(volume_fd, sampler->devid, device, avoid);
+    else
+        ret = run_add_remove(volume_fd, sampler->devid, device);
+
+    elapsed = bench_now_ns() - start;
+    bench_ticker_stop(&ticker);
+    workload_stop(workload);
+
+    return ret < 0 ? 0 : elapsed;
+}
+
+static void print_summary(const struct evac_sampler *sampler, __u64 elapsed)
+{
+    printf("%-12s %10llu %10.2f %10.1f %10.1f\n", sampler->phase,
+           sampler->total / 1048576, elapsed / 1e9,
+           sampler->total / 1048576.0 / (elapsed / 1e9), sampler->peak_rate);
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct workload_opts opts = {0};
+    struct workload workload = {0};
+    struct btrfs_ioctl_dev_info_args info;
+    struct evac_sampler replace = {0};
+    struct evac_sampler add_remove = {0};
+    char dir[BENCH_PATH_MAX];
+    __u64 baseline_secs = 10;
+    __u64 fill_bytes = 1ULL << 30;
+    __u64 interval_ms = 500;
+    __u64 devid = 1;
+    __u64 replace_ns, remove_ns = 0;
+    int avoid = 0;
+    int keep = 0;
+    int ret = 1;
+    int opt;
+
+    opts.type = WORKLOAD_RANDREAD;
+    opts.dir = bench_mnt_path();
+    opts.threads = 1;
+    opts.file_size = 256ULL << 20;
+    opts.block_size = 4096;
+
+    while ((opt = getopt(argc, argv, "r:f:i:akw:t:s:b:d:D")) != -1) {
+        switch (opt) {
+        case 'r':
+            devid = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            fill_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'a':
+            avoid = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'w':
+            if (workload_parse_type(optarg, &opts.type) < 0) {
+                return 1;
+            }
+            break;
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 's':
+            opts.file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            opts.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            baseline_secs = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            opts.direct = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r devid] [-f fill-bytes] "
+                    "[-i interval-ms] [-a] [-k] [-w workload] [-t threads] "
+                    "[-s file-size] [-b block-size] [-d baseline-secs] "
+                    "[-D] target [spare]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "missing args\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/replace-fill", bench_mnt_path());
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+
+    if (bench_populate(dir, "fill", FILL_FILES, fill_bytes) < 0 ||
+        syncfs(volume_fd) < 0) {
+        goto out;
+    }
+
+    if (workload_prepare(&workload, &opts) < 0) {
+        goto out;
+    }
+
+    printf("workload: %s, %d threads, %u byte blocks%s\n\n",
+           workload_type_name(opts.type), opts.threads, opts.block_size,
+           opts.direct ? ", O_DIRECT" : "");
+
+    if (workload_start(&workload) < 0) {
+        goto out;
+    }
+
+    sleep(baseline_secs);
+    workload_stop(&workload);
+    workload_print_header(stdout);
+    workload_print(stdout, "baseline", &workload);
+
+    if (dev_info(volume_fd, devid, &info) < 0) {
+        goto out;
+    }
+
+    replace.volume_fd = volume_fd;
+    replace.phase = "replace";
+    replace.devid = devid;
+    replace.total = info.bytes_used;
+
+    printf("\nphase,elapsed_s,permille,bytes_done,mib_s\n");
+
+    replace_ns = evacuate(volume_fd, &workload, &replace, sample_replace,
+                          interval_ms, argv[optind], avoid);
+
+    if (replace_ns == 0) {
+        goto out;
+    }
+
+    workload_print_header(stdout);
+    workload_print(stdout, "during-replace", &workload);
+
+    /* The target took over the devid, so remove it again from there. */
+    if (optind + 1 < argc) {
+        if (dev_info(volume_fd, devid, &info) < 0) {
+            goto out;
+        }
+
+        add_remove.volume_fd = volume_fd;
+        add_remove.phase = "add-remove";
+        add_remove.devid = devid;
+        add_remove.total = info.bytes_used;
+
+        printf("\nphase,elapsed_s,permille,bytes_done,mib_s\n");
+
+        remove_ns = evacuate(volume_fd, &workload, &add_remove,
+                             sample_remove, interval_ms, argv[optind + 1], 0);
+
+        if (remove_ns == 0) {
+            goto out;
+        }
+
+        workload_print_header(stdout);
+        workload_print(stdout, "during-remove", &workload);
+    }
+
+    printf("\n%-12s %10s %10s %10s %10s\n", "method", "MiB", "seconds",
+           "avg-MiB/s", "peak-MiB/s");
+    print_summary(&replace, replace_ns);
+
+    if (remove_ns > 0)
+        print_summary(&add_remove, remove_ns);
+
+    ret = 0;
+
+out:
+    /* Safe before workload_prepare() too, the workload is zeroed. */
+    workload_destroy(&workload, 1);
+
+    if (!keep)
+        remove_fill(dir);
+
+    return ret;
+}
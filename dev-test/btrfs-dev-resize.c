@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-workload.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-resize btrfs-dev-resize.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-workload.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 8G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loopX /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Online resize cost. For every -f fill level (percent of devid -r
+ * allocated, ascending) the device is resized with BTRFS_IOC_RESIZE
+ * to each -S size in MiB in turn and finally back to its full size.
+ * A shrink has to relocate every chunk past the new end first, so it
+ * gets slower as the fill level rises, while a grow only updates the
+ * device item:
+ *
+ * sudo ./btrfs-dev-resize  -r 1  -f 20,50,80  -S 6144,4096,8192
+ *
+ * DEV_INFO total_bytes and bytes_used are sampled every -i ms during
+ * each resize and printed as CSV. A foreground workload runs during
+ * every resize, and its p99 and worst latency are reported per resize
+ * next to a -d second baseline.
+ */
+
+#define MAX_ROUNDS 16
+#define FILL_STEP (256ULL << 20)
+#define FILL_FILES 4
+
+struct resize_sampler {
+    int volume_fd;
+    __u64 devid;
+    int fill;
+    __u64 target;
+};
+
+struct resize_result {
+    int fill;
+    __u64 from;
+    __u64 to;
+    __u64 elapsed;
+    double p99_ms;
+    double max_ms;
+    int failed;
+};
+
+static int dev_info(int volume_fd, __u64 devid,
+                    struct btrfs_ioctl_dev_info_args *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->devid = devid;
+
+    return BENCH_IOCTL(volume_fd, BTRFS_IOC_DEV_INFO, info);
+}
+
+/* Fill until @percent of the device's current size is allocated. */
+static int fill(int volume_fd, __u64 devid, const char *dir, int percent,
+                int *steps)
+{
+    struct btrfs_ioctl_dev_info_args info;
+    char prefix[64];
+
+    for (;;) {
+        if (dev_info(volume_fd, devid, &info) < 0) {
+            perror("ioctl BTRFS_IOC_DEV_INFO");
+            return -1;
+        }
+
+        if (info.bytes_used * 100 >= info.total_bytes * percent)
+            return 0;
+
+        snprintf(prefix, sizeof(prefix), "fill-%d", (*steps)++);
+
+        if (bench_populate(dir, prefix, FILL_FILES, FILL_STEP) < 0)
+            return -1;
+
+        if (syncfs(volume_fd) < 0) {
+            perror("syncfs");
+            return -1;
+        }
+    }
+}
+
+static void remove_fill(const char *dir, int steps)
+{
+    char path[BENCH_PATH_MAX];
+    int i;
+    int j;
+
+    for (i = 0; i < steps; i++) {
+        for (j = 0; j < FILL_FILES; j++) {
+            if (snprintf(path, sizeof(path), "%s/fill-%d-%d", dir, i,
+                         j) < (int)sizeof(path))
+                unlink(path);
+        }
+    }
+
+    rmdir(dir);
+}
+
+static void sample_device(__u64 elapsed_ns, void *data)
+{
+    struct resize_sampler *sampler = data;
+    struct btrfs_ioctl_dev_info_args info;
+
+    if (dev_info(sampler->volume_fd, sampler->devid, &info) < 0)
+        return;
+
+    printf("%d,%llu,%.3f,%llu,%llu\n", sampler->fill,
+           sampler->target / 1048576, elapsed_ns / 1e9, info.total_bytes,
+           info.bytes_used);
+    fflush(stdout);
+}
+
+static int resize(int volume_fd, struct workload *workload,
+                  struct resize_sampler *sampler, __u64 interval_ms,
+                  struct resize_result *result)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    struct bench_ticker ticker;
+    __u64 start;
+    int ret;
+
+    snprintf(args.name, sizeof(args.name), "%llu:%llu", sampler->devid,
+             sampler->target);
+
+    if (workload_start(workload) < 0)
+        return -1;
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL, sample_device,
+                           sampler) < 0) {
+        workload_stop(workload);
+        return -1;
+    }
+
+    start = bench_now_ns();
+    ret = BENCH_IOCTL(volume_fd, BTRFS_IOC_RESIZE, &args);
+    result->elapsed = bench_now_ns() - start;
+
+    bench_ticker_stop(&ticker);
+    workload_stop(workload);
+
+    result->p99_ms = bench_hist_percentile(workload->hist, 99.0) / 1e6;
+    result->max_ms = workload->hist->max / 1e6;
+
+    /* ENOSPC: the remaining chunks do not fit below the new end. */
+    if (ret < 0) {
+        perror("ioctl BTRFS_IOC_RESIZE");
+        result->failed = 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct workload_opts opts = {0};
+    struct workload workload;
+    struct btrfs_ioctl_dev_info_args info;
+    struct resize_sampler sampler = {0};
+    struct resize_result *results;
+    int fills[MAX_ROUNDS] = {20, 50, 80};
+    int sizes[MAX_ROUNDS] = {0};
+    int num_fills = 3;
+    int num_sizes = 0;
+    int num_results = 0;
+    char dir[BENCH_PATH_MAX];
+    __u64 baseline_secs = 10;
+    __u64 interval_ms = 200;
+    __u64 devid = 1;
+    __u64 full_size;
+    double base_p99, base_max;
+    int steps = 0;
+    int opt;
+    int f;
+    int s;
+
+    opts.type = WORKLOAD_RANDREAD;
+    opts.dir = bench_mnt_path();
+    opts.threads = 1;
+    opts.file_size = 256ULL << 20;
+    opts.block_size = 4096;
+
+    while ((opt = getopt(argc, argv, "r:f:S:i:w:t:s:b:d:D")) != -1) {
+        switch (opt) {
+        case 'r':
+            devid = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            num_fills = bench_parse_list(optarg, fills, MAX_ROUNDS, 0);
+
+            if (num_fills < 0) {
+                return 1;
+            }
+            break;
+        case 'S':
+            num_sizes = bench_parse_list(optarg, sizes, MAX_ROUNDS - 1, 1);
+
+            if (num_sizes < 0) {
+                return 1;
+            }
+            break;
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            if (workload_parse_type(optarg, &opts.type) < 0) {
+                return 1;
+            }
+            break;
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 's':
+            opts.file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            opts.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            baseline_secs = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            opts.direct = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r devid] [-f fill-percent,...] "
+                    "[-S size-mib,...] [-i interval-ms] [-w workload] "
+                    "[-t threads] [-s file-size] [-b block-size] "
+                    "[-d baseline-secs] [-D]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (dev_info(volume_fd, devid, &info) < 0) {
+        perror("ioctl BTRFS_IOC_DEV_INFO");
+        return 1;
+    }
+
+    full_size = info.total_bytes;
+
+    /* Default: shrink to three quarters and half, then grow back. */
+    if (num_sizes == 0) {
+        sizes[num_sizes++] = full_size * 3 / 4 / 1048576;
+        sizes[num_sizes++] = full_size / 2 / 1048576;
+    }
+
+    results = calloc(num_fills * (num_sizes + 1), sizeof(*results));
+
+    if (results == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    snprintf(dir, sizeof(dir), "%s/resize-fill", bench_mnt_path());
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+
+    if (workload_prepare(&workload, &opts) < 0) {
+        return 1;
+    }
+
+    if (workload_start(&workload) < 0) {
+        return 1;
+    }
+
+    sleep(baseline_secs);
+    workload_stop(&workload);
+    base_p99 = bench_hist_percentile(workload.hist, 99.0) / 1e6;
+    base_max = workload.hist->max / 1e6;
+
+    sampler.volume_fd = volume_fd;
+    sampler.devid = devid;
+
+    printf("fill,target_mib,elapsed_s,total_bytes,bytes_used\n");
+
+    for (f = 0; f < num_fills; f++) {
+        if (fill(volume_fd, devid, dir, fills[f], &steps) < 0) {
+            break;
+        }
+
+        sampler.fill = fills[f];
+
+        for (s = 0; s <= num_sizes; s++) {
+            struct resize_result *result = &results[num_results];
+
+            if (dev_info(volume_fd, devid, &info) < 0) {
+                perror("ioctl BTRFS_IOC_DEV_INFO");
+                break;
+            }
+
+            sampler.target = s < num_sizes ? sizes[s] * 1048576ULL :
+                             full_size;
+            result->fill = fills[f];
+            result->from = info.total_bytes;
+            result->to = sampler.target;
+
+            if (resize(volume_fd, &workload, &sampler, interval_ms,
+                       result) < 0) {
+                break;
+            }
+
+            /* Only complete rows make it into the table. */
+            num_results++;
+        }
+    }
+
+    printf("\nworkload: %s, %d threads, baseline p99 %.2f ms, "
+           "max %.2f ms\n\n", workload_type_name(opts.type), opts.threads,
+           base_p99, base_max);
+    printf("%6s %10s %10s %10s %10s %10s %8s\n", "fill", "from-MiB",
+           "to-MiB", "seconds", "fg-p99-ms", "fg-max-ms", "result");
+
+    for (s = 0; s < num_results; s++) {
+        struct resize_result *r = &results[s];
+
+        printf("%5d%% %10llu %10llu %10.2f %10.2f %10.2f %8s\n", r->fill,
+               r->from / 1048576, r->to / 1048576, r->elapsed / 1e9,
+               r->p99_ms, r->max_ms, r->failed ? "failed" : "ok");
+    }
+
+    /* Leave the device at its original size whatever failed above. */
+    {
+        struct btrfs_ioctl_vol_args args = {0};
+
+        snprintf(args.name, sizeof(args.name), "%llu:%llu", devid, full_size);
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RESIZE, &args) < 0)
+            perror("ioctl BTRFS_IOC_RESIZE");
+    }
+
+    remove_fill(dir, steps);
+    workload_destroy(&workload, 1);
+    free(results);
+
+    return 0;
+}
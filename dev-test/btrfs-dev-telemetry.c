@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-telemetry.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-telemetry btrfs-dev-telemetry.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-telemetry.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 1G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Device error and space telemetry (see lib/btrfs-telemetry). Every -i
+ * ms all devices' GET_DEV_STATS counters, DEV_INFO sizes and the
+ * SPACE_INFO totals are sampled into a -c record ring, which the main
+ * thread flushes to -o (stdout by default) as CSV, or as binary
+ * records with -b. Runs for -d seconds, or until interrupted when -d
+ * is 0:
+ *
+ * sudo ./btrfs-dev-telemetry  -i 1000  -d 0  -b  -o /var/log/btrfs.tel
+ *
+ * With -B N the sampler is not started; instead N samples are taken
+ * back to back to measure the per-sample latency and CPU time, the
+ * cost of flushing a record in both formats, and the CPU share a
+ * sampler at 1 Hz would use.
+ */
+
+static volatile sig_atomic_t stop;
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void tick(__u64 elapsed_ns, void *data)
+{
+    (void)elapsed_ns;
+    telemetry_sample(data);
+}
+
+static __u64 cpu_ns(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+static __u64 time_flush(struct telemetry *tel, int samples, int binary,
+                        __u64 *records)
+{
+    FILE *out = fopen("/dev/null", "w");
+    __u64 elapsed = 0;
+    int i;
+
+    if (out == NULL) {
+        perror("fopen /dev/null");
+        return 0;
+    }
+
+    *records = 0;
+
+    for (i = 0; i < samples; i++) {
+        __u64 start;
+
+        if (telemetry_sample(tel) < 0)
+            break;
+
+        start = bench_now_ns();
+        *records += telemetry_flush(tel, out, binary);
+        elapsed += bench_now_ns() - start;
+    }
+
+    fclose(out);
+
+    return elapsed;
+}
+
+static int run_benchmark(int volume_fd, int iterations, __u64 capacity)
+{
+    struct telemetry tel;
+    struct bench_hist *hist = bench_hist_alloc();
+    struct telemetry_record record;
+    __u64 cpu_start, cpu_used;
+    __u64 records = 0;
+    __u64 csv_ns, bin_ns;
+    __u64 csv_records, bin_records;
+    int i;
+
+    if (telemetry_init(&tel, volume_fd, capacity) < 0)
+        return -1;
+
+    /* Warm up the space buffer so the loop measures the steady state. */
+    if (telemetry_sample(&tel) < 0) {
+        telemetry_free(&tel);
+        return -1;
+    }
+
+    while (telemetry_pop(&tel, &record))
+        ;
+
+    tel.ioctls = 0;
+    tel.samples = 0;
+    cpu_start = cpu_ns();
+
+    for (i = 0; i < iterations; i++) {
+        __u64 start = bench_now_ns();
+
+        if (telemetry_sample(&tel) < 0) {
+            telemetry_free(&tel);
+            return -1;
+        }
+
+        bench_hist_record(hist, bench_now_ns() - start);
+
+        while (telemetry_pop(&tel, &record))
+            records++;
+    }
+
+    cpu_used = cpu_ns() - cpu_start;
+
+    csv_ns = time_flush(&tel, iterations, 0, &csv_records);
+    bin_ns = time_flush(&tel, iterations, 1, &bin_records);
+
+    printf("samples:            %d\n", iterations);
+    printf("ioctls/sample:      %.1f\n", (double)tel.ioctls / iterations);
+    printf("records/sample:     %.1f\n", (double)records / iterations);
+    printf("sample p50/p99/max: %.1f / %.1f / %.1f us\n",
+           bench_hist_percentile(hist, 50.0) / 1e3,
+           bench_hist_percentile(hist, 99.0) / 1e3, hist->max / 1e3);
+    printf("cpu/sample:         %.1f us\n", cpu_used / 1e3 / iterations);
+    printf("flush/record:       %.0f ns csv, %.0f ns binary\n",
+           csv_records ? (double)csv_ns / csv_records : 0,
+           bin_records ? (double)bin_ns / bin_records : 0);
+    printf("cpu at 1 Hz:        %.5f%%\n",
+           (double)cpu_used / iterations / 1e9 * 100);
+    printf("dropped:            %llu\n", tel.ring.dropped);
+
+    free(hist);
+    telemetry_free(&tel);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct telemetry tel;
+    struct bench_ticker ticker;
+    const char *output = NULL;
+    FILE *out = stdout;
+    __u64 interval_ms = 1000;
+    __u64 capacity = 4096;
+    __u64 records = 0;
+    __u64 start;
+    int duration = 60;
+    int iterations = 0;
+    int binary = 0;
+    int volume_fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:d:o:bc:B:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'b':
+            binary = 1;
+            break;
+        case 'c':
+            capacity = strtoull(optarg, NULL, 10);
+            break;
+        case 'B':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i interval-ms] [-d seconds] "
+                    "[-o file] [-b] [-c ring-records] [-B iterations]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (iterations > 0) {
+        return run_benchmark(volume_fd, iterations, capacity) < 0;
+    }
+
+    if (output != NULL) {
+        out = fopen(output, binary ? "wb" : "w");
+
+        if (out == NULL) {
+            perror(output);
+            return 1;
+        }
+    }
+
+    if (telemetry_init(&tel, volume_fd, capacity) < 0) {
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    telemetry_write_header(out, binary);
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL, tick,
+                           &tel) < 0) {
+        return 1;
+    }
+
+    start = bench_now_ns();
+
+    /* The ticker thread produces, this loop is the only consumer. */
+    while (!stop &&
+           (duration == 0 ||
+            bench_now_ns() - start < duration * 1000000000ULL)) {
+        sleep(1);
+        records += telemetry_flush(&tel, out, binary);
+    }
+
+    bench_ticker_stop(&ticker);
+    records += telemetry_flush(&tel, out, binary);
+
+    fprintf(stderr, "%llu samples, %llu records written, %llu dropped\n",
+            tel.samples, records, tel.ring.dropped);
+
+    if (out != stdout)
+        fclose(out);
+
+    telemetry_free(&tel);
+    close(volume_fd);
+
+    return 0;
+}
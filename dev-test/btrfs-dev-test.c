@@ -6,6 +6,14 @@
 #include <linux/btrfs.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-test btrfs-dev-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -56,11 +64,9 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    volume_fd = openat(AT_FDCWD, "/mnt", O_RDONLY|O_NONBLOCK
-                       |O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
 
     if (volume_fd < 0) {
-        perror("open");
         return 1;
     }
 
@@ -73,7 +79,7 @@ int main(int argc, char **argv)
 
     strncpy(args.name, argv[1], BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -83,7 +89,7 @@ int main(int argc, char **argv)
 
     strncpy(args.name, argv[2], BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -93,7 +99,7 @@ int main(int argc, char **argv)
 
     strncpy(args.name, argv[3], BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_ADD_DEV, &args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -103,7 +109,7 @@ int main(int argc, char **argv)
 
     strncpy(args.name, argv[1], BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
+    if (BENCH_IOCTL(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -113,7 +119,7 @@ int main(int argc, char **argv)
 
     info.devid = 2;
 
-    if (ioctl(volume_fd, BTRFS_IOC_DEV_INFO, &info) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_DEV_INFO, &info) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -125,7 +131,7 @@ int main(int argc, char **argv)
 
     stats.devid = 2;
 
-    if (ioctl(volume_fd, BTRFS_IOC_GET_DEV_STATS, &stats) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_GET_DEV_STATS, &stats) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -134,13 +140,13 @@ int main(int argc, char **argv)
     printf("nr_items: %llu\n", stats.nr_items);
     printf("flags: %llu\n\n", stats.flags);
 
-    if (ioctl(volume_fd, BTRFS_IOC_RM_DEV, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RM_DEV, &args) < 0) {
         perror("ioctl");
         return 1;
     }
 
     printf("ioctl BTRFS_IOC_RM_DEV:\n");
-    if (ioctl(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
+    if (BENCH_IOCTL(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
         printf("Device %s removed from /mnt\n\n", args.name);
     }
     else {
@@ -150,13 +156,13 @@ int main(int argc, char **argv)
     args_v2.flags = BTRFS_DEVICE_SPEC_BY_ID;
     args_v2.devid = 3;
 
-    if (ioctl(volume_fd, BTRFS_IOC_RM_DEV_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RM_DEV_V2, &args_v2) < 0) {
         perror("ioctl");
         return 1;
     }
 
     printf("ioctl BTRFS_IOC_RM_DEV_V2:\n");
-    if (ioctl(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
+    if (BENCH_IOCTL(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
         printf("Device %s removed from /mnt\n\n", argv[2]);
     }
     else {
@@ -166,13 +172,13 @@ int main(int argc, char **argv)
     args_v2.flags = 0;
     strncpy(args_v2.name, argv[3], BTRFS_SUBVOL_NAME_MAX);
 
-    if (ioctl(volume_fd, BTRFS_IOC_RM_DEV_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RM_DEV_V2, &args_v2) < 0) {
         perror("ioctl");
         return 1;
     }
 
     printf("ioctl BTRFS_IOC_RM_DEV_V2:\n");
-    if (ioctl(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
+    if (BENCH_IOCTL(dev_control_fd, BTRFS_IOC_SCAN_DEV, &args) < 0) {
         printf("Device %s removed from /mnt\n\n", args.name);
     }
     else {
@@ -181,7 +187,7 @@ int main(int argc, char **argv)
 
     strncpy(args.name, "", BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(dev_control_fd, BTRFS_IOC_FORGET_DEV, &args) < 0) {
+    if (BENCH_IOCTL(dev_control_fd, BTRFS_IOC_FORGET_DEV, &args) < 0) {
         perror("ioctl");
         return 1;
     }
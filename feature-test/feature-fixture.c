@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-loop.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o feature-fixture feature-fixture.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-loop.c
+ */
+
+/*
+ * Fixture setup cost: formatting a fresh loop image per test against
+ * cloning a golden image from the loop pool. Needs root, mkfs.btrfs
+ * and btrfstune, but no mounted filesystem; everything lives under the
+ * -i pool directory:
+ *
+ * sudo ./feature-fixture  -n 20  -t 1,4,16  -i /var/tmp/btrfs-fixtures
+ *
+ * The mkfs baseline runs -n fixtures in one thread. The pool then runs
+ * -n fixtures in each of -t threads at once, each fixture on its own
+ * mount point with a small write workload, so the numbers include
+ * contention on loop-control and the image directory, and the
+ * btrfstune -u that gives every clone its own fsid by rewriting all of
+ * its metadata blocks. Golden images are kept for the next run unless
+ * -p is given.
+ */
+
+#define MAX_ROUNDS 16
+#define WORKLOAD_FILES 4
+#define WORKLOAD_BYTES (4ULL << 20)
+
+struct fixture_thread {
+    pthread_t thread;
+    struct loop_pool *pool;
+    unsigned int flags;
+    int fixtures;
+    int failed;
+    struct bench_hist *setup;
+    struct bench_hist *teardown;
+};
+
+static void *fixture_thread(void *arg)
+{
+    struct fixture_thread *t = arg;
+    int i;
+
+    for (i = 0; i < t->fixtures; i++) {
+        struct loop_fs fs;
+        __u64 start = bench_now_ns();
+
+        if (loop_pool_get(t->pool, NULL, NULL, t->flags, &fs) < 0) {
+            t->failed++;
+            continue;
+        }
+
+        bench_hist_record(t->setup, bench_now_ns() - start);
+
+        if (bench_populate(fs.mnt, "fixture", WORKLOAD_FILES,
+                           WORKLOAD_BYTES) < 0)
+            t->failed++;
+
+        start = bench_now_ns();
+        loop_pool_put(&fs);
+        bench_hist_record(t->teardown, bench_now_ns() - start);
+    }
+
+    return NULL;
+}
+
+/* The pre-pool way: truncate, attach, mkfs and mount every time. */
+static int run_mkfs(struct loop_pool *pool, int fixtures,
+                    unsigned int flags, struct bench_hist *setup,
+                    struct bench_hist *teardown)
+{
+    char image[BENCH_PATH_MAX];
+    char mnt[BENCH_PATH_MAX];
+    int i;
+
+    if (snprintf(image, sizeof(image), "%s/mkfs.img",
+                 pool->dir) >= (int)sizeof(image)) {
+        fprintf(stderr, "%s: path too long\n", pool->dir);
+        return -1;
+    }
+
+    for (i = 0; i < fixtures; i++) {
+        struct loop_fs fs;
+        __u64 start = bench_now_ns();
+
+        if (snprintf(mnt, sizeof(mnt), "%s/mnt-XXXXXX",
+                     pool->dir) >= (int)sizeof(mnt)) {
+            fprintf(stderr, "%s: path too long\n", pool->dir);
+            return -1;
+        }
+
+        if (loop_image_create(image, pool->image_size) < 0 ||
+            loop_attach(&fs, image, flags) < 0)
+            return -1;
+
+        if (loop_mkfs(&fs, NULL) < 0 || mkdtemp(mnt) == NULL ||
+            loop_mount(&fs, mnt, NULL) < 0) {
+            loop_detach(&fs);
+            return -1;
+        }
+
+        bench_hist_record(setup, bench_now_ns() - start);
+
+        if (bench_populate(fs.mnt, "fixture", WORKLOAD_FILES,
+                           WORKLOAD_BYTES) < 0) {
+            loop_detach(&fs);
+            return -1;
+        }
+
+        start = bench_now_ns();
+        loop_detach(&fs);
+        rmdir(mnt);
+        unlink(image);
+        bench_hist_record(teardown, bench_now_ns() - start);
+    }
+
+    return 0;
+}
+
+static void print_row(const char *mode, int threads, __u64 elapsed_ns,
+                      const struct bench_hist *setup,
+                      const struct bench_hist *teardown)
+{
+    printf("%-6s %8d %9llu %12.1f %12.1f %14.1f %12.1f\n", mode, threads,
+           setup->count, bench_hist_percentile(setup, 50.0) / 1e6,
+           bench_hist_percentile(setup, 99.0) / 1e6,
+           bench_hist_percentile(teardown, 50.0) / 1e6,
+           setup->count * 1e9 / elapsed_ns);
+}
+
+int main(int argc, char **argv)
+{
+    int threads[MAX_ROUNDS] = {1, 4};
+    int num_threads = 2;
+    const char *dir = "/var/tmp/btrfs-fixtures";
+    __u64 image_size = 1ULL << 30;
+    unsigned int flags = 0;
+    struct loop_pool pool;
+    struct bench_hist *setup;
+    struct bench_hist *teardown;
+    __u64 start;
+    int fixtures = 10;
+    int purge = 0;
+    int opt;
+    int i;
+    int j;
+
+    while ((opt = getopt(argc, argv, "n:t:i:s:Dp")) != -1) {
+        switch (opt) {
+        case 'n':
+            fixtures = atoi(optarg);
+            break;
+        case 't':
+            num_threads = bench_parse_list(optarg, threads, MAX_ROUNDS, 1);
+
+            if (num_threads < 0) {
+                return 1;
+            }
+            break;
+        case 'i':
+            dir = optarg;
+            break;
+        case 's':
+            image_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            flags |= LOOP_FS_DIRECT_IO;
+            break;
+        case 'p':
+            purge = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n fixtures] [-t threads,...] "
+                    "[-i pool-dir] [-s image-size] [-D] [-p]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (loop_pool_init(&pool, dir, image_size) < 0)
+        return 1;
+
+    printf("%-6s %8s %9s %12s %12s %14s %12s\n", "mode", "threads",
+           "fixtures", "setup-p50", "setup-p99", "teardown-p50",
+           "fixtures/s");
+
+    setup = bench_hist_alloc();
+    teardown = bench_hist_alloc();
+    start = bench_now_ns();
+
+    if (run_mkfs(&pool, fixtures, flags, setup, teardown) < 0) {
+        loop_pool_destroy(&pool, purge);
+        return 1;
+    }
+
+    print_row("mkfs", 1, bench_now_ns() - start, setup, teardown);
+    free(setup);
+    free(teardown);
+
+    /* Format the golden image outside the timed runs. */
+    {
+        struct loop_fs fs;
+
+        if (loop_pool_get(&pool, NULL, NULL, flags, &fs) < 0) {
+            loop_pool_destroy(&pool, purge);
+            return 1;
+        }
+
+        loop_pool_put(&fs);
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        struct fixture_thread *workers = calloc(threads[i], sizeof(*workers));
+        int failed = 0;
+
+        setup = bench_hist_alloc();
+        teardown = bench_hist_alloc();
+        start = bench_now_ns();
+
+        for (j = 0; j < threads[i]; j++) {
+            workers[j].pool = &pool;
+            workers[j].flags = flags;
+            workers[j].fixtures = fixtures;
+            workers[j].setup = bench_hist_alloc();
+            workers[j].teardown = bench_hist_alloc();
+            pthread_create(&workers[j].thread, NULL, fixture_thread,
+                           &workers[j]);
+        }
+
+        for (j = 0; j < threads[i]; j++) {
+            pthread_join(workers[j].thread, NULL);
+            bench_hist_merge(setup, workers[j].setup);
+            bench_hist_merge(teardown, workers[j].teardown);
+            failed += workers[j].failed;
+            free(workers[j].setup);
+            free(workers[j].teardown);
+        }
+
+        print_row("pool", threads[i], bench_now_ns() - start, setup,
+                  teardown);
+
+        if (failed > 0)
+            fprintf(stderr, "pool: %d fixtures failed\n", failed);
+
+        free(workers);
+        free(setup);
+        free(teardown);
+    }
+
+    printf("\nclones: %llu reflinked, %llu copied, fsid rewritten with "
+           "btrfstune -u, direct I/O %s\n", pool.reflinks, pool.copies,
+           (flags & LOOP_FS_DIRECT_IO) ? "requested" : "off");
+
+    loop_pool_destroy(&pool, purge);
+
+    return 0;
+}
@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-loop.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o feature-matrix feature-matrix.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-loop.c
+ */
+
+/*
+ * Feature-matrix runner. Unlike the other tests this one formats its
+ * own filesystems, so it only needs root, mkfs.btrfs and an empty
+ * mount point (BTRFS_TEST_MNT, default /mnt):
+ *
+ * sudo ./feature-matrix  -f no-holes,free-space-tree,zstd
+ *
+ * Every on/off combination of the -f features gets a fresh -s byte
+ * image at -i, formatted with the matching mkfs.btrfs -O list (or
+ * mounted with compress= for zstd and lzo, which are not mkfs
+ * features). The resulting flags are checked with
+ * BTRFS_IOC_GET_FEATURES against BTRFS_IOC_GET_SUPPORTED_FEATURES,
+ * then a fixed workload runs:
+ *
+ *  - metadata: create, stat and unlink -n empty files, 1000 per dir
+ *  - data: write -d bytes in 16 files, sync, drop caches, read back;
+ *    the data is compressible text when zstd or lzo is on and random
+ *    otherwise
+ *
+ * The results of all combinations are printed as a comparison table.
+ * Combinations that can't be formatted or mounted (block-group-tree
+ * without free-space-tree, more than one compression algorithm) are
+ * listed as invalid and not run; combinations that fail are listed as
+ * failed.
+ */
+
+#define MAX_FEATURES 8
+#define FILES_PER_DIR 1000
+#define DATA_FILES 16
+/* One line of compressible data, buf is a multiple of it. */
+#define LINE_LEN 64
+
+enum feature_kind {
+    FEATURE_INCOMPAT,
+    FEATURE_COMPAT_RO,
+    FEATURE_COMPRESS,
+};
+
+struct feature {
+    const char *name;
+    const char *mkfs_name;
+    enum feature_kind kind;
+    __u64 flag;
+    const char *abbrev;
+    /* Feature this one can't be enabled without, or NULL. */
+    const char *requires;
+};
+
+static const struct feature features[] = {
+    { "no-holes", "no-holes", FEATURE_INCOMPAT,
+      BTRFS_FEATURE_INCOMPAT_NO_HOLES, "nh", NULL },
+    { "skinny-metadata", "skinny-metadata", FEATURE_INCOMPAT,
+      BTRFS_FEATURE_INCOMPAT_SKINNY_METADATA, "sm", NULL },
+    { "extended-iref", "extref", FEATURE_INCOMPAT,
+      BTRFS_FEATURE_INCOMPAT_EXTENDED_IREF, "xr", NULL },
+    { "free-space-tree", "free-space-tree", FEATURE_COMPAT_RO,
+      BTRFS_FEATURE_COMPAT_RO_FREE_SPACE_TREE, "fst", NULL },
+#ifdef BTRFS_FEATURE_COMPAT_RO_BLOCK_GROUP_TREE
+    { "block-group-tree", "block-group-tree", FEATURE_COMPAT_RO,
+      BTRFS_FEATURE_COMPAT_RO_BLOCK_GROUP_TREE, "bgt", "free-space-tree" },
+#endif
+    { "zstd", "zstd", FEATURE_COMPRESS,
+      BTRFS_FEATURE_INCOMPAT_COMPRESS_ZSTD, "zstd", NULL },
+    { "lzo", "lzo", FEATURE_COMPRESS,
+      BTRFS_FEATURE_INCOMPAT_COMPRESS_LZO, "lzo", NULL },
+};
+
+#define NUM_KNOWN (sizeof(features) / sizeof(features[0]))
+
+struct matrix_result {
+    char label[64];
+    /* "invalid" or "failed" if there are no numbers to show. */
+    const char *status;
+    int verified;
+    double create_rate;
+    double stat_rate;
+    double unlink_rate;
+    double write_mib;
+    double read_mib;
+    __u64 image_bytes;
+};
+
+static const struct feature *find_feature(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_KNOWN; i++) {
+        if (strcmp(name, features[i].name) == 0)
+            return &features[i];
+    }
+
+    return NULL;
+}
+
+static int parse_features(const char *arg, const struct feature **selected)
+{
+    char *copy = strdup(arg);
+    char *tok;
+    char *save = NULL;
+    int n = 0;
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (n == MAX_FEATURES) {
+            fprintf(stderr, "at most %d features\n", MAX_FEATURES);
+            n = -1;
+            break;
+        }
+
+        selected[n] = find_feature(tok);
+
+        if (selected[n] == NULL) {
+            fprintf(stderr, "unknown feature: %s\n", tok);
+            n = -1;
+            break;
+        }
+
+        n++;
+    }
+
+    free(copy);
+
+    return n;
+}
+
+/*
+ * Only one compression algorithm can be the mount default, and mkfs
+ * rejects a feature whose requirement is explicitly turned off. A
+ * requirement that isn't selected keeps the mkfs default.
+ */
+static int valid_combination(const struct feature **selected, int n,
+                             unsigned int mask)
+{
+    int compress = 0;
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        if (!(mask & (1U << i)))
+            continue;
+
+        if (selected[i]->kind == FEATURE_COMPRESS && ++compress > 1)
+            return 0;
+
+        if (selected[i]->requires == NULL)
+            continue;
+
+        for (j = 0; j < n; j++) {
+            if (strcmp(selected[j]->name, selected[i]->requires) == 0 &&
+                !(mask & (1U << j)))
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Path of the @i-th metadata workload file. */
+static int meta_path(char *path, size_t size, const char *mnt, int i)
+{
+    if (snprintf(path, size, "%s/meta-%d/file-%d", mnt, i / FILES_PER_DIR,
+                 i) >= (int)size) {
+        fprintf(stderr, "metadata file path too long\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Check every selected feature against GET_FEATURES. The kernel sets
+ * the COMPRESS_ZSTD/LZO incompat bits as soon as it parses the
+ * compress= mount option, so all of them can be checked right after
+ * mounting; features the kernel doesn't support can't be expected
+ * either way.
+ */
+static int verify_features(int fd, const struct feature **selected, int n,
+                           unsigned int mask)
+{
+    struct btrfs_ioctl_feature_flags supported[3];
+    struct btrfs_ioctl_feature_flags flags;
+    int ok = 1;
+    int i;
+
+    memset(supported, 0, sizeof(supported));
+    memset(&flags, 0, sizeof(flags));
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_SUPPORTED_FEATURES, supported) < 0) {
+        perror("ioctl BTRFS_IOC_GET_SUPPORTED_FEATURES");
+        return -1;
+    }
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_FEATURES, &flags) < 0) {
+        perror("ioctl BTRFS_IOC_GET_FEATURES");
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        const struct feature *f = selected[i];
+        int want = !!(mask & (1U << i));
+        __u64 have, known;
+
+        if (f->kind == FEATURE_COMPAT_RO) {
+            have = flags.compat_ro_flags & f->flag;
+            known = supported[0].compat_ro_flags & f->flag;
+        }
+        else {
+            have = flags.incompat_flags & f->flag;
+            known = supported[0].incompat_flags & f->flag;
+        }
+
+        if (!known) {
+            fprintf(stderr, "%s not supported by the kernel\n", f->name);
+            continue;
+        }
+
+        if (!!have != want) {
+            fprintf(stderr, "%s expected %s but is %s\n", f->name,
+                    want ? "on" : "off", have ? "on" : "off");
+            ok = 0;
+        }
+    }
+
+    return ok;
+}
+
+static int metadata_workload(const char *mnt, int files,
+                             struct matrix_result *result)
+{
+    char path[BENCH_PATH_MAX];
+    struct stat st;
+    __u64 start;
+    int i;
+
+    for (i = 0; i < (files + FILES_PER_DIR - 1) / FILES_PER_DIR; i++) {
+        if (snprintf(path, sizeof(path), "%s/meta-%d", mnt,
+                     i) >= (int)sizeof(path)) {
+            fprintf(stderr, "metadata directory path too long\n");
+            return -1;
+        }
+
+        if (mkdir(path, 0755) < 0) {
+            perror("mkdir");
+            return -1;
+        }
+    }
+
+    start = bench_now_ns();
+
+    for (i = 0; i < files; i++) {
+        int fd;
+
+        if (meta_path(path, sizeof(path), mnt, i) < 0)
+            return -1;
+
+        fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        close(fd);
+    }
+
+    sync();
+    result->create_rate = files / ((bench_now_ns() - start) / 1e9);
+    bench_drop_caches();
+    start = bench_now_ns();
+
+    for (i = 0; i < files; i++) {
+        if (meta_path(path, sizeof(path), mnt, i) < 0)
+            return -1;
+
+        if (stat(path, &st) < 0) {
+            perror("stat");
+            return -1;
+        }
+    }
+
+    result->stat_rate = files / ((bench_now_ns() - start) / 1e9);
+    start = bench_now_ns();
+
+    for (i = 0; i < files; i++) {
+        if (meta_path(path, sizeof(path), mnt, i) < 0)
+            return -1;
+
+        if (unlink(path) < 0) {
+            perror("unlink");
+            return -1;
+        }
+    }
+
+    sync();
+    result->unlink_rate = files / ((bench_now_ns() - start) / 1e9);
+
+    for (i = 0; i < (files + FILES_PER_DIR - 1) / FILES_PER_DIR; i++) {
+        if (snprintf(path, sizeof(path), "%s/meta-%d", mnt,
+                     i) < (int)sizeof(path))
+            rmdir(path);
+    }
+
+    return 0;
+}
+
+/*
+ * Like bench_populate(), but with numbered text lines that zstd and lzo
+ * shrink several times over, so the compressed rows really compress.
+ */
+static int populate_text(const char *mnt, int files, __u64 bytes)
+{
+    static char buf[1 << 20];
+    char text[LINE_LEN + 1];
+    char path[BENCH_PATH_MAX];
+    __u64 per_file = bytes / files;
+    unsigned int line = 0;
+    int i;
+
+    for (i = 0; i < files; i++) {
+        __u64 left = per_file;
+        int fd;
+
+        if (snprintf(path, sizeof(path), "%s/data-%d", mnt,
+                     i) >= (int)sizeof(path)) {
+            fprintf(stderr, "data file path too long\n");
+            return -1;
+        }
+
+        fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        while (left > 0) {
+            size_t len = left < sizeof(buf) ? left : sizeof(buf);
+            size_t pos;
+            ssize_t ret;
+
+            for (pos = 0; pos < len; pos += LINE_LEN) {
+                snprintf(text, sizeof(text), "file %4d line %12u of the "
+                         "feature matrix data workload\n", i, line++);
+                memcpy(buf + pos, text, LINE_LEN);
+            }
+
+            ret = write(fd, buf, len);
+
+            if (ret < 0) {
+                perror("write");
+                close(fd);
+                return -1;
+            }
+
+            left -= ret;
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+static int data_workload(const char *mnt, __u64 bytes, int compressible,
+                         struct matrix_result *result)
+{
+    static char buf[1 << 20];
+    char path[BENCH_PATH_MAX];
+    __u64 start;
+    int err;
+    int i;
+
+    start = bench_now_ns();
+
+    if (compressible)
+        err = populate_text(mnt, DATA_FILES, bytes);
+    else
+        err = bench_populate(mnt, "data", DATA_FILES, bytes);
+
+    if (err < 0)
+        return -1;
+
+    sync();
+    result->write_mib = bytes / 1048576.0 / ((bench_now_ns() - start) / 1e9);
+    bench_drop_caches();
+    start = bench_now_ns();
+
+    for (i = 0; i < DATA_FILES; i++) {
+        ssize_t ret;
+        int fd;
+
+        if (snprintf(path, sizeof(path), "%s/data-%d", mnt,
+                     i) >= (int)sizeof(path)) {
+            fprintf(stderr, "data file path too long\n");
+            return -1;
+        }
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        while ((ret = read(fd, buf, sizeof(buf))) > 0)
+            ;
+
+        close(fd);
+
+        if (ret < 0) {
+            perror("read");
+            return -1;
+        }
+    }
+
+    result->read_mib = bytes / 1048576.0 / ((bench_now_ns() - start) / 1e9);
+
+    return 0;
+}
+
+static int run_combination(const struct feature **selected, int n,
+                           unsigned int mask, const char *image,
+                           __u64 image_size, int files, __u64 bytes,
+                           struct matrix_result *result)
+{
+    const char *args[LOOP_MAX_MKFS_ARGS];
+    char features_arg[256] = "";
+    char options[64] = "";
+    struct loop_fs fs;
+    struct stat st;
+    int volume_fd;
+    int nargs = 0;
+    int ret = -1;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        const struct feature *f = selected[i];
+        int on = !!(mask & (1U << i));
+        size_t len = strlen(features_arg);
+
+        if (f->kind == FEATURE_COMPRESS) {
+            if (on)
+                snprintf(options, sizeof(options), "compress=%s",
+                         f->mkfs_name);
+            continue;
+        }
+
+        snprintf(features_arg + len, sizeof(features_arg) - len, "%s%s%s",
+                 len ? "," : "", on ? "" : "^", f->mkfs_name);
+    }
+
+    if (features_arg[0]) {
+        args[nargs++] = "-O";
+        args[nargs++] = features_arg;
+    }
+
+    args[nargs] = NULL;
+
+    if (loop_image_create(image, image_size) < 0 ||
+        loop_attach(&fs, image, 0) < 0)
+        return -1;
+
+    if (loop_mkfs(&fs, args) < 0)
+        goto out;
+
+    if (loop_mount(&fs, bench_mnt_path(), options) < 0)
+        goto out;
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0)
+        goto out;
+
+    result->verified = verify_features(volume_fd, selected, n, mask);
+
+    if (result->verified >= 0 &&
+        metadata_workload(fs.mnt, files, result) == 0 &&
+        data_workload(fs.mnt, bytes, options[0] != '\0', result) == 0)
+        ret = 0;
+
+    close(volume_fd);
+
+out:
+    loop_detach(&fs);
+
+    if (stat(image, &st) == 0)
+        result->image_bytes = (__u64)st.st_blocks * 512;
+
+    unlink(image);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    const struct feature *selected[MAX_FEATURES];
+    struct matrix_result *results;
+    const char *image = "/var/tmp/btrfs-feature-matrix.img";
+    __u64 image_size = 8ULL << 30;
+    __u64 bytes = 1ULL << 30;
+    int files = 100000;
+    int n = 0;
+    unsigned int combos;
+    unsigned int mask;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "f:i:s:n:d:")) != -1) {
+        switch (opt) {
+        case 'f':
+            n = parse_features(optarg, selected);
+
+            if (n < 0) {
+                return 1;
+            }
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 's':
+            image_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 'd':
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s -f feature,... [-i image] "
+                    "[-s image-size] [-n files] [-d bytes]\n", argv[0]);
+            fprintf(stderr, "features:");
+
+            for (i = 0; i < (int)NUM_KNOWN; i++) {
+                fprintf(stderr, " %s", features[i].name);
+            }
+
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+
+    if (n == 0) {
+        fprintf(stderr, "no features selected (-f)\n");
+        return 1;
+    }
+
+    combos = 1U << n;
+    results = calloc(combos, sizeof(*results));
+
+    if (results == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (mask = 0; mask < combos; mask++) {
+        struct matrix_result *result = &results[mask];
+        size_t len = 0;
+
+        for (i = 0; i < n; i++) {
+            int on = !!(mask & (1U << i));
+
+            len += snprintf(result->label + len, sizeof(result->label) - len,
+                            "%s%s%s", len ? " " : "", on ? "+" : "-",
+                            selected[i]->abbrev);
+        }
+
+        if (!valid_combination(selected, n, mask)) {
+            result->status = "invalid";
+            continue;
+        }
+
+        printf("%s\n", result->label);
+        fflush(stdout);
+
+        if (run_combination(selected, n, mask, image, image_size, files,
+                            bytes, result) < 0) {
+            result->status = "failed";
+        }
+    }
+
+    printf("\n%-32s %8s %10s %10s %10s %10s %10s %12s\n", "features",
+           "flags", "create/s", "stat/s", "unlink/s", "wr-MiB/s",
+           "rd-MiB/s", "image-MiB");
+
+    for (mask = 0; mask < combos; mask++) {
+        struct matrix_result *r = &results[mask];
+
+        if (r->status != NULL) {
+            printf("%-32s %8s\n", r->label, r->status);
+            continue;
+        }
+
+        printf("%-32s %8s %10.0f %10.0f %10.0f %10.1f %10.1f %12.1f\n",
+               r->label, r->verified > 0 ? "ok" : "MISMATCH", r->create_rate,
+               r->stat_rate, r->unlink_rate, r->write_mib, r->read_mib,
+               r->image_bytes / 1048576.0);
+    }
+
+    free(results);
+
+    return 0;
+}
@@ -0,0 +1,469 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/loop.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-chunk-map.h"
+#include "../lib/btrfs-loop.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o feature-mount feature-mount.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-chunk-map.c ../lib/btrfs-loop.c ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Mount time versus block group count. Like feature-matrix this
+ * formats its own images and needs root, mkfs.btrfs and an empty
+ * mount point (BTRFS_TEST_MNT, default /mnt):
+ *
+ * sudo ./feature-mount  -b 1000,10000,100000  -i /xfs/mount-test.img
+ *
+ * Three layouts are compared, each on its own image:
+ *
+ *   v1      - no free-space-tree, mounted with space_cache=v1
+ *   fst     - free-space-tree, no block-group-tree
+ *   fst+bgt - free-space-tree and block-group-tree
+ *
+ * Every image is filled with fallocate()d files until the chunk tree
+ * holds the next block group count of -b. The data chunk size is
+ * lowered to -c bytes through sysfs first where the kernel allows it,
+ * so fewer bytes are needed per block group. Preallocation only
+ * writes metadata to the image, but the image has to be large enough
+ * to hold all chunks. Unless -s is given it is sized at twice the
+ * largest -b count times the chunk size in effect, and grown (file,
+ * loop device and filesystem) if the kernel kept its default chunk
+ * size: 100k block groups of 64 MiB make a 12.8 TiB sparse file, which
+ * still fits ext4's 16 TiB limit, but with 1 GiB chunks it takes
+ * 200 TiB, so put the image on xfs or btrfs for large counts.
+ *
+ * At each count the filesystem is unmounted and mounted -r times
+ * with cold caches, timing mount(2) and the first successful
+ * BTRFS_IOC_FS_INFO on the mount point.
+ */
+
+#define MAX_ROUNDS 16
+/* Comfortably above what mkfs.btrfs accepts. */
+#define MIN_IMAGE_SIZE (1ULL << 30)
+/* Give up on a mount whose first ioctl doesn't succeed in this time. */
+#define FIRST_IOCTL_TIMEOUT_NS (30ULL * 1000000000)
+
+struct layout {
+    const char *name;
+    const char *features;
+    const char *options;
+    __u64 compat_ro;
+};
+
+static const struct layout layouts[] = {
+    { "v1", "^free-space-tree,^block-group-tree", "space_cache=v1", 0 },
+    { "fst", "free-space-tree,^block-group-tree", "space_cache=v2",
+      BTRFS_FEATURE_COMPAT_RO_FREE_SPACE_TREE },
+#ifdef BTRFS_FEATURE_COMPAT_RO_BLOCK_GROUP_TREE
+    { "fst+bgt", "free-space-tree,block-group-tree", "space_cache=v2",
+      BTRFS_FEATURE_COMPAT_RO_FREE_SPACE_TREE |
+      BTRFS_FEATURE_COMPAT_RO_BLOCK_GROUP_TREE },
+#endif
+};
+
+#define NUM_LAYOUTS (sizeof(layouts) / sizeof(layouts[0]))
+
+struct mount_result {
+    __u64 block_groups;
+    struct bench_hist *mount;
+    struct bench_hist *first_ioctl;
+    struct bench_hist *umount;
+};
+
+/* Returns the chunk size in effect, the default if it can't be set. */
+static __u64 set_chunk_size(int volume_fd, __u64 size)
+{
+    struct btrfs_ioctl_fs_info_args fs_info = {0};
+    char path[BENCH_PATH_MAX];
+    char value[32];
+    __u8 *u;
+    int len;
+    int fd;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+        perror("ioctl BTRFS_IOC_FS_INFO");
+        return 1ULL << 30;
+    }
+
+    u = fs_info.fsid;
+    snprintf(path, sizeof(path), "/sys/fs/btrfs/%02x%02x%02x%02x-%02x%02x-"
+             "%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x"
+             "/allocation/data/chunk_size",
+             u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8], u[9],
+             u[10], u[11], u[12], u[13], u[14], u[15]);
+
+    fd = open(path, O_RDWR|O_CLOEXEC);
+    len = snprintf(value, sizeof(value), "%llu", size);
+
+    if (fd < 0 || write(fd, value, len) != len) {
+        fprintf(stderr, "cannot set data chunk_size, using 1 GiB chunks\n");
+
+        if (fd >= 0)
+            close(fd);
+
+        return 1ULL << 30;
+    }
+
+    /* The kernel rounds the value and caps it at 10% of the device. */
+    len = pread(fd, value, sizeof(value) - 1, 0);
+    close(fd);
+
+    if (len > 0) {
+        value[len] = '\0';
+        size = strtoull(value, NULL, 10);
+    }
+
+    return size;
+}
+
+/*
+ * Grow the image file, the loop device on top of it and then the
+ * filesystem to @size bytes; the image stays sparse.
+ */
+static int grow_image(struct loop_fs *fs, int volume_fd, __u64 size)
+{
+    struct btrfs_ioctl_vol_args args;
+
+    if (truncate(fs->image, size) < 0) {
+        perror("truncate");
+        return -1;
+    }
+
+    if (ioctl(fs->loop_fd, LOOP_SET_CAPACITY, 0) < 0) {
+        perror("ioctl LOOP_SET_CAPACITY");
+        return -1;
+    }
+
+    memset(&args, 0, sizeof(args));
+    snprintf(args.name, sizeof(args.name), "max");
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_RESIZE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_RESIZE");
+        return -1;
+    }
+
+    return 0;
+}
+
+static __s64 count_block_groups(int volume_fd)
+{
+    struct chunk_map map;
+    __u64 count;
+
+    if (chunk_map_load(&map, volume_fd) < 0)
+        return -1;
+
+    count = map.num_chunks;
+    chunk_map_free(&map);
+
+    return count;
+}
+
+/*
+ * Preallocate chunk-sized files until the target is reached. The data
+ * chunk size the allocator picks depends on the filesystem size, and a
+ * file can end up in an existing chunk or span two, so the chunks are
+ * counted after every synced batch instead of assuming one file per
+ * block group.
+ */
+static int fill(const char *mnt, int volume_fd, __u64 chunk_size,
+                __u64 target, int *next_file)
+{
+    char path[BENCH_PATH_MAX];
+    __s64 count;
+
+    while ((count = count_block_groups(volume_fd)) >= 0 &&
+           (__u64)count < target) {
+        __u64 batch = target - count;
+        __u64 i;
+
+        if (batch > 1024)
+            batch = 1024;
+
+        for (i = 0; i < batch; i++) {
+            int fd;
+
+            if (snprintf(path, sizeof(path), "%s/fill-%d", mnt,
+                         (*next_file)++) >= (int)sizeof(path)) {
+                fprintf(stderr, "fill file path too long\n");
+                return -1;
+            }
+
+            fd = open(path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+
+            if (fd < 0) {
+                perror("open");
+                return -1;
+            }
+
+            if (fallocate(fd, 0, 0, chunk_size) < 0) {
+                perror("fallocate");
+                close(fd);
+                return -1;
+            }
+
+            close(fd);
+        }
+
+        syncfs(volume_fd);
+    }
+
+    return count < 0 ? -1 : 0;
+}
+
+static int check_flags(int volume_fd, const struct layout *layout)
+{
+    struct btrfs_ioctl_feature_flags flags = {0};
+    __u64 mask = BTRFS_FEATURE_COMPAT_RO_FREE_SPACE_TREE;
+
+#ifdef BTRFS_FEATURE_COMPAT_RO_BLOCK_GROUP_TREE
+    mask |= BTRFS_FEATURE_COMPAT_RO_BLOCK_GROUP_TREE;
+#endif
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_GET_FEATURES, &flags) < 0) {
+        perror("ioctl BTRFS_IOC_GET_FEATURES");
+        return -1;
+    }
+
+    if ((flags.compat_ro_flags & mask) != layout->compat_ro) {
+        fprintf(stderr, "%s: compat_ro flags 0x%llx, expected 0x%llx\n",
+                layout->name, flags.compat_ro_flags & mask,
+                layout->compat_ro);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * mount(2) returns once the block groups are loaded, but the first
+ * ioctl is what an application waiting for the mount point observes,
+ * so that is timed from the start of the mount as well.
+ */
+static int time_mounts(struct loop_fs *fs, const struct layout *layout,
+                       int repeats, struct mount_result *result)
+{
+    int r;
+
+    for (r = 0; r < repeats; r++) {
+        struct btrfs_ioctl_fs_info_args fs_info;
+        __u64 start, mounted;
+        int fd;
+
+        if (fs->mounted) {
+            start = bench_now_ns();
+
+            if (loop_umount(fs) < 0)
+                return -1;
+
+            bench_hist_record(result->umount, bench_now_ns() - start);
+        }
+
+        bench_drop_caches();
+        start = bench_now_ns();
+
+        if (loop_mount(fs, bench_mnt_path(), layout->options) < 0)
+            return -1;
+
+        mounted = bench_now_ns();
+
+        for (;;) {
+            fd = open(fs->mnt, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+            memset(&fs_info, 0, sizeof(fs_info));
+
+            if (fd >= 0 && ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info) == 0)
+                break;
+
+            if (bench_now_ns() - mounted > FIRST_IOCTL_TIMEOUT_NS) {
+                perror("first ioctl BTRFS_IOC_FS_INFO");
+
+                if (fd >= 0)
+                    close(fd);
+
+                return -1;
+            }
+
+            if (fd >= 0)
+                close(fd);
+        }
+
+        bench_hist_record(result->first_ioctl, bench_now_ns() - start);
+        bench_hist_record(result->mount, mounted - start);
+        close(fd);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int counts[MAX_ROUNDS] = {1000, 10000};
+    int num_counts = 2;
+    struct mount_result results[NUM_LAYOUTS][MAX_ROUNDS];
+    const char *image = "/var/tmp/btrfs-mount-test.img";
+    __u64 image_size = 0;
+    __u64 chunk_size = 64ULL << 20;
+    __u64 max_count = 0;
+    int auto_size;
+    int repeats = 5;
+    unsigned int l;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "b:c:i:s:r:")) != -1) {
+        switch (opt) {
+        case 'b':
+            num_counts = bench_parse_list(optarg, counts, MAX_ROUNDS, 1);
+
+            if (num_counts < 0) {
+                return 1;
+            }
+            break;
+        case 'c':
+            chunk_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            image = optarg;
+            break;
+        case 's':
+            image_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b block-groups,...] [-c chunk-size] "
+                    "[-i image] [-s image-size] [-r repeats]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < num_counts; i++) {
+        if ((__u64)counts[i] > max_count)
+            max_count = counts[i];
+    }
+
+    /*
+     * Twice the largest count of chunks leaves room for metadata and
+     * for chunks that are not completely filled. The requested chunk
+     * size is a guess until the filesystem is mounted, see grow_image().
+     */
+    auto_size = image_size == 0;
+
+    if (auto_size)
+        image_size = max_count * 2 * chunk_size;
+
+    if (image_size < MIN_IMAGE_SIZE)
+        image_size = MIN_IMAGE_SIZE;
+
+    memset(results, 0, sizeof(results));
+
+    for (l = 0; l < NUM_LAYOUTS; l++) {
+        const char *args[] = { "-O", layouts[l].features, NULL };
+        struct loop_fs fs;
+        __u64 effective;
+        int next_file = 0;
+        int volume_fd;
+
+        printf("%s: formatting %llu byte image\n", layouts[l].name,
+               image_size);
+        fflush(stdout);
+
+        if (loop_image_create(image, image_size) < 0 ||
+            loop_attach(&fs, image, 0) < 0) {
+            return 1;
+        }
+
+        if (loop_mkfs(&fs, args) < 0 ||
+            loop_mount(&fs, bench_mnt_path(), layouts[l].options) < 0) {
+            loop_detach(&fs);
+            return 1;
+        }
+
+        for (i = 0; i < num_counts; i++) {
+            struct mount_result *result = &results[l][i];
+
+            volume_fd = bench_open_volume();
+
+            if (volume_fd < 0 || check_flags(volume_fd, &layouts[l]) < 0) {
+                loop_detach(&fs);
+                return 1;
+            }
+
+            effective = set_chunk_size(volume_fd, chunk_size);
+
+            if (auto_size && max_count * 2 * effective > image_size) {
+                image_size = max_count * 2 * effective;
+                printf("%s: growing image to %llu bytes\n",
+                       layouts[l].name, image_size);
+
+                if (grow_image(&fs, volume_fd, image_size) < 0) {
+                    loop_detach(&fs);
+                    return 1;
+                }
+            }
+
+            if (fill(fs.mnt, volume_fd, effective, counts[i],
+                     &next_file) < 0) {
+                loop_detach(&fs);
+                return 1;
+            }
+
+            result->block_groups = count_block_groups(volume_fd);
+            close(volume_fd);
+
+            printf("%s: %llu block groups\n", layouts[l].name,
+                   result->block_groups);
+            fflush(stdout);
+
+            result->mount = bench_hist_alloc();
+            result->first_ioctl = bench_hist_alloc();
+            result->umount = bench_hist_alloc();
+
+            if (time_mounts(&fs, &layouts[l], repeats, result) < 0) {
+                loop_detach(&fs);
+                return 1;
+            }
+        }
+
+        loop_detach(&fs);
+        unlink(image);
+    }
+
+    printf("\n%-10s %12s %12s %12s %14s %12s\n", "layout", "block-groups",
+           "mount-p50", "mount-max", "first-ioctl", "umount-p50");
+
+    for (l = 0; l < NUM_LAYOUTS; l++) {
+        for (i = 0; i < num_counts; i++) {
+            struct mount_result *r = &results[l][i];
+
+            printf("%-10s %12llu %12.1f %12.1f %14.1f %12.1f\n",
+                   layouts[l].name, r->block_groups,
+                   bench_hist_percentile(r->mount, 50.0) / 1e6,
+                   r->mount->max / 1e6,
+                   bench_hist_percentile(r->first_ioctl, 50.0) / 1e6,
+                   bench_hist_percentile(r->umount, 50.0) / 1e6);
+
+            free(r->mount);
+            free(r->first_ioctl);
+            free(r->umount);
+        }
+    }
+
+    printf("\nall times in ms, caches dropped before every mount\n");
+
+    return 0;
+}
@@ -6,6 +6,14 @@
 #include <linux/btrfs.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o feature-test feature-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -124,9 +132,13 @@ int main(int argc, char **argv)
     struct btrfs_ioctl_feature_flags set_flags[2] = {{0},{0}};
     struct btrfs_ioctl_feature_flags get_flags = {0};
 
-    volume_fd = openat(AT_FDCWD, "/mnt/", O_RDONLY|O_NONBLOCK|O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
 
-    if (ioctl(volume_fd, BTRFS_IOC_GET_SUPPORTED_FEATURES, &supp_flags) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_GET_SUPPORTED_FEATURES, &supp_flags) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -146,7 +158,7 @@ int main(int argc, char **argv)
 
     set_flags[1].incompat_flags = BTRFS_FEATURE_INCOMPAT_EXTENDED_IREF;
 
-    if (ioctl(volume_fd, BTRFS_IOC_SET_FEATURES, &set_flags) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SET_FEATURES, &set_flags) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -154,7 +166,7 @@ int main(int argc, char **argv)
     printf("ioctl BTRFS_IOC_SET_FLAGS:\n\n");
     printf("incompat flag BTRFS_FEATURE_INCOMPAT_EXTENDED_IREF set\n\n\n");
 
-    if (ioctl(volume_fd, BTRFS_IOC_GET_FEATURES, &get_flags) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_GET_FEATURES, &get_flags) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-chunk-map.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o ino-chunk-map ino-chunk-map.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-chunk-map.c ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Loads the chunk tree of the mounted filesystem and times -n random
+ * logical->(devid, physical) lookups, followed by the reverse lookup
+ * of every result, which must lead back to the same logical address:
+ *
+ * sudo ./ino-chunk-map  -n 10000000
+ *
+ * Test filesystems only have a handful of chunks, so -g builds a
+ * synthetic map of that many chunks instead, spread over -d devices
+ * with profile -p single|dup|raid0|raid1|raid10|raid5|raid6. No
+ * mounted filesystem is needed for that:
+ *
+ * ./ino-chunk-map  -g 100000  -d 6  -p raid10  -n 10000000
+ */
+
+#define LOOKUP_BATCH (1 << 20)
+#define SYNTH_DEV_STRIPE (256ULL << 20)
+#define SYNTH_STRIPE_LEN (64 * 1024)
+
+struct profile_name {
+    const char *name;
+    __u64 flags;
+};
+
+static const struct profile_name profiles[] = {
+    { "single", 0 },
+    { "dup", BTRFS_BLOCK_GROUP_DUP },
+    { "raid0", BTRFS_BLOCK_GROUP_RAID0 },
+    { "raid1", BTRFS_BLOCK_GROUP_RAID1 },
+    { "raid10", BTRFS_BLOCK_GROUP_RAID10 },
+    { "raid5", BTRFS_BLOCK_GROUP_RAID5 },
+    { "raid6", BTRFS_BLOCK_GROUP_RAID6 },
+};
+
+struct lookup {
+    __u64 logical;
+    int mirror;
+    __u64 devid;
+    __u64 physical;
+};
+
+static __u64 rand64(unsigned int *seed)
+{
+    return (__u64)rand_r(seed) << 62 ^ (__u64)rand_r(seed) << 31 ^
+           rand_r(seed);
+}
+
+static int synth_map(struct chunk_map *map, __u64 nr_chunks, int nr_devs,
+                     __u64 profile)
+{
+    __u64 *dev_end;
+    __u16 num_stripes = 1;
+    __u16 nr_data = 1;
+    __u64 logical = 1ULL << 20;
+    __u64 i;
+    __u16 j;
+
+    if (profile & (BTRFS_BLOCK_GROUP_DUP | BTRFS_BLOCK_GROUP_RAID1)) {
+        num_stripes = 2;
+    }
+    else if (profile & BTRFS_BLOCK_GROUP_RAID0) {
+        num_stripes = nr_devs;
+        nr_data = nr_devs;
+    }
+    else if (profile & BTRFS_BLOCK_GROUP_RAID10) {
+        num_stripes = nr_devs & ~1;
+        nr_data = num_stripes / 2;
+    }
+    else if (profile & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+        num_stripes = nr_devs;
+        nr_data = nr_devs - ((profile & BTRFS_BLOCK_GROUP_RAID6) ? 2 : 1);
+    }
+
+    if (nr_devs < 1 || nr_data < 1 ||
+        (num_stripes > nr_devs && !(profile & BTRFS_BLOCK_GROUP_DUP))) {
+        fprintf(stderr, "not enough devices for the profile\n");
+        return -1;
+    }
+
+    memset(map, 0, sizeof(*map));
+    map->num_chunks = nr_chunks;
+    map->num_stripes = nr_chunks * num_stripes;
+    map->chunks = calloc(map->num_chunks, sizeof(*map->chunks));
+    map->stripes = calloc(map->num_stripes, sizeof(*map->stripes));
+    dev_end = calloc(nr_devs, sizeof(*dev_end));
+
+    if (map->chunks == NULL || map->stripes == NULL || dev_end == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (i = 0; i < nr_chunks; i++) {
+        struct chunk_map_entry *chunk = &map->chunks[i];
+
+        chunk->logical = logical;
+        chunk->length = SYNTH_DEV_STRIPE * nr_data;
+        chunk->type = BTRFS_BLOCK_GROUP_DATA | profile;
+        chunk->stripe_len = SYNTH_STRIPE_LEN;
+        chunk->num_stripes = num_stripes;
+        chunk->sub_stripes = (profile & BTRFS_BLOCK_GROUP_RAID10) ? 2 : 1;
+        chunk->stripes = &map->stripes[i * num_stripes];
+
+        for (j = 0; j < num_stripes; j++) {
+            int dev = (profile & BTRFS_BLOCK_GROUP_DUP) ?
+                      i % nr_devs : (i + j) % nr_devs;
+
+            chunk->stripes[j].devid = dev + 1;
+            chunk->stripes[j].physical = dev_end[dev] + (1ULL << 20);
+            dev_end[dev] += SYNTH_DEV_STRIPE;
+        }
+
+        logical += chunk->length;
+    }
+
+    free(dev_end);
+
+    return chunk_map_index(map);
+}
+
+int main(int argc, char **argv)
+{
+    struct chunk_map map;
+    struct lookup *lookups;
+    __u64 nr_lookups = 10000000;
+    __u64 nr_chunks = 0;
+    __u64 profile = BTRFS_BLOCK_GROUP_RAID1;
+    __u64 forward_ns = 0, reverse_ns = 0;
+    __u64 done = 0, mismatches = 0, parity = 0;
+    __u64 start;
+    unsigned int seed = 1;
+    int nr_devs = 4;
+    int opt;
+    unsigned int k;
+
+    while ((opt = getopt(argc, argv, "n:g:d:p:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nr_lookups = strtoull(optarg, NULL, 10);
+            break;
+        case 'g':
+            nr_chunks = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            nr_devs = atoi(optarg);
+            break;
+        case 'p':
+            for (k = 0; k < sizeof(profiles) / sizeof(profiles[0]); k++) {
+                if (strcmp(optarg, profiles[k].name) == 0)
+                    break;
+            }
+
+            if (k == sizeof(profiles) / sizeof(profiles[0])) {
+                fprintf(stderr, "unknown profile: %s\n", optarg);
+                return 1;
+            }
+
+            profile = profiles[k].flags;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n lookups] [-g chunks] [-d devices] "
+                    "[-p profile]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    start = bench_now_ns();
+
+    if (nr_chunks > 0) {
+        if (synth_map(&map, nr_chunks, nr_devs, profile) < 0) {
+            return 1;
+        }
+    }
+    else {
+        int volume_fd = bench_open_volume();
+
+        if (volume_fd < 0) {
+            return 1;
+        }
+
+        if (chunk_map_load(&map, volume_fd) < 0) {
+            return 1;
+        }
+
+        close(volume_fd);
+    }
+
+    printf("%s %llu chunks, %llu device extents in %.3f ms\n",
+           nr_chunks > 0 ? "Built" : "Loaded", map.num_chunks,
+           map.num_stripes, (bench_now_ns() - start) / 1e6);
+
+    if (map.num_chunks == 0) {
+        return 1;
+    }
+
+    lookups = malloc(LOOKUP_BATCH * sizeof(*lookups));
+
+    if (lookups == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    /*
+     * Addresses are generated up front in batches so that only the
+     * lookups themselves are inside the timed loops.
+     */
+    while (done < nr_lookups) {
+        __u64 batch = nr_lookups - done;
+        __u64 i;
+
+        if (batch > LOOKUP_BATCH)
+            batch = LOOKUP_BATCH;
+
+        for (i = 0; i < batch; i++) {
+            const struct chunk_map_entry *chunk =
+                &map.chunks[rand64(&seed) % map.num_chunks];
+            __u64 profile = chunk->type & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+            int copies = (profile & BTRFS_BLOCK_GROUP_RAID56_MASK) ?
+                         1 : chunk_map_num_copies(chunk);
+
+            lookups[i].logical = chunk->logical + rand64(&seed) % chunk->length;
+            lookups[i].mirror = rand_r(&seed) % copies;
+        }
+
+        start = bench_now_ns();
+
+        for (i = 0; i < batch; i++) {
+            __u64 len;
+
+            if (chunk_map_to_physical(&map, lookups[i].logical,
+                                      lookups[i].mirror, &lookups[i].devid,
+                                      &lookups[i].physical, &len) < 0)
+                lookups[i].devid = 0;
+        }
+
+        forward_ns += bench_now_ns() - start;
+        start = bench_now_ns();
+
+        for (i = 0; i < batch; i++) {
+            __u64 logical;
+            int mirror;
+
+            /* Must lead back to the same address and copy number. */
+            if (chunk_map_to_logical(&map, lookups[i].devid,
+                                     lookups[i].physical, &logical,
+                                     &mirror) < 0 ||
+                logical != lookups[i].logical || mirror != lookups[i].mirror)
+                mismatches++;
+        }
+
+        reverse_ns += bench_now_ns() - start;
+        done += batch;
+    }
+
+    /* Parity offsets only exist for RAID5/6 and have no logical address. */
+    if (map.chunks[0].type & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+        const struct chunk_dev_extent *extent = &map.dev_extents[0];
+        __u64 off;
+
+        for (off = 0; off < extent->length; off += SYNTH_STRIPE_LEN) {
+            __u64 logical;
+            int mirror;
+
+            if (chunk_map_to_logical(&map, extent->devid,
+                                     extent->physical + off, &logical,
+                                     &mirror) < 0)
+                parity++;
+        }
+    }
+
+    printf("\n%-24s %12s %12s %12s\n", "lookup", "count", "ns/op",
+           "Mops/s");
+    printf("%-24s %12llu %12.1f %12.2f\n", "logical->physical", nr_lookups,
+           (double)forward_ns / nr_lookups, nr_lookups * 1e3 / forward_ns);
+    printf("%-24s %12llu %12.1f %12.2f\n", "physical->logical", nr_lookups,
+           (double)reverse_ns / nr_lookups, nr_lookups * 1e3 / reverse_ns);
+    printf("\nround-trip mismatches: %llu\n", mismatches);
+
+    if (map.chunks[0].type & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+        printf("parity stripes on first device extent: %llu\n", parity);
+    }
+
+    free(lookups);
+    chunk_map_free(&map);
+
+    return mismatches ? 1 : 0;
+}
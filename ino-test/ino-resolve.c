@@ -0,0 +1,341 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <linux/fs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-resolve.h"
+#include "../lib/btrfs-tree-search.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o ino-resolve ino-resolve.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-resolve.c ../lib/btrfs-path-cache.c \
+ *     ../lib/btrfs-subvol-enum.c ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Batch logical -> path resolution throughput on heavily shared
+ * extents. The program creates the subvolume resolve-src with -f files
+ * holding -s bytes in total, reflinks every file -c times with FICLONE
+ * and takes -n snapshots of the subvolume, so every data extent ends up
+ * with (c + 1) * (n + 1) references. All data extents of the filesystem
+ * are then resolved once for every thread count of -t, each time with
+ * a fresh resolver:
+ *
+ * sudo ./ino-resolve  -s 268435456  -c 8  -n 32  -t 1,2,4,8
+ *
+ * -o drops BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET, which only returns
+ * the references to the first block of each extent, and -k keeps the
+ * subvolumes around afterwards. hit% is the share of references whose
+ * path came from the resolver's (root, inode) cache instead of an
+ * INO_PATHS call.
+ */
+
+#define MAX_ROUNDS 16
+
+struct extent_list {
+    __u64 *logical;
+    __u64 count;
+    __u64 alloc;
+};
+
+static int collect_extent(const struct btrfs_ioctl_search_header *hdr,
+                          const void *item, void *data)
+{
+    struct extent_list *list = data;
+
+    if (ts_hdr_type(hdr) != BTRFS_EXTENT_ITEM_KEY ||
+        !(TS_ITEM_LE64(item, struct btrfs_extent_item, flags) &
+          BTRFS_EXTENT_FLAG_DATA))
+        return 0;
+
+    if (list->count == list->alloc) {
+        __u64 alloc = list->alloc ? list->alloc * 2 : 4096;
+        __u64 *logical = realloc(list->logical, alloc * sizeof(*logical));
+
+        if (logical == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        list->logical = logical;
+        list->alloc = alloc;
+    }
+
+    list->logical[list->count++] = ts_hdr_objectid(hdr);
+
+    return 0;
+}
+
+static int count_ref(const struct resolve_ref *ref, void *data)
+{
+    __u64 *paths = data;
+
+    if (ref->path != NULL)
+        __atomic_fetch_add(paths, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+static int setup(int volume_fd, int files, __u64 bytes, int clones,
+                 int snapshots)
+{
+    struct btrfs_ioctl_vol_args args;
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    char dir[BENCH_PATH_MAX];
+    char path[BENCH_PATH_MAX];
+    int src_fd;
+    int i, j;
+
+    memset(&args, 0, sizeof(args));
+    strcpy(args.name, "resolve-src");
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+        return -1;
+    }
+
+    if (snprintf(dir, sizeof(dir), "%s/resolve-src",
+                 bench_mnt_path()) >= (int)sizeof(dir)) {
+        fprintf(stderr, "subvolume path too long\n");
+        return -1;
+    }
+
+    if (bench_populate(dir, "file", files, bytes) < 0)
+        return -1;
+
+    for (i = 0; i < files; i++) {
+        int fd;
+
+        if (snprintf(path, sizeof(path), "%s/file-%d", dir,
+                     i) >= (int)sizeof(path)) {
+            fprintf(stderr, "file path too long\n");
+            return -1;
+        }
+
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        for (j = 0; j < clones; j++) {
+            int clone_fd;
+
+            if (snprintf(path, sizeof(path), "%s/clone-%d-%d", dir, i,
+                         j) >= (int)sizeof(path)) {
+                fprintf(stderr, "clone path too long\n");
+                close(fd);
+                return -1;
+            }
+
+            clone_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+
+            if (clone_fd < 0) {
+                perror("open");
+                return -1;
+            }
+
+            if (ioctl(clone_fd, FICLONE, fd) < 0) {
+                perror("ioctl FICLONE");
+                return -1;
+            }
+
+            close(clone_fd);
+        }
+
+        close(fd);
+    }
+
+    src_fd = bench_open_path(dir);
+
+    if (src_fd < 0)
+        return -1;
+
+    syncfs(src_fd);
+
+    for (i = 0; i < snapshots; i++) {
+        memset(&args_v2, 0, sizeof(args_v2));
+        args_v2.fd = src_fd;
+        snprintf(args_v2.name, sizeof(args_v2.name), "resolve-snap-%d", i);
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
+            perror("ioctl BTRFS_IOC_SNAP_CREATE_V2");
+            return -1;
+        }
+    }
+
+    close(src_fd);
+    syncfs(volume_fd);
+
+    return 0;
+}
+
+static void cleanup(int volume_fd, int snapshots)
+{
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    int i;
+
+    for (i = -1; i < snapshots; i++) {
+        memset(&args_v2, 0, sizeof(args_v2));
+
+        if (i < 0)
+            strcpy(args_v2.name, "resolve-src");
+        else
+            snprintf(args_v2.name, sizeof(args_v2.name),
+                     "resolve-snap-%d", i);
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0)
+            perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    int threads[MAX_ROUNDS] = {1, 2, 4, 8};
+    int num_threads = 4;
+    int files = 8;
+    int clones = 4;
+    int snapshots = 16;
+    int keep = 0;
+    __u64 bytes = 64ULL << 20;
+    __u64 flags = BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET;
+    struct extent_list extents = {0};
+    struct tree_search ts;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:f:c:n:t:ok")) != -1) {
+        switch (opt) {
+        case 's':
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            files = atoi(optarg);
+            break;
+        case 'c':
+            clones = atoi(optarg);
+            break;
+        case 'n':
+            snapshots = atoi(optarg);
+            break;
+        case 't':
+            num_threads = bench_parse_list(optarg, threads, MAX_ROUNDS, 1);
+
+            if (num_threads < 0) {
+                return 1;
+            }
+            break;
+        case 'o':
+            flags = 0;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s bytes] [-f files] [-c clones] "
+                    "[-n snapshots] [-t threads,...] [-o] [-k]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (setup(volume_fd, files, bytes, clones, snapshots) < 0) {
+        return 1;
+    }
+
+    if (tree_search_init(&ts, volume_fd, TREE_SEARCH_MAX_BUF) < 0) {
+        return 1;
+    }
+
+    tree_search_reset(&ts, BTRFS_EXTENT_TREE_OBJECTID, 0, (__u64)-1,
+                      BTRFS_EXTENT_ITEM_KEY, BTRFS_EXTENT_ITEM_KEY, 0);
+
+    if (tree_search_walk(&ts, collect_extent, &extents) < 0) {
+        return 1;
+    }
+
+    tree_search_free(&ts);
+
+    printf("%llu data extents, %d references each expected\n\n",
+           extents.count, (clones + 1) * (snapshots + 1));
+    printf("%8s %10s %10s %10s %10s %8s %10s %10s %7s %12s %12s\n",
+           "threads", "extents", "refs", "paths", "logical", "grows",
+           "max-buf", "ino-paths", "hit%", "time(ms)", "refs/s");
+
+    for (i = 0; i < num_threads; i++) {
+        struct resolver resolver;
+        struct resolve_stats *stats = &resolver.stats;
+        __u64 paths = 0;
+        __u64 lookups;
+        __u64 start, elapsed;
+
+        if (resolver_init(&resolver, volume_fd, flags) < 0) {
+            return 1;
+        }
+
+        start = bench_now_ns();
+
+        if (resolver_run(&resolver, extents.logical, extents.count,
+                         threads[i], count_ref, &paths) < 0) {
+            return 1;
+        }
+
+        elapsed = bench_now_ns() - start;
+        lookups = resolver.cache.hits + resolver.cache.misses;
+
+        printf("%8d %10llu %10llu %10llu %10llu %8llu %9lluK %10llu "
+               "%6.1f%% %12.1f %12.0f\n",
+               threads[i], stats->addresses, stats->refs, paths,
+               stats->logical_calls, stats->container_grows,
+               stats->max_container >> 10, stats->ino_paths_calls,
+               lookups ? resolver.cache.hits * 100.0 / lookups : 0.0,
+               elapsed / 1e6, stats->refs / (elapsed / 1e9));
+
+        if (stats->errors > 0 || stats->unresolved > 0) {
+            printf("%8s %llu errors, %llu unresolved references\n", "",
+                   stats->errors, stats->unresolved);
+        }
+
+        resolver_destroy(&resolver);
+    }
+
+    if (!keep) {
+        cleanup(volume_fd, snapshots);
+    }
+
+    free(extents.logical);
+
+    return 0;
+}
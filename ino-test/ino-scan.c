@@ -0,0 +1,311 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-tree-search.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o ino-scan ino-scan.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Create a test subvolume with the following command:
+ *
+ * sudo btrfs subvol create /mnt/test_subvol
+ *
+ * The program compares a TREE_SEARCH_V2 scan of the subvolume's fs
+ * tree against a readdir+fstatat walk of the same directory tree.
+ * -n populates the subvolume with that many empty files first (-d
+ * files per directory), -b sets the search buffer size and -c drops
+ * the page cache before each pass:
+ *
+ * sudo ./ino-scan  -n 1000000  -c  test_subvol
+ *
+ * With -t root|quota|fs the program instead dumps per-type item
+ * counts of the chosen tree:
+ *
+ * sudo ./ino-scan  -t quota  test_subvol
+ */
+
+struct scan_totals {
+    __u64 inodes;
+    __u64 bytes;
+};
+
+static int count_inode(const struct btrfs_ioctl_search_header *hdr,
+                       const void *item, void *data)
+{
+    struct scan_totals *totals = data;
+
+    if (ts_hdr_type(hdr) != BTRFS_INODE_ITEM_KEY)
+        return 0;
+
+    totals->inodes++;
+    totals->bytes += TS_ITEM_LE64(item, struct btrfs_inode_item, size);
+
+    return 0;
+}
+
+static int count_type(const struct btrfs_ioctl_search_header *hdr,
+                      const void *item, void *data)
+{
+    __u64 *types = data;
+
+    (void)item;
+    types[ts_hdr_type(hdr) & 0xff]++;
+
+    return 0;
+}
+
+static int walk_dir(int dir_fd, struct scan_totals *totals)
+{
+    DIR *dir;
+    struct dirent *ent;
+
+    dir = fdopendir(dir_fd);
+
+    if (dir == NULL) {
+        perror("fdopendir");
+        close(dir_fd);
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        struct stat st;
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        if (fstatat(dirfd(dir), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            perror("fstatat");
+            continue;
+        }
+
+        totals->inodes++;
+        totals->bytes += st.st_size;
+
+        if (S_ISDIR(st.st_mode)) {
+            int fd = openat(dirfd(dir), ent->d_name, O_RDONLY|O_NONBLOCK
+                            |O_CLOEXEC|O_DIRECTORY);
+
+            if (fd < 0 || walk_dir(fd, totals) < 0) {
+                closedir(dir);
+                return -1;
+            }
+        }
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+static int populate(const char *subvolume_path, __u64 files, int per_dir)
+{
+    char dir[BENCH_PATH_MAX];
+    __u64 done = 0;
+    int d = 0;
+
+    while (done < files) {
+        int n = files - done < (__u64)per_dir ? (int)(files - done) : per_dir;
+
+        if (snprintf(dir, sizeof(dir), "%s/d%d", subvolume_path,
+                     d++) >= (int)sizeof(dir)) {
+            fprintf(stderr, "directory path too long\n");
+            return -1;
+        }
+
+        if (mkdir(dir, 0755) < 0) {
+            perror("mkdir");
+            return -1;
+        }
+
+        if (bench_populate(dir, "f", n, 0) < 0)
+            return -1;
+
+        done += n;
+    }
+
+    sync();
+
+    return 0;
+}
+
+static int dump_tree(struct tree_search *ts, __u64 tree_id)
+{
+    __u64 types[256] = {0};
+    __u64 start;
+    int i;
+
+    tree_search_reset(ts, tree_id, 0, (__u64)-1, 0, 255, 0);
+    start = bench_now_ns();
+
+    if (tree_search_walk(ts, count_type, types) < 0)
+        return -1;
+
+    printf("tree %llu: %llu items in %llu ioctls, %.1f ms\n", tree_id,
+           ts->items, ts->ioctls, (bench_now_ns() - start) / 1e6);
+
+    for (i = 0; i < 256; i++) {
+        if (types[i])
+            printf("  key type %3d: %llu\n", i, types[i]);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd, subvolume_fd;
+    char subvolume_path[BENCH_PATH_MAX];
+    struct btrfs_ioctl_get_subvol_info_args info = {0};
+    struct scan_totals scan = {0}, walk = {0};
+    struct tree_search ts;
+    const char *tree = NULL;
+    __u64 buf_size = TREE_SEARCH_DEFAULT_BUF;
+    __u64 files = 0;
+    int per_dir = 1000;
+    int cold = 0;
+    __u64 start, scan_ns, walk_ns;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:b:ct:")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            per_dir = atoi(optarg);
+            break;
+        case 'b':
+            buf_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            cold = 1;
+            break;
+        case 't':
+            tree = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n files] [-d per-dir] [-b buf] [-c] "
+                    "[-t root|quota|fs] subvolume\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc || per_dir <= 0) {
+        fprintf(stderr, "missing args\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    snprintf(subvolume_path, sizeof(subvolume_path), "%s/%s",
+             bench_mnt_path(), argv[optind]);
+    subvolume_fd = bench_open_path(subvolume_path);
+
+    if (subvolume_fd < 0) {
+        return 1;
+    }
+
+    if (BENCH_IOCTL(subvolume_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        perror("ioctl");
+        return 1;
+    }
+
+    if (tree_search_init(&ts, volume_fd, buf_size) < 0) {
+        return 1;
+    }
+
+    if (tree != NULL) {
+        __u64 tree_id = info.treeid;
+
+        if (strcmp(tree, "root") == 0) {
+            tree_id = BTRFS_ROOT_TREE_OBJECTID;
+        }
+        else if (strcmp(tree, "quota") == 0) {
+            tree_id = BTRFS_QUOTA_TREE_OBJECTID;
+        }
+
+        return dump_tree(&ts, tree_id) < 0;
+    }
+
+    if (files > 0 && populate(subvolume_path, files, per_dir) < 0) {
+        return 1;
+    }
+
+    if (cold) {
+        bench_drop_caches();
+    }
+
+    tree_search_reset(&ts, info.treeid, BTRFS_FIRST_FREE_OBJECTID,
+                      BTRFS_LAST_FREE_OBJECTID, BTRFS_INODE_ITEM_KEY,
+                      BTRFS_INODE_ITEM_KEY, 0);
+    start = bench_now_ns();
+
+    if (tree_search_walk(&ts, count_inode, &scan) < 0) {
+        return 1;
+    }
+
+    scan_ns = bench_now_ns() - start;
+
+    if (cold) {
+        bench_drop_caches();
+    }
+
+    start = bench_now_ns();
+
+    if (walk_dir(dup(subvolume_fd), &walk) < 0) {
+        return 1;
+    }
+
+    walk_ns = bench_now_ns() - start;
+
+    /* The scan also sees the subvolume root directory itself. */
+    printf("%-16s %12s %16s %10s %14s\n", "method", "inodes", "bytes",
+           "time(ms)", "inodes/s");
+    printf("%-16s %12llu %16llu %10.1f %14.0f\n", "tree-search-v2",
+           scan.inodes, scan.bytes, scan_ns / 1e6,
+           scan.inodes * 1e9 / scan_ns);
+    printf("%-16s %12llu %16llu %10.1f %14.0f\n", "readdir+fstatat",
+           walk.inodes + 1, walk.bytes, walk_ns / 1e6,
+           (walk.inodes + 1) * 1e9 / walk_ns);
+    printf("\nsearch ioctls: %llu, buffer: %llu bytes, speedup: %.1fx\n",
+           ts.ioctls, ts.buf_size, (double)walk_ns / scan_ns);
+
+    tree_search_free(&ts);
+
+    return 0;
+}
@@ -7,6 +7,14 @@
 #include <linux/btrfs_tree.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o ino-test ino-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -50,23 +58,21 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    volume_fd = openat(AT_FDCWD, "/mnt", O_RDONLY|O_NONBLOCK
-                       |O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
 
     if (volume_fd < 0) {
-        perror("open");
         return 1;
     }
 
-    strncpy(subvolume_path, "/mnt/", BTRFS_PATH_NAME_MAX);
-    strncat(subvolume_path, argv[1], BTRFS_PATH_NAME_MAX);
+    snprintf(subvolume_path, sizeof(subvolume_path), "%s/%s",
+             bench_mnt_path(), argv[1]);
     subvolume_fd = openat(AT_FDCWD, subvolume_path, O_RDONLY|O_NONBLOCK
                           |O_CLOEXEC|O_DIRECTORY);
 
     lookup_args.treeid = 0;
     lookup_args.objectid = BTRFS_FIRST_FREE_OBJECTID;
 
-    if (ioctl(volume_fd, BTRFS_IOC_INO_LOOKUP, &lookup_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_INO_LOOKUP, &lookup_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -75,7 +81,7 @@ int main(int argc, char **argv)
     printf("treeid: %llu\n", lookup_args.treeid);
     printf("name: %s\n\n", lookup_args.name);
 
-    if (ioctl(subvolume_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+    if (BENCH_IOCTL(subvolume_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -83,7 +89,7 @@ int main(int argc, char **argv)
     lookup_user_args.dirid = info.dirid;
     lookup_user_args.treeid = info.treeid;
 
-    if (ioctl(volume_fd, BTRFS_IOC_INO_LOOKUP_USER, &lookup_user_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_INO_LOOKUP_USER, &lookup_user_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -95,7 +101,7 @@ int main(int argc, char **argv)
     path_args.inum = info.dirid;
     path_args.size = 0;
 
-    if (ioctl(subvolume_fd, BTRFS_IOC_INO_PATHS, &path_args) < 0) {
+    if (BENCH_IOCTL(subvolume_fd, BTRFS_IOC_INO_PATHS, &path_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -106,13 +112,13 @@ int main(int argc, char **argv)
     logical_args.logical = -1;
     logical_args.size = 0;
 
-    if (ioctl(volume_fd, BTRFS_IOC_LOGICAL_INO, &logical_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_LOGICAL_INO, &logical_args) < 0) {
         perror("ioctl BTRFS_IOC_LOGICAL_INO");
     }
 
     logical_args.flags = BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET;
 
-    if (ioctl(volume_fd, BTRFS_IOC_LOGICAL_INO_V2, &logical_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_LOGICAL_INO_V2, &logical_args) < 0) {
         perror("ioctl BTRFS_IOC_LOGICAL_INO_V2");
     }
 
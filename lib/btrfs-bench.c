@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "btrfs-bench.h"
+
+/*
+ * Upper bound on the number of distinct ioctl requests a single
+ * program issues. The seven test programs use at most a dozen each.
+ */
+#define BENCH_MAX_IOCTLS 64
+
+struct bench_ioctl_slot {
+    unsigned long request;
+    const char *name;
+    struct bench_hist *hist;
+};
+
+static struct bench_ioctl_slot ioctl_slots[BENCH_MAX_IOCTLS];
+static pthread_once_t report_once = PTHREAD_ONCE_INIT;
+
+__u64 bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned int hist_index(__u64 value)
+{
+    unsigned int msb;
+    unsigned int shift;
+
+    if (value < (1ULL << BENCH_HIST_SUB_BITS))
+        return value;
+
+    if (value >= (1ULL << BENCH_HIST_MAX_BITS))
+        value = (1ULL << BENCH_HIST_MAX_BITS) - 1;
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - BENCH_HIST_SUB_BITS;
+
+    return ((shift + 1) << BENCH_HIST_SUB_BITS) +
+           (unsigned int)((value >> shift) - (1ULL << BENCH_HIST_SUB_BITS));
+}
+
+/* Highest value that maps into bucket @index. */
+static __u64 hist_value(unsigned int index)
+{
+    unsigned int shift;
+    __u64 sub;
+
+    if (index < (1U << BENCH_HIST_SUB_BITS))
+        return index;
+
+    shift = (index >> BENCH_HIST_SUB_BITS) - 1;
+    sub = (index & ((1U << BENCH_HIST_SUB_BITS) - 1)) +
+          (1ULL << BENCH_HIST_SUB_BITS);
+
+    return ((sub + 1) << shift) - 1;
+}
+
+void bench_hist_init(struct bench_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = (__u64)-1;
+}
+
+struct bench_hist *bench_hist_alloc(void)
+{
+    struct bench_hist *hist;
+
+    hist = malloc(sizeof(*hist));
+
+    if (hist == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    bench_hist_init(hist);
+
+    return hist;
+}
+
+/*
+ * Lock-free so that worker threads can share one histogram; the
+ * relaxed atomics compile to a handful of locked adds on x86.
+ */
+void bench_hist_record(struct bench_hist *hist, __u64 value)
+{
+    __u64 cur;
+
+    __atomic_fetch_add(&hist->buckets[hist_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum, value, __ATOMIC_RELAXED);
+
+    cur = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    while (value < cur &&
+           !__atomic_compare_exchange_n(&hist->min, &cur, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    cur = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(&hist->max, &cur, value, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+    unsigned int i;
+
+    if (src->count == 0)
+        return;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->min < dst->min)
+        dst->min = src->min;
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+__u64 bench_hist_percentile(const struct bench_hist *hist, double percentile)
+{
+    __u64 target;
+    __u64 seen = 0;
+    unsigned int i;
+
+    if (hist->count == 0)
+        return 0;
+
+    target = (__u64)(percentile / 100.0 * hist->count + 0.5);
+
+    if (target == 0)
+        target = 1;
+
+    for (i = 0; i < BENCH_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+
+        if (seen >= target) {
+            __u64 value = hist_value(i);
+
+            return value < hist->max ? value : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+__u64 bench_hist_mean(const struct bench_hist *hist)
+{
+    if (hist->count == 0)
+        return 0;
+
+    return hist->sum / hist->count;
+}
+
+void bench_hist_print_header(FILE *out)
+{
+    fprintf(out, "%-36s %10s %10s %10s %10s %10s %10s\n",
+            "name", "count", "mean(us)", "p50(us)", "p99(us)",
+            "p999(us)", "max(us)");
+}
+
+void bench_hist_print(FILE *out, const char *name,
+                      const struct bench_hist *hist)
+{
+    fprintf(out, "%-36s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+            name, hist->count,
+            bench_hist_mean(hist) / 1000.0,
+            bench_hist_percentile(hist, 50.0) / 1000.0,
+            bench_hist_percentile(hist, 99.0) / 1000.0,
+            bench_hist_percentile(hist, 99.9) / 1000.0,
+            (hist->count ? hist->max : 0) / 1000.0);
+}
+
+const char *bench_mnt_path(void)
+{
+    const char *path = getenv("BTRFS_TEST_MNT");
+
+    if (path == NULL || path[0] == '\0')
+        return "/mnt";
+
+    return path;
+}
+
+int bench_open_path(const char *path)
+{
+    int fd;
+
+    fd = openat(AT_FDCWD, path, O_RDONLY|O_NONBLOCK
+                |O_CLOEXEC|O_DIRECTORY);
+
+    if (fd < 0)
+        perror("open");
+
+    return fd;
+}
+
+int bench_open_volume(void)
+{
+    return bench_open_path(bench_mnt_path());
+}
+
+/*
+ * Discover all devices of the filesystem @fd is on. Devids can have
+ * holes after a device was removed, so probe every id up to max_id.
+ * Returns the number of devices stored in the malloc'ed @devs array.
+ */
+int bench_list_devices(int fd, struct btrfs_ioctl_dev_info_args **devs)
+{
+    struct btrfs_ioctl_fs_info_args fs_info = {0};
+    struct btrfs_ioctl_dev_info_args *list;
+    __u64 devid;
+    __u64 n = 0;
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+        perror("ioctl BTRFS_IOC_FS_INFO");
+        return -1;
+    }
+
+    list = calloc(fs_info.num_devices ? fs_info.num_devices : 1,
+                  sizeof(*list));
+
+    if (list == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (devid = 1; devid <= fs_info.max_id && n < fs_info.num_devices;
+         devid++) {
+        memset(&list[n], 0, sizeof(list[n]));
+        list[n].devid = devid;
+
+        if (BENCH_IOCTL(fd, BTRFS_IOC_DEV_INFO, &list[n]) < 0) {
+            if (errno == ENODEV)
+                continue;
+
+            perror("ioctl BTRFS_IOC_DEV_INFO");
+            free(list);
+            return -1;
+        }
+
+        n++;
+    }
+
+    *devs = list;
+
+    /* n never exceeds num_devices, which always fits in an int. */
+    return (int)n;
+}
+
+/* Write back dirty data, then drop clean page, dentry and inode caches. */
+void bench_drop_caches(void)
+{
+    int fd;
+
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+
+    if (fd < 0 || write(fd, "3", 1) != 1)
+        perror("drop_caches");
+
+    if (fd >= 0)
+        close(fd);
+}
+
+int bench_parse_list(const char *arg, int *values, int max, int min)
+{
+    char *copy = strdup(arg);
+    char *tok;
+    char *save = NULL;
+    int n = 0;
+
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && n < max;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *end;
+        long value = strtol(tok, &end, 10);
+
+        if (*end != '\0' || value < min || value > 0x7fffffff) {
+            fprintf(stderr, "invalid list value: %s\n", tok);
+            free(copy);
+            return -1;
+        }
+
+        values[n++] = value;
+    }
+
+    free(copy);
+
+    if (n == 0)
+        fprintf(stderr, "empty list: %s\n", arg);
+
+    return n ? n : -1;
+}
+
+int bench_parse_size_list(const char *arg, __u64 *values, int max)
+{
+    char *copy = strdup(arg);
+    char *tok;
+    char *save = NULL;
+    int n = 0;
+
+    if (copy == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL && n < max;
+         tok = strtok_r(NULL, ",", &save)) {
+        unsigned long long value;
+        int shift = 0;
+        char *end;
+
+        errno = 0;
+        value = strtoull(tok, &end, 10);
+
+        switch (*end) {
+        case 'G': case 'g':
+            shift = 30;
+            end++;
+            break;
+        case 'M': case 'm':
+            shift = 20;
+            end++;
+            break;
+        case 'K': case 'k':
+            shift = 10;
+            end++;
+            break;
+        }
+
+        if (end == tok || *end != '\0' || tok[0] == '-' || errno != 0 ||
+            value > (~0ULL >> shift)) {
+            fprintf(stderr, "invalid size: %s\n", tok);
+            free(copy);
+            return -1;
+        }
+
+        values[n++] = value << shift;
+    }
+
+    free(copy);
+
+    if (n == 0)
+        fprintf(stderr, "empty list: %s\n", arg);
+
+    return n ? n : -1;
+}
+
+/*
+ * Create @files files named <prefix>-<n> in @dir and spread @bytes of
+ * incompressible data evenly across them. Nothing is synced, so the
+ * data is left dirty in the page cache.
+ */
+int bench_populate(const char *dir, const char *prefix, int files,
+                   __u64 bytes)
+{
+    static __thread char buf[1 << 20];
+    static __thread unsigned int seed;
+    char path[BENCH_PATH_MAX];
+    __u64 per_file;
+    int i;
+
+    if (seed == 0) {
+        unsigned int j;
+
+        seed = (unsigned int)bench_now_ns() | 1;
+
+        for (j = 0; j < sizeof(buf); j++)
+            buf[j] = rand_r(&seed);
+    }
+
+    per_file = files ? bytes / files : 0;
+
+    for (i = 0; i < files; i++) {
+        __u64 left = per_file;
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s-%d", dir, prefix, i);
+        fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        while (left > 0) {
+            size_t len = left < sizeof(buf) ? left : sizeof(buf);
+            ssize_t ret;
+
+            /* Vary the buffer so files do not dedupe or compress. */
+            buf[0]++;
+            buf[len - 1]++;
+
+            ret = write(fd, buf, len);
+
+            if (ret < 0) {
+                perror("write");
+                close(fd);
+                return -1;
+            }
+
+            left -= ret;
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+static void *ticker_thread(void *data)
+{
+    struct bench_ticker *ticker = data;
+    struct timespec next;
+    __u64 deadline = ticker->start_ns;
+
+    while (!__atomic_load_n(&ticker->stop, __ATOMIC_ACQUIRE)) {
+        deadline += ticker->interval_ns;
+        next.tv_sec = deadline / 1000000000ULL;
+        next.tv_nsec = deadline % 1000000000ULL;
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+                               NULL) == EINTR)
+            ;
+
+        if (__atomic_load_n(&ticker->stop, __ATOMIC_ACQUIRE))
+            break;
+
+        ticker->cb(bench_now_ns() - ticker->start_ns, ticker->data);
+    }
+
+    return NULL;
+}
+
+int bench_ticker_start(struct bench_ticker *ticker, __u64 interval_ns,
+                       bench_tick_cb cb, void *data)
+{
+    ticker->interval_ns = interval_ns;
+    ticker->cb = cb;
+    ticker->data = data;
+    ticker->stop = 0;
+    ticker->start_ns = bench_now_ns();
+
+    if (pthread_create(&ticker->thread, NULL, ticker_thread, ticker) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    return 0;
+}
+
+void bench_ticker_stop(struct bench_ticker *ticker)
+{
+    __atomic_store_n(&ticker->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(ticker->thread, NULL);
+    ticker->cb(bench_now_ns() - ticker->start_ns, ticker->data);
+}
+
+static void report_at_exit(void)
+{
+    if (getenv("BTRFS_BENCH_QUIET") == NULL)
+        bench_report(stderr);
+}
+
+static void register_report(void)
+{
+    atexit(report_at_exit);
+}
+
+static struct bench_ioctl_slot *lookup_slot(unsigned long request,
+                                            const char *name)
+{
+    unsigned int i = (request ^ (request >> 8)) % BENCH_MAX_IOCTLS;
+    unsigned int probe;
+
+    for (probe = 0; probe < BENCH_MAX_IOCTLS; probe++) {
+        struct bench_ioctl_slot *slot = &ioctl_slots[i];
+        unsigned long cur = __atomic_load_n(&slot->request, __ATOMIC_ACQUIRE);
+
+        if (cur == request)
+            break;
+
+        if (cur == 0) {
+            struct bench_hist *hist;
+
+            if (name == NULL)
+                return NULL;
+
+            hist = bench_hist_alloc();
+
+            if (__atomic_compare_exchange_n(&slot->request, &cur, request, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                slot->name = name;
+                __atomic_store_n(&slot->hist, hist, __ATOMIC_RELEASE);
+                pthread_once(&report_once, register_report);
+                return slot;
+            }
+
+            free(hist);
+
+            if (cur == request)
+                break;
+        }
+
+        i = (i + 1) % BENCH_MAX_IOCTLS;
+    }
+
+    if (probe == BENCH_MAX_IOCTLS)
+        return NULL;
+
+    /* Another thread claimed the slot and is about to publish it. */
+    while (__atomic_load_n(&ioctl_slots[i].hist, __ATOMIC_ACQUIRE) == NULL)
+        ;
+
+    return &ioctl_slots[i];
+}
+
+int bench_ioctl(int fd, unsigned long request, const char *name, void *arg)
+{
+    struct bench_ioctl_slot *slot;
+    __u64 start;
+    __u64 elapsed;
+    int saved_errno;
+    int ret;
+
+    start = bench_now_ns();
+    ret = ioctl(fd, request, arg);
+    elapsed = bench_now_ns() - start;
+    saved_errno = errno;
+
+    slot = lookup_slot(request, name);
+
+    if (slot != NULL)
+        bench_hist_record(slot->hist, elapsed);
+
+    errno = saved_errno;
+
+    return ret;
+}
+
+struct bench_hist *bench_ioctl_hist(unsigned long request)
+{
+    struct bench_ioctl_slot *slot = lookup_slot(request, NULL);
+
+    return slot ? slot->hist : NULL;
+}
+
+void bench_report(FILE *out)
+{
+    unsigned int i;
+    int printed = 0;
+
+    for (i = 0; i < BENCH_MAX_IOCTLS; i++) {
+        struct bench_ioctl_slot *slot = &ioctl_slots[i];
+
+        if (slot->request == 0 || slot->hist == NULL)
+            continue;
+
+        if (!printed) {
+            fprintf(out, "\nioctl latency:\n");
+            bench_hist_print_header(out);
+            printed = 1;
+        }
+
+        bench_hist_print(out, slot->name, slot->hist);
+    }
+}
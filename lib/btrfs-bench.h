@@ -0,0 +1,111 @@
+#ifndef BTRFS_BENCH_H
+#define BTRFS_BENCH_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include <linux/types.h>
+#include <linux/btrfs.h>
+
+/*
+ * Shared ioctl harness for the btrfs test programs.
+ *
+ * Every ioctl issued through BENCH_IOCTL() is timed with the monotonic
+ * clock and recorded into a per-request latency histogram. The
+ * histograms are printed to stderr when the program exits, so the
+ * regular test output on stdout is left untouched.
+ *
+ * Programs using the harness are built together with btrfs-bench.c:
+ *
+ * gcc -O2 -pthread -o btrfs-dev-test btrfs-dev-test.c ../lib/btrfs-bench.c
+ *
+ * The mount point defaults to /mnt and can be overridden with the
+ * BTRFS_TEST_MNT environment variable. Setting BTRFS_BENCH_QUIET
+ * suppresses the exit report.
+ */
+
+/*
+ * Log-linear histogram in the spirit of HdrHistogram: every power of
+ * two is split into 2^BENCH_HIST_SUB_BITS linear sub-buckets, which
+ * keeps the relative error below 1% for any recorded value. Values
+ * at or above 2^BENCH_HIST_MAX_BITS ns (~4.8 hours) are clamped.
+ */
+#define BENCH_HIST_SUB_BITS    7
+#define BENCH_HIST_MAX_BITS    44
+#define BENCH_HIST_BUCKETS     ((BENCH_HIST_MAX_BITS - BENCH_HIST_SUB_BITS + 1) \
+                                << BENCH_HIST_SUB_BITS)
+
+#define BENCH_PATH_MAX 4096
+
+struct bench_hist {
+    __u64 count;
+    __u64 sum;
+    __u64 min;
+    __u64 max;
+    __u64 buckets[BENCH_HIST_BUCKETS];
+};
+
+__u64 bench_now_ns(void);
+
+void bench_hist_init(struct bench_hist *hist);
+struct bench_hist *bench_hist_alloc(void);
+void bench_hist_record(struct bench_hist *hist, __u64 value);
+void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+__u64 bench_hist_percentile(const struct bench_hist *hist, double percentile);
+__u64 bench_hist_mean(const struct bench_hist *hist);
+void bench_hist_print_header(FILE *out);
+void bench_hist_print(FILE *out, const char *name,
+                      const struct bench_hist *hist);
+
+const char *bench_mnt_path(void);
+int bench_open_volume(void);
+int bench_open_path(const char *path);
+
+int bench_list_devices(int fd, struct btrfs_ioctl_dev_info_args **devs);
+
+/*
+ * Parse a comma separated list of at most @max integers, each at least
+ * @min. Returns the number of values, or -1 after printing an error.
+ */
+int bench_parse_list(const char *arg, int *values, int max, int min);
+
+/*
+ * Like bench_parse_list(), for byte counts with an optional K, M or G
+ * suffix (powers of 1024). Values that don't fit in 64 bits are
+ * rejected.
+ */
+int bench_parse_size_list(const char *arg, __u64 *values, int max);
+
+int bench_populate(const char *dir, const char *prefix, int files,
+                   __u64 bytes);
+
+/* Needs root; failures are reported but not fatal. */
+void bench_drop_caches(void);
+
+/*
+ * Periodic sampler thread. The callback runs every @interval_ns on an
+ * absolute monotonic schedule, so slow callbacks do not make the
+ * series drift, and once more when the ticker is stopped.
+ */
+typedef void (*bench_tick_cb)(__u64 elapsed_ns, void *data);
+
+struct bench_ticker {
+    pthread_t thread;
+    __u64 interval_ns;
+    __u64 start_ns;
+    bench_tick_cb cb;
+    void *data;
+    int stop;
+};
+
+int bench_ticker_start(struct bench_ticker *ticker, __u64 interval_ns,
+                       bench_tick_cb cb, void *data);
+void bench_ticker_stop(struct bench_ticker *ticker);
+
+int bench_ioctl(int fd, unsigned long request, const char *name, void *arg);
+struct bench_hist *bench_ioctl_hist(unsigned long request);
+void bench_report(FILE *out);
+
+#define BENCH_IOCTL(fd, request, arg) \
+    bench_ioctl((fd), (request), #request, (arg))
+
+#endif
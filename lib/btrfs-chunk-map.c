@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+#include "btrfs-chunk-map.h"
+#include "btrfs-tree-search.h"
+
+struct load_ctx {
+    struct chunk_map *map;
+    __u64 chunks_alloc;
+    __u64 stripes_alloc;
+};
+
+static int add_chunk(const struct btrfs_ioctl_search_header *hdr,
+                     const void *item, void *data)
+{
+    struct load_ctx *ctx = data;
+    struct chunk_map *map = ctx->map;
+    struct chunk_map_entry *entry;
+    const char *stripe;
+    __u16 num_stripes;
+    __u16 i;
+
+    if (ts_hdr_type(hdr) != BTRFS_CHUNK_ITEM_KEY)
+        return 0;
+
+    num_stripes = TS_ITEM_LE16(item, struct btrfs_chunk, num_stripes);
+
+    if (map->num_chunks == ctx->chunks_alloc) {
+        ctx->chunks_alloc = ctx->chunks_alloc ? ctx->chunks_alloc * 2 : 256;
+        map->chunks = realloc(map->chunks,
+                              ctx->chunks_alloc * sizeof(*map->chunks));
+
+        if (map->chunks == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+
+    if (map->num_stripes + num_stripes > ctx->stripes_alloc) {
+        ctx->stripes_alloc = (map->num_stripes + num_stripes) * 2;
+        map->stripes = realloc(map->stripes,
+                               ctx->stripes_alloc * sizeof(*map->stripes));
+
+        if (map->stripes == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+
+    entry = &map->chunks[map->num_chunks++];
+    entry->logical = ts_hdr_offset(hdr);
+    entry->length = TS_ITEM_LE64(item, struct btrfs_chunk, length);
+    entry->type = TS_ITEM_LE64(item, struct btrfs_chunk, type);
+    entry->stripe_len = TS_ITEM_LE64(item, struct btrfs_chunk, stripe_len);
+    entry->num_stripes = num_stripes;
+    entry->sub_stripes = TS_ITEM_LE16(item, struct btrfs_chunk, sub_stripes);
+
+    /* Stripe arrays move on realloc, so store the index for now. */
+    entry->stripes = (struct chunk_stripe *)(uintptr_t)map->num_stripes;
+
+    stripe = (const char *)item + offsetof(struct btrfs_chunk, stripe);
+
+    for (i = 0; i < num_stripes; i++) {
+        map->stripes[map->num_stripes].devid =
+            TS_ITEM_LE64(stripe, struct btrfs_stripe, devid);
+        map->stripes[map->num_stripes].physical =
+            TS_ITEM_LE64(stripe, struct btrfs_stripe, offset);
+        map->num_stripes++;
+        stripe += sizeof(struct btrfs_stripe);
+    }
+
+    return 0;
+}
+
+int chunk_map_load(struct chunk_map *map, int fd)
+{
+    struct load_ctx ctx = {0};
+    struct tree_search ts;
+    __u64 i;
+
+    memset(map, 0, sizeof(*map));
+    ctx.map = map;
+
+    if (tree_search_init(&ts, fd, TREE_SEARCH_MAX_BUF) < 0)
+        return -1;
+
+    tree_search_reset(&ts, BTRFS_CHUNK_TREE_OBJECTID,
+                      BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+                      BTRFS_FIRST_CHUNK_TREE_OBJECTID,
+                      BTRFS_CHUNK_ITEM_KEY, BTRFS_CHUNK_ITEM_KEY, 0);
+
+    if (tree_search_walk(&ts, add_chunk, &ctx) < 0) {
+        tree_search_free(&ts);
+        chunk_map_free(map);
+        return -1;
+    }
+
+    tree_search_free(&ts);
+
+    /* The chunk tree is keyed by logical start, so chunks are sorted. */
+    for (i = 0; i < map->num_chunks; i++)
+        map->chunks[i].stripes =
+            map->stripes + (uintptr_t)map->chunks[i].stripes;
+
+    if (chunk_map_index(map) < 0) {
+        chunk_map_free(map);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compare_dev_extent(const void *a, const void *b)
+{
+    const struct chunk_dev_extent *x = a;
+    const struct chunk_dev_extent *y = b;
+
+    if (x->devid != y->devid)
+        return x->devid < y->devid ? -1 : 1;
+
+    if (x->physical != y->physical)
+        return x->physical < y->physical ? -1 : 1;
+
+    return 0;
+}
+
+int chunk_map_index(struct chunk_map *map)
+{
+    struct chunk_dev_extent *extent;
+    __u64 i;
+    __u16 j;
+
+    free(map->dev_extents);
+    map->dev_extents = malloc((map->num_stripes ? map->num_stripes : 1) *
+                              sizeof(*map->dev_extents));
+
+    if (map->dev_extents == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    extent = map->dev_extents;
+
+    for (i = 0; i < map->num_chunks; i++) {
+        const struct chunk_map_entry *chunk = &map->chunks[i];
+        __u64 length = chunk_map_stripe_length(chunk);
+
+        for (j = 0; j < chunk->num_stripes; j++) {
+            extent->devid = chunk->stripes[j].devid;
+            extent->physical = chunk->stripes[j].physical;
+            extent->length = length;
+            extent->chunk = chunk;
+            extent->stripe = j;
+            extent++;
+        }
+    }
+
+    qsort(map->dev_extents, map->num_stripes, sizeof(*map->dev_extents),
+          compare_dev_extent);
+
+    return 0;
+}
+
+void chunk_map_free(struct chunk_map *map)
+{
+    free(map->chunks);
+    free(map->stripes);
+    free(map->dev_extents);
+    memset(map, 0, sizeof(*map));
+}
+
+const struct chunk_map_entry *chunk_map_find(const struct chunk_map *map,
+                                             __u64 logical)
+{
+    __u64 lo = 0;
+    __u64 hi = map->num_chunks;
+
+    while (lo < hi) {
+        __u64 mid = lo + (hi - lo) / 2;
+        const struct chunk_map_entry *entry = &map->chunks[mid];
+
+        if (logical < entry->logical)
+            hi = mid;
+        else if (logical >= entry->logical + entry->length)
+            lo = mid + 1;
+        else
+            return entry;
+    }
+
+    return NULL;
+}
+
+int chunk_map_num_copies(const struct chunk_map_entry *chunk)
+{
+    __u64 profile = chunk->type & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+
+    if (profile & (BTRFS_BLOCK_GROUP_RAID1_MASK | BTRFS_BLOCK_GROUP_DUP))
+        return chunk->num_stripes;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID10)
+        return chunk->sub_stripes;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID5)
+        return 2;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID6)
+        return 3;
+
+    return 1;
+}
+
+int chunk_map_to_physical(const struct chunk_map *map, __u64 logical,
+                          int mirror, __u64 *devid, __u64 *physical,
+                          __u64 *len)
+{
+    const struct chunk_map_entry *chunk = chunk_map_find(map, logical);
+    __u64 profile;
+    __u64 offset;
+    __u64 stripe_nr;
+    __u64 stripe_offset;
+    __u64 index;
+
+    if (chunk == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    profile = chunk->type & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+    offset = logical - chunk->logical;
+
+    if (mirror < 0 || mirror >= chunk_map_num_copies(chunk)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    /* Mirrored profiles keep a full copy of the chunk on every stripe. */
+    if (profile == 0 ||
+        (profile & (BTRFS_BLOCK_GROUP_RAID1_MASK | BTRFS_BLOCK_GROUP_DUP))) {
+        *devid = chunk->stripes[mirror].devid;
+        *physical = chunk->stripes[mirror].physical + offset;
+        *len = chunk->length - offset;
+        return 0;
+    }
+
+    stripe_nr = offset / chunk->stripe_len;
+    stripe_offset = offset % chunk->stripe_len;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID0) {
+        index = stripe_nr % chunk->num_stripes;
+        stripe_nr /= chunk->num_stripes;
+    }
+    else if (profile & BTRFS_BLOCK_GROUP_RAID10) {
+        __u64 factor = chunk->num_stripes / chunk->sub_stripes;
+
+        index = (stripe_nr % factor) * chunk->sub_stripes + mirror;
+        stripe_nr /= factor;
+    }
+    else {
+        /*
+         * RAID5/6: mirror 0 is the data stripe itself, higher mirrors
+         * can only be rebuilt from parity and have no direct location.
+         */
+        __u64 nr_parity = (profile & BTRFS_BLOCK_GROUP_RAID6) ? 2 : 1;
+        __u64 nr_data = chunk->num_stripes - nr_parity;
+
+        if (mirror != 0) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+
+        index = stripe_nr % nr_data;
+        stripe_nr /= nr_data;
+        index = (stripe_nr + index) % chunk->num_stripes;
+    }
+
+    *devid = chunk->stripes[index].devid;
+    *physical = chunk->stripes[index].physical +
+                stripe_nr * chunk->stripe_len + stripe_offset;
+    *len = chunk->stripe_len - stripe_offset;
+
+    return 0;
+}
+
+__u64 chunk_map_stripe_length(const struct chunk_map_entry *chunk)
+{
+    __u64 profile = chunk->type & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID0)
+        return chunk->length / chunk->num_stripes;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID10)
+        return chunk->length / (chunk->num_stripes / chunk->sub_stripes);
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID5)
+        return chunk->length / (chunk->num_stripes - 1);
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID6)
+        return chunk->length / (chunk->num_stripes - 2);
+
+    return chunk->length;
+}
+
+const struct chunk_dev_extent *chunk_map_find_dev(const struct chunk_map *map,
+                                                  __u64 devid,
+                                                  __u64 physical)
+{
+    __u64 lo = 0;
+    __u64 hi = map->num_stripes;
+
+    while (lo < hi) {
+        __u64 mid = lo + (hi - lo) / 2;
+        const struct chunk_dev_extent *extent = &map->dev_extents[mid];
+
+        if (devid < extent->devid ||
+            (devid == extent->devid && physical < extent->physical))
+            hi = mid;
+        else if (devid > extent->devid ||
+                 physical >= extent->physical + extent->length)
+            lo = mid + 1;
+        else
+            return extent;
+    }
+
+    return NULL;
+}
+
+int chunk_map_to_logical(const struct chunk_map *map, __u64 devid,
+                         __u64 physical, __u64 *logical, int *mirror)
+{
+    const struct chunk_dev_extent *extent;
+    const struct chunk_map_entry *chunk;
+    __u64 profile;
+    __u64 offset;
+    __u64 stripe_nr;
+    __u64 stripe_offset;
+
+    extent = chunk_map_find_dev(map, devid, physical);
+
+    if (extent == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    chunk = extent->chunk;
+    profile = chunk->type & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+    offset = physical - extent->physical;
+
+    if (profile == 0 ||
+        (profile & (BTRFS_BLOCK_GROUP_RAID1_MASK | BTRFS_BLOCK_GROUP_DUP))) {
+        *logical = chunk->logical + offset;
+        *mirror = extent->stripe;
+        return 0;
+    }
+
+    stripe_nr = offset / chunk->stripe_len;
+    stripe_offset = offset % chunk->stripe_len;
+
+    if (profile & BTRFS_BLOCK_GROUP_RAID0) {
+        stripe_nr = stripe_nr * chunk->num_stripes + extent->stripe;
+        *mirror = 0;
+    }
+    else if (profile & BTRFS_BLOCK_GROUP_RAID10) {
+        __u64 factor = chunk->num_stripes / chunk->sub_stripes;
+
+        stripe_nr = stripe_nr * factor + extent->stripe / chunk->sub_stripes;
+        *mirror = extent->stripe % chunk->sub_stripes;
+    }
+    else {
+        /* Undo the per-row rotation of chunk_map_to_physical(). */
+        __u64 nr_parity = (profile & BTRFS_BLOCK_GROUP_RAID6) ? 2 : 1;
+        __u64 nr_data = chunk->num_stripes - nr_parity;
+        __u64 index = (extent->stripe + chunk->num_stripes -
+                       stripe_nr % chunk->num_stripes) % chunk->num_stripes;
+
+        if (index >= nr_data) {
+            errno = EADDRNOTAVAIL;
+            return -1;
+        }
+
+        stripe_nr = stripe_nr * nr_data + index;
+        *mirror = 0;
+    }
+
+    *logical = chunk->logical + stripe_nr * chunk->stripe_len + stripe_offset;
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#ifndef BTRFS_CHUNK_MAP_H
+#define BTRFS_CHUNK_MAP_H
+
+#include <linux/types.h>
+
+/*
+ * In-memory copy of the chunk tree, read with TREE_SEARCH_V2.
+ *
+ * Chunks never overlap in logical address space, so a flat array
+ * sorted by logical start is a complete interval index: a binary
+ * search finds the chunk covering any logical address.
+ *
+ * The reverse direction uses a second array of device extents, one
+ * per chunk stripe, sorted by (devid, physical). Device extents don't
+ * overlap on a device either, so the same binary search applies.
+ */
+
+struct chunk_stripe {
+    __u64 devid;
+    __u64 physical;
+};
+
+struct chunk_map_entry {
+    __u64 logical;
+    __u64 length;
+    __u64 type;
+    __u64 stripe_len;
+    __u16 num_stripes;
+    __u16 sub_stripes;
+    struct chunk_stripe *stripes;
+};
+
+/* The part of a chunk stored on one device. */
+struct chunk_dev_extent {
+    __u64 devid;
+    __u64 physical;
+    __u64 length;
+    const struct chunk_map_entry *chunk;
+    __u16 stripe;
+};
+
+struct chunk_map {
+    struct chunk_map_entry *chunks;
+    __u64 num_chunks;
+    struct chunk_stripe *stripes;
+    __u64 num_stripes;
+    struct chunk_dev_extent *dev_extents;
+};
+
+int chunk_map_load(struct chunk_map *map, int fd);
+void chunk_map_free(struct chunk_map *map);
+
+/*
+ * (Re)build the device extent index from chunks and stripes. Called by
+ * chunk_map_load(); only maps assembled by hand need to call it.
+ */
+int chunk_map_index(struct chunk_map *map);
+
+const struct chunk_map_entry *chunk_map_find(const struct chunk_map *map,
+                                             __u64 logical);
+
+/* Number of complete copies of every data block in the chunk. */
+int chunk_map_num_copies(const struct chunk_map_entry *chunk);
+
+/*
+ * Translate @logical to the device location of copy @mirror (0-based,
+ * below chunk_map_num_copies()). On success *@len is the number of
+ * bytes that stay physically contiguous from there, i.e. up to the end
+ * of the current stripe.
+ */
+int chunk_map_to_physical(const struct chunk_map *map, __u64 logical,
+                          int mirror, __u64 *devid, __u64 *physical,
+                          __u64 *len);
+
+/* Bytes of the chunk stored on each of its stripes. */
+__u64 chunk_map_stripe_length(const struct chunk_map_entry *chunk);
+
+const struct chunk_dev_extent *chunk_map_find_dev(const struct chunk_map *map,
+                                                  __u64 devid,
+                                                  __u64 physical);
+
+/*
+ * Reverse of chunk_map_to_physical(): translate a device offset to the
+ * logical address it stores and the copy number it holds. Offsets in
+ * RAID5/6 parity fail with EADDRNOTAVAIL, unallocated space with ENOENT.
+ */
+int chunk_map_to_logical(const struct chunk_map *map, __u64 devid,
+                         __u64 physical, __u64 *logical, int *mirror);
+
+#endif
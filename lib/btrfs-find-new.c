@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/btrfs_tree.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-find-new.h"
+
+/* The kernel never returns more than this from BTRFS_IOC_INO_PATHS. */
+#define INO_PATHS_SIZE 4096
+/* Each level adds at least two bytes to a path that must fit in PATH_MAX. */
+#define MAX_DEPTH (BENCH_PATH_MAX / 2)
+
+struct find_new_run {
+    struct find_new *fn;
+    __u64 min_gen;
+    struct find_new_entry entry;
+    /* The current inode's INODE_ITEM or an extent is new enough. */
+    int changed;
+    /* First INODE_REF of the current inode, if the walk returned it. */
+    int has_ref;
+    __u64 ref_parent;
+    char ref_name[NAME_MAX + 1];
+    int stop;
+    find_new_cb cb;
+    void *data;
+};
+
+int find_new_generation(int fd, __u64 *generation)
+{
+    struct btrfs_ioctl_get_subvol_info_args info = {0};
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        perror("ioctl BTRFS_IOC_GET_SUBVOL_INFO");
+        return -1;
+    }
+
+    *generation = info.generation;
+
+    return 0;
+}
+
+int find_new_init(struct find_new *fn, int fd)
+{
+    struct btrfs_ioctl_get_subvol_info_args info = {0};
+
+    memset(fn, 0, sizeof(*fn));
+    fn->fd = fd;
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        perror("ioctl BTRFS_IOC_GET_SUBVOL_INFO");
+        return -1;
+    }
+
+    fn->treeid = info.treeid;
+    fn->generation = info.generation;
+    fn->fspath = malloc(INO_PATHS_SIZE);
+
+    if (fn->fspath == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (tree_search_init(&fn->ts, fd, TREE_SEARCH_DEFAULT_BUF) < 0) {
+        free(fn->fspath);
+        return -1;
+    }
+
+    return 0;
+}
+
+void find_new_destroy(struct find_new *fn)
+{
+    tree_search_free(&fn->ts);
+    free(fn->fspath);
+    fn->fspath = NULL;
+}
+
+static void free_dirs(struct find_new *fn)
+{
+    __u64 i;
+
+    for (i = 0; i < fn->num_dirs; i++)
+        free(fn->dirs[i].name);
+
+    free(fn->dirs);
+    fn->dirs = NULL;
+    fn->num_dirs = 0;
+    fn->dirs_alloc = 0;
+}
+
+/* The walk visits inodes in order, so appending keeps @dirs sorted. */
+static int add_dir(struct find_new *fn, __u64 inode, __u64 parent,
+                   const char *name)
+{
+    struct find_new_dir *dir;
+
+    if (fn->num_dirs == fn->dirs_alloc) {
+        __u64 alloc = fn->dirs_alloc ? fn->dirs_alloc * 2 : 256;
+
+        dir = realloc(fn->dirs, alloc * sizeof(*dir));
+
+        if (dir == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        fn->dirs = dir;
+        fn->dirs_alloc = alloc;
+    }
+
+    dir = &fn->dirs[fn->num_dirs];
+    dir->name = strdup(name);
+
+    if (dir->name == NULL) {
+        perror("strdup");
+        return -1;
+    }
+
+    dir->inode = inode;
+    dir->parent = parent;
+    fn->num_dirs++;
+
+    return 0;
+}
+
+static const struct find_new_dir *find_dir(const struct find_new *fn,
+                                           __u64 inode)
+{
+    __u64 lo = 0;
+    __u64 hi = fn->num_dirs;
+
+    while (lo < hi) {
+        __u64 mid = lo + (hi - lo) / 2;
+
+        if (inode < fn->dirs[mid].inode)
+            hi = mid;
+        else if (inode > fn->dirs[mid].inode)
+            lo = mid + 1;
+        else
+            return &fn->dirs[mid];
+    }
+
+    return NULL;
+}
+
+/* Valid until the next call; NULL if the inode has no name left. */
+static const char *ino_paths(struct find_new *fn, __u64 inode)
+{
+    struct btrfs_ioctl_ino_path_args args = {0};
+
+    args.inum = inode;
+    args.size = INO_PATHS_SIZE;
+    args.fspath = (__u64)(unsigned long)fn->fspath;
+    fn->stats.ino_paths_calls++;
+
+    if (BENCH_IOCTL(fn->fd, BTRFS_IOC_INO_PATHS, &args) < 0) {
+        if (errno != ENOENT)
+            perror("ioctl BTRFS_IOC_INO_PATHS");
+        return NULL;
+    }
+
+    if (fn->fspath->elem_cnt == 0)
+        return NULL;
+
+    /* Hard links give several names, the first one is reported. */
+    return (const char *)fn->fspath->val + fn->fspath->val[0];
+}
+
+/* Join @parent and @name in fn->path. */
+static const char *join_path(struct find_new *fn, const char *parent,
+                             const char *name)
+{
+    int len = snprintf(fn->path, sizeof(fn->path), "%s%s%s", parent,
+                       parent[0] ? "/" : "", name);
+
+    if (len < 0 || len >= (int)sizeof(fn->path))
+        return NULL;
+
+    return fn->path;
+}
+
+/*
+ * Path of directory @dir relative to the subvolume root, "" for the
+ * root itself. fn->path is only written after the recursive call has
+ * returned, so the one buffer serves every level.
+ */
+static const char *dir_path(struct find_new *fn, __u64 dir, int depth)
+{
+    const struct find_new_dir *ref;
+    const char *path;
+
+    if (dir == BTRFS_FIRST_FREE_OBJECTID)
+        return "";
+
+    path = path_cache_lookup(&fn->cache, fn->treeid, dir);
+
+    if (path != NULL)
+        return path;
+
+    ref = find_dir(fn, dir);
+
+    /* A rename racing with the walk could make the refs loop. */
+    if (ref != NULL && depth < MAX_DEPTH) {
+        path = dir_path(fn, ref->parent, depth + 1);
+
+        if (path != NULL)
+            path = join_path(fn, path, ref->name);
+    }
+
+    if (path == NULL)
+        path = ino_paths(fn, dir);
+
+    if (path == NULL)
+        return NULL;
+
+    return path_cache_insert(&fn->cache, fn->treeid, dir, path);
+}
+
+static const char *inode_path(struct find_new_run *run)
+{
+    struct find_new *fn = run->fn;
+    const char *parent;
+
+    if (run->entry.inode == BTRFS_FIRST_FREE_OBJECTID)
+        return ".";
+
+    if (S_ISDIR(run->entry.mode))
+        return dir_path(fn, run->entry.inode, 0);
+
+    if (run->has_ref) {
+        parent = dir_path(fn, run->ref_parent, 0);
+
+        if (parent != NULL && join_path(fn, parent, run->ref_name) != NULL) {
+            fn->stats.ref_paths++;
+            return fn->path;
+        }
+    }
+
+    return ino_paths(fn, run->entry.inode);
+}
+
+static void flush_inode(struct find_new_run *run)
+{
+    struct find_new *fn = run->fn;
+
+    if (run->entry.inode == 0 || !run->changed)
+        return;
+
+    run->entry.path = inode_path(run);
+
+    if (run->entry.path == NULL)
+        fn->stats.unresolved++;
+
+    fn->stats.inodes++;
+
+    if (run->cb != NULL && run->cb(&run->entry, run->data))
+        run->stop = 1;
+}
+
+/*
+ * Inline extents end at the type byte, with the data in place of
+ * disk_bytenr and the rest, so only ram_bytes applies to them.
+ */
+static __u64 extent_bytes(const void *item)
+{
+    __u8 type = *((const __u8 *)item +
+                  offsetof(struct btrfs_file_extent_item, type));
+
+    if (type == BTRFS_FILE_EXTENT_INLINE)
+        return TS_ITEM_LE64(item, struct btrfs_file_extent_item, ram_bytes);
+
+    return TS_ITEM_LE64(item, struct btrfs_file_extent_item, num_bytes);
+}
+
+static int visit_item(const struct btrfs_ioctl_search_header *hdr,
+                      const void *item, void *data)
+{
+    struct find_new_run *run = data;
+    __u64 inode = ts_hdr_objectid(hdr);
+    __u32 type = ts_hdr_type(hdr);
+
+    run->fn->stats.items++;
+
+    if (inode != run->entry.inode) {
+        flush_inode(run);
+
+        if (run->stop)
+            return 1;
+
+        memset(&run->entry, 0, sizeof(run->entry));
+        run->entry.inode = inode;
+        run->changed = 0;
+        run->has_ref = 0;
+    }
+
+    if (type == BTRFS_INODE_ITEM_KEY) {
+        run->entry.transid = TS_ITEM_LE64(item, struct btrfs_inode_item,
+                                          transid);
+        run->entry.size = TS_ITEM_LE64(item, struct btrfs_inode_item, size);
+        run->entry.mode = TS_ITEM_LE32(item, struct btrfs_inode_item, mode);
+
+        if (run->entry.transid >= run->min_gen)
+            run->changed = 1;
+    }
+    else if (type == BTRFS_INODE_REF_KEY && !run->has_ref) {
+        __u32 len = ts_hdr_len(hdr);
+        __u16 name_len;
+
+        if (len < sizeof(struct btrfs_inode_ref))
+            return 0;
+
+        name_len = TS_ITEM_LE16(item, struct btrfs_inode_ref, name_len);
+
+        if (name_len > NAME_MAX ||
+            sizeof(struct btrfs_inode_ref) + name_len > len)
+            return 0;
+
+        memcpy(run->ref_name, (const char *)item +
+               sizeof(struct btrfs_inode_ref), name_len);
+        run->ref_name[name_len] = '\0';
+        run->ref_parent = ts_hdr_offset(hdr);
+        run->has_ref = 1;
+
+        /* INODE_ITEM sorts first, so the mode is known if it was seen. */
+        if (S_ISDIR(run->entry.mode) &&
+            add_dir(run->fn, inode, run->ref_parent, run->ref_name) < 0)
+            return -1;
+    }
+    else if (type == BTRFS_EXTENT_DATA_KEY &&
+             TS_ITEM_LE64(item, struct btrfs_file_extent_item,
+                          generation) >= run->min_gen) {
+        run->entry.extents++;
+        run->entry.extent_bytes += extent_bytes(item);
+        run->fn->stats.extents++;
+        run->changed = 1;
+    }
+
+    return 0;
+}
+
+int find_new_run(struct find_new *fn, __u64 min_gen, find_new_cb cb,
+                 void *data)
+{
+    struct find_new_run run;
+    __u64 ioctls = fn->ts.ioctls;
+    int ret = 0;
+
+    if (path_cache_init(&fn->cache, 1024) < 0)
+        return -1;
+
+    memset(&run, 0, sizeof(run));
+    run.fn = fn;
+    run.min_gen = min_gen;
+    run.cb = cb;
+    run.data = data;
+
+    /*
+     * INODE_ITEM is the lowest and EXTENT_DATA the highest key type of
+     * an inode; in between only the INODE_REFs are used, the rest
+     * (extrefs, xattrs, dir entries) is skipped by visit_item().
+     */
+    tree_search_reset(&fn->ts, fn->treeid, BTRFS_FIRST_FREE_OBJECTID,
+                      BTRFS_LAST_FREE_OBJECTID, BTRFS_INODE_ITEM_KEY,
+                      BTRFS_EXTENT_DATA_KEY, min_gen);
+
+    if (tree_search_walk(&fn->ts, visit_item, &run) < 0)
+        ret = -1;
+    else if (!run.stop)
+        flush_inode(&run);
+
+    fn->stats.search_ioctls += fn->ts.ioctls - ioctls;
+    free_dirs(fn);
+    path_cache_destroy(&fn->cache);
+
+    return ret;
+}
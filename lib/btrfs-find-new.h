@@ -0,0 +1,109 @@
+#ifndef BTRFS_FIND_NEW_H
+#define BTRFS_FIND_NEW_H
+
+#include <linux/types.h>
+#include <linux/btrfs.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-path-cache.h"
+#include "btrfs-tree-search.h"
+
+/*
+ * Changed-file detector for one subvolume, in the spirit of
+ * "btrfs subvolume find-new".
+ *
+ * The subvolume's fs tree is scanned with TREE_SEARCH_V2 and
+ * min_transid set to the generation of interest, which makes the
+ * kernel skip every subtree that was not COWed since then: the cost
+ * follows the number of changed leaves, not the size of the tree.
+ * Leaves that are returned still carry unchanged items, so each
+ * INODE_ITEM is checked against its own transid and each EXTENT_DATA
+ * against its generation.
+ *
+ * A subvolume's items are sorted by inode, so all items of an inode
+ * arrive together and are folded into one find_new_entry that is
+ * handed to the callback as soon as the next inode starts.
+ *
+ * Paths are built from the INODE_REF items the walk returns anyway
+ * (their key type lies between INODE_ITEM and EXTENT_DATA): the first
+ * (parent, name) ref of every reported inode is joined to the path of
+ * its parent directory. Directory paths are kept in a path cache keyed
+ * by directory inode and built the same way from the directories' own
+ * refs. Only a directory the walk did not return, because its leaf is
+ * older than @min_gen, costs a BTRFS_IOC_INO_PATHS call, once per run;
+ * so does an inode whose ref sits in such a leaf. The cache and the
+ * refs only live for one run, as a later run may follow renames.
+ *
+ * The generation to compare against is usually that of a read-only
+ * snapshot taken earlier (find_new_generation() on the snapshot, plus
+ * one). Deleted inodes leave no items behind and are not reported;
+ * their parent directories are. Needs CAP_SYS_ADMIN.
+ */
+
+struct find_new_entry {
+    __u64 inode;
+    /* Last transaction that changed the inode item. */
+    __u64 transid;
+    __u32 mode;
+    __u64 size;
+    /* File extents written at or after the requested generation. */
+    __u64 extents;
+    __u64 extent_bytes;
+    /*
+     * Relative to the subvolume root; NULL if it has no name left.
+     * Only valid during the callback.
+     */
+    const char *path;
+};
+
+/* Return non-zero to stop the run. */
+typedef int (*find_new_cb)(const struct find_new_entry *entry, void *data);
+
+struct find_new_stats {
+    __u64 search_ioctls;
+    __u64 items;
+    __u64 inodes;
+    __u64 extents;
+    /* Paths built from INODE_REF items and the directory cache. */
+    __u64 ref_paths;
+    __u64 ino_paths_calls;
+    __u64 unresolved;
+};
+
+/* A directory's INODE_REF as returned by the walk. */
+struct find_new_dir {
+    __u64 inode;
+    __u64 parent;
+    char *name;
+};
+
+struct find_new {
+    int fd;
+    __u64 treeid;
+    __u64 generation;
+    struct tree_search ts;
+    struct btrfs_data_container *fspath;
+    /* Per run: directory refs in inode order and their paths. */
+    struct find_new_dir *dirs;
+    __u64 num_dirs;
+    __u64 dirs_alloc;
+    struct path_cache cache;
+    char path[BENCH_PATH_MAX];
+    struct find_new_stats stats;
+};
+
+/* Current generation of the subvolume @fd is in. */
+int find_new_generation(int fd, __u64 *generation);
+
+/*
+ * @fd must be inside the subvolume to scan; its current generation is
+ * stored in @fn->generation as the marker for the next run.
+ */
+int find_new_init(struct find_new *fn, int fd);
+void find_new_destroy(struct find_new *fn);
+
+/* Report every inode changed in transaction @min_gen or later. */
+int find_new_run(struct find_new *fn, __u64 min_gen, find_new_cb cb,
+                 void *data);
+
+#endif
@@ -0,0 +1,510 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/fs.h>
+#include <linux/loop.h>
+
+#include "btrfs-loop.h"
+
+int loop_image_create(const char *path, __u64 size)
+{
+    int fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (ftruncate(fd, size) < 0) {
+        perror("ftruncate");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+int loop_attach(struct loop_fs *fs, const char *image, unsigned int flags)
+{
+    struct loop_config config;
+    struct loop_info64 info;
+    int ctl_fd;
+    int file_fd;
+    int tries;
+
+    memset(fs, 0, sizeof(*fs));
+    fs->loop_fd = -1;
+    fs->flags = flags;
+    snprintf(fs->image, sizeof(fs->image), "%s", image);
+
+    file_fd = open(image, O_RDWR|O_CLOEXEC);
+
+    if (file_fd < 0) {
+        perror(image);
+        return -1;
+    }
+
+    ctl_fd = open("/dev/loop-control", O_RDWR|O_CLOEXEC);
+
+    if (ctl_fd < 0) {
+        perror("open /dev/loop-control");
+        close(file_fd);
+        return -1;
+    }
+
+    /* Another process may grab the free device before we bind it. */
+    for (tries = 0; tries < 16; tries++) {
+        int nr = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+
+        if (nr < 0) {
+            perror("ioctl LOOP_CTL_GET_FREE");
+            break;
+        }
+
+        snprintf(fs->device, sizeof(fs->device), "/dev/loop%d", nr);
+        fs->loop_fd = open(fs->device, O_RDWR|O_CLOEXEC);
+
+        if (fs->loop_fd < 0) {
+            perror(fs->device);
+            break;
+        }
+
+        memset(&config, 0, sizeof(config));
+        config.fd = file_fd;
+        config.info.lo_flags = LO_FLAGS_AUTOCLEAR;
+
+        /* Direct I/O needs the loop block size to match the host's. */
+        if (flags & LOOP_FS_DIRECT_IO) {
+            config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+            config.block_size = 4096;
+        }
+
+        if (ioctl(fs->loop_fd, LOOP_CONFIGURE, &config) == 0)
+            break;
+
+        close(fs->loop_fd);
+        fs->loop_fd = -1;
+
+        if (errno != EBUSY) {
+            perror("ioctl LOOP_CONFIGURE");
+            break;
+        }
+    }
+
+    close(ctl_fd);
+    close(file_fd);
+
+    if (fs->loop_fd < 0)
+        return -1;
+
+    if ((flags & LOOP_FS_DIRECT_IO) &&
+        (ioctl(fs->loop_fd, LOOP_GET_STATUS64, &info) < 0 ||
+         !(info.lo_flags & LO_FLAGS_DIRECT_IO)))
+        fs->flags &= ~LOOP_FS_DIRECT_IO;
+
+    return 0;
+}
+
+void loop_detach(struct loop_fs *fs)
+{
+    if (fs->mounted)
+        loop_umount(fs);
+
+    if (fs->loop_fd < 0)
+        return;
+
+    /* With autoclear set this only fails if the device is still busy. */
+    if (ioctl(fs->loop_fd, LOOP_CLR_FD, 0) < 0 && errno != ENXIO)
+        perror("ioctl LOOP_CLR_FD");
+
+    close(fs->loop_fd);
+    fs->loop_fd = -1;
+}
+
+/*
+ * Run a btrfs-progs tool from $PATH and wait for it. A non-zero exit
+ * status is left to the caller to report.
+ */
+static int run_tool(const char *const *argv)
+{
+    int status;
+    pid_t pid;
+
+    pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        execvp(argv[0], (char *const *)argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return -1;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+
+    return 0;
+}
+
+int loop_mkfs(const struct loop_fs *fs, const char *const *args)
+{
+    const char *argv[LOOP_MAX_MKFS_ARGS + 5];
+    int argc = 0;
+
+    argv[argc++] = "mkfs.btrfs";
+    argv[argc++] = "-f";
+    argv[argc++] = "-q";
+
+    while (args != NULL && *args != NULL && argc < LOOP_MAX_MKFS_ARGS + 3)
+        argv[argc++] = *args++;
+
+    argv[argc++] = fs->device;
+    argv[argc] = NULL;
+
+    if (run_tool(argv) < 0) {
+        fprintf(stderr, "mkfs.btrfs failed on %s\n", fs->device);
+        return -1;
+    }
+
+    return 0;
+}
+
+int loop_mount(struct loop_fs *fs, const char *mnt, const char *options)
+{
+    snprintf(fs->mnt, sizeof(fs->mnt), "%s", mnt);
+
+    if (mount(fs->device, fs->mnt, "btrfs", 0, options) < 0) {
+        perror("mount");
+        return -1;
+    }
+
+    fs->mounted = 1;
+
+    return 0;
+}
+
+int loop_umount(struct loop_fs *fs)
+{
+    if (umount(fs->mnt) < 0) {
+        perror("umount");
+        return -1;
+    }
+
+    fs->mounted = 0;
+
+    return 0;
+}
+
+const char *loop_export(const struct loop_fs *fs)
+{
+    return fs->mnt;
+}
+
+int loop_pool_init(struct loop_pool *pool, const char *dir, __u64 image_size)
+{
+    memset(pool, 0, sizeof(*pool));
+    snprintf(pool->dir, sizeof(pool->dir), "%s", dir);
+    pool->image_size = image_size;
+
+    if (mkdir(pool->dir, 0700) < 0 && errno != EEXIST) {
+        perror(pool->dir);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return 0;
+}
+
+void loop_pool_destroy(struct loop_pool *pool, int purge)
+{
+    int i;
+
+    for (i = 0; purge && i < pool->num_golden; i++)
+        unlink(pool->golden[i].path);
+
+    pthread_mutex_destroy(&pool->lock);
+}
+
+/* FNV-1a over the image size and mkfs arguments. */
+static __u64 golden_key(__u64 image_size, const char *const *args)
+{
+    __u64 hash = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        hash ^= (image_size >> (i * 8)) & 0xff;
+        hash *= 0x100000001b3ULL;
+    }
+
+    while (args != NULL && *args != NULL) {
+        const char *p = *args++;
+
+        do {
+            hash ^= (unsigned char)*p;
+            hash *= 0x100000001b3ULL;
+        } while (*p++ != '\0');
+    }
+
+    return hash;
+}
+
+/*
+ * Format into a temporary name and rename it into place, so an
+ * interrupted mkfs never leaves a golden image behind for later runs.
+ */
+static int golden_create(const struct loop_pool *pool,
+                         const char *const *args, const char *path)
+{
+    char tmp[BENCH_PATH_MAX];
+    struct loop_fs fs;
+    int ret;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    if (loop_image_create(tmp, pool->image_size) < 0)
+        return -1;
+
+    if (loop_attach(&fs, tmp, 0) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    ret = loop_mkfs(&fs, args);
+    loop_detach(&fs);
+
+    if (ret == 0 && rename(tmp, path) < 0) {
+        perror("rename");
+        ret = -1;
+    }
+
+    if (ret < 0)
+        unlink(tmp);
+
+    return ret;
+}
+
+static const char *golden_get(struct loop_pool *pool, const char *const *args)
+{
+    __u64 key = golden_key(pool->image_size, args);
+    struct loop_golden *golden = NULL;
+    struct stat st;
+    int len;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (i = 0; i < pool->num_golden; i++) {
+        if (pool->golden[i].key == key) {
+            golden = &pool->golden[i];
+            break;
+        }
+    }
+
+    if (golden == NULL && pool->num_golden < LOOP_POOL_MAX_GOLDEN) {
+        golden = &pool->golden[pool->num_golden];
+        golden->key = key;
+        len = snprintf(golden->path, sizeof(golden->path),
+                       "%s/golden-%016llx.img", pool->dir, key);
+
+        /* Formatted by an earlier run with the same arguments. */
+        if (len >= (int)sizeof(golden->path)) {
+            fprintf(stderr, "loop pool: %s: path too long\n", pool->dir);
+            golden = NULL;
+        }
+        else if (stat(golden->path, &st) < 0 &&
+                 golden_create(pool, args, golden->path) < 0) {
+            golden = NULL;
+        }
+        else {
+            pool->num_golden++;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (golden == NULL && pool->num_golden == LOOP_POOL_MAX_GOLDEN)
+        fprintf(stderr, "loop pool: more than %d golden images\n",
+                LOOP_POOL_MAX_GOLDEN);
+
+    return golden != NULL ? golden->path : NULL;
+}
+
+/* Copy only the allocated ranges so the clone stays sparse. */
+static int copy_sparse(int src_fd, int dst_fd, __u64 size)
+{
+    off_t data = 0;
+
+    if (ftruncate(dst_fd, size) < 0) {
+        perror("ftruncate");
+        return -1;
+    }
+
+    while ((data = lseek(src_fd, data, SEEK_DATA)) >= 0) {
+        off_t hole = lseek(src_fd, data, SEEK_HOLE);
+        loff_t in = data;
+        loff_t out = data;
+
+        if (hole < 0) {
+            perror("lseek SEEK_HOLE");
+            return -1;
+        }
+
+        while (in < hole) {
+            ssize_t ret = copy_file_range(src_fd, &in, dst_fd, &out,
+                                          hole - in, 0);
+
+            if (ret <= 0) {
+                perror("copy_file_range");
+                return -1;
+            }
+        }
+
+        data = hole;
+    }
+
+    if (errno != ENXIO) {
+        perror("lseek SEEK_DATA");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * A clone carries the golden image's fsid, and before Linux 6.7 (which
+ * hands out temporary fsids to single-device duplicates) the kernel
+ * refuses to mount a second filesystem with the same fsid. btrfstune -m
+ * only rewrites the superblock, so every clone gets a fresh random fsid
+ * for the price of a fork.
+ */
+static int change_fsid(const char *path)
+{
+    /* -f skips the confirmation prompt of -u. */
+    const char *argv[] = { "btrfstune", "-f", "-u", path, NULL };
+
+    if (run_tool(argv) < 0) {
+        fprintf(stderr, "btrfstune -u failed on %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int clone_image(struct loop_pool *pool, const char *golden, char *path)
+{
+    int src_fd;
+    int dst_fd;
+    int ret = 0;
+
+    if (snprintf(path, BENCH_PATH_MAX, "%s/fixture-XXXXXX",
+                 pool->dir) >= BENCH_PATH_MAX) {
+        fprintf(stderr, "loop pool: %s: path too long\n", pool->dir);
+        return -1;
+    }
+
+    src_fd = open(golden, O_RDONLY|O_CLOEXEC);
+
+    if (src_fd < 0) {
+        perror(golden);
+        return -1;
+    }
+
+    dst_fd = mkostemp(path, O_CLOEXEC);
+
+    if (dst_fd < 0) {
+        perror("mkostemp");
+        close(src_fd);
+        return -1;
+    }
+
+    if (ioctl(dst_fd, FICLONE, src_fd) == 0) {
+        __atomic_fetch_add(&pool->reflinks, 1, __ATOMIC_RELAXED);
+    }
+    else if (copy_sparse(src_fd, dst_fd, pool->image_size) == 0) {
+        __atomic_fetch_add(&pool->copies, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        unlink(path);
+        ret = -1;
+    }
+
+    close(dst_fd);
+    close(src_fd);
+
+    if (ret == 0 && change_fsid(path) < 0) {
+        unlink(path);
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int loop_pool_get(struct loop_pool *pool, const char *const *args,
+                  const char *options, unsigned int flags, struct loop_fs *fs)
+{
+    char image[BENCH_PATH_MAX];
+    char mnt[BENCH_PATH_MAX];
+    const char *golden = golden_get(pool, args);
+    int len;
+
+    if (golden == NULL || clone_image(pool, golden, image) < 0)
+        return -1;
+
+    if (loop_attach(fs, image, flags) < 0) {
+        unlink(image);
+        return -1;
+    }
+
+    fs->flags |= LOOP_FS_FIXTURE;
+
+    /* Never truncated: clone_image() already fit a longer name. */
+    len = snprintf(mnt, sizeof(mnt), "%s/mnt-XXXXXX", pool->dir);
+
+    if (len >= (int)sizeof(mnt) || mkdtemp(mnt) == NULL) {
+        perror("mkdtemp");
+        loop_pool_put(fs);
+        return -1;
+    }
+
+    if (loop_mount(fs, mnt, options) < 0) {
+        rmdir(mnt);
+        loop_pool_put(fs);
+        return -1;
+    }
+
+    return 0;
+}
+
+void loop_pool_put(struct loop_fs *fs)
+{
+    int mounted = fs->mounted;
+
+    loop_detach(fs);
+
+    if (!(fs->flags & LOOP_FS_FIXTURE))
+        return;
+
+    if (mounted)
+        rmdir(fs->mnt);
+
+    unlink(fs->image);
+}
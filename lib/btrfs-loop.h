@@ -0,0 +1,100 @@
+#ifndef BTRFS_LOOP_H
+#define BTRFS_LOOP_H
+
+#include <pthread.h>
+#include <linux/types.h>
+
+#include "btrfs-bench.h"
+
+/*
+ * Scratch filesystems on loop devices, for tests that need to format
+ * or remount rather than use the filesystem mounted at
+ * BTRFS_TEST_MNT.
+ *
+ * The loop device is taken with LOOP_CTL_GET_FREE and bound with a
+ * single LOOP_CONFIGURE, with LO_FLAGS_AUTOCLEAR set so the device is
+ * released once the last user (the mount) is gone. mkfs.btrfs and,
+ * for the pool, btrfstune from btrfs-progs must be in $PATH.
+ *
+ * The pool keeps one pre-formatted golden image per set of mkfs
+ * arguments and hands out clones of it, reflinked with FICLONE where
+ * the image directory supports it and copied extent by extent with
+ * copy_file_range() otherwise. Each clone then gets a random fsid with
+ * btrfstune -f -u, as kernels before 6.7 refuse to mount two
+ * filesystems with the same fsid, and is mounted on its own mkdtemp()
+ * directory, so fixtures can be taken from several threads at once and
+ * the golden images survive between runs. btrfstune -u rewrites the
+ * fsid in every metadata block, so a reflinked clone stops sharing its
+ * metadata with the golden image but leaves the feature flags alone;
+ * btrfstune -m would be cheaper, but sets the METADATA_UUID incompat
+ * flag that the tests would then see.
+ */
+
+#define LOOP_MAX_MKFS_ARGS 32
+#define LOOP_POOL_MAX_GOLDEN 16
+
+/* Bypass the page cache of the backing file (LO_FLAGS_DIRECT_IO). */
+#define LOOP_FS_DIRECT_IO   (1U << 0)
+/* Set by the pool: the image and mount point are removed on put. */
+#define LOOP_FS_FIXTURE     (1U << 1)
+
+struct loop_fs {
+    char image[BENCH_PATH_MAX];
+    char device[32];
+    char mnt[BENCH_PATH_MAX];
+    unsigned int flags;
+    int loop_fd;
+    int mounted;
+};
+
+struct loop_golden {
+    __u64 key;
+    char path[BENCH_PATH_MAX];
+};
+
+struct loop_pool {
+    pthread_mutex_t lock;
+    char dir[BENCH_PATH_MAX];
+    __u64 image_size;
+    struct loop_golden golden[LOOP_POOL_MAX_GOLDEN];
+    int num_golden;
+    __u64 reflinks;
+    __u64 copies;
+};
+
+/* Create (or truncate) a sparse image file of @size bytes. */
+int loop_image_create(const char *path, __u64 size);
+
+/*
+ * LOOP_FS_DIRECT_IO is dropped from fs->flags if the kernel fell back
+ * to buffered I/O for this backing file.
+ */
+int loop_attach(struct loop_fs *fs, const char *image, unsigned int flags);
+void loop_detach(struct loop_fs *fs);
+
+/* Run mkfs.btrfs -f -q on the device with the NULL terminated @args. */
+int loop_mkfs(const struct loop_fs *fs, const char *const *args);
+
+int loop_mount(struct loop_fs *fs, const char *mnt, const char *options);
+int loop_umount(struct loop_fs *fs);
+
+/*
+ * The value that points BTRFS_TEST_MNT, and so bench_open_volume(), at
+ * the fixture. Setting the environment is left to the caller, as
+ * setenv() isn't safe while other threads read it.
+ */
+const char *loop_export(const struct loop_fs *fs);
+
+int loop_pool_init(struct loop_pool *pool, const char *dir, __u64 image_size);
+/* Unlinks the golden images as well if @purge is set. */
+void loop_pool_destroy(struct loop_pool *pool, int purge);
+
+/*
+ * Clone the golden image for @args (formatting it on first use),
+ * attach it and mount it with @options on a fresh temporary directory.
+ */
+int loop_pool_get(struct loop_pool *pool, const char *const *args,
+                  const char *options, unsigned int flags, struct loop_fs *fs);
+void loop_pool_put(struct loop_fs *fs);
+
+#endif
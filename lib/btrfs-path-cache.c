@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btrfs-path-cache.h"
+
+static __u64 hash_key(__u64 root, __u64 inode)
+{
+    __u64 h = root * 0x9e3779b97f4a7c15ULL ^ inode;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return h;
+}
+
+static struct path_cache_entry *find_slot(struct path_cache_entry *entries,
+                                          __u64 size, __u64 root, __u64 inode)
+{
+    __u64 i = hash_key(root, inode) & (size - 1);
+
+    while (entries[i].path != NULL &&
+           (entries[i].root != root || entries[i].inode != inode))
+        i = (i + 1) & (size - 1);
+
+    return &entries[i];
+}
+
+static int grow(struct path_cache *cache)
+{
+    struct path_cache_entry *entries;
+    __u64 size = cache->size * 2;
+    __u64 i;
+
+    entries = calloc(size, sizeof(*entries));
+
+    if (entries == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (i = 0; i < cache->size; i++) {
+        struct path_cache_entry *old = &cache->entries[i];
+
+        if (old->path != NULL)
+            *find_slot(entries, size, old->root, old->inode) = *old;
+    }
+
+    free(cache->entries);
+    cache->entries = entries;
+    cache->size = size;
+
+    return 0;
+}
+
+int path_cache_init(struct path_cache *cache, __u64 expected)
+{
+    __u64 size = 64;
+
+    while (size < expected * 2)
+        size *= 2;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->entries = calloc(size, sizeof(*cache->entries));
+
+    if (cache->entries == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    cache->size = size;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return 0;
+}
+
+void path_cache_destroy(struct path_cache *cache)
+{
+    __u64 i;
+
+    for (i = 0; i < cache->size; i++)
+        free(cache->entries[i].path);
+
+    free(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+const char *path_cache_lookup(struct path_cache *cache, __u64 root,
+                              __u64 inode)
+{
+    struct path_cache_entry *entry;
+    const char *path;
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = find_slot(cache->entries, cache->size, root, inode);
+    path = entry->path;
+
+    if (path != NULL)
+        cache->hits++;
+    else
+        cache->misses++;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return path;
+}
+
+/*
+ * Insert @path for (root, inode) unless another thread beat us to it,
+ * and return the cached copy either way.
+ */
+const char *path_cache_insert(struct path_cache *cache, __u64 root,
+                              __u64 inode, const char *path)
+{
+    struct path_cache_entry *entry;
+    const char *ret = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if ((cache->count + 1) * 10 > cache->size * 7 && grow(cache) < 0)
+        goto out;
+
+    entry = find_slot(cache->entries, cache->size, root, inode);
+
+    if (entry->path == NULL) {
+        entry->path = strdup(path);
+
+        if (entry->path == NULL) {
+            perror("strdup");
+            goto out;
+        }
+
+        entry->root = root;
+        entry->inode = inode;
+        cache->count++;
+    }
+
+    ret = entry->path;
+out:
+    pthread_mutex_unlock(&cache->lock);
+
+    return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef BTRFS_PATH_CACHE_H
+#define BTRFS_PATH_CACHE_H
+
+#include <pthread.h>
+#include <linux/types.h>
+
+/*
+ * Thread-safe (root, inode) -> path cache.
+ *
+ * Subvolume paths are stored under (treeid, BTRFS_FIRST_FREE_OBJECTID),
+ * the inode number of every subvolume's root directory, so the same
+ * cache serves both subvolume and file path resolution. Returned
+ * strings stay valid until path_cache_destroy().
+ */
+
+struct path_cache_entry {
+    __u64 root;
+    __u64 inode;
+    char *path;
+};
+
+struct path_cache {
+    pthread_mutex_t lock;
+    struct path_cache_entry *entries;
+    __u64 size;
+    __u64 count;
+    __u64 hits;
+    __u64 misses;
+};
+
+int path_cache_init(struct path_cache *cache, __u64 expected);
+void path_cache_destroy(struct path_cache *cache);
+const char *path_cache_lookup(struct path_cache *cache, __u64 root,
+                              __u64 inode);
+const char *path_cache_insert(struct path_cache *cache, __u64 root,
+                              __u64 inode, const char *path);
+
+#endif
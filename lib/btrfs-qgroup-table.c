@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+#include "btrfs-qgroup-table.h"
+
+struct qgroup_entry *qgroup_table_find(const struct qgroup_table *table,
+                                       __u64 qgroupid)
+{
+    __u64 lo = 0;
+    __u64 hi = table->count;
+
+    while (lo < hi) {
+        __u64 mid = lo + (hi - lo) / 2;
+
+        if (qgroupid < table->entries[mid].qgroupid)
+            hi = mid;
+        else if (qgroupid > table->entries[mid].qgroupid)
+            lo = mid + 1;
+        else
+            return &table->entries[mid];
+    }
+
+    return NULL;
+}
+
+static int add_info(struct qgroup_table *table,
+                    const struct btrfs_ioctl_search_header *hdr,
+                    const void *item)
+{
+    struct qgroup_entry *entry;
+
+    if (table->count == table->alloc) {
+        table->alloc = table->alloc ? table->alloc * 2 : 1024;
+        table->entries = realloc(table->entries,
+                                 table->alloc * sizeof(*table->entries));
+
+        if (table->entries == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+
+    entry = &table->entries[table->count++];
+    memset(entry, 0, sizeof(*entry));
+    entry->qgroupid = ts_hdr_offset(hdr);
+    entry->generation = TS_ITEM_LE64(item, struct btrfs_qgroup_info_item,
+                                     generation);
+    entry->rfer = TS_ITEM_LE64(item, struct btrfs_qgroup_info_item, rfer);
+    entry->excl = TS_ITEM_LE64(item, struct btrfs_qgroup_info_item, excl);
+
+    return 0;
+}
+
+static void add_limit(struct qgroup_table *table,
+                      const struct btrfs_ioctl_search_header *hdr,
+                      const void *item)
+{
+    struct qgroup_entry *entry = qgroup_table_find(table,
+                                                   ts_hdr_offset(hdr));
+
+    if (entry == NULL)
+        return;
+
+    entry->limit_flags = TS_ITEM_LE64(item, struct btrfs_qgroup_limit_item,
+                                      flags);
+    entry->max_rfer = TS_ITEM_LE64(item, struct btrfs_qgroup_limit_item,
+                                   max_rfer);
+    entry->max_excl = TS_ITEM_LE64(item, struct btrfs_qgroup_limit_item,
+                                   max_excl);
+}
+
+static int add_relation(struct qgroup_table *table,
+                        const struct btrfs_ioctl_search_header *hdr)
+{
+    struct qgroup_relation *relation;
+    struct qgroup_entry *entry;
+    __u64 child = ts_hdr_objectid(hdr);
+    __u64 parent = ts_hdr_offset(hdr);
+
+    /* Parents are on a higher level and thus always the larger id. */
+    if (child > parent)
+        return 0;
+
+    if (table->num_relations == table->rel_alloc) {
+        table->rel_alloc = table->rel_alloc ? table->rel_alloc * 2 : 1024;
+        table->relations = realloc(table->relations, table->rel_alloc *
+                                   sizeof(*table->relations));
+
+        if (table->relations == NULL) {
+            perror("realloc");
+            return -1;
+        }
+    }
+
+    relation = &table->relations[table->num_relations++];
+    relation->child = child;
+    relation->parent = parent;
+
+    if ((entry = qgroup_table_find(table, child)) != NULL)
+        entry->num_parents++;
+
+    if ((entry = qgroup_table_find(table, parent)) != NULL)
+        entry->num_children++;
+
+    return 0;
+}
+
+static int add_item(const struct btrfs_ioctl_search_header *hdr,
+                    const void *item, void *data)
+{
+    struct qgroup_table *table = data;
+
+    switch (ts_hdr_type(hdr)) {
+    case BTRFS_QGROUP_STATUS_KEY:
+        table->status_flags = TS_ITEM_LE64(item,
+                                           struct btrfs_qgroup_status_item,
+                                           flags);
+        table->status_generation =
+            TS_ITEM_LE64(item, struct btrfs_qgroup_status_item, generation);
+        return 0;
+    case BTRFS_QGROUP_INFO_KEY:
+        return add_info(table, hdr, item);
+    case BTRFS_QGROUP_LIMIT_KEY:
+        add_limit(table, hdr, item);
+        return 0;
+    case BTRFS_QGROUP_RELATION_KEY:
+        return add_relation(table, hdr);
+    }
+
+    return 0;
+}
+
+int qgroup_table_load(struct qgroup_table *table, struct tree_search *ts)
+{
+    table->count = 0;
+    table->num_relations = 0;
+    table->status_flags = 0;
+    table->status_generation = 0;
+
+    tree_search_reset(ts, BTRFS_QUOTA_TREE_OBJECTID, 0, (__u64)-1,
+                      BTRFS_QGROUP_STATUS_KEY, BTRFS_QGROUP_RELATION_KEY, 0);
+
+    return tree_search_walk(ts, add_item, table);
+}
+
+void qgroup_table_free(struct qgroup_table *table)
+{
+    free(table->entries);
+    free(table->relations);
+    memset(table, 0, sizeof(*table));
+}
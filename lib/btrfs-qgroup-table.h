@@ -0,0 +1,62 @@
+#ifndef BTRFS_QGROUP_TABLE_H
+#define BTRFS_QGROUP_TABLE_H
+
+#include <linux/types.h>
+
+#include "btrfs-tree-search.h"
+
+/*
+ * Snapshot of the quota tree, read with TREE_SEARCH_V2.
+ *
+ * All INFO and LIMIT items live under objectid 0 and come out of the
+ * tree sorted by qgroupid, so the table is a flat array that is built
+ * by appending INFO items and then filling in LIMIT items by binary
+ * search. Relations are stored twice in the tree; only the
+ * (child, parent) copy is kept. One walk of the tree with a large
+ * search buffer loads everything, which is a handful of ioctls even
+ * for tens of thousands of qgroups.
+ */
+
+struct qgroup_entry {
+    __u64 qgroupid;
+    __u64 generation;
+    __u64 rfer;
+    __u64 excl;
+    __u64 limit_flags;
+    __u64 max_rfer;
+    __u64 max_excl;
+    __u32 num_parents;
+    __u32 num_children;
+};
+
+struct qgroup_relation {
+    __u64 child;
+    __u64 parent;
+};
+
+struct qgroup_table {
+    struct qgroup_entry *entries;
+    __u64 count;
+    __u64 alloc;
+    struct qgroup_relation *relations;
+    __u64 num_relations;
+    __u64 rel_alloc;
+    __u64 status_flags;
+    __u64 status_generation;
+};
+
+#define qgroup_level(id) ((id) >> BTRFS_QGROUP_LEVEL_SHIFT)
+#define qgroup_subvid(id) ((id) & ((1ULL << BTRFS_QGROUP_LEVEL_SHIFT) - 1))
+
+/*
+ * (Re)load @table through @ts, which the caller initializes once so the
+ * search buffer is reused across periodic loads. Previous contents are
+ * replaced; the arrays are kept to avoid reallocating.
+ */
+int qgroup_table_load(struct qgroup_table *table, struct tree_search *ts);
+void qgroup_table_free(struct qgroup_table *table);
+
+struct qgroup_entry *qgroup_table_find(const struct qgroup_table *table,
+                                       __u64 qgroupid);
+
+#endif
@@ -0,0 +1,393 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-resolve.h"
+#include "btrfs-subvol-enum.h"
+
+/* The kernel never returns more than this from BTRFS_IOC_INO_PATHS. */
+#define INO_PATHS_SIZE 4096
+
+struct resolve_worker {
+    pthread_t thread;
+    struct resolve_run *run;
+    struct btrfs_data_container *inodes;
+    __u64 size;
+    struct btrfs_data_container *fspath;
+};
+
+struct resolve_run {
+    struct resolver *resolver;
+    const __u64 *logical;
+    __u64 count;
+    __u64 next;
+    int stop;
+    resolve_cb cb;
+    void *data;
+};
+
+static int add_root(struct resolver *resolver, __u64 treeid, const char *path)
+{
+    struct resolve_root *roots;
+
+    roots = realloc(resolver->roots,
+                    (resolver->num_roots + 1) * sizeof(*roots));
+
+    if (roots == NULL) {
+        perror("realloc");
+        return -1;
+    }
+
+    roots[resolver->num_roots].treeid = treeid;
+    roots[resolver->num_roots].path = path;
+    roots[resolver->num_roots].fd = -1;
+    resolver->roots = roots;
+    resolver->num_roots++;
+
+    return 0;
+}
+
+static int collect_root(const struct subvol_entry *entry, void *data)
+{
+    return add_root(data, entry->treeid, entry->path);
+}
+
+static int compare_root(const void *a, const void *b)
+{
+    const struct resolve_root *x = a;
+    const struct resolve_root *y = b;
+
+    return x->treeid < y->treeid ? -1 : x->treeid > y->treeid;
+}
+
+int resolver_init(struct resolver *resolver, int fd, __u64 flags)
+{
+    struct btrfs_ioctl_get_subvol_info_args info = {0};
+
+    memset(resolver, 0, sizeof(*resolver));
+    resolver->fd = fd;
+    resolver->flags = flags;
+
+    if (path_cache_init(&resolver->cache, 1024) < 0)
+        return -1;
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        perror("ioctl BTRFS_IOC_GET_SUBVOL_INFO");
+        resolver_destroy(resolver);
+        return -1;
+    }
+
+    if (add_root(resolver, info.treeid, "") < 0 ||
+        subvol_enum(fd, &resolver->cache, collect_root, resolver, NULL) < 0) {
+        resolver_destroy(resolver);
+        return -1;
+    }
+
+    /* Only count the lookups made while resolving files. */
+    resolver->cache.hits = 0;
+    resolver->cache.misses = 0;
+
+    /* Sorted once here, searched lock-free by the workers. */
+    qsort(resolver->roots, resolver->num_roots, sizeof(*resolver->roots),
+          compare_root);
+
+    return 0;
+}
+
+void resolver_destroy(struct resolver *resolver)
+{
+    int i;
+
+    for (i = 0; i < resolver->num_roots; i++) {
+        if (resolver->roots[i].fd >= 0 &&
+            resolver->roots[i].fd != resolver->fd)
+            close(resolver->roots[i].fd);
+    }
+
+    free(resolver->roots);
+    path_cache_destroy(&resolver->cache);
+    resolver->roots = NULL;
+    resolver->num_roots = 0;
+}
+
+/*
+ * BTRFS_IOC_INO_PATHS resolves inodes of the subvolume its fd belongs
+ * to, so every root needs an fd of its own. They are opened on first
+ * use; a racing thread that loses the exchange closes its copy.
+ */
+static int root_fd(struct resolver *resolver, __u64 treeid,
+                   const char **path)
+{
+    struct resolve_root *root = NULL;
+    int lo = 0;
+    int hi = resolver->num_roots;
+    int expected = -1;
+    int fd;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (treeid < resolver->roots[mid].treeid) {
+            hi = mid;
+        }
+        else if (treeid > resolver->roots[mid].treeid) {
+            lo = mid + 1;
+        }
+        else {
+            root = &resolver->roots[mid];
+            break;
+        }
+    }
+
+    if (root == NULL)
+        return -1;
+
+    *path = root->path;
+    fd = __atomic_load_n(&root->fd, __ATOMIC_ACQUIRE);
+
+    if (fd >= 0)
+        return fd;
+
+    if (root->path[0] == '\0')
+        fd = resolver->fd;
+    else
+        fd = openat(resolver->fd, root->path,
+                    O_RDONLY|O_NONBLOCK|O_CLOEXEC|O_DIRECTORY);
+
+    if (fd < 0) {
+        perror("openat");
+        return -1;
+    }
+
+    if (!__atomic_compare_exchange_n(&root->fd, &expected, fd, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        if (fd != resolver->fd)
+            close(fd);
+
+        fd = expected;
+    }
+
+    return fd;
+}
+
+static const char *inode_path(struct resolve_worker *worker, __u64 root,
+                              __u64 inode)
+{
+    struct resolver *resolver = worker->run->resolver;
+    struct btrfs_ioctl_ino_path_args args = {0};
+    char path[BENCH_PATH_MAX];
+    const char *root_path;
+    const char *name;
+    int len;
+    int fd;
+
+    name = path_cache_lookup(&resolver->cache, root, inode);
+
+    if (name != NULL)
+        return name;
+
+    fd = root_fd(resolver, root, &root_path);
+
+    if (fd < 0)
+        return NULL;
+
+    args.inum = inode;
+    args.size = INO_PATHS_SIZE;
+    args.fspath = (__u64)(unsigned long)worker->fspath;
+
+    __atomic_fetch_add(&resolver->stats.ino_paths_calls, 1, __ATOMIC_RELAXED);
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_INO_PATHS, &args) < 0) {
+        perror("ioctl BTRFS_IOC_INO_PATHS");
+        return NULL;
+    }
+
+    if (worker->fspath->elem_cnt == 0)
+        return NULL;
+
+    /* Hard links give several names, the first one is reported. */
+    name = (const char *)worker->fspath->val + worker->fspath->val[0];
+    len = snprintf(path, sizeof(path), "%s%s%s", root_path,
+                   root_path[0] ? "/" : "", name);
+
+    if (len < 0 || len >= (int)sizeof(path))
+        return NULL;
+
+    return path_cache_insert(&resolver->cache, root, inode, path);
+}
+
+static int grow_container(struct resolve_worker *worker, __u64 size)
+{
+    struct btrfs_data_container *inodes;
+
+    if (size > RESOLVE_CONTAINER_MAX)
+        size = RESOLVE_CONTAINER_MAX;
+
+    inodes = realloc(worker->inodes, size);
+
+    if (inodes == NULL) {
+        perror("realloc");
+        return -1;
+    }
+
+    worker->inodes = inodes;
+    worker->size = size;
+
+    return 0;
+}
+
+static int resolve_one(struct resolve_worker *worker, __u64 logical)
+{
+    struct resolve_run *run = worker->run;
+    struct resolver *resolver = run->resolver;
+    struct resolve_stats *stats = &resolver->stats;
+    struct btrfs_ioctl_logical_ino_args args;
+    __u32 i;
+
+    for (;;) {
+        memset(&args, 0, sizeof(args));
+        args.logical = logical;
+        args.size = worker->size;
+        args.flags = resolver->flags;
+        args.inodes = (__u64)(unsigned long)worker->inodes;
+
+        __atomic_fetch_add(&stats->logical_calls, 1, __ATOMIC_RELAXED);
+
+        if (BENCH_IOCTL(resolver->fd, BTRFS_IOC_LOGICAL_INO_V2, &args) < 0) {
+            if (errno == ENOENT) {
+                __atomic_fetch_add(&stats->not_found, 1, __ATOMIC_RELAXED);
+                return 0;
+            }
+
+            perror("ioctl BTRFS_IOC_LOGICAL_INO_V2");
+            __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+
+        /*
+         * bytes_missing says exactly how much more room the full
+         * result needs, so a single retry is enough below the cap.
+         */
+        if (worker->inodes->bytes_missing == 0 ||
+            worker->size == RESOLVE_CONTAINER_MAX)
+            break;
+
+        if (grow_container(worker, worker->size +
+                           worker->inodes->bytes_missing) < 0)
+            return -1;
+
+        __atomic_fetch_add(&stats->container_grows, 1, __ATOMIC_RELAXED);
+    }
+
+    if (worker->inodes->elem_missed > 0)
+        __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i + 2 < worker->inodes->elem_cnt; i += 3) {
+        struct resolve_ref ref;
+
+        ref.logical = logical;
+        ref.inode = worker->inodes->val[i];
+        ref.offset = worker->inodes->val[i + 1];
+        ref.root = worker->inodes->val[i + 2];
+        ref.path = inode_path(worker, ref.root, ref.inode);
+
+        __atomic_fetch_add(&stats->refs, 1, __ATOMIC_RELAXED);
+
+        if (ref.path == NULL)
+            __atomic_fetch_add(&stats->unresolved, 1, __ATOMIC_RELAXED);
+
+        if (run->cb != NULL && run->cb(&ref, run->data) != 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static void *resolve_thread(void *data)
+{
+    struct resolve_worker *worker = data;
+    struct resolve_run *run = worker->run;
+
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+        __u64 i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+
+        if (i >= run->count)
+            break;
+
+        __atomic_fetch_add(&run->resolver->stats.addresses, 1,
+                           __ATOMIC_RELAXED);
+
+        if (resolve_one(worker, run->logical[i]) != 0)
+            __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+int resolver_run(struct resolver *resolver, const __u64 *logical,
+                 __u64 count, int threads, resolve_cb cb, void *data)
+{
+    struct resolve_run run = {0};
+    struct resolve_worker *workers;
+    int started = 0;
+    int ret = 0;
+    int i;
+
+    run.resolver = resolver;
+    run.logical = logical;
+    run.count = count;
+    run.cb = cb;
+    run.data = data;
+
+    workers = calloc(threads, sizeof(*workers));
+
+    if (workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (i = 0; i < threads; i++) {
+        workers[i].run = &run;
+        workers[i].fspath = malloc(INO_PATHS_SIZE);
+
+        if (workers[i].fspath == NULL ||
+            grow_container(&workers[i], RESOLVE_CONTAINER_MIN) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (pthread_create(&workers[i].thread, NULL, resolve_thread,
+                           &workers[i]) != 0) {
+            perror("pthread_create");
+            ret = -1;
+            break;
+        }
+
+        started++;
+    }
+
+    if (ret < 0)
+        __atomic_store_n(&run.stop, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < threads; i++) {
+        if (i < started)
+            pthread_join(workers[i].thread, NULL);
+
+        if (workers[i].size > resolver->stats.max_container)
+            resolver->stats.max_container = workers[i].size;
+
+        free(workers[i].inodes);
+        free(workers[i].fspath);
+    }
+
+    free(workers);
+
+    return ret;
+}
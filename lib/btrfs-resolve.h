@@ -0,0 +1,94 @@
+#ifndef BTRFS_RESOLVE_H
+#define BTRFS_RESOLVE_H
+
+#include <pthread.h>
+#include <linux/types.h>
+
+#include "btrfs-path-cache.h"
+
+/*
+ * Batch logical address -> file path resolver.
+ *
+ * Every address is looked up with BTRFS_IOC_LOGICAL_INO_V2 into a
+ * per-thread btrfs_data_container that starts at 64 KiB and grows
+ * towards the kernel's 16 MiB limit whenever the kernel reports
+ * bytes_missing, so heavily shared extents cost one retry instead of
+ * truncated results. Every (root, inode) pair found is turned into a
+ * path with BTRFS_IOC_INO_PATHS on an fd inside the owning subvolume.
+ *
+ * The paths are kept in a (root, inode) path cache shared by all worker
+ * threads and protected by its lock. resolver_init() seeds it with the
+ * subvolume paths; file paths are added as they are resolved, so only
+ * the first reference to a (root, inode) pair costs an INO_PATHS call.
+ * Pairs repeat when a file spans several extents, when one inode
+ * references an extent more than once (FICLONE'd ranges within a file,
+ * all returned under IGNORE_OFFSET) and when many bad sectors fall in
+ * one file. Reflinks and snapshots are distinct pairs and always miss.
+ * The cache's hits and misses count file path lookups only.
+ *
+ * With BTRFS_LOGICAL_INO_ARGS_IGNORE_OFFSET in @flags the addresses
+ * must be extent starts and every reference to the extent is returned;
+ * without it any address inside an extent works, but only references
+ * covering that block are returned.
+ */
+
+#define RESOLVE_CONTAINER_MIN (64 * 1024)
+#define RESOLVE_CONTAINER_MAX (16 * 1024 * 1024)
+
+struct resolve_ref {
+    __u64 logical;
+    __u64 root;
+    __u64 inode;
+    __u64 offset;
+    /*
+     * NULL if the subvolume isn't reachable from the resolver's fd.
+     * Valid until resolver_destroy().
+     */
+    const char *path;
+};
+
+/*
+ * Called from the worker threads, possibly concurrently. Return
+ * non-zero to stop the run.
+ */
+typedef int (*resolve_cb)(const struct resolve_ref *ref, void *data);
+
+struct resolve_stats {
+    __u64 addresses;
+    __u64 refs;
+    __u64 logical_calls;
+    __u64 container_grows;
+    __u64 max_container;
+    __u64 ino_paths_calls;
+    __u64 not_found;
+    __u64 unresolved;
+    __u64 errors;
+};
+
+struct resolve_root {
+    __u64 treeid;
+    const char *path;
+    int fd;
+};
+
+struct resolver {
+    int fd;
+    __u64 flags;
+    struct path_cache cache;
+    struct resolve_root *roots;
+    int num_roots;
+    struct resolve_stats stats;
+};
+
+/*
+ * Enumerate the subvolumes below @fd so that references from any of
+ * them can be turned into paths relative to @fd.
+ */
+int resolver_init(struct resolver *resolver, int fd, __u64 flags);
+void resolver_destroy(struct resolver *resolver);
+
+/* Resolve @count addresses on @threads threads. */
+int resolver_run(struct resolver *resolver, const __u64 *logical,
+                 __u64 count, int threads, resolve_cb cb, void *data);
+
+#endif
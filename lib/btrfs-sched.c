@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-sched.h"
+
+#define SCHED_DEQUE_MIN 64
+
+static int deque_push(struct sched_deque *deque, sched_fn fn, void *arg)
+{
+    unsigned int tail;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->size) {
+        unsigned int size = deque->size ? deque->size * 2 : SCHED_DEQUE_MIN;
+        struct sched_task *tasks = malloc(size * sizeof(*tasks));
+        unsigned int i;
+
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            perror("malloc");
+            return -1;
+        }
+
+        for (i = 0; i < deque->count; i++)
+            tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->size = size;
+    }
+
+    tail = (deque->head + deque->count) % deque->size;
+    deque->tasks[tail].fn = fn;
+    deque->tasks[tail].arg = arg;
+    deque->count++;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return 0;
+}
+
+/* The owner takes the newest task, thieves the oldest. */
+static int deque_take(struct sched_deque *deque, int steal,
+                      struct sched_task *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count > 0) {
+        if (steal) {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) % deque->size;
+        }
+        else {
+            *task = deque->tasks[(deque->head + deque->count - 1) %
+                                 deque->size];
+        }
+
+        deque->count--;
+        found = 1;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+static int find_task(struct sched_worker *worker, struct sched_task *task)
+{
+    struct sched_pool *pool = worker->pool;
+    int start;
+    int i;
+
+    if (deque_take(&worker->deque, 0, task))
+        return 1;
+
+    /* Start at a random victim so thieves do not all pile on worker 0. */
+    start = rand_r(&worker->seed) % pool->num_workers;
+
+    for (i = 0; i < pool->num_workers; i++) {
+        struct sched_worker *victim =
+            &pool->workers[(start + i) % pool->num_workers];
+
+        if (victim != worker && deque_take(&victim->deque, 1, task)) {
+            worker->stolen++;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void *worker_thread(void *data)
+{
+    struct sched_worker *worker = data;
+    struct sched_pool *pool = worker->pool;
+    struct sched_task task;
+
+    for (;;) {
+        if (!find_task(worker, &task)) {
+            pthread_mutex_lock(&pool->lock);
+
+            /* Submitters bump queued under the lock, so no lost wakeup. */
+            while (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) == 0 &&
+                   !pool->stop)
+                pthread_cond_wait(&pool->work, &pool->lock);
+
+            if (pool->stop) {
+                pthread_mutex_unlock(&pool->lock);
+                break;
+            }
+
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_RELAXED);
+
+        task.fn(worker, task.arg);
+        worker->executed++;
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle);
+
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+int sched_pool_start(struct sched_pool *pool, int threads)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    pool->workers = calloc(threads, sizeof(*pool->workers));
+
+    if (pool->workers == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    pool->num_workers = threads;
+
+    for (i = 0; i < threads; i++) {
+        struct sched_worker *worker = &pool->workers[i];
+
+        worker->pool = pool;
+        worker->id = i;
+        worker->seed = (unsigned int)bench_now_ns() ^ (i * 2654435761U);
+        pthread_mutex_init(&worker->deque.lock, NULL);
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_thread,
+                           &pool->workers[i]) != 0) {
+            perror("pthread_create");
+            pool->num_workers = i;
+            sched_pool_stop(pool);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int sched_submit(struct sched_pool *pool, struct sched_worker *worker,
+                 sched_fn fn, void *arg)
+{
+    struct sched_deque *deque;
+
+    if (worker == NULL) {
+        unsigned int i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+
+        worker = &pool->workers[i % pool->num_workers];
+    }
+
+    deque = &worker->deque;
+
+    /*
+     * Count it first so sched_pool_wait() can't see a false idle pool,
+     * and so a worker that takes the task as soon as it is pushed never
+     * drives queued below zero.
+     */
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    __atomic_fetch_add(&pool->queued, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+
+    if (deque_push(deque, fn, arg) < 0) {
+        pthread_mutex_lock(&pool->lock);
+        __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_RELAXED);
+
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle);
+
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void sched_pool_wait(struct sched_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void sched_pool_stop(struct sched_pool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->num_workers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+
+    for (i = 0; i < pool->num_workers; i++) {
+        free(pool->workers[i].deque.tasks);
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+    }
+
+    free(pool->workers);
+    pool->workers = NULL;
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->idle);
+    pthread_mutex_destroy(&pool->lock);
+}
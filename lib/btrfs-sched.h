@@ -0,0 +1,73 @@
+#ifndef BTRFS_SCHED_H
+#define BTRFS_SCHED_H
+
+#include <pthread.h>
+#include <linux/types.h>
+
+/*
+ * Work-stealing thread pool for mixing long and short control-path
+ * operations.
+ *
+ * Every worker owns a deque. Tasks submitted from a worker go to the
+ * tail of its own deque and are popped LIFO; a worker with an empty
+ * deque steals the oldest task from the head of another one. A worker
+ * blocked in a long ioctl (scrub, rescan, commit) therefore does not
+ * hold back the tasks queued behind it. The deques are small
+ * mutex-protected rings; contention on them is negligible next to the
+ * ioctls the tasks run.
+ */
+
+struct sched_worker;
+
+typedef void (*sched_fn)(struct sched_worker *worker, void *arg);
+
+struct sched_task {
+    sched_fn fn;
+    void *arg;
+};
+
+struct sched_deque {
+    pthread_mutex_t lock;
+    struct sched_task *tasks;
+    unsigned int head;
+    unsigned int count;
+    unsigned int size;
+};
+
+struct sched_worker {
+    pthread_t thread;
+    struct sched_pool *pool;
+    int id;
+    unsigned int seed;
+    struct sched_deque deque;
+    __u64 executed;
+    __u64 stolen;
+};
+
+struct sched_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    struct sched_worker *workers;
+    int num_workers;
+    unsigned int next;
+    __u64 queued;
+    __u64 pending;
+    int stop;
+};
+
+int sched_pool_start(struct sched_pool *pool, int threads);
+/* Wait until no task is queued or running. */
+void sched_pool_wait(struct sched_pool *pool);
+/* Join the workers; queued tasks that never ran are dropped. */
+void sched_pool_stop(struct sched_pool *pool);
+
+/*
+ * Queue a task. From inside a task pass the running @worker so the
+ * task lands on its own deque; from outside pass NULL and the tasks
+ * are spread round-robin.
+ */
+int sched_submit(struct sched_pool *pool, struct sched_worker *worker,
+                 sched_fn fn, void *arg);
+
+#endif
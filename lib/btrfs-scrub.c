@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <linux/ioprio.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-scrub.h"
+
+static void *scrub_thread(void *data)
+{
+    struct scrub_dev *dev = data;
+
+    if (dev->ioprio != 0 &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, dev->ioprio) < 0)
+        perror("ioprio_set");
+
+    dev->start_ns = bench_now_ns();
+
+    if (BENCH_IOCTL(dev->volume_fd, BTRFS_IOC_SCRUB, &dev->args) < 0) {
+        dev->error = errno;
+
+        if (errno != ECANCELED) {
+            fprintf(stderr, "devid %llu: ", dev->args.devid);
+            perror("ioctl BTRFS_IOC_SCRUB");
+        }
+    }
+
+    dev->end_ns = bench_now_ns();
+    __atomic_store_n(&dev->done, 1, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+int scrub_job_start(struct scrub_job *job, int volume_fd, __u64 flags,
+                    int ioprio)
+{
+    struct btrfs_ioctl_dev_info_args *dev_info;
+    int i;
+
+    memset(job, 0, sizeof(*job));
+    job->volume_fd = volume_fd;
+    job->num_devs = bench_list_devices(volume_fd, &dev_info);
+
+    if (job->num_devs <= 0)
+        return -1;
+
+    job->devs = calloc(job->num_devs, sizeof(*job->devs));
+
+    if (job->devs == NULL) {
+        perror("calloc");
+        free(dev_info);
+        return -1;
+    }
+
+    for (i = 0; i < job->num_devs; i++) {
+        struct scrub_dev *dev = &job->devs[i];
+
+        dev->volume_fd = volume_fd;
+        dev->ioprio = ioprio;
+        dev->args.devid = dev_info[i].devid;
+        dev->args.start = 0;
+        dev->args.end = (__u64)-1;
+        dev->args.flags = flags;
+        memcpy(dev->path, dev_info[i].path, BTRFS_DEVICE_PATH_NAME_MAX);
+
+        if (pthread_create(&dev->thread, NULL, scrub_thread, dev) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    free(dev_info);
+
+    return 0;
+}
+
+void scrub_job_wait(struct scrub_job *job)
+{
+    int i;
+
+    for (i = 0; i < job->num_devs; i++)
+        pthread_join(job->devs[i].thread, NULL);
+}
+
+void scrub_job_cancel(struct scrub_job *job)
+{
+    if (BENCH_IOCTL(job->volume_fd, BTRFS_IOC_SCRUB_CANCEL, NULL) < 0 &&
+        errno != ENOTCONN)
+        perror("ioctl BTRFS_IOC_SCRUB_CANCEL");
+}
+
+void scrub_job_free(struct scrub_job *job)
+{
+    free(job->devs);
+    job->devs = NULL;
+}
+
+int scrub_job_done(struct scrub_job *job)
+{
+    int i;
+
+    for (i = 0; i < job->num_devs; i++) {
+        if (!__atomic_load_n(&job->devs[i].done, __ATOMIC_ACQUIRE))
+            return 0;
+    }
+
+    return 1;
+}
+
+int scrub_dev_progress(struct scrub_job *job, struct scrub_dev *dev,
+                       struct btrfs_scrub_progress *progress)
+{
+    struct btrfs_ioctl_scrub_args args = {0};
+
+    if (__atomic_load_n(&dev->done, __ATOMIC_ACQUIRE)) {
+        /* The finished scrub left its final counters in dev->args. */
+        *progress = dev->args.progress;
+        return 1;
+    }
+
+    args.devid = dev->args.devid;
+
+    if (BENCH_IOCTL(job->volume_fd, BTRFS_IOC_SCRUB_PROGRESS, &args) < 0) {
+        if (errno != ENOTCONN)
+            perror("ioctl BTRFS_IOC_SCRUB_PROGRESS");
+
+        return -1;
+    }
+
+    *progress = args.progress;
+
+    return 0;
+}
+
+/* Accepts idle, be[:level] and rt[:level]. */
+int scrub_parse_ioprio(const char *arg)
+{
+    int level = 4;
+    const char *colon = strchr(arg, ':');
+
+    if (colon != NULL)
+        level = atoi(colon + 1);
+
+    if (strncmp(arg, "idle", 4) == 0)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+
+    if (strncmp(arg, "be", 2) == 0)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, level);
+
+    if (strncmp(arg, "rt", 2) == 0)
+        return IOPRIO_PRIO_VALUE(IOPRIO_CLASS_RT, level);
+
+    return -1;
+}
+
+/* 8-4-4-4-12 uuid layout as used by /sys/fs/btrfs. */
+static int sysfs_fsid(int volume_fd, char *fsid)
+{
+    struct btrfs_ioctl_fs_info_args fs_info = {0};
+    int i, n = 0;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+        perror("ioctl BTRFS_IOC_FS_INFO");
+        return -1;
+    }
+
+    for (i = 0; i < BTRFS_FSID_SIZE; i++) {
+        n += sprintf(fsid + n, "%02x", fs_info.fsid[i]);
+
+        if (i == 3 || i == 5 || i == 7 || i == 9)
+            fsid[n++] = '-';
+    }
+
+    fsid[n] = '\0';
+
+    return 0;
+}
+
+static int speed_limit_io(const char *fsid, __u64 devid, __u64 *value,
+                          int write_value)
+{
+    char path[BENCH_PATH_MAX];
+    char buf[32];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path),
+             "/sys/fs/btrfs/%s/devinfo/%llu/scrub_speed_max", fsid, devid);
+    fd = open(path, (write_value ? O_WRONLY : O_RDONLY)|O_CLOEXEC);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    if (write_value) {
+        snprintf(buf, sizeof(buf), "%llu\n", *value);
+        len = write(fd, buf, strlen(buf));
+    }
+    else {
+        len = read(fd, buf, sizeof(buf) - 1);
+
+        if (len >= 0) {
+            buf[len] = '\0';
+            *value = strtoull(buf, NULL, 10);
+        }
+    }
+
+    if (len < 0)
+        perror(path);
+
+    close(fd);
+
+    return len < 0 ? -1 : 0;
+}
+
+int scrub_set_speed_limit(int volume_fd, __u64 bytes_per_sec)
+{
+    struct btrfs_ioctl_dev_info_args *dev_info;
+    char fsid[BTRFS_FSID_SIZE * 2 + 5];
+    int num_devs;
+    int i;
+
+    if (sysfs_fsid(volume_fd, fsid) < 0)
+        return -1;
+
+    num_devs = bench_list_devices(volume_fd, &dev_info);
+
+    if (num_devs <= 0)
+        return -1;
+
+    for (i = 0; i < num_devs; i++) {
+        if (speed_limit_io(fsid, dev_info[i].devid, &bytes_per_sec, 1) < 0) {
+            free(dev_info);
+            return -1;
+        }
+    }
+
+    free(dev_info);
+
+    return 0;
+}
+
+int scrub_save_speed_limits(int volume_fd, struct scrub_speed_limits *saved)
+{
+    struct btrfs_ioctl_dev_info_args *dev_info;
+    char fsid[BTRFS_FSID_SIZE * 2 + 5];
+    int i;
+
+    memset(saved, 0, sizeof(*saved));
+
+    if (sysfs_fsid(volume_fd, fsid) < 0)
+        return -1;
+
+    saved->num_devs = bench_list_devices(volume_fd, &dev_info);
+
+    if (saved->num_devs <= 0)
+        return -1;
+
+    saved->devids = calloc(saved->num_devs, sizeof(__u64));
+    saved->limits = calloc(saved->num_devs, sizeof(__u64));
+
+    if (saved->devids == NULL || saved->limits == NULL) {
+        perror("calloc");
+        free(dev_info);
+        scrub_free_speed_limits(saved);
+        return -1;
+    }
+
+    for (i = 0; i < saved->num_devs; i++) {
+        saved->devids[i] = dev_info[i].devid;
+
+        if (speed_limit_io(fsid, saved->devids[i], &saved->limits[i],
+                           0) < 0) {
+            free(dev_info);
+            scrub_free_speed_limits(saved);
+            return -1;
+        }
+    }
+
+    free(dev_info);
+
+    return 0;
+}
+
+/* Every device is tried even if an earlier one failed. */
+int scrub_restore_speed_limits(int volume_fd,
+                               const struct scrub_speed_limits *saved)
+{
+    char fsid[BTRFS_FSID_SIZE * 2 + 5];
+    int ret = 0;
+    int i;
+
+    if (saved->num_devs == 0)
+        return 0;
+
+    if (sysfs_fsid(volume_fd, fsid) < 0)
+        return -1;
+
+    for (i = 0; i < saved->num_devs; i++) {
+        if (speed_limit_io(fsid, saved->devids[i], &saved->limits[i],
+                           1) < 0)
+            ret = -1;
+    }
+
+    return ret;
+}
+
+void scrub_free_speed_limits(struct scrub_speed_limits *saved)
+{
+    free(saved->devids);
+    free(saved->limits);
+    saved->devids = NULL;
+    saved->limits = NULL;
+    saved->num_devs = 0;
+}
@@ -0,0 +1,77 @@
+#ifndef BTRFS_SCRUB_H
+#define BTRFS_SCRUB_H
+
+#include <pthread.h>
+#include <linux/types.h>
+#include <linux/btrfs.h>
+
+/*
+ * Whole-filesystem scrub: one blocking BTRFS_IOC_SCRUB thread per
+ * device. Each thread optionally lowers its own I/O priority first,
+ * which the block layer applies to the scrub reads it submits.
+ */
+
+struct scrub_dev {
+    pthread_t thread;
+    int volume_fd;
+    int ioprio;
+    struct btrfs_ioctl_scrub_args args;
+    int done;
+    int error;
+    __u64 start_ns;
+    __u64 end_ns;
+    __u64 last_bytes;
+    char path[BTRFS_DEVICE_PATH_NAME_MAX + 1];
+};
+
+struct scrub_job {
+    int volume_fd;
+    int num_devs;
+    struct scrub_dev *devs;
+};
+
+/* @ioprio is an IOPRIO_PRIO_VALUE(), or 0 to inherit the caller's. */
+int scrub_job_start(struct scrub_job *job, int volume_fd, __u64 flags,
+                    int ioprio);
+void scrub_job_wait(struct scrub_job *job);
+void scrub_job_cancel(struct scrub_job *job);
+void scrub_job_free(struct scrub_job *job);
+int scrub_job_done(struct scrub_job *job);
+
+/*
+ * Current counters of @dev: polled with BTRFS_IOC_SCRUB_PROGRESS while
+ * running, the final ones once the scrub returned. Returns 1 when the
+ * device is finished, 0 while running and -1 when nothing is known.
+ */
+int scrub_dev_progress(struct scrub_job *job, struct scrub_dev *dev,
+                       struct btrfs_scrub_progress *progress);
+
+int scrub_parse_ioprio(const char *arg);
+
+/* Write scrub_speed_max in sysfs for every device; 0 removes the limit. */
+int scrub_set_speed_limit(int volume_fd, __u64 bytes_per_sec);
+
+/* The per-device limits in place before a program changed them. */
+struct scrub_speed_limits {
+    int num_devs;
+    __u64 *devids;
+    __u64 *limits;
+};
+
+int scrub_save_speed_limits(int volume_fd, struct scrub_speed_limits *saved);
+int scrub_restore_speed_limits(int volume_fd,
+                               const struct scrub_speed_limits *saved);
+void scrub_free_speed_limits(struct scrub_speed_limits *saved);
+
+static inline __u64 scrub_progress_bytes(const struct btrfs_scrub_progress *p)
+{
+    return p->data_bytes_scrubbed + p->tree_bytes_scrubbed;
+}
+
+static inline __u64 scrub_progress_errors(const struct btrfs_scrub_progress *p)
+{
+    return p->read_errors + p->csum_errors + p->verify_errors +
+           p->super_errors + p->uncorrectable_errors;
+}
+
+#endif
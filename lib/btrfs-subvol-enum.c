@@ -0,0 +1,263 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-subvol-enum.h"
+
+struct subvol_child {
+    __u64 treeid;
+    __u64 dirid;
+};
+
+/* A subvolume that was found but not visited yet. */
+struct enum_pending {
+    __u64 treeid;
+    __u64 parent;
+    __u64 dirid;
+    const char *path;
+};
+
+struct enum_ctx {
+    int fd;
+    struct path_cache *cache;
+    subvol_enum_cb cb;
+    void *data;
+    struct subvol_enum_stats *stats;
+    struct enum_pending *stack;
+    int depth;
+    int alloc;
+    char path[BENCH_PATH_MAX];
+};
+
+/*
+ * Collect all children of the subvolume @fd belongs to. The ioctl fails
+ * with EOVERFLOW when more than BTRFS_MAX_ROOTREF_BUFFER_NUM refs are
+ * left, in which case the batch is still valid and we continue after
+ * the last returned treeid.
+ */
+static int read_children(int fd, struct subvol_child **children, int *count,
+                         struct subvol_enum_stats *stats)
+{
+    struct btrfs_ioctl_get_subvol_rootref_args rootref_args;
+    struct subvol_child *list = NULL;
+    int alloc = 0;
+    int n = 0;
+    __u64 min_treeid = BTRFS_FIRST_FREE_OBJECTID;
+
+    for (;;) {
+        int ret;
+        int i;
+
+        memset(&rootref_args, 0, sizeof(rootref_args));
+        rootref_args.min_treeid = min_treeid;
+
+        ret = BENCH_IOCTL(fd, BTRFS_IOC_GET_SUBVOL_ROOTREF, &rootref_args);
+        stats->rootref_calls++;
+
+        if (ret < 0 && errno != EOVERFLOW) {
+            perror("ioctl BTRFS_IOC_GET_SUBVOL_ROOTREF");
+            free(list);
+            return -1;
+        }
+
+        if (n + rootref_args.num_items > alloc) {
+            alloc = (n + rootref_args.num_items) * 2;
+            list = realloc(list, alloc * sizeof(*list));
+
+            if (list == NULL) {
+                perror("realloc");
+                return -1;
+            }
+        }
+
+        for (i = 0; i < rootref_args.num_items; i++) {
+            list[n].treeid = rootref_args.rootref[i].treeid;
+            list[n].dirid = rootref_args.rootref[i].dirid;
+            n++;
+        }
+
+        if (ret == 0 || rootref_args.num_items == 0)
+            break;
+
+        min_treeid =
+            rootref_args.rootref[rootref_args.num_items - 1].treeid + 1;
+    }
+
+    *children = list;
+    *count = n;
+
+    return 0;
+}
+
+static int push(struct enum_ctx *ctx, const struct enum_pending *pending)
+{
+    if (ctx->depth == ctx->alloc) {
+        int alloc = ctx->alloc ? ctx->alloc * 2 : 64;
+        struct enum_pending *stack;
+
+        stack = realloc(ctx->stack, alloc * sizeof(*stack));
+
+        if (stack == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        ctx->stack = stack;
+        ctx->alloc = alloc;
+    }
+
+    ctx->stack[ctx->depth++] = *pending;
+
+    return 0;
+}
+
+/*
+ * Resolve the children of @parent, which is open as @fd, and push them
+ * in reverse so they are popped, and reported, in ROOTREF order.
+ */
+static int expand(struct enum_ctx *ctx, int fd,
+                  const struct enum_pending *parent)
+{
+    struct subvol_child *children = NULL;
+    struct btrfs_ioctl_ino_lookup_user_args lookup;
+    int count = 0;
+    int i;
+
+    if (read_children(fd, &children, &count, ctx->stats) < 0)
+        return -1;
+
+    for (i = count - 1; i >= 0; i--) {
+        struct enum_pending child;
+        int len;
+
+        memset(&lookup, 0, sizeof(lookup));
+        lookup.dirid = children[i].dirid;
+        lookup.treeid = children[i].treeid;
+
+        if (BENCH_IOCTL(fd, BTRFS_IOC_INO_LOOKUP_USER, &lookup) < 0) {
+            perror("ioctl BTRFS_IOC_INO_LOOKUP_USER");
+            free(children);
+            return -1;
+        }
+
+        ctx->stats->lookup_calls++;
+
+        /* lookup.path is relative to the parent and ends in '/' if set. */
+        len = snprintf(ctx->path, sizeof(ctx->path), "%s%s%s%s",
+                       parent->path, parent->path[0] ? "/" : "",
+                       lookup.path, lookup.name);
+
+        if (len < 0 || len >= (int)sizeof(ctx->path)) {
+            fprintf(stderr, "subvolume %llu: path too long\n",
+                    children[i].treeid);
+            free(children);
+            return -1;
+        }
+
+        child.treeid = children[i].treeid;
+        child.parent = parent->treeid;
+        child.dirid = children[i].dirid;
+        child.path = path_cache_insert(ctx->cache, child.treeid,
+                                       BTRFS_FIRST_FREE_OBJECTID, ctx->path);
+
+        if (child.path == NULL || push(ctx, &child) < 0) {
+            free(children);
+            return -1;
+        }
+    }
+
+    free(children);
+
+    return 0;
+}
+
+/*
+ * Depth first with an explicit stack, so neither the nesting depth nor
+ * the path length is bounded by the C stack. Every subvolume is opened
+ * by its full path relative to the starting fd when it is visited, so
+ * at most one extra fd is open at a time.
+ */
+static int walk(struct enum_ctx *ctx, __u64 treeid, const char *root_path)
+{
+    struct enum_pending root = {0};
+    int ret;
+
+    root.treeid = treeid;
+    root.path = root_path;
+
+    if (expand(ctx, ctx->fd, &root) < 0)
+        return -1;
+
+    while (ctx->depth > 0) {
+        struct enum_pending pending = ctx->stack[--ctx->depth];
+        struct subvol_entry entry;
+        int fd;
+
+        entry.treeid = pending.treeid;
+        entry.parent = pending.parent;
+        entry.dirid = pending.dirid;
+        entry.path = pending.path;
+        ctx->stats->subvols++;
+
+        if (ctx->cb != NULL && (ret = ctx->cb(&entry, ctx->data)) != 0)
+            return ret;
+
+        fd = openat(ctx->fd, pending.path, O_RDONLY|O_NONBLOCK
+                    |O_CLOEXEC|O_DIRECTORY);
+
+        if (fd < 0) {
+            perror("openat");
+            return -1;
+        }
+
+        ret = expand(ctx, fd, &pending);
+        close(fd);
+
+        if (ret < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int subvol_enum(int fd, struct path_cache *cache, subvol_enum_cb cb,
+                void *data, struct subvol_enum_stats *stats)
+{
+    struct btrfs_ioctl_get_subvol_info_args info = {0};
+    struct subvol_enum_stats local = {0};
+    struct enum_ctx ctx;
+    const char *root_path;
+    int ret;
+
+    if (stats == NULL)
+        stats = &local;
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        perror("ioctl BTRFS_IOC_GET_SUBVOL_INFO");
+        return -1;
+    }
+
+    root_path = path_cache_insert(cache, info.treeid,
+                                  BTRFS_FIRST_FREE_OBJECTID, "");
+
+    if (root_path == NULL)
+        return -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.fd = fd;
+    ctx.cache = cache;
+    ctx.cb = cb;
+    ctx.data = data;
+    ctx.stats = stats;
+
+    ret = walk(&ctx, info.treeid, root_path);
+    free(ctx.stack);
+
+    return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef BTRFS_SUBVOL_ENUM_H
+#define BTRFS_SUBVOL_ENUM_H
+
+#include <linux/types.h>
+
+#include "btrfs-path-cache.h"
+
+/*
+ * Unprivileged subvolume enumeration.
+ *
+ * Starting at the subvolume @fd points into, every nested subvolume is
+ * visited depth first. Children are read with BTRFS_IOC_GET_SUBVOL_ROOTREF,
+ * paging through all batches via min_treeid, and each child's name is
+ * resolved with a single BTRFS_IOC_INO_LOOKUP_USER relative to its
+ * parent. Full paths are built from the memoized parent path, so the
+ * total cost is one lookup and one ROOTREF walk per subvolume.
+ */
+
+struct subvol_entry {
+    __u64 treeid;
+    __u64 parent;
+    __u64 dirid;
+    const char *path;
+};
+
+/* Return non-zero from the callback to stop the walk. */
+typedef int (*subvol_enum_cb)(const struct subvol_entry *entry, void *data);
+
+struct subvol_enum_stats {
+    __u64 subvols;
+    __u64 rootref_calls;
+    __u64 lookup_calls;
+};
+
+int subvol_enum(int fd, struct path_cache *cache, subvol_enum_cb cb,
+                void *data, struct subvol_enum_stats *stats);
+
+#endif
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-telemetry.h"
+
+#define TELEMETRY_SPACE_SLOTS 16
+
+int telemetry_init(struct telemetry *tel, int volume_fd, __u64 capacity)
+{
+    __u64 size = 1;
+
+    memset(tel, 0, sizeof(*tel));
+    tel->volume_fd = volume_fd;
+
+    while (size < capacity)
+        size <<= 1;
+
+    tel->ring.records = calloc(size, sizeof(*tel->ring.records));
+    tel->ring.mask = size - 1;
+    tel->space_slots = TELEMETRY_SPACE_SLOTS;
+    tel->space = calloc(1, sizeof(*tel->space) +
+                        tel->space_slots * sizeof(tel->space->spaces[0]));
+
+    if (tel->ring.records == NULL || tel->space == NULL) {
+        perror("calloc");
+        telemetry_free(tel);
+        return -1;
+    }
+
+    return 0;
+}
+
+void telemetry_free(struct telemetry *tel)
+{
+    free(tel->ring.records);
+    free(tel->space);
+    tel->ring.records = NULL;
+    tel->space = NULL;
+}
+
+/*
+ * Only the producer writes head and only the consumer writes tail, so
+ * a release store of one paired with an acquire load by the other side
+ * is all the synchronisation needed.
+ */
+static int ring_push(struct telemetry_ring *ring,
+                     const struct telemetry_record *record)
+{
+    __u64 head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    __u64 tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > ring->mask) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    ring->records[head & ring->mask] = *record;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+int telemetry_pop(struct telemetry *tel, struct telemetry_record *record)
+{
+    struct telemetry_ring *ring = &tel->ring;
+    __u64 tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    __u64 head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (tail == head)
+        return 0;
+
+    *record = ring->records[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static int sample_devices(struct telemetry *tel, __u64 now)
+{
+    struct btrfs_ioctl_fs_info_args fs_info = {0};
+    struct btrfs_ioctl_dev_info_args dev;
+    struct btrfs_ioctl_get_dev_stats stats;
+    struct telemetry_record record;
+    __u64 found = 0;
+    __u64 devid;
+    int i;
+
+    tel->ioctls++;
+
+    if (BENCH_IOCTL(tel->volume_fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+        perror("ioctl BTRFS_IOC_FS_INFO");
+        return -1;
+    }
+
+    for (devid = 1; devid <= fs_info.max_id && found < fs_info.num_devices;
+         devid++) {
+        memset(&dev, 0, sizeof(dev));
+        dev.devid = devid;
+        tel->ioctls++;
+
+        if (BENCH_IOCTL(tel->volume_fd, BTRFS_IOC_DEV_INFO, &dev) < 0) {
+            if (errno == ENODEV)
+                continue;
+
+            perror("ioctl BTRFS_IOC_DEV_INFO");
+            return -1;
+        }
+
+        found++;
+        memset(&stats, 0, sizeof(stats));
+        stats.devid = devid;
+        stats.nr_items = BTRFS_DEV_STAT_VALUES_MAX;
+        tel->ioctls++;
+
+        if (BENCH_IOCTL(tel->volume_fd, BTRFS_IOC_GET_DEV_STATS,
+                        &stats) < 0) {
+            perror("ioctl BTRFS_IOC_GET_DEV_STATS");
+            return -1;
+        }
+
+        memset(&record, 0, sizeof(record));
+        record.time_ns = now;
+        record.kind = TELEMETRY_DEV;
+        record.id = devid;
+        record.total_bytes = dev.total_bytes;
+        record.used_bytes = dev.bytes_used;
+
+        for (i = 0; i < BTRFS_DEV_STAT_VALUES_MAX && i < (int)stats.nr_items;
+             i++)
+            record.dev_stats[i] = stats.values[i];
+
+        ring_push(&tel->ring, &record);
+    }
+
+    return 0;
+}
+
+/* The slot buffer is kept between samples and only grows. */
+static int sample_space(struct telemetry *tel, __u64 now)
+{
+    struct telemetry_record record;
+    __u64 i;
+
+    tel->space->space_slots = tel->space_slots;
+    tel->ioctls++;
+
+    if (BENCH_IOCTL(tel->volume_fd, BTRFS_IOC_SPACE_INFO, tel->space) < 0) {
+        perror("ioctl BTRFS_IOC_SPACE_INFO");
+        return -1;
+    }
+
+    if (tel->space->total_spaces > tel->space_slots) {
+        __u64 slots = tel->space->total_spaces;
+        struct btrfs_ioctl_space_args *space;
+
+        space = realloc(tel->space, sizeof(*space) +
+                        slots * sizeof(space->spaces[0]));
+
+        if (space == NULL) {
+            perror("realloc");
+            return -1;
+        }
+
+        tel->space = space;
+        tel->space_slots = slots;
+
+        return sample_space(tel, now);
+    }
+
+    for (i = 0; i < tel->space->total_spaces; i++) {
+        memset(&record, 0, sizeof(record));
+        record.time_ns = now;
+        record.kind = TELEMETRY_SPACE;
+        record.id = tel->space->spaces[i].flags;
+        record.total_bytes = tel->space->spaces[i].total_bytes;
+        record.used_bytes = tel->space->spaces[i].used_bytes;
+        ring_push(&tel->ring, &record);
+    }
+
+    return 0;
+}
+
+int telemetry_sample(struct telemetry *tel)
+{
+    __u64 now = bench_now_ns();
+
+    if (sample_devices(tel, now) < 0 || sample_space(tel, now) < 0)
+        return -1;
+
+    tel->samples++;
+
+    return 0;
+}
+
+void telemetry_write_header(FILE *out, int binary)
+{
+    struct telemetry_file_header header;
+
+    if (!binary) {
+        fprintf(out, "time_ns,kind,id,total_bytes,used_bytes,write_errs,"
+                "read_errs,flush_errs,corruption_errs,generation_errs\n");
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TELEMETRY_MAGIC, sizeof(header.magic));
+    header.version = TELEMETRY_VERSION;
+    header.record_size = sizeof(struct telemetry_record);
+    fwrite(&header, sizeof(header), 1, out);
+}
+
+__u64 telemetry_flush(struct telemetry *tel, FILE *out, int binary)
+{
+    struct telemetry_record record;
+    __u64 count = 0;
+
+    while (telemetry_pop(tel, &record)) {
+        count++;
+
+        if (binary) {
+            fwrite(&record, sizeof(record), 1, out);
+            continue;
+        }
+
+        if (record.kind == TELEMETRY_SPACE) {
+            fprintf(out, "%llu,space,0x%llx,%llu,%llu,,,,,\n",
+                    record.time_ns, record.id, record.total_bytes,
+                    record.used_bytes);
+            continue;
+        }
+
+        fprintf(out, "%llu,dev,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                record.time_ns, record.id, record.total_bytes,
+                record.used_bytes,
+                record.dev_stats[BTRFS_DEV_STAT_WRITE_ERRS],
+                record.dev_stats[BTRFS_DEV_STAT_READ_ERRS],
+                record.dev_stats[BTRFS_DEV_STAT_FLUSH_ERRS],
+                record.dev_stats[BTRFS_DEV_STAT_CORRUPTION_ERRS],
+                record.dev_stats[BTRFS_DEV_STAT_GENERATION_ERRS]);
+    }
+
+    fflush(out);
+
+    return count;
+}
@@ -0,0 +1,81 @@
+#ifndef BTRFS_TELEMETRY_H
+#define BTRFS_TELEMETRY_H
+
+#include <stdio.h>
+#include <linux/types.h>
+#include <linux/btrfs.h>
+
+/*
+ * Periodic device error and space telemetry.
+ *
+ * Each telemetry_sample() enumerates the devices with
+ * BTRFS_IOC_FS_INFO and BTRFS_IOC_DEV_INFO, reads all
+ * BTRFS_IOC_GET_DEV_STATS counters and the BTRFS_IOC_SPACE_INFO
+ * totals, and pushes one fixed-size record per device and per space
+ * info into a ring. The ring is single-producer single-consumer and
+ * lock-free: the sampling thread never blocks on the thread that
+ * flushes records to disk, and drops (and counts) records when the
+ * ring is full rather than waiting.
+ *
+ * The binary format is a struct telemetry_file_header followed by raw
+ * records in host byte order.
+ */
+
+#define TELEMETRY_MAGIC "BTRFSTEL"
+#define TELEMETRY_VERSION 1
+
+enum telemetry_kind {
+    TELEMETRY_DEV = 1,
+    TELEMETRY_SPACE = 2,
+};
+
+struct telemetry_record {
+    __u64 time_ns;
+    __u32 kind;
+    __u32 pad;
+    /* devid for TELEMETRY_DEV, block group flags for TELEMETRY_SPACE */
+    __u64 id;
+    __u64 total_bytes;
+    __u64 used_bytes;
+    /* TELEMETRY_DEV only, indexed by enum btrfs_dev_stat_values */
+    __u64 dev_stats[BTRFS_DEV_STAT_VALUES_MAX];
+};
+
+struct telemetry_file_header {
+    char magic[8];
+    __u32 version;
+    __u32 record_size;
+};
+
+struct telemetry_ring {
+    struct telemetry_record *records;
+    __u64 mask;
+    __u64 head;
+    __u64 tail;
+    __u64 dropped;
+};
+
+struct telemetry {
+    int volume_fd;
+    struct telemetry_ring ring;
+    struct btrfs_ioctl_space_args *space;
+    __u64 space_slots;
+    __u64 samples;
+    __u64 ioctls;
+};
+
+/* @capacity is rounded up to a power of two. */
+int telemetry_init(struct telemetry *tel, int volume_fd, __u64 capacity);
+void telemetry_free(struct telemetry *tel);
+
+/* Producer side: take one sample of every device and space info. */
+int telemetry_sample(struct telemetry *tel);
+
+/* Consumer side: pop one record, returns 0 when the ring is empty. */
+int telemetry_pop(struct telemetry *tel, struct telemetry_record *record);
+
+void telemetry_write_header(FILE *out, int binary);
+/* Pop everything queued and write it out; returns the record count. */
+__u64 telemetry_flush(struct telemetry *tel, FILE *out, int binary);
+
+#endif
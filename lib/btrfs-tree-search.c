@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <string.h>
+#include <linux/btrfs.h>
+
+#include "btrfs-bench.h"
+#include "btrfs-tree-search.h"
+
+int tree_search_init(struct tree_search *ts, int fd, __u64 buf_size)
+{
+    memset(ts, 0, sizeof(*ts));
+
+    if (buf_size == 0)
+        buf_size = TREE_SEARCH_DEFAULT_BUF;
+
+    if (buf_size > TREE_SEARCH_MAX_BUF)
+        buf_size = TREE_SEARCH_MAX_BUF;
+
+    ts->args = malloc(sizeof(*ts->args) + buf_size);
+
+    if (ts->args == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    ts->fd = fd;
+    ts->buf_size = buf_size;
+    ts->done = 1;
+
+    return 0;
+}
+
+void tree_search_free(struct tree_search *ts)
+{
+    free(ts->args);
+    ts->args = NULL;
+}
+
+void tree_search_reset(struct tree_search *ts, __u64 tree_id,
+                       __u64 min_objectid, __u64 max_objectid,
+                       __u32 min_type, __u32 max_type, __u64 min_transid)
+{
+    memset(&ts->key, 0, sizeof(ts->key));
+    ts->key.tree_id = tree_id;
+    ts->key.min_objectid = min_objectid;
+    ts->key.max_objectid = max_objectid;
+    ts->key.min_type = min_type;
+    ts->key.max_type = max_type;
+    ts->key.min_offset = 0;
+    ts->key.max_offset = (__u64)-1;
+    ts->key.min_transid = min_transid;
+    ts->key.max_transid = (__u64)-1;
+    ts->nr_left = 0;
+    ts->off = 0;
+    ts->done = 0;
+}
+
+/*
+ * Continue right after the last returned key. The search range is a
+ * compound (objectid, type, offset) key, so carry into the next field
+ * when one wraps.
+ */
+static int advance_key(struct btrfs_ioctl_search_key *key,
+                       const struct btrfs_ioctl_search_header *last)
+{
+    key->min_objectid = ts_hdr_objectid(last);
+    key->min_type = ts_hdr_type(last);
+    key->min_offset = ts_hdr_offset(last);
+
+    if (key->min_offset < (__u64)-1) {
+        key->min_offset++;
+    }
+    else if (key->min_type < 255) {
+        key->min_type++;
+        key->min_offset = 0;
+    }
+    else if (key->min_objectid < (__u64)-1) {
+        key->min_objectid++;
+        key->min_type = 0;
+        key->min_offset = 0;
+    }
+    else {
+        return 1;
+    }
+
+    return key->min_objectid > key->max_objectid;
+}
+
+static int refill(struct tree_search *ts)
+{
+    ts->args->key = ts->key;
+    ts->args->key.nr_items = (__u32)-1;
+    ts->args->buf_size = ts->buf_size;
+
+    if (BENCH_IOCTL(ts->fd, BTRFS_IOC_TREE_SEARCH_V2, ts->args) < 0) {
+        perror("ioctl BTRFS_IOC_TREE_SEARCH_V2");
+        return -1;
+    }
+
+    ts->ioctls++;
+    ts->nr_left = ts->args->key.nr_items;
+    ts->off = 0;
+
+    if (ts->nr_left == 0)
+        ts->done = 1;
+
+    return 0;
+}
+
+int tree_search_next(struct tree_search *ts,
+                     const struct btrfs_ioctl_search_header **hdr,
+                     const void **item)
+{
+    const struct btrfs_ioctl_search_header *sh;
+    const char *buf = (const char *)ts->args->buf;
+
+    while (ts->nr_left == 0) {
+        if (ts->done)
+            return 0;
+
+        if (refill(ts) < 0)
+            return -1;
+    }
+
+    sh = (const struct btrfs_ioctl_search_header *)(buf + ts->off);
+    ts->off += sizeof(*sh) + ts_hdr_len(sh);
+    ts->nr_left--;
+    ts->items++;
+
+    if (ts->nr_left == 0 && advance_key(&ts->key, sh))
+        ts->done = 1;
+
+    *hdr = sh;
+    *item = sh + 1;
+
+    return 1;
+}
+
+int tree_search_walk(struct tree_search *ts, tree_search_cb cb, void *data)
+{
+    const struct btrfs_ioctl_search_header *hdr;
+    const void *item;
+    int ret;
+
+    while ((ret = tree_search_next(ts, &hdr, &item)) > 0) {
+        ret = cb(hdr, item, data);
+
+        if (ret != 0)
+            return ret;
+    }
+
+    return ret;
+}
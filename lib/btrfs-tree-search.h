@@ -0,0 +1,124 @@
+#ifndef BTRFS_TREE_SEARCH_H
+#define BTRFS_TREE_SEARCH_H
+
+#include <stddef.h>
+#include <string.h>
+#include <endian.h>
+#include <linux/types.h>
+#include <linux/btrfs.h>
+
+/*
+ * Bulk metadata scanner on top of BTRFS_IOC_TREE_SEARCH_V2.
+ *
+ * One large result buffer is allocated up front and reused for every
+ * batch. Records are handed out as pointers straight into that buffer:
+ * the search header is read in place with the accessors below and the
+ * item body is passed through untouched, so nothing is copied between
+ * the ioctl and the caller. Item pointers are only valid until the
+ * next call to tree_search_next().
+ *
+ * TREE_SEARCH needs CAP_SYS_ADMIN.
+ */
+
+#define TREE_SEARCH_DEFAULT_BUF (1 << 20)
+#define TREE_SEARCH_MAX_BUF     (16 << 20)
+
+struct tree_search {
+    int fd;
+    struct btrfs_ioctl_search_args_v2 *args;
+    __u64 buf_size;
+    struct btrfs_ioctl_search_key key;
+    __u32 nr_left;
+    __u64 off;
+    int done;
+    __u64 ioctls;
+    __u64 items;
+};
+
+int tree_search_init(struct tree_search *ts, int fd, __u64 buf_size);
+void tree_search_free(struct tree_search *ts);
+
+/*
+ * Restart the scan on @tree_id for every key between
+ * (min_objectid, min_type, 0) and (max_objectid, max_type, -1).
+ * @min_transid only prunes nodes and leaves last written before that
+ * transaction; a newer leaf returns all its items, so callers that want
+ * changed items must check each item's own generation or transid.
+ */
+void tree_search_reset(struct tree_search *ts, __u64 tree_id,
+                       __u64 min_objectid, __u64 max_objectid,
+                       __u32 min_type, __u32 max_type, __u64 min_transid);
+
+/* Returns 1 and sets @hdr/@item for each record, 0 at the end, -1 on error. */
+int tree_search_next(struct tree_search *ts,
+                     const struct btrfs_ioctl_search_header **hdr,
+                     const void **item);
+
+/* Return non-zero from the callback to stop the walk early. */
+typedef int (*tree_search_cb)(const struct btrfs_ioctl_search_header *hdr,
+                              const void *item, void *data);
+
+int tree_search_walk(struct tree_search *ts, tree_search_cb cb, void *data);
+
+/*
+ * Search headers follow variable sized items in the result buffer, so
+ * they are not naturally aligned; read each field with memcpy, which
+ * compiles to a plain load.
+ */
+static inline __u64 ts_get_u64(const void *p)
+{
+    __u64 v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static inline __u32 ts_get_u32(const void *p)
+{
+    __u32 v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+/* Item bodies are on-disk structures and therefore little endian. */
+static inline __u64 ts_get_le64(const void *p)
+{
+    return le64toh(ts_get_u64(p));
+}
+
+static inline __u32 ts_get_le32(const void *p)
+{
+    return le32toh(ts_get_u32(p));
+}
+
+static inline __u16 ts_get_le16(const void *p)
+{
+    __u16 v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return le16toh(v);
+}
+
+#define TS_HDR_FIELD(hdr, field, bits) \
+    ts_get_u##bits((const char *)(hdr) + \
+                   offsetof(struct btrfs_ioctl_search_header, field))
+
+#define ts_hdr_transid(hdr)  TS_HDR_FIELD(hdr, transid, 64)
+#define ts_hdr_objectid(hdr) TS_HDR_FIELD(hdr, objectid, 64)
+#define ts_hdr_offset(hdr)   TS_HDR_FIELD(hdr, offset, 64)
+#define ts_hdr_type(hdr)     TS_HDR_FIELD(hdr, type, 32)
+#define ts_hdr_len(hdr)      TS_HDR_FIELD(hdr, len, 32)
+
+/* Read a little endian field of an on-disk item in place. */
+#define TS_ITEM_LE64(item, type, field) \
+    ts_get_le64((const char *)(item) + offsetof(type, field))
+#define TS_ITEM_LE32(item, type, field) \
+    ts_get_le32((const char *)(item) + offsetof(type, field))
+#define TS_ITEM_LE16(item, type, field) \
+    ts_get_le16((const char *)(item) + offsetof(type, field))
+
+#endif
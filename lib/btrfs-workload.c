@@ -0,0 +1,308 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+
+#include "btrfs-workload.h"
+
+static const char *type_names[] = {
+    [WORKLOAD_RANDREAD] = "randread",
+    [WORKLOAD_SEQWRITE] = "seqwrite",
+    [WORKLOAD_FSYNC] = "fsync",
+    [WORKLOAD_FDATASYNC] = "fdatasync",
+};
+
+int workload_parse_type(const char *arg, enum workload_type *type)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(type_names) / sizeof(type_names[0]); i++) {
+        if (strcmp(arg, type_names[i]) == 0) {
+            *type = i;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "unknown workload: %s\n", arg);
+
+    return -1;
+}
+
+const char *workload_type_name(enum workload_type type)
+{
+    return type_names[type];
+}
+
+static void file_path(char *path, const struct workload_opts *opts, int id)
+{
+    snprintf(path, BENCH_PATH_MAX, "%s/workload-%d", opts->dir, id);
+}
+
+int workload_prepare(struct workload *workload,
+                     const struct workload_opts *opts)
+{
+    int i;
+
+    memset(workload, 0, sizeof(*workload));
+    workload->opts = *opts;
+
+    if (opts->threads <= 0 || opts->block_size == 0 ||
+        opts->file_size < opts->block_size) {
+        fprintf(stderr, "invalid workload options\n");
+        return -1;
+    }
+
+    workload->threads = calloc(opts->threads, sizeof(*workload->threads));
+    workload->hist = bench_hist_alloc();
+
+    if (workload->threads == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (i = 0; i < opts->threads; i++)
+        workload->threads[i].fd = -1;
+
+    for (i = 0; i < opts->threads; i++) {
+        struct workload_thread *thread = &workload->threads[i];
+        char path[BENCH_PATH_MAX];
+        int flags = O_RDWR|O_CREAT|O_CLOEXEC;
+
+        thread->workload = workload;
+        thread->id = i;
+        thread->seed = i * 7919 + 1;
+
+        if (posix_memalign(&thread->buf, 4096, opts->block_size) != 0) {
+            perror("posix_memalign");
+            return -1;
+        }
+
+        memset(thread->buf, 0x5a + i, opts->block_size);
+
+        /*
+         * Reads need data on disk to hit, so fill the file up front;
+         * writers start from an empty file of the same size.
+         */
+        if (opts->type == WORKLOAD_RANDREAD) {
+            __u64 off;
+
+            file_path(path, opts, i);
+            thread->fd = open(path, flags|O_TRUNC, 0644);
+
+            if (thread->fd < 0) {
+                perror("open");
+                return -1;
+            }
+
+            for (off = 0; off < opts->file_size; off += opts->block_size) {
+                if (pwrite(thread->fd, thread->buf, opts->block_size,
+                           off) < 0) {
+                    perror("pwrite");
+                    return -1;
+                }
+            }
+
+            fsync(thread->fd);
+            close(thread->fd);
+            thread->fd = -1;
+        }
+
+        file_path(path, opts, i);
+
+        if (opts->direct)
+            flags |= O_DIRECT;
+
+        thread->fd = open(path, flags, 0644);
+
+        if (thread->fd < 0) {
+            perror("open");
+            return -1;
+        }
+
+        if (opts->type != WORKLOAD_RANDREAD &&
+            ftruncate(thread->fd, opts->file_size) < 0) {
+            perror("ftruncate");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *workload_thread(void *data)
+{
+    struct workload_thread *thread = data;
+    struct workload *workload = thread->workload;
+    const struct workload_opts *opts = &workload->opts;
+    __u64 blocks = opts->file_size / opts->block_size;
+    __u64 next = 0;
+    int failures = 0;
+
+    while (!__atomic_load_n(&workload->stop, __ATOMIC_RELAXED)) {
+        __u64 off;
+        __u64 start;
+        ssize_t ret;
+
+        if (opts->type == WORKLOAD_RANDREAD) {
+            off = ((__u64)rand_r(&thread->seed) << 31 ^
+                   rand_r(&thread->seed)) % blocks * opts->block_size;
+        }
+        else {
+            off = next * opts->block_size;
+            next = (next + 1) % blocks;
+        }
+
+        start = bench_now_ns();
+
+        if (opts->type == WORKLOAD_RANDREAD)
+            ret = pread(thread->fd, thread->buf, opts->block_size, off);
+        else
+            ret = pwrite(thread->fd, thread->buf, opts->block_size, off);
+
+        if (ret >= 0 && opts->type == WORKLOAD_FSYNC)
+            ret = fsync(thread->fd);
+        else if (ret >= 0 && opts->type == WORKLOAD_FDATASYNC)
+            ret = fdatasync(thread->fd);
+
+        if (ret < 0) {
+            __atomic_fetch_add(&workload->errors, 1, __ATOMIC_RELAXED);
+
+            if (++failures >= WORKLOAD_MAX_ERRORS) {
+                fprintf(stderr, "workload thread %d: stopping after %d "
+                        "consecutive errors: %s\n", thread->id, failures,
+                        strerror(errno));
+                break;
+            }
+
+            continue;
+        }
+
+        failures = 0;
+
+        bench_hist_record(workload->hist, bench_now_ns() - start);
+        __atomic_fetch_add(&workload->ops, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&workload->bytes, opts->block_size,
+                           __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*
+ * Buffered reads of a file that was just written are page cache hits,
+ * so drop the read files' cached pages before every run. Otherwise
+ * randread without O_DIRECT never reaches the disk and cannot show
+ * the impact of the operation under test, and every run after the
+ * first would start warmer than the one before.
+ */
+static void drop_file_cache(struct workload *workload)
+{
+    int i;
+
+    if (workload->opts.type != WORKLOAD_RANDREAD || workload->opts.direct)
+        return;
+
+    for (i = 0; i < workload->opts.threads; i++) {
+        int err = posix_fadvise(workload->threads[i].fd, 0, 0,
+                                POSIX_FADV_DONTNEED);
+
+        if (err != 0)
+            fprintf(stderr, "posix_fadvise: %s\n", strerror(err));
+    }
+}
+
+int workload_start(struct workload *workload)
+{
+    int i;
+
+    drop_file_cache(workload);
+    bench_hist_init(workload->hist);
+    workload->ops = 0;
+    workload->bytes = 0;
+    workload->errors = 0;
+    workload->stop = 0;
+    workload->start_ns = bench_now_ns();
+
+    for (i = 0; i < workload->opts.threads; i++) {
+        if (pthread_create(&workload->threads[i].thread, NULL,
+                           workload_thread, &workload->threads[i]) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    workload->running = 1;
+
+    return 0;
+}
+
+void workload_stop(struct workload *workload)
+{
+    int i;
+
+    if (!workload->running)
+        return;
+
+    __atomic_store_n(&workload->stop, 1, __ATOMIC_RELAXED);
+
+    for (i = 0; i < workload->opts.threads; i++)
+        pthread_join(workload->threads[i].thread, NULL);
+
+    workload->end_ns = bench_now_ns();
+    workload->running = 0;
+}
+
+void workload_destroy(struct workload *workload, int unlink_files)
+{
+    int i;
+
+    workload_stop(workload);
+
+    for (i = 0; i < workload->opts.threads && workload->threads; i++) {
+        char path[BENCH_PATH_MAX];
+
+        if (workload->threads[i].fd >= 0)
+            close(workload->threads[i].fd);
+
+        free(workload->threads[i].buf);
+
+        if (unlink_files) {
+            file_path(path, &workload->opts, i);
+            unlink(path);
+        }
+    }
+
+    free(workload->threads);
+    free(workload->hist);
+    workload->threads = NULL;
+    workload->hist = NULL;
+}
+
+void workload_print_header(FILE *out)
+{
+    fprintf(out, "%-16s %10s %10s %10s %10s %10s %10s %10s %8s\n",
+            "phase", "ops", "ops/s", "MiB/s", "p50(us)", "p99(us)",
+            "p999(us)", "max(us)", "errors");
+}
+
+void workload_print(FILE *out, const char *label,
+                    const struct workload *workload)
+{
+    double secs = (workload->end_ns - workload->start_ns) / 1e9;
+    const struct bench_hist *hist = workload->hist;
+
+    if (secs <= 0)
+        secs = 1e-9;
+
+    fprintf(out, "%-16s %10llu %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f "
+            "%8llu\n",
+            label, workload->ops, workload->ops / secs,
+            workload->bytes / 1048576.0 / secs,
+            bench_hist_percentile(hist, 50.0) / 1000.0,
+            bench_hist_percentile(hist, 99.0) / 1000.0,
+            bench_hist_percentile(hist, 99.9) / 1000.0,
+            (hist->count ? hist->max : 0) / 1000.0, workload->errors);
+}
@@ -0,0 +1,85 @@
+#ifndef BTRFS_WORKLOAD_H
+#define BTRFS_WORKLOAD_H
+
+#include <pthread.h>
+#include <linux/types.h>
+
+#include "btrfs-bench.h"
+
+/*
+ * Foreground I/O generator used to measure how maintenance operations
+ * (scrub, balance, replace, resize, ...) affect application latency.
+ *
+ * Every thread works on its own preallocated file below @dir and
+ * records the latency of each operation into one shared histogram:
+ *
+ *   randread  - random block-aligned preads
+ *   seqwrite  - sequential pwrites, wrapping at the end of the file
+ *   fsync     - one block pwrite followed by fsync
+ *   fdatasync - one block pwrite followed by fdatasync
+ *
+ * Without @direct the randread files are evicted from the page cache
+ * at every workload_start(), so each run begins by reading from disk;
+ * a long run still warms up, so use @direct for steady-state numbers.
+ *
+ * Failed operations are counted in @errors. A thread that fails
+ * WORKLOAD_MAX_ERRORS times in a row (ENOSPC, EROFS, ...) reports the
+ * error and exits instead of spinning on it.
+ */
+
+#define WORKLOAD_MAX_ERRORS 100
+
+enum workload_type {
+    WORKLOAD_RANDREAD,
+    WORKLOAD_SEQWRITE,
+    WORKLOAD_FSYNC,
+    WORKLOAD_FDATASYNC,
+};
+
+struct workload_opts {
+    enum workload_type type;
+    const char *dir;
+    int threads;
+    __u64 file_size;
+    __u32 block_size;
+    int direct;
+};
+
+struct workload_thread {
+    pthread_t thread;
+    struct workload *workload;
+    int id;
+    int fd;
+    void *buf;
+    unsigned int seed;
+};
+
+struct workload {
+    struct workload_opts opts;
+    struct workload_thread *threads;
+    struct bench_hist *hist;
+    __u64 ops;
+    __u64 bytes;
+    __u64 errors;
+    __u64 start_ns;
+    __u64 end_ns;
+    int stop;
+    int running;
+};
+
+int workload_parse_type(const char *arg, enum workload_type *type);
+const char *workload_type_name(enum workload_type type);
+
+/* Create and fill the per-thread files; done once per workload. */
+int workload_prepare(struct workload *workload,
+                     const struct workload_opts *opts);
+/* Start the threads with a fresh histogram and counters. */
+int workload_start(struct workload *workload);
+void workload_stop(struct workload *workload);
+void workload_destroy(struct workload *workload, int unlink_files);
+
+void workload_print_header(FILE *out);
+void workload_print(FILE *out, const char *label,
+                    const struct workload *workload);
+
+#endif
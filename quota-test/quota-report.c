@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-qgroup-table.h"
+#include "../lib/btrfs-tree-search.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o quota-report quota-report.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-qgroup-table.c ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 1G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Qgroup usage report read straight from the quota tree. Without
+ * options every qgroup is printed once with its referenced and
+ * exclusive bytes, limits and relation counts:
+ *
+ * sudo ./quota-report
+ *
+ * -w reloads the table every that many seconds and prints the -N
+ * qgroups whose referenced (or with -e exclusive) bytes grew the most
+ * since the previous load, -c times or until interrupted:
+ *
+ * sudo ./quota-report  -w 5  -N 20  -e
+ *
+ * -g creates that many level 1 qgroups, a limit on every fourth and a
+ * level 2 parent for every -f of them, then times -r loads of the
+ * table for every search buffer size of -b. Quotas must be disabled
+ * beforehand and are disabled again afterwards:
+ *
+ * sudo ./quota-report  -g 50000  -b 65536,1048576,16777216
+ */
+
+#define MAX_ROUNDS 16
+
+struct growth {
+    __u64 qgroupid;
+    __s64 delta;
+    __u64 value;
+};
+
+static void format_qgroupid(char *buf, size_t size, __u64 qgroupid)
+{
+    snprintf(buf, size, "%llu/%llu", qgroup_level(qgroupid),
+             qgroup_subvid(qgroupid));
+}
+
+static void format_limit(char *buf, size_t size, __u64 flags, __u64 flag,
+                         __u64 value)
+{
+    if (flags & flag)
+        snprintf(buf, size, "%llu", value);
+    else
+        snprintf(buf, size, "none");
+}
+
+static void print_table(const struct qgroup_table *table)
+{
+    char id[32], max_rfer[32], max_excl[32];
+    __u64 i;
+
+    printf("%-16s %16s %16s %16s %16s %8s %8s\n", "qgroupid", "rfer", "excl",
+           "max_rfer", "max_excl", "parents", "children");
+
+    for (i = 0; i < table->count; i++) {
+        const struct qgroup_entry *entry = &table->entries[i];
+
+        format_qgroupid(id, sizeof(id), entry->qgroupid);
+        format_limit(max_rfer, sizeof(max_rfer), entry->limit_flags,
+                     BTRFS_QGROUP_LIMIT_MAX_RFER, entry->max_rfer);
+        format_limit(max_excl, sizeof(max_excl), entry->limit_flags,
+                     BTRFS_QGROUP_LIMIT_MAX_EXCL, entry->max_excl);
+        printf("%-16s %16llu %16llu %16s %16s %8u %8u\n", id, entry->rfer,
+               entry->excl, max_rfer, max_excl, entry->num_parents,
+               entry->num_children);
+    }
+
+    printf("\n%llu qgroups, %llu relations%s\n", table->count,
+           table->num_relations,
+           (table->status_flags & BTRFS_QGROUP_STATUS_FLAG_INCONSISTENT) ?
+           ", inconsistent (rescan needed)" : "");
+}
+
+static int compare_growth(const void *a, const void *b)
+{
+    const struct growth *x = a;
+    const struct growth *y = b;
+
+    return x->delta < y->delta ? 1 : x->delta > y->delta ? -1 : 0;
+}
+
+/*
+ * Both tables are sorted by qgroupid, so the deltas come from a single
+ * merge pass; qgroups that are new since the last load grow from zero.
+ */
+static void print_growth(const struct qgroup_table *prev,
+                         const struct qgroup_table *cur, int excl, int top,
+                         struct growth *growth, double elapsed)
+{
+    char id[32];
+    __u64 i, j = 0;
+    __u64 n = 0;
+
+    for (i = 0; i < cur->count; i++) {
+        const struct qgroup_entry *entry = &cur->entries[i];
+        __u64 value = excl ? entry->excl : entry->rfer;
+        __u64 before = 0;
+
+        while (j < prev->count && prev->entries[j].qgroupid < entry->qgroupid)
+            j++;
+
+        if (j < prev->count && prev->entries[j].qgroupid == entry->qgroupid)
+            before = excl ? prev->entries[j].excl : prev->entries[j].rfer;
+
+        growth[n].qgroupid = entry->qgroupid;
+        growth[n].delta = (__s64)(value - before);
+        growth[n].value = value;
+        n++;
+    }
+
+    qsort(growth, n, sizeof(*growth), compare_growth);
+
+    printf("%-16s %16s %16s %14s\n", "qgroupid", excl ? "excl" : "rfer",
+           "delta", "bytes/s");
+
+    for (i = 0; i < n && i < (__u64)top; i++) {
+        format_qgroupid(id, sizeof(id), growth[i].qgroupid);
+        printf("%-16s %16llu %+16lld %14.0f\n", id, growth[i].value,
+               growth[i].delta, growth[i].delta / elapsed);
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+static int watch(struct tree_search *ts, int interval, int iterations,
+                 int top, int excl)
+{
+    struct qgroup_table tables[2] = {{0}};
+    struct growth *growth = NULL;
+    __u64 growth_alloc = 0;
+    __u64 last;
+    int cur = 0;
+    int i;
+
+    if (qgroup_table_load(&tables[cur], ts) < 0)
+        return -1;
+
+    last = bench_now_ns();
+
+    for (i = 0; iterations == 0 || i < iterations; i++) {
+        __u64 now;
+
+        sleep(interval);
+        cur ^= 1;
+
+        if (qgroup_table_load(&tables[cur], ts) < 0)
+            return -1;
+
+        now = bench_now_ns();
+
+        if (tables[cur].count > growth_alloc) {
+            growth_alloc = tables[cur].count;
+            growth = realloc(growth, growth_alloc * sizeof(*growth));
+
+            if (growth == NULL) {
+                perror("realloc");
+                return -1;
+            }
+        }
+
+        print_growth(&tables[cur ^ 1], &tables[cur], excl, top, growth,
+                     (now - last) / 1e9);
+        last = now;
+    }
+
+    free(growth);
+    qgroup_table_free(&tables[0]);
+    qgroup_table_free(&tables[1]);
+
+    return 0;
+}
+
+static int create_qgroups(int volume_fd, int count, int fanout)
+{
+    struct btrfs_ioctl_quota_ctl_args ctl = {0};
+    struct btrfs_ioctl_qgroup_create_args create_args = {0};
+    struct btrfs_ioctl_qgroup_assign_args assign_args = {0};
+    struct btrfs_ioctl_qgroup_limit_args limit_args = {0};
+    __u64 start = bench_now_ns();
+    int k;
+
+    ctl.cmd = BTRFS_QUOTA_CTL_ENABLE;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_CTL");
+        return -1;
+    }
+
+    create_args.create = 1;
+
+    for (k = 0; k < (count + fanout - 1) / fanout; k++) {
+        create_args.qgroupid = 2ULL << BTRFS_QGROUP_LEVEL_SHIFT | k;
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE,
+                        &create_args) < 0) {
+            perror("ioctl BTRFS_IOC_QGROUP_CREATE");
+            return -1;
+        }
+    }
+
+    for (k = 0; k < count; k++) {
+        create_args.qgroupid = 1ULL << BTRFS_QGROUP_LEVEL_SHIFT | k;
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE,
+                        &create_args) < 0) {
+            perror("ioctl BTRFS_IOC_QGROUP_CREATE");
+            return -1;
+        }
+
+        assign_args.assign = 1;
+        assign_args.src = create_args.qgroupid;
+        assign_args.dst = 2ULL << BTRFS_QGROUP_LEVEL_SHIFT | k / fanout;
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_ASSIGN,
+                        &assign_args) < 0) {
+            perror("ioctl BTRFS_IOC_QGROUP_ASSIGN");
+            return -1;
+        }
+
+        if (k % 4 != 0)
+            continue;
+
+        limit_args.qgroupid = create_args.qgroupid;
+        limit_args.lim.flags = BTRFS_QGROUP_LIMIT_MAX_RFER;
+        limit_args.lim.max_rfer = (__u64)(k + 1) << 20;
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_LIMIT, &limit_args) < 0) {
+            perror("ioctl BTRFS_IOC_QGROUP_LIMIT");
+            return -1;
+        }
+    }
+
+    syncfs(volume_fd);
+    printf("Created %d qgroups in %.1f ms\n\n", count,
+           (bench_now_ns() - start) / 1e6);
+
+    return 0;
+}
+
+static int benchmark(int volume_fd, int count, int fanout, int repeats,
+                     const int *buf_sizes, int num_buf_sizes)
+{
+    struct btrfs_ioctl_quota_ctl_args ctl = {0};
+    struct qgroup_table table = {0};
+    int i, r;
+
+    if (create_qgroups(volume_fd, count, fanout) < 0)
+        return -1;
+
+    printf("%10s %10s %10s %10s %10s %12s %12s\n", "buf", "qgroups",
+           "relations", "ioctls", "items", "load(ms)", "qgroups/s");
+
+    for (i = 0; i < num_buf_sizes; i++) {
+        struct bench_hist *hist = bench_hist_alloc();
+        struct tree_search ts;
+        __u64 ioctls = 0;
+
+        if (hist == NULL || tree_search_init(&ts, volume_fd,
+                                             buf_sizes[i]) < 0)
+            return -1;
+
+        for (r = 0; r < repeats; r++) {
+            __u64 start = bench_now_ns();
+
+            ts.ioctls = 0;
+            ts.items = 0;
+
+            if (qgroup_table_load(&table, &ts) < 0)
+                return -1;
+
+            bench_hist_record(hist, bench_now_ns() - start);
+            ioctls = ts.ioctls;
+        }
+
+        printf("%10d %10llu %10llu %10llu %10llu %12.2f %12.0f\n",
+               buf_sizes[i], table.count, table.num_relations, ioctls,
+               ts.items, bench_hist_percentile(hist, 50.0) / 1e6,
+               table.count / (bench_hist_percentile(hist, 50.0) / 1e9));
+
+        tree_search_free(&ts);
+        free(hist);
+    }
+
+    qgroup_table_free(&table);
+    ctl.cmd = BTRFS_QUOTA_CTL_DISABLE;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_CTL");
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct tree_search ts;
+    int buf_sizes[MAX_ROUNDS] = {64 * 1024, 1 << 20, TREE_SEARCH_MAX_BUF};
+    int num_buf_sizes = 3;
+    int interval = 0;
+    int iterations = 0;
+    int top = 10;
+    int excl = 0;
+    int generate = 0;
+    int fanout = 64;
+    int repeats = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:c:N:eg:f:r:b:")) != -1) {
+        switch (opt) {
+        case 'w':
+            interval = atoi(optarg);
+            break;
+        case 'c':
+            iterations = atoi(optarg);
+            break;
+        case 'N':
+            top = atoi(optarg);
+            break;
+        case 'e':
+            excl = 1;
+            break;
+        case 'g':
+            generate = atoi(optarg);
+            break;
+        case 'f':
+            fanout = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'b':
+            num_buf_sizes = bench_parse_list(optarg, buf_sizes, MAX_ROUNDS, 1);
+
+            if (num_buf_sizes < 0) {
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w secs] [-c count] [-N top] [-e] "
+                    "[-g qgroups] [-f fanout] [-r repeats] "
+                    "[-b buf-size,...]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (generate > 0) {
+        if (fanout < 1 || benchmark(volume_fd, generate, fanout, repeats,
+                                    buf_sizes, num_buf_sizes) < 0) {
+            return 1;
+        }
+
+        return 0;
+    }
+
+    if (tree_search_init(&ts, volume_fd, TREE_SEARCH_MAX_BUF) < 0) {
+        return 1;
+    }
+
+    if (interval > 0) {
+        if (watch(&ts, interval, iterations, top, excl) < 0) {
+            return 1;
+        }
+    }
+    else {
+        struct qgroup_table table = {0};
+
+        if (qgroup_table_load(&table, &ts) < 0) {
+            return 1;
+        }
+
+        print_table(&table);
+        qgroup_table_free(&table);
+    }
+
+    tree_search_free(&ts);
+
+    return 0;
+}
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o quota-scale quota-scale.c ../lib/btrfs-bench.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Qgroup scalability: for every count of -n the program creates that
+ * many subvolume qgroups, made of base subvolumes holding -b bytes of
+ * data each plus -s snapshots of every base subvolume. It then
+ *
+ *  - times commits (syncfs after small writes into up to 64 random
+ *    subvolumes) with quotas still disabled,
+ *  - enables quotas, which creates the level 0 qgroups and rescans,
+ *  - builds a -l level hierarchy on top with BTRFS_IOC_QGROUP_CREATE
+ *    and BTRFS_IOC_QGROUP_ASSIGN, -f child qgroups per parent,
+ *  - runs a full BTRFS_IOC_QUOTA_RESCAN, sampling
+ *    BTRFS_IOC_QUOTA_RESCAN_STATUS every -i milliseconds,
+ *  - and times the same commits again with quotas enabled.
+ *
+ * The rescan progress series is printed as CSV per round, followed by
+ * a summary table:
+ *
+ * sudo ./quota-scale  -n 100,1000,5000  -s 4  -l 3  -f 16
+ *
+ * Quotas must be disabled when the program starts.
+ */
+
+#define MAX_ROUNDS 16
+#define MAX_LEVELS 7
+#define PROBE_SUBVOLS 64
+
+struct rescan_sampler {
+    int volume_fd;
+    __u64 samples;
+};
+
+struct round_result {
+    int qgroups;
+    int hierarchy;
+    __u64 create_ns;
+    __u64 enable_ns;
+    __u64 assign_ns;
+    __u64 rescan_ns;
+    __u64 disable_ns;
+    struct bench_hist *commit_off;
+    struct bench_hist *commit_on;
+};
+
+/* Subvolume k is either base k / (snaps + 1) or one of its snapshots. */
+static void subvol_name(char *name, size_t size, int k, int snaps)
+{
+    int base = k / (snaps + 1);
+    int snap = k % (snaps + 1);
+
+    if (snap == 0)
+        snprintf(name, size, "qscale-%d", base);
+    else
+        snprintf(name, size, "qscale-%d-%d", base, snap - 1);
+}
+
+static int create_subvols(int volume_fd, int count, int snaps, __u64 bytes)
+{
+    struct btrfs_ioctl_vol_args args;
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    char path[BENCH_PATH_MAX];
+    int base_fd = -1;
+    int k;
+
+    for (k = 0; k < count; k++) {
+        if (k % (snaps + 1) == 0) {
+            if (base_fd >= 0)
+                close(base_fd);
+
+            memset(&args, 0, sizeof(args));
+            subvol_name(args.name, sizeof(args.name), k, snaps);
+
+            if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+                perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+                return -1;
+            }
+
+            snprintf(path, sizeof(path), "%s/%s", bench_mnt_path(),
+                     args.name);
+
+            if (bytes > 0 && bench_populate(path, "data", 1, bytes) < 0)
+                return -1;
+
+            base_fd = bench_open_path(path);
+
+            if (base_fd < 0)
+                return -1;
+
+            continue;
+        }
+
+        memset(&args_v2, 0, sizeof(args_v2));
+        args_v2.fd = base_fd;
+        subvol_name(args_v2.name, sizeof(args_v2.name), k, snaps);
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
+            perror("ioctl BTRFS_IOC_SNAP_CREATE_V2");
+            return -1;
+        }
+    }
+
+    if (base_fd >= 0)
+        close(base_fd);
+
+    return 0;
+}
+
+static void destroy_subvols(int volume_fd, int count, int snaps)
+{
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    int k;
+
+    for (k = count - 1; k >= 0; k--) {
+        memset(&args_v2, 0, sizeof(args_v2));
+        subvol_name(args_v2.name, sizeof(args_v2.name), k, snaps);
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0)
+            perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+    }
+}
+
+static int subvol_treeid(int volume_fd, int k, int snaps, __u64 *treeid)
+{
+    struct btrfs_ioctl_get_subvol_info_args info = {0};
+    char name[BTRFS_PATH_NAME_MAX + 1];
+    int fd;
+
+    subvol_name(name, sizeof(name), k, snaps);
+    fd = openat(volume_fd, name, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+    if (fd < 0) {
+        perror("openat");
+        return -1;
+    }
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+        perror("ioctl BTRFS_IOC_GET_SUBVOL_INFO");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    *treeid = info.treeid;
+
+    return 0;
+}
+
+/*
+ * Dirty a 4 KiB block in up to PROBE_SUBVOLS random subvolumes and
+ * time the commit that writes them out. With quotas enabled the commit
+ * also has to account every touched extent against its qgroups.
+ */
+static int probe_commits(int volume_fd, int count, int snaps, int repeats,
+                         struct bench_hist *hist, unsigned int *seed)
+{
+    static char block[4096];
+    char path[BENCH_PATH_MAX];
+    int r, i;
+
+    for (r = 0; r < repeats; r++) {
+        __u64 start;
+
+        for (i = 0; i < count && i < PROBE_SUBVOLS; i++) {
+            char name[BTRFS_PATH_NAME_MAX + 1];
+            int fd;
+
+            subvol_name(name, sizeof(name), rand_r(seed) % count, snaps);
+            if (snprintf(path, sizeof(path), "%s/qscale-probe",
+                         name) >= (int)sizeof(path)) {
+                fprintf(stderr, "probe path too long\n");
+                return -1;
+            }
+
+            fd = openat(volume_fd, path, O_WRONLY|O_CREAT|O_CLOEXEC, 0644);
+
+            if (fd < 0) {
+                perror("openat");
+                return -1;
+            }
+
+            memset(block, r + i, sizeof(block));
+
+            if (pwrite(fd, block, sizeof(block),
+                       (rand_r(seed) % 256) * sizeof(block)) < 0) {
+                perror("pwrite");
+                close(fd);
+                return -1;
+            }
+
+            close(fd);
+        }
+
+        start = bench_now_ns();
+
+        if (syncfs(volume_fd) < 0) {
+            perror("syncfs");
+            return -1;
+        }
+
+        bench_hist_record(hist, bench_now_ns() - start);
+    }
+
+    return 0;
+}
+
+/*
+ * Level n qgroup k gets id n/k and contains the level n - 1 qgroups
+ * k * fanout ... k * fanout + fanout - 1. Returns the number of
+ * qgroups created above level 0.
+ */
+static int build_hierarchy(int volume_fd, const __u64 *treeids, int count,
+                           int levels, int fanout)
+{
+    struct btrfs_ioctl_qgroup_create_args create_args;
+    struct btrfs_ioctl_qgroup_assign_args assign_args;
+    int children = count;
+    int created = 0;
+    int level;
+    int k;
+
+    for (level = 1; level < levels && children > 1; level++) {
+        int parents = (children + fanout - 1) / fanout;
+
+        for (k = 0; k < parents; k++) {
+            memset(&create_args, 0, sizeof(create_args));
+            create_args.create = 1;
+            create_args.qgroupid = (__u64)level << BTRFS_QGROUP_LEVEL_SHIFT | k;
+
+            if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE,
+                            &create_args) < 0) {
+                perror("ioctl BTRFS_IOC_QGROUP_CREATE");
+                return -1;
+            }
+
+            created++;
+        }
+
+        for (k = 0; k < children; k++) {
+            memset(&assign_args, 0, sizeof(assign_args));
+            assign_args.assign = 1;
+            assign_args.src = level == 1 ? treeids[k] :
+                              (__u64)(level - 1) << BTRFS_QGROUP_LEVEL_SHIFT | k;
+            assign_args.dst = (__u64)level << BTRFS_QGROUP_LEVEL_SHIFT |
+                              k / fanout;
+
+            if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_ASSIGN,
+                            &assign_args) < 0) {
+                perror("ioctl BTRFS_IOC_QGROUP_ASSIGN");
+                return -1;
+            }
+        }
+
+        children = parents;
+    }
+
+    return created;
+}
+
+static void sample_rescan(__u64 elapsed_ns, void *data)
+{
+    struct rescan_sampler *sampler = data;
+    struct btrfs_ioctl_quota_rescan_args args = {0};
+
+    if (BENCH_IOCTL(sampler->volume_fd, BTRFS_IOC_QUOTA_RESCAN_STATUS,
+                    &args) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_RESCAN_STATUS");
+        return;
+    }
+
+    printf("%.1f,%llu,%llu\n", elapsed_ns / 1e6, args.flags, args.progress);
+    sampler->samples++;
+}
+
+static int run_rescan(int volume_fd, __u64 interval_ms, __u64 *elapsed)
+{
+    struct btrfs_ioctl_quota_rescan_args args = {0};
+    struct rescan_sampler sampler = {0};
+    struct bench_ticker ticker;
+    __u64 start;
+
+    sampler.volume_fd = volume_fd;
+    start = bench_now_ns();
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN, &args) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_RESCAN");
+        return -1;
+    }
+
+    printf("elapsed_ms,running,progress\n");
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL, sample_rescan,
+                           &sampler) < 0) {
+        return -1;
+    }
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN_WAIT, NULL) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_RESCAN_WAIT");
+        bench_ticker_stop(&ticker);
+        return -1;
+    }
+
+    *elapsed = bench_now_ns() - start;
+    bench_ticker_stop(&ticker);
+
+    return 0;
+}
+
+static int quota_ctl(int volume_fd, __u64 cmd, __u64 *elapsed)
+{
+    struct btrfs_ioctl_quota_ctl_args ctl = {0};
+    __u64 start = bench_now_ns();
+
+    ctl.cmd = cmd;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_CTL");
+        return -1;
+    }
+
+    /* Enabling kicks off a rescan of its own, which is part of the cost. */
+    if (cmd == BTRFS_QUOTA_CTL_ENABLE &&
+        BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN_WAIT, NULL) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_RESCAN_WAIT");
+        return -1;
+    }
+
+    *elapsed = bench_now_ns() - start;
+
+    return 0;
+}
+
+static int run_round(int volume_fd, struct round_result *result, int snaps,
+                     int levels, int fanout, __u64 bytes, int repeats,
+                     __u64 interval_ms, unsigned int *seed)
+{
+    int count = result->qgroups;
+    __u64 *treeids;
+    __u64 start;
+    int k;
+
+    treeids = calloc(count, sizeof(*treeids));
+    result->commit_off = bench_hist_alloc();
+    result->commit_on = bench_hist_alloc();
+
+    if (treeids == NULL || result->commit_off == NULL ||
+        result->commit_on == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    start = bench_now_ns();
+
+    if (create_subvols(volume_fd, count, snaps, bytes) < 0)
+        return -1;
+
+    syncfs(volume_fd);
+    result->create_ns = bench_now_ns() - start;
+
+    for (k = 0; k < count; k++) {
+        if (subvol_treeid(volume_fd, k, snaps, &treeids[k]) < 0)
+            return -1;
+    }
+
+    if (probe_commits(volume_fd, count, snaps, repeats, result->commit_off,
+                      seed) < 0)
+        return -1;
+
+    if (quota_ctl(volume_fd, BTRFS_QUOTA_CTL_ENABLE, &result->enable_ns) < 0)
+        return -1;
+
+    start = bench_now_ns();
+    result->hierarchy = build_hierarchy(volume_fd, treeids, count, levels,
+                                        fanout);
+
+    if (result->hierarchy < 0)
+        return -1;
+
+    syncfs(volume_fd);
+    result->assign_ns = bench_now_ns() - start;
+
+    printf("# %d level 0 qgroups, %d above, rescan progress\n", count,
+           result->hierarchy);
+
+    if (run_rescan(volume_fd, interval_ms, &result->rescan_ns) < 0)
+        return -1;
+
+    printf("\n");
+    fflush(stdout);
+
+    if (probe_commits(volume_fd, count, snaps, repeats, result->commit_on,
+                      seed) < 0)
+        return -1;
+
+    if (quota_ctl(volume_fd, BTRFS_QUOTA_CTL_DISABLE,
+                  &result->disable_ns) < 0)
+        return -1;
+
+    destroy_subvols(volume_fd, count, snaps);
+    free(treeids);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    int counts[MAX_ROUNDS] = {100, 1000};
+    int num_counts = 2;
+    struct round_result results[MAX_ROUNDS];
+    __u64 bytes = 1ULL << 20;
+    __u64 interval_ms = 100;
+    unsigned int seed = 1;
+    int snaps = 3;
+    int levels = 3;
+    int fanout = 16;
+    int repeats = 20;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "n:s:l:f:b:r:i:")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_counts = bench_parse_list(optarg, counts, MAX_ROUNDS, 0);
+
+            if (num_counts < 0) {
+                return 1;
+            }
+            break;
+        case 's':
+            snaps = atoi(optarg);
+            break;
+        case 'l':
+            levels = atoi(optarg);
+            break;
+        case 'f':
+            fanout = atoi(optarg);
+            break;
+        case 'b':
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n qgroups,...] [-s snapshots] "
+                    "[-l levels] [-f fanout] [-b bytes] [-r repeats] "
+                    "[-i interval-ms]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (levels < 1 || levels > MAX_LEVELS || fanout < 2 || snaps < 0) {
+        fprintf(stderr, "invalid hierarchy options\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    memset(results, 0, sizeof(results));
+
+    for (i = 0; i < num_counts; i++) {
+        results[i].qgroups = counts[i];
+
+        if (run_round(volume_fd, &results[i], snaps, levels, fanout, bytes,
+                      repeats, interval_ms, &seed) < 0) {
+            return 1;
+        }
+    }
+
+    printf("%8s %8s %12s %12s %12s %12s %12s %10s %10s %10s %10s\n",
+           "level0", "upper", "create(ms)", "enable(ms)", "assign(ms)",
+           "rescan(ms)", "disable(ms)", "off-p50", "off-p99", "on-p50",
+           "on-p99");
+
+    for (i = 0; i < num_counts; i++) {
+        struct round_result *r = &results[i];
+
+        printf("%8d %8d %12.1f %12.1f %12.1f %12.1f %12.1f %10.2f %10.2f "
+               "%10.2f %10.2f\n",
+               r->qgroups, r->hierarchy, r->create_ns / 1e6,
+               r->enable_ns / 1e6, r->assign_ns / 1e6, r->rescan_ns / 1e6,
+               r->disable_ns / 1e6,
+               bench_hist_percentile(r->commit_off, 50.0) / 1e6,
+               bench_hist_percentile(r->commit_off, 99.0) / 1e6,
+               bench_hist_percentile(r->commit_on, 50.0) / 1e6,
+               bench_hist_percentile(r->commit_on, 99.0) / 1e6);
+
+        free(r->commit_off);
+        free(r->commit_on);
+    }
+
+    printf("\ncommit latencies are syncfs times in ms with quotas off/on\n");
+
+    return 0;
+}
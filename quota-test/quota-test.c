@@ -6,6 +6,14 @@
 #include <linux/btrfs.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o quota-test quota-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -34,17 +42,15 @@ int main(int argc, char **argv)
     struct btrfs_qgroup_limit limit = {0};
     struct btrfs_ioctl_quota_rescan_args rescan_args = {0};
 
-    volume_fd = openat(AT_FDCWD, "/mnt", O_RDONLY|O_NONBLOCK
-                       |O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
 
     if (volume_fd < 0) {
-        perror("openat");
         return 1;
     }
 
     ctl.cmd = BTRFS_QUOTA_CTL_ENABLE;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -55,7 +61,7 @@ int main(int argc, char **argv)
     create_args.create = 1;
     create_args.qgroupid = 1;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -65,7 +71,7 @@ int main(int argc, char **argv)
 
     create_args.qgroupid = 2;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -77,7 +83,7 @@ int main(int argc, char **argv)
     assign_args.src = 1;
     assign_args.dst = 2;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QGROUP_ASSIGN, &assign_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_ASSIGN, &assign_args) < 0) {
         perror("ioctl BTRFS_IOC_QGROUP_ASSIGN");
         printf("\n");
     }
@@ -87,7 +93,7 @@ int main(int argc, char **argv)
     limit_args.qgroupid = 1;
     limit_args.lim = limit;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QGROUP_LIMIT, &limit_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_LIMIT, &limit_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -95,7 +101,7 @@ int main(int argc, char **argv)
     printf("ioctl BTRFS_IOC_QGROUP_LIMIT:\n");
     printf("Size of qgroup 1 limited to 100\n\n");
 
-    if (ioctl(volume_fd, BTRFS_IOC_QUOTA_RESCAN, &rescan_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN, &rescan_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -103,7 +109,7 @@ int main(int argc, char **argv)
     printf("ioctl BTRFS_IOC_QUOTA_RESCAN:\n");
     printf("Quota rescan started for /mnt\n\n");
 
-    if (ioctl(volume_fd, BTRFS_IOC_QUOTA_RESCAN_WAIT) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN_WAIT, NULL) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -111,7 +117,7 @@ int main(int argc, char **argv)
     printf("ioctl BTRFS_IOC_QUOTA_RESCAN_WAIT:\n");
     printf("Waiting for quota rescan for /mnt to finish...\n\n");
 
-    if (ioctl(volume_fd, BTRFS_IOC_QUOTA_RESCAN_STATUS, &rescan_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN_STATUS, &rescan_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -125,7 +131,7 @@ int main(int argc, char **argv)
 
     ctl.cmd = BTRFS_QUOTA_CTL_ENABLE;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -136,7 +142,7 @@ int main(int argc, char **argv)
     create_args.create = 0;
     create_args.qgroupid = 1;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -146,7 +152,7 @@ int main(int argc, char **argv)
 
     create_args.qgroupid = 2;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QGROUP_CREATE, &create_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -156,7 +162,7 @@ int main(int argc, char **argv)
 
     ctl.cmd = BTRFS_QUOTA_CTL_DISABLE;
 
-    if (ioctl(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
         perror("ioctl");
         return 1;
     }
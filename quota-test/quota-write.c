@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-workload.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o quota-write quota-write.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-workload.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Write-path cost of quota accounting. The same three workloads
+ * (buffered seqwrite, O_DIRECT seqwrite and fsync) run for -d seconds
+ * each with quotas disabled, with full qgroups and, if the headers
+ * know about it, with simple quotas. While quotas are on the test
+ * subvolume carries a BTRFS_QGROUP_LIMIT_MAX_RFER limit well above
+ * what the workload writes, so limit checks happen without failing.
+ *
+ * Each mode then measures enforcement: a fresh subvolume gets a limit
+ * of -L bytes and is written to in 1 MiB chunks until EDQUOT. The
+ * bytes written past the limit and the time from crossing it to the
+ * first EDQUOT are reported:
+ *
+ * sudo ./quota-write  -t 4  -s 67108864  -d 10  -L 268435456
+ *
+ * Quotas must be disabled when the program starts.
+ */
+
+#define NUM_WORKLOADS 3
+#define CHUNK_SIZE (1 << 20)
+
+struct quota_mode {
+    const char *name;
+    __u64 cmd;
+};
+
+static const struct quota_mode modes[] = {
+    { "off", 0 },
+    { "qgroups", BTRFS_QUOTA_CTL_ENABLE },
+#ifdef BTRFS_QUOTA_CTL_ENABLE_SIMPLE_QUOTA
+    { "simple", BTRFS_QUOTA_CTL_ENABLE_SIMPLE_QUOTA },
+#endif
+};
+
+#define NUM_MODES (sizeof(modes) / sizeof(modes[0]))
+
+struct workload_kind {
+    const char *name;
+    enum workload_type type;
+    int direct;
+};
+
+static const struct workload_kind kinds[NUM_WORKLOADS] = {
+    { "buffered", WORKLOAD_SEQWRITE, 0 },
+    { "direct", WORKLOAD_SEQWRITE, 1 },
+    { "fsync", WORKLOAD_FSYNC, 0 },
+};
+
+struct phase_result {
+    double ops_per_sec;
+    __u64 p50;
+    __u64 p99;
+};
+
+struct edquot_result {
+    __u64 written;
+    __u64 overshoot;
+    __u64 delay_ns;
+    int hit;
+};
+
+static int quota_ctl(int volume_fd, __u64 cmd)
+{
+    struct btrfs_ioctl_quota_ctl_args ctl = {0};
+
+    ctl.cmd = cmd;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_CTL, &ctl) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_CTL");
+        return -1;
+    }
+
+    if (cmd != BTRFS_QUOTA_CTL_DISABLE &&
+        BENCH_IOCTL(volume_fd, BTRFS_IOC_QUOTA_RESCAN_WAIT, NULL) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_RESCAN_WAIT");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int create_subvol(int volume_fd, const char *name)
+{
+    struct btrfs_ioctl_vol_args args;
+
+    memset(&args, 0, sizeof(args));
+    strncpy(args.name, name, BTRFS_PATH_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void destroy_subvol(int volume_fd, const char *name)
+{
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+
+    memset(&args_v2, 0, sizeof(args_v2));
+    strncpy(args_v2.name, name, BTRFS_SUBVOL_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0)
+        perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+}
+
+/* qgroupid 0 makes the kernel use the qgroup of the subvolume @fd is in. */
+static int set_limit(const char *path, __u64 max_rfer)
+{
+    struct btrfs_ioctl_qgroup_limit_args limit_args = {0};
+    int fd = bench_open_path(path);
+    int ret = 0;
+
+    if (fd < 0)
+        return -1;
+
+    limit_args.qgroupid = 0;
+    limit_args.lim.flags = BTRFS_QGROUP_LIMIT_MAX_RFER;
+    limit_args.lim.max_rfer = max_rfer;
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_QGROUP_LIMIT, &limit_args) < 0) {
+        perror("ioctl BTRFS_IOC_QGROUP_LIMIT");
+        ret = -1;
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+static int run_workloads(const char *dir, const struct workload_opts *base,
+                         __u64 secs, const char *mode,
+                         struct phase_result *results)
+{
+    char label[64];
+    int i;
+
+    for (i = 0; i < NUM_WORKLOADS; i++) {
+        struct workload_opts opts = *base;
+        struct workload workload;
+
+        opts.dir = dir;
+        opts.type = kinds[i].type;
+        opts.direct = kinds[i].direct;
+
+        if (workload_prepare(&workload, &opts) < 0)
+            return -1;
+
+        if (workload_start(&workload) < 0)
+            return -1;
+
+        sleep(secs);
+        workload_stop(&workload);
+
+        snprintf(label, sizeof(label), "%s/%s", mode, kinds[i].name);
+        workload_print(stdout, label, &workload);
+        fflush(stdout);
+
+        results[i].ops_per_sec = workload.ops /
+            ((workload.end_ns - workload.start_ns) / 1e9);
+        results[i].p50 = bench_hist_percentile(workload.hist, 50.0);
+        results[i].p99 = bench_hist_percentile(workload.hist, 99.0);
+
+        workload_destroy(&workload, 1);
+    }
+
+    return 0;
+}
+
+/*
+ * Buffered writes reserve qgroup space when the data is dirtied, so
+ * EDQUOT normally comes from write() itself; syncing every chunk keeps
+ * the accounting from lagging behind by a whole commit interval.
+ */
+static int run_edquot(const char *dir, __u64 limit, __u64 max_bytes,
+                      struct edquot_result *result)
+{
+    static char buf[CHUNK_SIZE];
+    char path[BENCH_PATH_MAX];
+    __u64 crossed_ns = 0;
+    int fd;
+
+    memset(result, 0, sizeof(*result));
+    memset(buf, 0xa5, sizeof(buf));
+    if (snprintf(path, sizeof(path), "%s/edquot", dir) >= (int)sizeof(path)) {
+        fprintf(stderr, "edquot path too long\n");
+        return -1;
+    }
+
+    fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    while (result->written < max_bytes) {
+        ssize_t ret = write(fd, buf, sizeof(buf));
+
+        if (ret >= 0 && fdatasync(fd) < 0)
+            ret = -1;
+
+        if (ret < 0 && errno == EDQUOT) {
+            result->hit = 1;
+            result->delay_ns = crossed_ns ? bench_now_ns() - crossed_ns : 0;
+            break;
+        }
+
+        if (ret < 0) {
+            perror("write");
+            close(fd);
+            return -1;
+        }
+
+        result->written += ret;
+
+        if (crossed_ns == 0 && result->written >= limit)
+            crossed_ns = bench_now_ns();
+    }
+
+    if (result->written > limit)
+        result->overshoot = result->written - limit;
+
+    close(fd);
+    unlink(path);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct workload_opts opts = {0};
+    struct phase_result results[NUM_MODES][NUM_WORKLOADS];
+    struct edquot_result edquot[NUM_MODES];
+    char dir[BENCH_PATH_MAX];
+    char limit_dir[BENCH_PATH_MAX];
+    __u64 secs = 10;
+    __u64 limit = 256ULL << 20;
+    long block_size = 4096;
+    unsigned int m;
+    int opt;
+    int i;
+
+    opts.dir = bench_mnt_path();
+    opts.threads = 1;
+    opts.file_size = 64ULL << 20;
+
+    while ((opt = getopt(argc, argv, "t:s:b:d:L:")) != -1) {
+        switch (opt) {
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 's':
+            opts.file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            block_size = strtol(optarg, NULL, 10);
+            break;
+        case 'd':
+            secs = strtoull(optarg, NULL, 10);
+            break;
+        case 'L':
+            limit = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-s file-size] "
+                    "[-b block-size] [-d secs] [-L limit]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (opts.threads <= 0 || block_size <= 0 || block_size > 1L << 30 ||
+        opts.file_size < (__u64)block_size) {
+        fprintf(stderr, "invalid args\n");
+        return 1;
+    }
+
+    opts.block_size = block_size;
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+#ifndef BTRFS_QUOTA_CTL_ENABLE_SIMPLE_QUOTA
+    printf("simple quotas not supported by these kernel headers, skipped\n\n");
+#endif
+
+    snprintf(dir, sizeof(dir), "%s/qwrite", bench_mnt_path());
+    snprintf(limit_dir, sizeof(limit_dir), "%s/qwrite-limit",
+             bench_mnt_path());
+    workload_print_header(stdout);
+
+    for (m = 0; m < NUM_MODES; m++) {
+        if (modes[m].cmd != 0 && quota_ctl(volume_fd, modes[m].cmd) < 0) {
+            return 1;
+        }
+
+        if (create_subvol(volume_fd, "qwrite") < 0 ||
+            create_subvol(volume_fd, "qwrite-limit") < 0) {
+            return 1;
+        }
+
+        if (modes[m].cmd != 0 &&
+            set_limit(dir, opts.file_size * opts.threads * 4) < 0) {
+            return 1;
+        }
+
+        if (run_workloads(dir, &opts, secs, modes[m].name, results[m]) < 0) {
+            return 1;
+        }
+
+        if (modes[m].cmd != 0 && set_limit(limit_dir, limit) < 0) {
+            return 1;
+        }
+
+        /* Without quotas this only gives the plain write rate. */
+        if (run_edquot(limit_dir, limit, modes[m].cmd ? limit * 2 : limit,
+                       &edquot[m]) < 0) {
+            return 1;
+        }
+
+        destroy_subvol(volume_fd, "qwrite");
+        destroy_subvol(volume_fd, "qwrite-limit");
+
+        if (modes[m].cmd != 0 &&
+            quota_ctl(volume_fd, BTRFS_QUOTA_CTL_DISABLE) < 0) {
+            return 1;
+        }
+    }
+
+    printf("\n%-10s %-10s %12s %10s %10s %10s\n", "mode", "workload",
+           "ops/s", "delta", "p50-delta", "p99-delta");
+
+    for (m = 0; m < NUM_MODES; m++) {
+        for (i = 0; i < NUM_WORKLOADS; i++) {
+            struct phase_result *r = &results[m][i];
+            struct phase_result *base = &results[0][i];
+
+            printf("%-10s %-10s %12.0f %9.1f%% %9.1f%% %9.1f%%\n",
+                   modes[m].name, kinds[i].name, r->ops_per_sec,
+                   base->ops_per_sec > 0 ?
+                   100.0 * (r->ops_per_sec / base->ops_per_sec - 1) : 0.0,
+                   base->p50 ? 100.0 * ((double)r->p50 / base->p50 - 1) : 0.0,
+                   base->p99 ? 100.0 * ((double)r->p99 / base->p99 - 1) : 0.0);
+        }
+    }
+
+    printf("\n%-10s %14s %14s %14s %10s\n", "mode", "limit", "written",
+           "overshoot", "delay(ms)");
+
+    for (m = 0; m < NUM_MODES; m++) {
+        if (modes[m].cmd == 0)
+            continue;
+
+        if (!edquot[m].hit) {
+            printf("%-10s %14llu %14llu %14s %10s\n", modes[m].name, limit,
+                   edquot[m].written, "-", "no EDQUOT");
+            continue;
+        }
+
+        printf("%-10s %14llu %14llu %14llu %10.2f\n", modes[m].name, limit,
+               edquot[m].written, edquot[m].overshoot,
+               edquot[m].delay_ns / 1e6);
+    }
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-scrub.h"
+#include "../lib/btrfs-workload.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-scrub-load btrfs-scrub-load.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-scrub.c ../lib/btrfs-workload.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX
+ */
+
+/*
+ * Measures how much a running scrub hurts foreground I/O. A workload
+ * (-w randread|seqwrite|fsync|fdatasync) first runs alone for -d
+ * seconds, then again while every device is scrubbed with
+ * BTRFS_IOC_SCRUB until the scrub finishes. Both latency distributions
+ * and the scrub throughput are reported.
+ *
+ * The scrub threads can be given an I/O priority (-p idle|be:N|rt:N)
+ * and a per-device bandwidth limit in bytes/s (-l, via sysfs
+ * scrub_speed_max), which is what the comparison is meant to tune.
+ * There needs to be data on the filesystem for the scrub to read:
+ *
+ *  sudo ./btrfs-scrub-load  -w randread  -t 4  -D  -p idle  -l 104857600
+ */
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct workload_opts opts = {0};
+    struct workload workload;
+    struct scrub_job job;
+    struct scrub_speed_limits saved = {0};
+    __u64 baseline_secs = 10;
+    __u64 limit = 0;
+    __u64 scrub_bytes = 0;
+    __u64 start, elapsed;
+    int ioprio = 0;
+    int opt;
+    int i;
+
+    opts.type = WORKLOAD_RANDREAD;
+    opts.dir = bench_mnt_path();
+    opts.threads = 1;
+    opts.file_size = 256ULL << 20;
+    opts.block_size = 4096;
+
+    while ((opt = getopt(argc, argv, "w:t:s:b:d:Dp:l:")) != -1) {
+        switch (opt) {
+        case 'w':
+            if (workload_parse_type(optarg, &opts.type) < 0) {
+                return 1;
+            }
+            break;
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 's':
+            opts.file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            opts.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            baseline_secs = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            opts.direct = 1;
+            break;
+        case 'p':
+            ioprio = scrub_parse_ioprio(optarg);
+
+            if (ioprio < 0) {
+                fprintf(stderr, "invalid ioprio: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            limit = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w workload] [-t threads] "
+                    "[-s file-size] [-b block-size] [-d baseline-secs] "
+                    "[-D] [-p ioprio] [-l bytes-per-sec]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (workload_prepare(&workload, &opts) < 0) {
+        return 1;
+    }
+
+    printf("workload: %s, %d threads, %u byte blocks%s\n\n",
+           workload_type_name(opts.type), opts.threads, opts.block_size,
+           opts.direct ? ", O_DIRECT" : "");
+    workload_print_header(stdout);
+
+    if (workload_start(&workload) < 0) {
+        return 1;
+    }
+
+    sleep(baseline_secs);
+    workload_stop(&workload);
+    workload_print(stdout, "baseline", &workload);
+    fflush(stdout);
+
+    /* Whatever limit was configured before is put back on every exit. */
+    if (limit > 0) {
+        if (scrub_save_speed_limits(volume_fd, &saved) < 0) {
+            return 1;
+        }
+
+        if (scrub_set_speed_limit(volume_fd, limit) < 0) {
+            scrub_restore_speed_limits(volume_fd, &saved);
+            return 1;
+        }
+    }
+
+    if (workload_start(&workload) < 0) {
+        scrub_restore_speed_limits(volume_fd, &saved);
+        return 1;
+    }
+
+    start = bench_now_ns();
+
+    if (scrub_job_start(&job, volume_fd, BTRFS_SCRUB_READONLY, ioprio) < 0) {
+        workload_stop(&workload);
+        scrub_restore_speed_limits(volume_fd, &saved);
+        return 1;
+    }
+
+    scrub_job_wait(&job);
+    elapsed = bench_now_ns() - start;
+    workload_stop(&workload);
+    scrub_restore_speed_limits(volume_fd, &saved);
+    scrub_free_speed_limits(&saved);
+    workload_print(stdout, "during-scrub", &workload);
+
+    for (i = 0; i < job.num_devs; i++) {
+        scrub_bytes += scrub_progress_bytes(&job.devs[i].args.progress);
+    }
+
+    printf("\nscrub: %llu bytes on %d devices in %.2f s, %.1f MiB/s\n",
+           scrub_bytes, job.num_devs, elapsed / 1e9,
+           scrub_bytes / 1048576.0 / (elapsed / 1e9));
+
+    scrub_job_free(&job);
+    workload_destroy(&workload, 1);
+
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-scrub.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-scrub-parallel btrfs-scrub-parallel.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-scrub.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a multi-device btrfs filesystem on loop devices:
+ *
+ * qemu-img create -f raw test-disk-1.img 4G
+ * qemu-img create -f raw test-disk-2.img 4G
+ * sudo losetup -f test-disk-1.img
+ * sudo losetup -f test-disk-2.img
+ * sudo mkfs -t btrfs -d raid1 -m raid1 /dev/loopX /dev/loopY
+ * sudo mount /dev/loopX /mnt
+ *
+ * After finishing with the loop devices, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX /dev/loopY
+ */
+
+/*
+ * Scrubs every device of /mnt in parallel, one BTRFS_IOC_SCRUB thread
+ * per devid found via BTRFS_IOC_FS_INFO. A sampler thread polls
+ * BTRFS_IOC_SCRUB_PROGRESS every interval (-i ms, default 1000) and
+ * prints one CSV row per device and sample. The scrub is read-only
+ * unless -w is passed:
+ *
+ *  sudo ./btrfs-scrub-parallel  -i 500  > scrub.csv
+ */
+
+struct scrub_run {
+    struct scrub_job job;
+    __u64 last_ns;
+};
+
+static void sample(__u64 elapsed_ns, void *data)
+{
+    struct scrub_run *run = data;
+    double interval = (elapsed_ns - run->last_ns) / 1e9;
+    int i;
+
+    for (i = 0; i < run->job.num_devs; i++) {
+        struct scrub_dev *dev = &run->job.devs[i];
+        struct btrfs_scrub_progress p;
+        const char *state = "running";
+        __u64 bytes;
+        int ret;
+
+        ret = scrub_dev_progress(&run->job, dev, &p);
+
+        if (ret < 0)
+            continue;
+
+        if (ret > 0)
+            state = dev->error ? "failed" : "finished";
+
+        bytes = scrub_progress_bytes(&p);
+
+        printf("%.3f,%llu,%s,%.0f,%llu,%llu,%llu,%llu,%llu\n",
+               elapsed_ns / 1e9, dev->args.devid, state,
+               interval > 0 ? (bytes - dev->last_bytes) / interval : 0.0,
+               p.data_bytes_scrubbed, p.tree_bytes_scrubbed,
+               scrub_progress_errors(&p), p.corrected_errors,
+               p.last_physical);
+
+        dev->last_bytes = bytes;
+    }
+
+    fflush(stdout);
+    run->last_ns = elapsed_ns;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct scrub_run run = {0};
+    struct bench_ticker ticker;
+    __u64 interval_ms = 1000;
+    __u64 flags = BTRFS_SCRUB_READONLY;
+    __u64 start, wall, fastest = (__u64)-1, slowest = 0;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "i:w")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            flags = 0;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i interval-ms] [-w]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (interval_ms == 0) {
+        fprintf(stderr, "invalid interval\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    printf("time,devid,state,bytes_per_sec,data_bytes,tree_bytes,"
+           "errors,corrected,last_physical\n");
+
+    start = bench_now_ns();
+
+    if (scrub_job_start(&run.job, volume_fd, flags, 0) < 0) {
+        return 1;
+    }
+
+    if (bench_ticker_start(&ticker, interval_ms * 1000000ULL, sample,
+                           &run) < 0) {
+        return 1;
+    }
+
+    scrub_job_wait(&run.job);
+    bench_ticker_stop(&ticker);
+    wall = bench_now_ns() - start;
+
+    fprintf(stderr, "\n%6s %-24s %10s %14s %12s %8s\n", "devid", "path",
+            "time(s)", "bytes", "MiB/s", "errors");
+
+    for (i = 0; i < run.job.num_devs; i++) {
+        struct scrub_dev *dev = &run.job.devs[i];
+        struct btrfs_scrub_progress *p = &dev->args.progress;
+        __u64 elapsed = dev->end_ns - dev->start_ns;
+        __u64 bytes = scrub_progress_bytes(p);
+
+        fprintf(stderr, "%6llu %-24s %10.2f %14llu %12.1f %8llu\n",
+                dev->args.devid, dev->path, elapsed / 1e9,
+                bytes, elapsed ? bytes / 1048576.0 / (elapsed / 1e9) : 0.0,
+                scrub_progress_errors(p));
+
+        if (elapsed < fastest)
+            fastest = elapsed;
+
+        if (elapsed > slowest)
+            slowest = elapsed;
+    }
+
+    fprintf(stderr, "\nwall time: %.2f s, slowest/fastest device: %.2f\n",
+            wall / 1e9, fastest ? (double)slowest / fastest : 0.0);
+
+    scrub_job_free(&run.job);
+
+    return 0;
+}
@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-chunk-map.h"
+#include "../lib/btrfs-scrub.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-scrub-repair btrfs-scrub-repair.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-chunk-map.c ../lib/btrfs-scrub.c \
+ *     ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program to setup
+ * a RAID1 btrfs filesystem on two loop devices:
+ *
+ * qemu-img create -f raw test-disk-1.img 2G
+ * qemu-img create -f raw test-disk-2.img 2G
+ * sudo losetup -f test-disk-1.img
+ * sudo losetup -f test-disk-2.img
+ * sudo mkfs -t btrfs -d raid1 -m raid1 /dev/loopX /dev/loopY
+ * sudo mount /dev/loopX /mnt
+ *
+ * A single loop device formatted with "mkfs -t btrfs -d dup -m dup"
+ * works as well. After finishing with the loop devices, run following
+ * commands for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loopX /dev/loopY
+ */
+
+/*
+ * Scrub repair-rate benchmark. The program writes -s bytes of data into
+ * its own files, maps them to logical extents with FS_IOC_FIEMAP, maps
+ * every sector of copy -m (default 0) to its device offset through the
+ * chunk tree and flips the bytes of a -p fraction of those sectors
+ * directly in the loop device's backing image. A repairing
+ * BTRFS_IOC_SCRUB then has to rewrite each of them from the intact
+ * copy:
+ *
+ *  sudo ./btrfs-scrub-repair  -s 1073741824  -p 0.01
+ *
+ * Only extents of the benchmark's files that are not shared and sit in
+ * a mirrored (RAID1*, RAID10 or DUP) data chunk are touched. The
+ * program refuses to run unless every data chunk is mirrored, since a
+ * corrupted single copy cannot be repaired.
+ */
+
+#define FIEMAP_BATCH 256
+
+struct backing_dev {
+    __u64 devid;
+    int fd;
+};
+
+struct corrupt_ctx {
+    struct chunk_map *map;
+    struct backing_dev *devs;
+    int num_devs;
+    __u32 sectorsize;
+    int mirror;
+    double density;
+    unsigned int seed;
+    char *sector;
+    struct fiemap *fiemap;
+    __u64 data_sectors;
+    __u64 corrupted;
+    __u64 single_copy;
+    __u64 skipped_extents;
+};
+
+/*
+ * Loop devices expose their backing file in sysfs, which lets us
+ * corrupt the image underneath the mounted filesystem.
+ */
+static int open_backing_file(const char *dev_path)
+{
+    const char *name = strrchr(dev_path, '/');
+    char sysfs[BENCH_PATH_MAX];
+    char backing[BENCH_PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    name = name ? name + 1 : dev_path;
+    snprintf(sysfs, sizeof(sysfs), "/sys/block/%s/loop/backing_file", name);
+    fd = open(sysfs, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0) {
+        fprintf(stderr, "%s is not a loop device\n", dev_path);
+        return -1;
+    }
+
+    len = read(fd, backing, sizeof(backing) - 1);
+    close(fd);
+
+    if (len <= 0) {
+        perror("read backing_file");
+        return -1;
+    }
+
+    backing[len] = '\0';
+
+    if (backing[len - 1] == '\n')
+        backing[len - 1] = '\0';
+
+    fd = open(backing, O_RDWR|O_CLOEXEC);
+
+    if (fd < 0)
+        perror(backing);
+
+    return fd;
+}
+
+static int backing_fd(struct corrupt_ctx *ctx, __u64 devid)
+{
+    int i;
+
+    for (i = 0; i < ctx->num_devs; i++) {
+        if (ctx->devs[i].devid == devid)
+            return ctx->devs[i].fd;
+    }
+
+    return -1;
+}
+
+static int corrupt_sector(struct corrupt_ctx *ctx, __u64 logical)
+{
+    __u64 devid, physical, len;
+    __u32 i;
+    int fd;
+
+    if (chunk_map_to_physical(ctx->map, logical, ctx->mirror, &devid,
+                              &physical, &len) < 0) {
+        perror("chunk_map_to_physical");
+        return -1;
+    }
+
+    fd = backing_fd(ctx, devid);
+
+    if (fd < 0) {
+        fprintf(stderr, "no backing file for devid %llu\n", devid);
+        return -1;
+    }
+
+    if (pread(fd, ctx->sector, ctx->sectorsize, physical) != ctx->sectorsize) {
+        perror("pread");
+        return -1;
+    }
+
+    for (i = 0; i < ctx->sectorsize; i++)
+        ctx->sector[i] = ~ctx->sector[i];
+
+    if (pwrite(fd, ctx->sector, ctx->sectorsize, physical) !=
+        ctx->sectorsize) {
+        perror("pwrite");
+        return -1;
+    }
+
+    ctx->corrupted++;
+
+    return 0;
+}
+
+static int mirrored(const struct chunk_map_entry *chunk)
+{
+    return (chunk->type & (BTRFS_BLOCK_GROUP_RAID1_MASK |
+                           BTRFS_BLOCK_GROUP_RAID10 |
+                           BTRFS_BLOCK_GROUP_DUP)) != 0;
+}
+
+/* Refuse filesystems where a corrupted data sector has no good copy. */
+static int check_profile(int volume_fd)
+{
+    struct chunk_map map;
+    __u64 data_chunks = 0;
+    __u64 i;
+
+    if (chunk_map_load(&map, volume_fd) < 0)
+        return -1;
+
+    for (i = 0; i < map.num_chunks; i++) {
+        const struct chunk_map_entry *chunk = &map.chunks[i];
+
+        if (!(chunk->type & BTRFS_BLOCK_GROUP_DATA))
+            continue;
+
+        data_chunks++;
+
+        if (!mirrored(chunk) || chunk_map_num_copies(chunk) < 2) {
+            fprintf(stderr, "data chunk at %llu is not mirrored; the "
+                    "benchmark needs a RAID1, RAID10 or DUP data "
+                    "profile\n", chunk->logical);
+            chunk_map_free(&map);
+            return -1;
+        }
+    }
+
+    chunk_map_free(&map);
+
+    if (data_chunks == 0) {
+        fprintf(stderr, "no data chunks found\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int corrupt_range(struct corrupt_ctx *ctx, __u64 logical, __u64 len)
+{
+    const struct chunk_map_entry *chunk;
+    __u64 end = logical + len;
+
+    chunk = chunk_map_find(ctx->map, logical);
+
+    if (chunk == NULL || !(chunk->type & BTRFS_BLOCK_GROUP_DATA))
+        return 0;
+
+    /* Never destroy the only copy, even if the profile changed since. */
+    if (!mirrored(chunk) || chunk_map_num_copies(chunk) < 2) {
+        ctx->single_copy++;
+        return 0;
+    }
+
+    for (; logical < end; logical += ctx->sectorsize) {
+        ctx->data_sectors++;
+
+        if ((double)rand_r(&ctx->seed) / RAND_MAX >= ctx->density)
+            continue;
+
+        if (corrupt_sector(ctx, logical) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * On btrfs fe_physical is the logical address of the file's data.
+ * Shared extents may belong to other files, and encoded, inline or
+ * unaligned extents have no sector-for-sector image on disk, so they
+ * are left alone.
+ */
+static int corrupt_file(struct corrupt_ctx *ctx, const char *path)
+{
+    struct fiemap *fm = ctx->fiemap;
+    __u64 start = 0;
+    int last = 0;
+    int ret = 0;
+    int fd;
+
+    fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    while (!last && ret == 0) {
+        __u32 i;
+
+        memset(fm, 0, sizeof(*fm));
+        fm->fm_start = start;
+        fm->fm_length = FIEMAP_MAX_OFFSET - start;
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_BATCH;
+
+        if (BENCH_IOCTL(fd, FS_IOC_FIEMAP, fm) < 0) {
+            perror("ioctl FS_IOC_FIEMAP");
+            ret = -1;
+            break;
+        }
+
+        if (fm->fm_mapped_extents == 0)
+            break;
+
+        for (i = 0; i < fm->fm_mapped_extents && ret == 0; i++) {
+            struct fiemap_extent *fe = &fm->fm_extents[i];
+
+            if (fe->fe_flags & FIEMAP_EXTENT_LAST)
+                last = 1;
+
+            start = fe->fe_logical + fe->fe_length;
+
+            if (fe->fe_flags & (FIEMAP_EXTENT_SHARED |
+                                FIEMAP_EXTENT_UNKNOWN |
+                                FIEMAP_EXTENT_DELALLOC |
+                                FIEMAP_EXTENT_ENCODED |
+                                FIEMAP_EXTENT_DATA_INLINE |
+                                FIEMAP_EXTENT_NOT_ALIGNED |
+                                FIEMAP_EXTENT_UNWRITTEN)) {
+                ctx->skipped_extents++;
+                continue;
+            }
+
+            ret = corrupt_range(ctx, fe->fe_physical, fe->fe_length);
+        }
+    }
+
+    close(fd);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct btrfs_ioctl_fs_info_args fs_info = {0};
+    struct btrfs_ioctl_dev_info_args *dev_info;
+    struct corrupt_ctx ctx = {0};
+    struct chunk_map map;
+    struct scrub_job job;
+    struct btrfs_scrub_progress total = {0};
+    char data_dir[BENCH_PATH_MAX];
+    __u64 bytes = 256ULL << 20;
+    __u64 start, elapsed;
+    int files = 16;
+    int keep = 0;
+    int opt;
+    int i;
+
+    ctx.density = 0.001;
+    ctx.seed = 1;
+
+    while ((opt = getopt(argc, argv, "s:p:m:r:k")) != -1) {
+        switch (opt) {
+        case 's':
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'p':
+            ctx.density = atof(optarg);
+            break;
+        case 'm':
+            ctx.mirror = atoi(optarg);
+            break;
+        case 'r':
+            ctx.seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s bytes] [-p density] [-m mirror] "
+                    "[-r seed] [-k]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_FS_INFO, &fs_info) < 0) {
+        perror("ioctl BTRFS_IOC_FS_INFO");
+        return 1;
+    }
+
+    if (check_profile(volume_fd) < 0) {
+        return 1;
+    }
+
+    ctx.sectorsize = fs_info.sectorsize;
+    ctx.sector = malloc(ctx.sectorsize);
+    ctx.fiemap = calloc(1, sizeof(*ctx.fiemap) +
+                        FIEMAP_BATCH * sizeof(struct fiemap_extent));
+    ctx.num_devs = bench_list_devices(volume_fd, &dev_info);
+
+    if (ctx.sector == NULL || ctx.fiemap == NULL || ctx.num_devs <= 0) {
+        return 1;
+    }
+
+    ctx.devs = calloc(ctx.num_devs, sizeof(*ctx.devs));
+
+    for (i = 0; i < ctx.num_devs; i++) {
+        ctx.devs[i].devid = dev_info[i].devid;
+        ctx.devs[i].fd = open_backing_file((char *)dev_info[i].path);
+
+        if (ctx.devs[i].fd < 0) {
+            return 1;
+        }
+    }
+
+    snprintf(data_dir, sizeof(data_dir), "%s/scrub-repair",
+             bench_mnt_path());
+
+    if (mkdir(data_dir, 0755) < 0 && errno != EEXIST) {
+        perror("mkdir");
+        return 1;
+    }
+
+    if (bench_populate(data_dir, "data", files, bytes) < 0) {
+        return 1;
+    }
+
+    syncfs(volume_fd);
+
+    if (chunk_map_load(&map, volume_fd) < 0) {
+        return 1;
+    }
+
+    ctx.map = &map;
+
+    for (i = 0; i < files; i++) {
+        char path[BENCH_PATH_MAX];
+
+        if (snprintf(path, sizeof(path), "%s/data-%d", data_dir,
+                     i) >= (int)sizeof(path)) {
+            fprintf(stderr, "data file path too long\n");
+            return 1;
+        }
+
+        if (corrupt_file(&ctx, path) < 0) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < ctx.num_devs; i++) {
+        fsync(ctx.devs[i].fd);
+    }
+
+    printf("Corrupted %llu of %llu data sectors (%u bytes) on mirror %d\n",
+           ctx.corrupted, ctx.data_sectors, ctx.sectorsize, ctx.mirror);
+
+    if (ctx.single_copy > 0 || ctx.skipped_extents > 0) {
+        printf("Skipped %llu single-copy and %llu shared, inline or "
+               "encoded extents\n", ctx.single_copy, ctx.skipped_extents);
+    }
+
+    bench_drop_caches();
+
+    start = bench_now_ns();
+
+    if (scrub_job_start(&job, volume_fd, 0, 0) < 0) {
+        return 1;
+    }
+
+    scrub_job_wait(&job);
+    elapsed = bench_now_ns() - start;
+
+    for (i = 0; i < job.num_devs; i++) {
+        struct btrfs_scrub_progress *p = &job.devs[i].args.progress;
+
+        total.data_bytes_scrubbed += p->data_bytes_scrubbed;
+        total.tree_bytes_scrubbed += p->tree_bytes_scrubbed;
+        total.csum_errors += p->csum_errors;
+        total.read_errors += p->read_errors;
+        total.corrected_errors += p->corrected_errors;
+        total.uncorrectable_errors += p->uncorrectable_errors;
+    }
+
+    printf("\nioctl BTRFS_IOC_SCRUB (repair):\n");
+    printf("scrubbed bytes:       %llu\n", scrub_progress_bytes(&total));
+    printf("csum errors:          %llu\n", total.csum_errors);
+    printf("read errors:          %llu\n", total.read_errors);
+    printf("corrected errors:     %llu\n", total.corrected_errors);
+    printf("uncorrectable errors: %llu\n", total.uncorrectable_errors);
+    printf("scrub time:           %.2f s\n", elapsed / 1e9);
+    printf("scrub throughput:     %.1f MiB/s\n",
+           scrub_progress_bytes(&total) / 1048576.0 / (elapsed / 1e9));
+    printf("repair rate:          %.1f sectors/s\n",
+           total.corrected_errors / (elapsed / 1e9));
+
+    if (!keep) {
+        char path[BENCH_PATH_MAX];
+
+        for (i = 0; i < files; i++) {
+            if (snprintf(path, sizeof(path), "%s/data-%d", data_dir,
+                         i) >= (int)sizeof(path))
+                break;
+
+            unlink(path);
+        }
+
+        rmdir(data_dir);
+    }
+
+    scrub_job_free(&job);
+    chunk_map_free(&map);
+    free(ctx.fiemap);
+    free(dev_info);
+
+    return 0;
+}
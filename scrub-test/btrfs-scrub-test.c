@@ -6,6 +6,14 @@
 #include <linux/btrfs.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-scrub-test btrfs-scrub-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -27,18 +35,16 @@ int main(int argc, char **argv)
     int volume_fd;
     struct btrfs_ioctl_scrub_args scrub_args = {0};
 
-    volume_fd = openat(AT_FDCWD, "/mnt", O_RDONLY|O_NONBLOCK
-                       |O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
 
     if (volume_fd < 0) {
-        perror("open");
         return 1;
     }
 
     scrub_args.devid = 1;
     scrub_args.flags = BTRFS_SCRUB_READONLY;
 
-    if (ioctl(volume_fd, BTRFS_IOC_SCRUB, &scrub_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SCRUB, &scrub_args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -46,12 +52,12 @@ int main(int argc, char **argv)
     printf("ioctl BTRFS_IOC_SCRUB:\n");
     printf("Scrubbing of filesystem /mnt started.\n\n");
 
-    if (ioctl(volume_fd, BTRFS_IOC_SCRUB_PROGRESS, &scrub_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SCRUB_PROGRESS, &scrub_args) < 0) {
         perror("ioctl BTRFS_IOC_SCRUB_PROGRESS");
         printf("\n");
     }
 
-    if (ioctl(volume_fd, BTRFS_IOC_SCRUB_CANCEL, &scrub_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SCRUB_CANCEL, &scrub_args) < 0) {
         perror("ioctl BTRFS_IOC_SCRUB_CANCEL");
         printf("\n");
     }
@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-find-new.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-snap-find-new btrfs-snap-find-new.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-tree-search.c \
+ *     ../lib/btrfs-find-new.c ../lib/btrfs-path-cache.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Changed-file detection between a snapshot and its live source (see
+ * lib/btrfs-find-new). A source subvolume is populated with -n files
+ * of -b bytes, -d per directory, and snapshotted read-only; then -c
+ * percent of the files are rewritten. The changed files are found
+ * twice:
+ *
+ *  - find-new: TREE_SEARCH_V2 on the source from the snapshot's
+ *    generation + 1, with paths built from the INODE_REF items it
+ *    returns and a BTRFS_IOC_INO_PATHS per directory it doesn't;
+ *  - readdir diff: the rsync quick check, i.e. a readdir+fstatat walk
+ *    of both trees comparing size and mtime of every file.
+ *
+ * sudo ./btrfs-snap-find-new  -n 1000000  -c 0.1  -C
+ *
+ * -C drops the page cache before each method, -l prints the paths
+ * find-new reports and -k keeps the subvolumes afterwards.
+ */
+
+#define SOURCE_NAME "find-new-src"
+#define BASE_NAME   "find-new-base"
+
+struct diff_entry {
+    char *name;
+    struct stat st;
+};
+
+struct diff_totals {
+    __u64 dirs;
+    __u64 entries;
+    __u64 changed;
+};
+
+struct found_totals {
+    __u64 files;
+    __u64 other;
+    __u64 bytes;
+    int list;
+};
+
+static int destroy_subvol(int volume_fd, const char *name)
+{
+    struct btrfs_ioctl_vol_args_v2 args_v2 = {0};
+
+    strncpy(args_v2.name, name, BTRFS_SUBVOL_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
+        perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int populate(const char *source_path, int files, int per_dir,
+                    __u64 bytes)
+{
+    char dir[BENCH_PATH_MAX];
+    int done = 0;
+    int d = 0;
+
+    while (done < files) {
+        int n = files - done < per_dir ? files - done : per_dir;
+
+        if (snprintf(dir, sizeof(dir), "%s/d%d", source_path,
+                     d++) >= (int)sizeof(dir)) {
+            fprintf(stderr, "directory path too long\n");
+            return -1;
+        }
+
+        if (mkdir(dir, 0755) < 0) {
+            perror("mkdir");
+            return -1;
+        }
+
+        if (bench_populate(dir, "f", n, bytes * n) < 0)
+            return -1;
+
+        done += n;
+    }
+
+    return 0;
+}
+
+/* Rewrite the first block of @count distinct random files. */
+static int modify(const char *source_path, int files, int per_dir, int count)
+{
+    unsigned char *picked = calloc(files, 1);
+    char path[BENCH_PATH_MAX];
+    char buf[4096];
+    unsigned int seed = (unsigned int)bench_now_ns() | 1;
+    int done = 0;
+
+    if (picked == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    memset(buf, 0xa5, sizeof(buf));
+
+    while (done < count) {
+        int i = rand_r(&seed) % files;
+        int fd;
+
+        if (picked[i])
+            continue;
+
+        picked[i] = 1;
+
+        if (snprintf(path, sizeof(path), "%s/d%d/f-%d", source_path,
+                     i / per_dir, i % per_dir) >= (int)sizeof(path)) {
+            fprintf(stderr, "file path too long\n");
+            free(picked);
+            return -1;
+        }
+
+        fd = open(path, O_WRONLY|O_CLOEXEC);
+
+        if (fd < 0 || pwrite(fd, buf, sizeof(buf), 0) < 0) {
+            perror(path);
+            free(picked);
+            return -1;
+        }
+
+        close(fd);
+        done++;
+    }
+
+    free(picked);
+
+    return 0;
+}
+
+static int compare_entry(const void *a, const void *b)
+{
+    const struct diff_entry *x = a;
+    const struct diff_entry *y = b;
+
+    return strcmp(x->name, y->name);
+}
+
+static int read_entries(int dir_fd, struct diff_entry **entries, int *count)
+{
+    struct dirent *ent;
+    int capacity = 0;
+    DIR *dir;
+
+    *entries = NULL;
+    *count = 0;
+    dir = fdopendir(dup(dir_fd));
+
+    if (dir == NULL) {
+        perror("fdopendir");
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL) {
+        struct diff_entry *e;
+
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+            continue;
+
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            e = realloc(*entries, capacity * sizeof(*e));
+
+            if (e == NULL) {
+                perror("realloc");
+                closedir(dir);
+                return -1;
+            }
+
+            *entries = e;
+        }
+
+        e = &(*entries)[*count];
+
+        if (fstatat(dir_fd, ent->d_name, &e->st, AT_SYMLINK_NOFOLLOW) < 0) {
+            perror("fstatat");
+            continue;
+        }
+
+        e->name = strdup(ent->d_name);
+
+        if (e->name == NULL) {
+            perror("strdup");
+            closedir(dir);
+            return -1;
+        }
+
+        (*count)++;
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+static void free_entries(struct diff_entry *entries, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        free(entries[i].name);
+
+    free(entries);
+}
+
+/* @base_fd is -1 when the directory is new in the source. */
+static int diff_dir(int source_fd, int base_fd, struct diff_totals *totals)
+{
+    struct diff_entry *source = NULL, *base = NULL;
+    int num_source = 0, num_base = 0;
+    int ret = 0;
+    int i;
+
+    totals->dirs++;
+
+    if (read_entries(source_fd, &source, &num_source) < 0 ||
+        (base_fd >= 0 && read_entries(base_fd, &base, &num_base) < 0)) {
+        free_entries(source, num_source);
+        return -1;
+    }
+
+    totals->entries += num_source + num_base;
+    qsort(base, num_base, sizeof(*base), compare_entry);
+
+    for (i = 0; i < num_source && ret == 0; i++) {
+        struct diff_entry *s = &source[i];
+        struct diff_entry *b = NULL;
+
+        if (num_base > 0)
+            b = bsearch(s, base, num_base, sizeof(*base), compare_entry);
+
+        if (S_ISDIR(s->st.st_mode)) {
+            int sub_source, sub_base = -1;
+
+            sub_source = openat(source_fd, s->name, O_RDONLY|O_NONBLOCK
+                                |O_CLOEXEC|O_DIRECTORY);
+
+            if (b != NULL && S_ISDIR(b->st.st_mode))
+                sub_base = openat(base_fd, b->name, O_RDONLY|O_NONBLOCK
+                                  |O_CLOEXEC|O_DIRECTORY);
+
+            if (sub_source < 0) {
+                perror("openat");
+                ret = -1;
+            }
+            else {
+                ret = diff_dir(sub_source, sub_base, totals);
+                close(sub_source);
+            }
+
+            if (sub_base >= 0)
+                close(sub_base);
+
+            continue;
+        }
+
+        if (!S_ISREG(s->st.st_mode))
+            continue;
+
+        if (b == NULL || b->st.st_size != s->st.st_size ||
+            b->st.st_mtim.tv_sec != s->st.st_mtim.tv_sec ||
+            b->st.st_mtim.tv_nsec != s->st.st_mtim.tv_nsec)
+            totals->changed++;
+    }
+
+    free_entries(source, num_source);
+    free_entries(base, num_base);
+
+    return ret;
+}
+
+static int count_found(const struct find_new_entry *entry, void *data)
+{
+    struct found_totals *totals = data;
+
+    if (!S_ISREG(entry->mode)) {
+        totals->other++;
+        return 0;
+    }
+
+    totals->files++;
+    totals->bytes += entry->extent_bytes;
+
+    if (totals->list)
+        printf("%s transid %llu extents %llu bytes %llu\n",
+               entry->path ? entry->path : "?", entry->transid,
+               entry->extents, entry->extent_bytes);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    struct btrfs_ioctl_vol_args_v2 args_v2 = {0};
+    struct find_new fn;
+    struct found_totals found = {0};
+    struct diff_totals diff = {0};
+    char source_path[BENCH_PATH_MAX];
+    char base_path[BENCH_PATH_MAX];
+    __u64 base_gen;
+    __u64 bytes = 4096;
+    __u64 find_ns, diff_ns, start;
+    double percent = 0.1;
+    int files = 100000;
+    int per_dir = 1000;
+    int cold = 0;
+    int keep = 0;
+    int changed;
+    int volume_fd, source_fd, base_fd;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:d:b:c:Clk")) != -1) {
+        switch (opt) {
+        case 'n':
+            files = atoi(optarg);
+            break;
+        case 'd':
+            per_dir = atoi(optarg);
+            break;
+        case 'b':
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            percent = atof(optarg);
+            break;
+        case 'C':
+            cold = 1;
+            break;
+        case 'l':
+            found.list = 1;
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n files] [-d files-per-dir] "
+                    "[-b bytes] [-c percent] [-C] [-l] [-k]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (files <= 0 || per_dir <= 0 || percent < 0 || percent > 100) {
+        fprintf(stderr, "invalid args\n");
+        return 1;
+    }
+
+    changed = files * percent / 100;
+
+    if (changed == 0 && percent > 0)
+        changed = 1;
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    strncpy(args.name, SOURCE_NAME, BTRFS_PATH_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+        return 1;
+    }
+
+    if (snprintf(source_path, sizeof(source_path), "%s/%s",
+                 bench_mnt_path(), SOURCE_NAME) >= (int)sizeof(source_path)) {
+        fprintf(stderr, "source path too long\n");
+        return 1;
+    }
+
+    source_fd = bench_open_path(source_path);
+
+    if (source_fd < 0) {
+        return 1;
+    }
+
+    printf("populating %d files of %llu bytes, %d per directory\n", files,
+           bytes, per_dir);
+
+    if (populate(source_path, files, per_dir, bytes) < 0) {
+        return 1;
+    }
+
+    syncfs(volume_fd);
+
+    args_v2.fd = source_fd;
+    args_v2.flags = BTRFS_SUBVOL_RDONLY;
+    strncpy(args_v2.name, BASE_NAME, BTRFS_SUBVOL_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
+        perror("ioctl BTRFS_IOC_SNAP_CREATE_V2");
+        return 1;
+    }
+
+    if (snprintf(base_path, sizeof(base_path), "%s/%s",
+                 bench_mnt_path(), BASE_NAME) >= (int)sizeof(base_path)) {
+        fprintf(stderr, "snapshot path too long\n");
+        return 1;
+    }
+
+    base_fd = bench_open_path(base_path);
+
+    if (base_fd < 0 || find_new_generation(base_fd, &base_gen) < 0) {
+        return 1;
+    }
+
+    if (modify(source_path, files, per_dir, changed) < 0) {
+        return 1;
+    }
+
+    syncfs(volume_fd);
+
+    if (find_new_init(&fn, source_fd) < 0) {
+        return 1;
+    }
+
+    if (cold)
+        bench_drop_caches();
+
+    /* Everything the snapshot holds was committed by base_gen. */
+    start = bench_now_ns();
+
+    if (find_new_run(&fn, base_gen + 1, count_found, &found) < 0) {
+        return 1;
+    }
+
+    find_ns = bench_now_ns() - start;
+
+    if (cold)
+        bench_drop_caches();
+
+    start = bench_now_ns();
+
+    if (diff_dir(source_fd, base_fd, &diff) < 0) {
+        return 1;
+    }
+
+    diff_ns = bench_now_ns() - start;
+
+    printf("\nbase generation %llu, source generation %llu, "
+           "%d files rewritten\n\n", base_gen, fn.generation, changed);
+    printf("%-14s %12s %12s %14s %12s\n", "method", "time-ms", "changed",
+           "work", "ioctls");
+    printf("%-14s %12.1f %12llu %8llu items %12llu\n", "find-new",
+           find_ns / 1e6, found.files, fn.stats.items,
+           fn.stats.search_ioctls + fn.stats.ino_paths_calls);
+    printf("%-14s %12.1f %12llu %6llu entries %12s\n", "readdir-diff",
+           diff_ns / 1e6, diff.changed, diff.entries, "-");
+    printf("\nfind-new: %llu changed directories or other inodes, "
+           "%llu unresolved, %.1fx faster\n",
+           found.other, fn.stats.unresolved,
+           find_ns ? (double)diff_ns / find_ns : 0);
+    printf("find-new: %llu paths from INODE_REF items, %llu INO_PATHS "
+           "calls\n", fn.stats.ref_paths, fn.stats.ino_paths_calls);
+
+    find_new_destroy(&fn);
+    close(base_fd);
+    close(source_fd);
+
+    if (!keep &&
+        (destroy_subvol(volume_fd, BASE_NAME) < 0 ||
+         destroy_subvol(volume_fd, SOURCE_NAME) < 0)) {
+        return 1;
+    }
+
+    close(volume_fd);
+
+    return 0;
+}
@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-snap-storm btrfs-snap-storm.c ../lib/btrfs-bench.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 1G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Snapshot storm: N threads create snapshots of one or more source
+ * subvolumes with BTRFS_IOC_SNAP_CREATE_V2 and then destroy them again
+ * with BTRFS_IOC_SNAP_DESTROY_V2. Every combination of thread count and
+ * total snapshot count is run as a separate round, and each round
+ * reports create/destroy throughput and latency percentiles.
+ *
+ * The source subvolumes need to exist (see btrfs-subvol-test). Thread
+ * and snapshot counts are comma separated lists:
+ *
+ *  ./btrfs-snap-storm  -t 1,2,4,8  -n 100,1000  test-volume  test-volume-2
+ */
+
+#define MAX_ROUNDS 16
+
+struct storm_round {
+    int id;
+    int threads;
+    int snapshots;
+    int num_sources;
+    int *source_fds;
+    /* Only snapshots that were created are destroyed again. */
+    unsigned char *created;
+};
+
+struct storm_worker {
+    pthread_t thread;
+    int id;
+    int volume_fd;
+    int first;
+    int count;
+    struct storm_round *round;
+    pthread_barrier_t *barrier;
+    struct bench_hist *create_hist;
+    struct bench_hist *destroy_hist;
+    int failed;
+    __u64 create_end;
+    __u64 destroy_end;
+};
+
+static void snapshot_name(char *name, int round_id, int index)
+{
+    snprintf(name, BTRFS_SUBVOL_NAME_MAX, "storm-%d-%d", round_id, index);
+}
+
+static void *storm_thread(void *data)
+{
+    struct storm_worker *worker = data;
+    struct storm_round *round = worker->round;
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    int i;
+
+    pthread_barrier_wait(worker->barrier);
+
+    for (i = worker->first; i < worker->first + worker->count; i++) {
+        __u64 start;
+
+        memset(&args_v2, 0, sizeof(args_v2));
+        args_v2.fd = round->source_fds[i % round->num_sources];
+        snapshot_name(args_v2.name, round->id, i);
+
+        start = bench_now_ns();
+
+        if (BENCH_IOCTL(worker->volume_fd, BTRFS_IOC_SNAP_CREATE_V2,
+                        &args_v2) < 0) {
+            perror("ioctl BTRFS_IOC_SNAP_CREATE_V2");
+            worker->failed++;
+            continue;
+        }
+
+        bench_hist_record(worker->create_hist, bench_now_ns() - start);
+        round->created[i] = 1;
+    }
+
+    worker->create_end = bench_now_ns();
+    pthread_barrier_wait(worker->barrier);
+
+    for (i = worker->first; i < worker->first + worker->count; i++) {
+        __u64 start;
+
+        if (!round->created[i])
+            continue;
+
+        memset(&args_v2, 0, sizeof(args_v2));
+        snapshot_name(args_v2.name, round->id, i);
+
+        start = bench_now_ns();
+
+        if (BENCH_IOCTL(worker->volume_fd, BTRFS_IOC_SNAP_DESTROY_V2,
+                        &args_v2) < 0) {
+            perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+            worker->failed++;
+            continue;
+        }
+
+        bench_hist_record(worker->destroy_hist, bench_now_ns() - start);
+    }
+
+    worker->destroy_end = bench_now_ns();
+
+    return NULL;
+}
+
+static int run_round(int volume_fd, struct storm_round *round)
+{
+    struct storm_worker *workers;
+    struct bench_hist *create_hist = bench_hist_alloc();
+    struct bench_hist *destroy_hist = bench_hist_alloc();
+    pthread_barrier_t barrier;
+    __u64 start, create_end = 0, destroy_end = 0;
+    int per_thread = round->snapshots / round->threads;
+    int extra = round->snapshots % round->threads;
+    int first = 0;
+    int failed = 0;
+    int i;
+
+    workers = calloc(round->threads, sizeof(*workers));
+    round->created = calloc(round->snapshots, 1);
+
+    if (workers == NULL || round->created == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    pthread_barrier_init(&barrier, NULL, round->threads + 1);
+
+    for (i = 0; i < round->threads; i++) {
+        workers[i].id = i;
+        workers[i].volume_fd = volume_fd;
+        workers[i].first = first;
+        workers[i].count = per_thread + (i < extra);
+        workers[i].round = round;
+        workers[i].barrier = &barrier;
+        workers[i].create_hist = bench_hist_alloc();
+        workers[i].destroy_hist = bench_hist_alloc();
+        first += workers[i].count;
+
+        if (pthread_create(&workers[i].thread, NULL, storm_thread,
+                           &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    start = bench_now_ns();
+    pthread_barrier_wait(&barrier);
+    pthread_barrier_wait(&barrier);
+
+    for (i = 0; i < round->threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        bench_hist_merge(create_hist, workers[i].create_hist);
+        bench_hist_merge(destroy_hist, workers[i].destroy_hist);
+        failed += workers[i].failed;
+
+        if (workers[i].create_end > create_end)
+            create_end = workers[i].create_end;
+
+        if (workers[i].destroy_end > destroy_end)
+            destroy_end = workers[i].destroy_end;
+
+        free(workers[i].create_hist);
+        free(workers[i].destroy_hist);
+    }
+
+    printf("%7d %9d %10.1f %9.1f %9.1f %9.1f %10.1f %9.1f %9.1f %9.1f %6d\n",
+           round->threads, round->snapshots,
+           create_hist->count * 1e9 / (create_end - start),
+           bench_hist_percentile(create_hist, 50.0) / 1000.0,
+           bench_hist_percentile(create_hist, 99.0) / 1000.0,
+           bench_hist_percentile(create_hist, 99.9) / 1000.0,
+           destroy_hist->count * 1e9 / (destroy_end - create_end),
+           bench_hist_percentile(destroy_hist, 50.0) / 1000.0,
+           bench_hist_percentile(destroy_hist, 99.0) / 1000.0,
+           bench_hist_percentile(destroy_hist, 99.9) / 1000.0,
+           failed);
+    fflush(stdout);
+
+    pthread_barrier_destroy(&barrier);
+    free(round->created);
+    free(workers);
+    free(create_hist);
+    free(destroy_hist);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    int thread_counts[MAX_ROUNDS] = {1};
+    int snapshot_counts[MAX_ROUNDS] = {100};
+    int num_threads = 1;
+    int num_snapshots = 1;
+    int *source_fds;
+    int num_sources;
+    char subvolume_path[BTRFS_PATH_NAME_MAX];
+    struct storm_round round = {0};
+    int opt;
+    int i, j;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = bench_parse_list(optarg, thread_counts,
+                                           MAX_ROUNDS, 1);
+
+            if (num_threads < 0) {
+                return 1;
+            }
+            break;
+        case 'n':
+            num_snapshots = bench_parse_list(optarg, snapshot_counts,
+                                             MAX_ROUNDS, 1);
+
+            if (num_snapshots < 0) {
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads,...] [-n snapshots,...] "
+                    "subvolume...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_threads <= 0 || num_snapshots <= 0) {
+        return 1;
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr, "missing args\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    num_sources = argc - optind;
+    source_fds = calloc(num_sources, sizeof(*source_fds));
+
+    if (source_fds == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (i = 0; i < num_sources; i++) {
+        snprintf(subvolume_path, sizeof(subvolume_path), "%s/%s",
+                 bench_mnt_path(), argv[optind + i]);
+        source_fds[i] = bench_open_path(subvolume_path);
+
+        if (source_fds[i] < 0) {
+            return 1;
+        }
+    }
+
+    round.num_sources = num_sources;
+    round.source_fds = source_fds;
+
+    printf("%7s %9s %10s %9s %9s %9s %10s %9s %9s %9s %6s\n",
+           "threads", "snapshots", "create/s", "p50(us)", "p99(us)",
+           "p999(us)", "destroy/s", "p50(us)", "p99(us)", "p999(us)",
+           "failed");
+
+    for (i = 0; i < num_threads; i++) {
+        for (j = 0; j < num_snapshots; j++) {
+            round.id++;
+            round.threads = thread_counts[i];
+            round.snapshots = snapshot_counts[j];
+
+            if (round.threads > round.snapshots) {
+                round.threads = round.snapshots;
+            }
+
+            if (run_round(volume_fd, &round) < 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
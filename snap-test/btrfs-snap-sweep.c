@@ -0,0 +1,230 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-snap-sweep btrfs-snap-sweep.c ../lib/btrfs-bench.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Snapshot latency sweep: for every combination of file count and
+ * data size a fresh source subvolume is created and populated, then
+ * snapshotted with BTRFS_IOC_SNAP_CREATE_V2 a number of times. In
+ * clean mode the data is synced before each snapshot; in dirty mode
+ * (-d) the files are rewritten and left in the page cache, so the
+ * measured latency includes the flush the snapshot forces.
+ *
+ * Byte sizes accept K/M/G suffixes and all lists are comma separated:
+ *
+ *  ./btrfs-snap-sweep  -f 1,1000,100000  -b 0,100M,1G  -r 5  -d
+ */
+
+#define MAX_POINTS 16
+
+static int destroy_subvol(int volume_fd, const char *name)
+{
+    struct btrfs_ioctl_vol_args_v2 args_v2 = {0};
+
+    strncpy(args_v2.name, name, BTRFS_SUBVOL_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
+        perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int run_point(int volume_fd, int files, __u64 bytes, int repeats,
+                     int dirty)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    struct bench_hist *hist;
+    char source_path[BENCH_PATH_MAX];
+    const char *source = "sweep-source";
+    int source_fd = -1;
+    int snaps = 0;
+    int ret = -1;
+    int i;
+
+    if (snprintf(source_path, sizeof(source_path), "%s/%s",
+                 bench_mnt_path(), source) >= (int)sizeof(source_path)) {
+        fprintf(stderr, "source path too long\n");
+        return -1;
+    }
+
+    hist = bench_hist_alloc();
+
+    strncpy(args.name, source, BTRFS_PATH_NAME_MAX);
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+        free(hist);
+        return -1;
+    }
+
+    source_fd = bench_open_path(source_path);
+
+    if (source_fd < 0) {
+        goto out;
+    }
+
+    if (bench_populate(source_path, "file", files, bytes) < 0) {
+        goto out;
+    }
+
+    for (i = 0; i < repeats; i++) {
+        __u64 start;
+
+        /*
+         * Rewriting the files re-dirties every page, so each dirty
+         * snapshot pays for the full flush and not just the first.
+         */
+        if (dirty && i > 0 &&
+            bench_populate(source_path, "file", files, bytes) < 0) {
+            goto out;
+        }
+
+        if (!dirty) {
+            syncfs(volume_fd);
+        }
+
+        memset(&args_v2, 0, sizeof(args_v2));
+        args_v2.fd = source_fd;
+        snprintf(args_v2.name, sizeof(args_v2.name), "sweep-snap-%d", i);
+
+        start = bench_now_ns();
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
+            perror("ioctl BTRFS_IOC_SNAP_CREATE_V2");
+            goto out;
+        }
+
+        bench_hist_record(hist, bench_now_ns() - start);
+        snaps++;
+    }
+
+    printf("%10d %14llu %6s %10.1f %10.1f %10.1f %10.1f\n",
+           files, bytes, dirty ? "dirty" : "clean",
+           bench_hist_mean(hist) / 1000.0,
+           bench_hist_percentile(hist, 50.0) / 1000.0,
+           bench_hist_percentile(hist, 99.0) / 1000.0,
+           hist->max / 1000.0);
+    fflush(stdout);
+
+    ret = 0;
+
+out:
+    /*
+     * Remove everything this point created even on failure, otherwise
+     * the next run fails to create sweep-source with EEXIST.
+     */
+    for (i = 0; i < snaps; i++) {
+        char name[BTRFS_SUBVOL_NAME_MAX];
+
+        snprintf(name, sizeof(name), "sweep-snap-%d", i);
+
+        if (destroy_subvol(volume_fd, name) < 0) {
+            ret = -1;
+        }
+    }
+
+    if (source_fd >= 0) {
+        close(source_fd);
+    }
+
+    free(hist);
+
+    if (destroy_subvol(volume_fd, source) < 0) {
+        ret = -1;
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    int file_counts[MAX_POINTS] = {1};
+    __u64 byte_counts[MAX_POINTS] = {0};
+    int num_files = 1;
+    int num_bytes = 1;
+    int repeats = 5;
+    int dirty = 0;
+    int opt;
+    int i, j;
+
+    while ((opt = getopt(argc, argv, "f:b:r:d")) != -1) {
+        switch (opt) {
+        case 'f':
+            num_files = bench_parse_list(optarg, file_counts, MAX_POINTS, 0);
+            break;
+        case 'b':
+            num_bytes = bench_parse_size_list(optarg, byte_counts,
+                                              MAX_POINTS);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'd':
+            dirty = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-f files,...] [-b bytes,...] "
+                    "[-r repeats] [-d]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_files <= 0 || num_bytes <= 0 || repeats <= 0) {
+        fprintf(stderr, "invalid args\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    printf("%10s %14s %6s %10s %10s %10s %10s\n",
+           "files", "bytes", "state", "mean(us)", "p50(us)", "p99(us)",
+           "max(us)");
+
+    for (i = 0; i < num_files; i++) {
+        for (j = 0; j < num_bytes; j++) {
+            if (run_point(volume_fd, file_counts[i], byte_counts[j],
+                          repeats, dirty) < 0) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
@@ -6,6 +6,14 @@
 #include <linux/btrfs.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-snap-test btrfs-snap-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -49,7 +57,7 @@ int main(int argc, char **argv)
     int snapshot_fd;
     struct btrfs_ioctl_vol_args args = {0};
 #ifdef BTRFS_IOC_SNAP_CREATE_V2
-    struct btrfs_ioctl_vol_args_v2_new args_v2 = {0};
+    struct btrfs_ioctl_vol_args_v2 args_v2 = {0};
     struct btrfs_qgroup_inherit inherit = {0};
     struct btrfs_qgroup_limit lim = {0};
 #endif
@@ -62,16 +70,14 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    volume_fd = openat(AT_FDCWD, "/mnt", O_RDONLY|O_NONBLOCK
-                       |O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
 
     if (volume_fd < 0) {
-        perror("open");
         return 1;
     }
 
-    strncpy(subvolume_path, "/mnt/", BTRFS_PATH_NAME_MAX);
-    strncat(subvolume_path, argv[1], BTRFS_PATH_NAME_MAX);
+    snprintf(subvolume_path, sizeof(subvolume_path), "%s/%s",
+             bench_mnt_path(), argv[1]);
 
     subvolume_fd = openat(AT_FDCWD, subvolume_path, O_RDONLY|O_NONBLOCK |
                           O_CLOEXEC|O_DIRECTORY);
@@ -79,7 +85,7 @@ int main(int argc, char **argv)
     args.fd = subvolume_fd;
     strncpy(args.name, argv[2], BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(volume_fd, BTRFS_IOC_SNAP_CREATE, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE, &args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -90,14 +96,14 @@ int main(int argc, char **argv)
 
 #ifdef BTRFS_IOC_SNAP_CREATE_V2
     args_v2.fd = subvolume_fd;
-    strncpy(args_v2.name, argv[3], BTRFS_PATH_NAME_MAX);
+    strncpy(args_v2.name, argv[3], sizeof(args_v2.name) - 1);
     args_v2.flags = BTRFS_SUBVOL_QGROUP_INHERIT;
     args_v2.size = sizeof(inherit) + sizeof(u_int64_t);
     inherit.lim = lim;
     inherit.num_qgroups = 1;
     args_v2.qgroup_inherit = &inherit;
 
-    if (ioctl(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -107,9 +113,9 @@ int main(int argc, char **argv)
            args_v2.name, subvolume_path);
 
     args_v2.fd = subvolume_fd;
-    strncpy(args_v2.name, argv[4], BTRFS_PATH_NAME_MAX);
+    strncpy(args_v2.name, argv[4], sizeof(args_v2.name) - 1);
 
-    if (ioctl(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -119,7 +125,7 @@ int main(int argc, char **argv)
            args_v2.name, subvolume_path);
 #endif
 
-    if (ioctl(volume_fd, BTRFS_IOC_SNAP_DESTROY, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY, &args) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -130,20 +136,20 @@ int main(int argc, char **argv)
 
 #ifdef BTRFS_IOC_SNAP_CREATE_V2
     args_v2.flags = BTRFS_SUBVOL_SPEC_BY_ID;
-    strncpy(snapshot_path, "/mnt/", BTRFS_PATH_NAME_MAX);
-    strncat(snapshot_path, argv[3], BTRFS_PATH_NAME_MAX);
+    snprintf(snapshot_path, sizeof(snapshot_path), "%s/%s",
+             bench_mnt_path(), argv[3]);
     snapshot_fd = openat(AT_FDCWD, snapshot_path, O_RDONLY|O_NONBLOCK |
                           O_CLOEXEC|O_DIRECTORY);
 
-    if (ioctl(snapshot_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+    if (BENCH_IOCTL(snapshot_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
         perror("ioctl");
         return 1;
     }
 
-    strncpy(args_v2.name, "", BTRFS_PATH_NAME_MAX);
+    strncpy(args_v2.name, "", sizeof(args_v2.name) - 1);
     args_v2.subvolid = info.treeid;
 
-    if (ioctl(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
         perror("ioctl");
         return -1;
     }
@@ -152,9 +158,9 @@ int main(int argc, char **argv)
            argv[3], subvolume_path);
 
     args_v2.flags = 0;
-    strncpy(args_v2.name, argv[4], BTRFS_PATH_NAME_MAX);
+    strncpy(args_v2.name, argv[4], sizeof(args_v2.name) - 1);
 
-    if (ioctl(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
         perror("ioctl");
         return -1;
     }
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <mntent.h>
+#include <linux/btrfs.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-workload.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-commit-probe btrfs-commit-probe.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-workload.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 4G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Transaction commit latency. For every combination of -t fsync thread
+ * count and -m dirty MiB, -n probes are taken while the fsync workload
+ * (lib/btrfs-workload, -w fsync or fdatasync) runs: each probe first
+ * writes the given amount of buffered data to new files, then times
+ * BTRFS_IOC_START_SYNC and the BTRFS_IOC_WAIT_SYNC on the transaction
+ * it returned, and finally removes the files:
+ *
+ * sudo ./btrfs-commit-probe  -t 0,1,4,16  -m 0,64,256  -n 20
+ *
+ * A commit only writes back the dirty data itself when the filesystem
+ * is mounted with flushoncommit; otherwise the flusher threads write it
+ * whenever they get to it and -m mostly measures their interference.
+ * The mount options are checked and reported. -S times syncfs()
+ * instead, which writes back all dirty data and then commits, so -m
+ * counts fully with either mount option.
+ *
+ * The commit latency distribution is reported per round together with
+ * the fsync rate and p99 the workload saw meanwhile, since every
+ * commit stalls the fsyncs that land in it.
+ */
+
+#define MAX_ROUNDS 16
+#define DIRTY_FILES 4
+
+struct probe_result {
+    int threads;
+    int dirty_mib;
+    struct bench_hist *commit;
+    __u64 start_sync_ns;
+    double fsync_rate;
+    double fsync_p99_us;
+};
+
+/*
+ * Whether the filesystem at @mnt is mounted with flushoncommit, or -1
+ * if it isn't in the mount table.
+ */
+static int flushoncommit(const char *mnt)
+{
+    struct mntent *ent;
+    FILE *mounts;
+    int ret = -1;
+
+    mounts = setmntent("/proc/self/mounts", "r");
+
+    if (mounts == NULL) {
+        perror("/proc/self/mounts");
+        return -1;
+    }
+
+    /* The last entry wins if something is mounted on top. */
+    while ((ent = getmntent(mounts)) != NULL) {
+        if (strcmp(ent->mnt_dir, mnt) == 0)
+            ret = hasmntopt(ent, "flushoncommit") != NULL;
+    }
+
+    endmntent(mounts);
+
+    return ret;
+}
+
+static void remove_dirty(const char *dir, const char *prefix)
+{
+    char path[BENCH_PATH_MAX];
+    int i;
+
+    for (i = 0; i < DIRTY_FILES; i++) {
+        if (snprintf(path, sizeof(path), "%s/%s-%d", dir, prefix,
+                     i) < (int)sizeof(path))
+            unlink(path);
+    }
+}
+
+/*
+ * The dirty files get a new name for every probe: bench_populate()
+ * opens with O_TRUNC, and after a truncate to zero btrfs starts
+ * writeback of the new data as soon as the file is closed, long before
+ * the commit.
+ */
+static int probe(int volume_fd, const char *dir, int seq, int use_syncfs,
+                 int dirty_mib, struct probe_result *result)
+{
+    char prefix[32];
+    __u64 transid = 0;
+    __u64 start, started;
+    int ret = -1;
+
+    snprintf(prefix, sizeof(prefix), "dirty-%d", seq);
+
+    if (dirty_mib > 0 &&
+        bench_populate(dir, prefix, DIRTY_FILES,
+                       (__u64)dirty_mib << 20) < 0)
+        goto out;
+
+    start = bench_now_ns();
+
+    if (use_syncfs) {
+        if (syncfs(volume_fd) < 0) {
+            perror("syncfs");
+            goto out;
+        }
+
+        started = start;
+    }
+    else {
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_START_SYNC, &transid) < 0) {
+            perror("ioctl BTRFS_IOC_START_SYNC");
+            goto out;
+        }
+
+        started = bench_now_ns();
+
+        if (BENCH_IOCTL(volume_fd, BTRFS_IOC_WAIT_SYNC, &transid) < 0) {
+            perror("ioctl BTRFS_IOC_WAIT_SYNC");
+            goto out;
+        }
+    }
+
+    bench_hist_record(result->commit, bench_now_ns() - start);
+    result->start_sync_ns += started - start;
+    ret = 0;
+
+out:
+    if (dirty_mib > 0)
+        remove_dirty(dir, prefix);
+
+    return ret;
+}
+
+static int run_round(int volume_fd, const struct workload_opts *base,
+                     const char *dir, int probes, int use_syncfs,
+                     struct probe_result *result)
+{
+    static int seq;
+    struct workload_opts opts = *base;
+    struct workload workload;
+    int ret = 0;
+    int i;
+
+    opts.threads = result->threads;
+
+    if (opts.threads > 0 &&
+        (workload_prepare(&workload, &opts) < 0 ||
+         workload_start(&workload) < 0))
+        return -1;
+
+    for (i = 0; i < probes && ret == 0; i++)
+        ret = probe(volume_fd, dir, seq++, use_syncfs, result->dirty_mib,
+                    result);
+
+    if (opts.threads > 0) {
+        double secs;
+
+        workload_stop(&workload);
+        secs = (workload.end_ns - workload.start_ns) / 1e9;
+        result->fsync_rate = secs > 0 ? workload.ops / secs : 0;
+        result->fsync_p99_us = bench_hist_percentile(workload.hist, 99.0) /
+                               1e3;
+        workload_destroy(&workload, 1);
+    }
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    struct workload_opts opts = {0};
+    struct probe_result *results;
+    int threads[MAX_ROUNDS] = {0, 1, 4};
+    int dirty[MAX_ROUNDS] = {0, 64};
+    int num_threads = 3;
+    int num_dirty = 2;
+    int num_results = 0;
+    int probes = 20;
+    int use_syncfs = 0;
+    int flush;
+    char dir[BENCH_PATH_MAX];
+    int opt;
+    int i;
+    int j;
+
+    opts.type = WORKLOAD_FSYNC;
+    opts.dir = bench_mnt_path();
+    opts.file_size = 64ULL << 20;
+    opts.block_size = 4096;
+
+    while ((opt = getopt(argc, argv, "t:m:n:w:s:b:S")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = bench_parse_list(optarg, threads, MAX_ROUNDS, 0);
+
+            if (num_threads < 0) {
+                return 1;
+            }
+            break;
+        case 'm':
+            num_dirty = bench_parse_list(optarg, dirty, MAX_ROUNDS, 0);
+
+            if (num_dirty < 0) {
+                return 1;
+            }
+            break;
+        case 'n':
+            probes = atoi(optarg);
+            break;
+        case 'w':
+            if (workload_parse_type(optarg, &opts.type) < 0 ||
+                (opts.type != WORKLOAD_FSYNC &&
+                 opts.type != WORKLOAD_FDATASYNC)) {
+                fprintf(stderr, "workload must be fsync or fdatasync\n");
+                return 1;
+            }
+            break;
+        case 's':
+            opts.file_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            opts.block_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'S':
+            use_syncfs = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads,...] [-m dirty-mib,...] "
+                    "[-n probes] [-w fsync|fdatasync] [-s file-size] "
+                    "[-b block-size] [-S]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    flush = flushoncommit(bench_mnt_path());
+
+    if (flush == 0 && !use_syncfs) {
+        fprintf(stderr, "%s is not mounted with flushoncommit, commits "
+                "won't write back the dirty data; use -S or remount\n",
+                bench_mnt_path());
+    }
+
+    if (snprintf(dir, sizeof(dir), "%s/commit-probe",
+                 bench_mnt_path()) >= (int)sizeof(dir)) {
+        fprintf(stderr, "probe directory path too long\n");
+        return 1;
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return 1;
+    }
+
+    results = calloc(num_threads * num_dirty, sizeof(*results));
+
+    if (results == NULL) {
+        perror("calloc");
+        return 1;
+    }
+
+    for (i = 0; i < num_threads; i++) {
+        for (j = 0; j < num_dirty; j++) {
+            struct probe_result *result = &results[num_results++];
+
+            result->threads = threads[i];
+            result->dirty_mib = dirty[j];
+            result->commit = bench_hist_alloc();
+
+            if (run_round(volume_fd, &opts, dir, probes, use_syncfs,
+                          result) < 0) {
+                rmdir(dir);
+                return 1;
+            }
+        }
+    }
+
+    rmdir(dir);
+
+    printf("%8s %10s %12s %12s %12s %14s %12s %14s\n", "threads",
+           "dirty-MiB", "commit-p50", "commit-p99", "commit-max",
+           "start-sync-us", "fsyncs/s", "fsync-p99-us");
+
+    for (i = 0; i < num_results; i++) {
+        struct probe_result *r = &results[i];
+
+        printf("%8d %10d %12.2f %12.2f %12.2f %14.1f %12.0f %14.1f\n",
+               r->threads, r->dirty_mib,
+               bench_hist_percentile(r->commit, 50.0) / 1e6,
+               bench_hist_percentile(r->commit, 99.0) / 1e6,
+               r->commit->max / 1e6,
+               r->commit->count ?
+               r->start_sync_ns / 1e3 / r->commit->count : 0,
+               r->fsync_rate, r->fsync_p99_us);
+
+        free(r->commit);
+    }
+
+    printf("\ncommit times in ms, %s workload with %u byte writes\n",
+           workload_type_name(opts.type), opts.block_size);
+    printf("timed %s, flushoncommit %s\n",
+           use_syncfs ? "syncfs()" : "START_SYNC + WAIT_SYNC",
+           flush < 0 ? "unknown" : flush ? "on" : "off");
+
+    free(results);
+    close(volume_fd);
+
+    return 0;
+}
@@ -0,0 +1,571 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-path-cache.h"
+#include "../lib/btrfs-sched.h"
+#include "../lib/btrfs-subvol-enum.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-stress btrfs-stress.c ../lib/btrfs-bench.c \
+ *     ../lib/btrfs-sched.c ../lib/btrfs-subvol-enum.c \
+ *     ../lib/btrfs-path-cache.c ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 4G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Mixed control-path stress: the operations of the snap, subvol,
+ * quota, scrub and dev tests run concurrently as a weighted job mix on
+ * a work-stealing pool (lib/btrfs-sched) for -d seconds.
+ *
+ * -c jobs are kept in flight on -t worker threads; every finished job
+ * queues its successor, drawn from the -m weights, on its own worker,
+ * and idle workers steal the jobs queued behind a long scrub or
+ * commit. -b bytes are written into the snapshot source first so
+ * snapshots and scrubs have something to do:
+ *
+ * sudo ./btrfs-stress  -t 8  -c 32  -d 60  -m snap-create=4,scrub=1
+ *
+ * Jobs that find their resource busy (a second scrub on a device, a
+ * rescan already running) are counted as busy rather than failed, and
+ * destroy jobs with nothing left to destroy create instead. Quotas are
+ * enabled for the run when rescan has a weight and disabled again at
+ * the end. Per-operation throughput and latency percentiles are
+ * printed at the end.
+ */
+
+#define SOURCE_NAME "stress-src"
+#define SOURCE_FILES 64
+#define MAX_NAMES 65536
+
+enum stress_op {
+    OP_SNAP_CREATE,
+    OP_SNAP_DESTROY,
+    OP_SUBVOL_CREATE,
+    OP_SUBVOL_DESTROY,
+    OP_SUBVOL_LIST,
+    OP_RESCAN,
+    OP_SCRUB,
+    OP_DEV_INFO,
+    OP_SYNC,
+    NUM_OPS,
+};
+
+static const char *const op_names[NUM_OPS] = {
+    "snap-create",
+    "snap-destroy",
+    "subvol-create",
+    "subvol-destroy",
+    "subvol-list",
+    "rescan",
+    "scrub",
+    "dev-info",
+    "sync",
+};
+
+static const int default_weights[NUM_OPS] = { 4, 4, 2, 2, 2, 1, 1, 2, 2 };
+
+struct op_stats {
+    struct bench_hist *hist;
+    __u64 busy;
+    __u64 errors;
+};
+
+/* Names of the snapshots or subvolumes created and not destroyed yet. */
+struct name_stack {
+    pthread_mutex_t lock;
+    int ids[MAX_NAMES];
+    int count;
+    int next;
+};
+
+struct stress {
+    int volume_fd;
+    int source_fd;
+    int weights[NUM_OPS];
+    int total_weight;
+    __u64 scrub_bytes;
+    __u64 deadline_ns;
+    int num_devs;
+    struct btrfs_ioctl_dev_info_args *devs;
+    struct name_stack snaps;
+    struct name_stack subvols;
+    struct op_stats stats[NUM_OPS];
+    struct sched_pool pool;
+};
+
+static struct stress stress;
+
+static int parse_mix(const char *arg, int *weights)
+{
+    char *copy = strdup(arg);
+    char *tok;
+    char *save = NULL;
+    int op;
+
+    memset(weights, 0, NUM_OPS * sizeof(*weights));
+
+    for (tok = strtok_r(copy, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+
+        if (eq != NULL)
+            *eq = '\0';
+
+        for (op = 0; op < NUM_OPS; op++) {
+            if (strcmp(tok, op_names[op]) == 0)
+                break;
+        }
+
+        if (op == NUM_OPS) {
+            fprintf(stderr, "unknown operation: %s\n", tok);
+            free(copy);
+            return -1;
+        }
+
+        weights[op] = eq != NULL ? atoi(eq + 1) : 1;
+    }
+
+    free(copy);
+
+    return 0;
+}
+
+static int name_push(struct name_stack *stack, int id)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&stack->lock);
+
+    if (stack->count < MAX_NAMES)
+        stack->ids[stack->count++] = id;
+    else
+        ret = -1;
+
+    pthread_mutex_unlock(&stack->lock);
+
+    return ret;
+}
+
+/* Pop a random name so destroys do not always hit the newest root. */
+static int name_pop(struct name_stack *stack, unsigned int *seed)
+{
+    int id = -1;
+
+    pthread_mutex_lock(&stack->lock);
+
+    if (stack->count > 0) {
+        int i = rand_r(seed) % stack->count;
+
+        id = stack->ids[i];
+        stack->ids[i] = stack->ids[--stack->count];
+    }
+
+    pthread_mutex_unlock(&stack->lock);
+
+    return id;
+}
+
+static int name_next(struct name_stack *stack)
+{
+    return __atomic_fetch_add(&stack->next, 1, __ATOMIC_RELAXED);
+}
+
+static int snap_create(void)
+{
+    struct btrfs_ioctl_vol_args_v2 args = {0};
+    int id = name_next(&stress.snaps);
+
+    args.fd = stress.source_fd;
+    snprintf(args.name, sizeof(args.name), "stress-snap-%d", id);
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_SNAP_CREATE_V2, &args) < 0)
+        return -1;
+
+    return name_push(&stress.snaps, id);
+}
+
+static int subvol_create(void)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    int id = name_next(&stress.subvols);
+
+    snprintf(args.name, sizeof(args.name), "stress-subvol-%d", id);
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0)
+        return -1;
+
+    return name_push(&stress.subvols, id);
+}
+
+static int destroy(const char *prefix, int id)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+
+    snprintf(args.name, sizeof(args.name), "%s-%d", prefix, id);
+
+    return BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_SNAP_DESTROY, &args);
+}
+
+static int subvol_list(void)
+{
+    struct path_cache cache;
+    int ret;
+
+    if (path_cache_init(&cache, 1024) < 0)
+        return -1;
+
+    ret = subvol_enum(stress.volume_fd, &cache, NULL, NULL, NULL);
+    path_cache_destroy(&cache);
+
+    return ret;
+}
+
+static int rescan(void)
+{
+    struct btrfs_ioctl_quota_rescan_args args = {0};
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_QUOTA_RESCAN, &args) < 0)
+        return -1;
+
+    return BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_QUOTA_RESCAN_WAIT, NULL);
+}
+
+/* A read-only scrub of the first -s bytes of a random device. */
+static int scrub(unsigned int *seed)
+{
+    struct btrfs_ioctl_scrub_args args = {0};
+
+    args.devid = stress.devs[rand_r(seed) % stress.num_devs].devid;
+    args.start = 0;
+    args.end = stress.scrub_bytes;
+    args.flags = BTRFS_SCRUB_READONLY;
+
+    return BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_SCRUB, &args);
+}
+
+static int dev_info(void)
+{
+    int i;
+
+    for (i = 0; i < stress.num_devs; i++) {
+        struct btrfs_ioctl_dev_info_args info = {0};
+        struct btrfs_ioctl_get_dev_stats stats = {0};
+
+        info.devid = stress.devs[i].devid;
+        stats.devid = stress.devs[i].devid;
+        stats.nr_items = BTRFS_DEV_STAT_VALUES_MAX;
+
+        if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_DEV_INFO, &info) < 0 ||
+            BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_GET_DEV_STATS,
+                        &stats) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int sync_fs(void)
+{
+    __u64 transid;
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_START_SYNC, &transid) < 0)
+        return -1;
+
+    return BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_WAIT_SYNC, &transid);
+}
+
+static enum stress_op pick_op(unsigned int *seed)
+{
+    int r = rand_r(seed) % stress.total_weight;
+    int op;
+
+    for (op = 0; op < NUM_OPS - 1; op++) {
+        r -= stress.weights[op];
+
+        if (r < 0)
+            break;
+    }
+
+    return op;
+}
+
+static void stress_job(struct sched_worker *worker, void *arg)
+{
+    enum stress_op op = pick_op(&worker->seed);
+    __u64 start;
+    int ret;
+    int id;
+
+    (void)arg;
+
+    /* Nothing left to destroy: keep the mix moving with a create. */
+    if (op == OP_SNAP_DESTROY &&
+        (id = name_pop(&stress.snaps, &worker->seed)) < 0)
+        op = OP_SNAP_CREATE;
+
+    if (op == OP_SUBVOL_DESTROY &&
+        (id = name_pop(&stress.subvols, &worker->seed)) < 0)
+        op = OP_SUBVOL_CREATE;
+
+    start = bench_now_ns();
+
+    switch (op) {
+    case OP_SNAP_CREATE:
+        ret = snap_create();
+        break;
+    case OP_SNAP_DESTROY:
+        ret = destroy("stress-snap", id);
+        break;
+    case OP_SUBVOL_CREATE:
+        ret = subvol_create();
+        break;
+    case OP_SUBVOL_DESTROY:
+        ret = destroy("stress-subvol", id);
+        break;
+    case OP_SUBVOL_LIST:
+        ret = subvol_list();
+        break;
+    case OP_RESCAN:
+        ret = rescan();
+        break;
+    case OP_SCRUB:
+        ret = scrub(&worker->seed);
+        break;
+    case OP_DEV_INFO:
+        ret = dev_info();
+        break;
+    default:
+        ret = sync_fs();
+        break;
+    }
+
+    if (ret == 0) {
+        bench_hist_record(stress.stats[op].hist, bench_now_ns() - start);
+    }
+    else if (errno == EINPROGRESS) {
+        __atomic_fetch_add(&stress.stats[op].busy, 1, __ATOMIC_RELAXED);
+    }
+    else {
+        fprintf(stderr, "%s: %s\n", op_names[op], strerror(errno));
+        __atomic_fetch_add(&stress.stats[op].errors, 1, __ATOMIC_RELAXED);
+    }
+
+    if (bench_now_ns() < stress.deadline_ns)
+        sched_submit(&stress.pool, worker, stress_job, NULL);
+}
+
+static int quota_ctl(__u64 cmd)
+{
+    struct btrfs_ioctl_quota_ctl_args args = {0};
+
+    args.cmd = cmd;
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_QUOTA_CTL, &args) < 0) {
+        perror("ioctl BTRFS_IOC_QUOTA_CTL");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int create_source(__u64 bytes)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    char path[BENCH_PATH_MAX];
+
+    strncpy(args.name, SOURCE_NAME, BTRFS_PATH_NAME_MAX);
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", bench_mnt_path(), SOURCE_NAME);
+
+    if (bench_populate(path, "file", SOURCE_FILES, bytes) < 0)
+        return -1;
+
+    sync();
+    stress.source_fd = bench_open_path(path);
+
+    return stress.source_fd < 0 ? -1 : 0;
+}
+
+static void cleanup(void)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    unsigned int seed = 1;
+    int id;
+
+    while ((id = name_pop(&stress.snaps, &seed)) >= 0)
+        destroy("stress-snap", id);
+
+    while ((id = name_pop(&stress.subvols, &seed)) >= 0)
+        destroy("stress-subvol", id);
+
+    close(stress.source_fd);
+    strncpy(args.name, SOURCE_NAME, BTRFS_PATH_NAME_MAX);
+
+    if (BENCH_IOCTL(stress.volume_fd, BTRFS_IOC_SNAP_DESTROY, &args) < 0)
+        perror("ioctl BTRFS_IOC_SNAP_DESTROY");
+}
+
+int main(int argc, char **argv)
+{
+    __u64 start, elapsed;
+    double seconds;
+    int threads = 4;
+    int inflight = 16;
+    int duration = 30;
+    __u64 source_bytes = 256ULL << 20;
+    __u64 executed = 0, stolen = 0;
+    int opt;
+    int op;
+    int i;
+
+    memcpy(stress.weights, default_weights, sizeof(stress.weights));
+    stress.scrub_bytes = 256ULL << 20;
+
+    while ((opt = getopt(argc, argv, "t:c:d:m:b:s:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            inflight = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'm':
+            if (parse_mix(optarg, stress.weights) < 0)
+                return 1;
+            break;
+        case 'b':
+            source_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            stress.scrub_bytes = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-c inflight] "
+                    "[-d seconds] [-m op=weight,...] [-b source-bytes] "
+                    "[-s scrub-bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (op = 0; op < NUM_OPS; op++) {
+        stress.total_weight += stress.weights[op];
+        stress.stats[op].hist = bench_hist_alloc();
+    }
+
+    if (threads <= 0 || inflight <= 0 || stress.total_weight <= 0) {
+        fprintf(stderr, "threads, jobs and the mix weights must be positive\n");
+        return 1;
+    }
+
+    pthread_mutex_init(&stress.snaps.lock, NULL);
+    pthread_mutex_init(&stress.subvols.lock, NULL);
+
+    stress.volume_fd = bench_open_volume();
+
+    if (stress.volume_fd < 0) {
+        return 1;
+    }
+
+    stress.num_devs = bench_list_devices(stress.volume_fd, &stress.devs);
+
+    if (stress.num_devs <= 0) {
+        return 1;
+    }
+
+    if (create_source(source_bytes) < 0) {
+        return 1;
+    }
+
+    if (stress.weights[OP_RESCAN] > 0 &&
+        quota_ctl(BTRFS_QUOTA_CTL_ENABLE) < 0) {
+        cleanup();
+        return 1;
+    }
+
+    if (sched_pool_start(&stress.pool, threads) < 0) {
+        cleanup();
+        return 1;
+    }
+
+    start = bench_now_ns();
+    stress.deadline_ns = start + duration * 1000000000ULL;
+
+    for (i = 0; i < inflight; i++)
+        sched_submit(&stress.pool, NULL, stress_job, NULL);
+
+    sched_pool_wait(&stress.pool);
+    elapsed = bench_now_ns() - start;
+
+    for (i = 0; i < stress.pool.num_workers; i++) {
+        executed += stress.pool.workers[i].executed;
+        stolen += stress.pool.workers[i].stolen;
+    }
+
+    sched_pool_stop(&stress.pool);
+
+    if (stress.weights[OP_RESCAN] > 0)
+        quota_ctl(BTRFS_QUOTA_CTL_DISABLE);
+
+    cleanup();
+
+    seconds = elapsed / 1e9;
+
+    printf("%-15s %8s %10s %10s %10s %10s %6s %6s\n", "operation", "ops",
+           "ops/s", "p50-ms", "p99-ms", "max-ms", "busy", "errors");
+
+    for (op = 0; op < NUM_OPS; op++) {
+        struct op_stats *s = &stress.stats[op];
+
+        if (stress.weights[op] == 0 && s->hist->count == 0)
+            continue;
+
+        printf("%-15s %8llu %10.1f %10.2f %10.2f %10.2f %6llu %6llu\n",
+               op_names[op], s->hist->count, s->hist->count / seconds,
+               bench_hist_percentile(s->hist, 50.0) / 1e6,
+               bench_hist_percentile(s->hist, 99.0) / 1e6,
+               s->hist->max / 1e6, s->busy, s->errors);
+
+        free(s->hist);
+    }
+
+    printf("\n%d threads, %d jobs in flight, %.1f s: %llu jobs, %llu stolen\n",
+           threads, inflight, seconds, executed, stolen);
+
+    free(stress.devs);
+    close(stress.volume_fd);
+
+    return 0;
+}
@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-tree-search.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-subvol-churn btrfs-subvol-churn.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Short-lived subvolume churn. Each round creates -n subvolumes from
+ * -t threads, spread over -p parent directories, fills each with -b
+ * bytes of data (untimed, after all creates), then deletes them all by
+ * id with BTRFS_IOC_SNAP_DESTROY_V2 and BTRFS_SUBVOL_SPEC_BY_ID:
+ *
+ * sudo ./btrfs-subvol-churn  -t 1,4,16  -n 10000  -p 64  -b 65536
+ *
+ * SNAP_DESTROY only unlinks the subvolume; its trees are dropped later
+ * by the cleaner thread. After the deletes a commit is forced and the
+ * time until the cleaner has dropped every deleted root is measured,
+ * with BTRFS_IOC_SUBVOL_SYNC_WAIT where the kernel has it and
+ * otherwise by polling the root tree every -i ms for the ROOT_ITEMs of
+ * the deleted subvolumes that are left (which needs root), for at most
+ * -w seconds. The space given back is the drop in SPACE_INFO used
+ * bytes across the delete and cleanup.
+ */
+
+#define MAX_ROUNDS 16
+
+enum churn_phase {
+    PHASE_CREATE,
+    PHASE_POPULATE,
+    PHASE_DESTROY,
+};
+
+struct churn_round {
+    int id;
+    int threads;
+    int subvols;
+    int parents;
+    __u64 bytes;
+    int volume_fd;
+    int *parent_fds;
+    __u64 *subvol_ids;
+    unsigned char *destroyed;
+};
+
+struct churn_worker {
+    pthread_t thread;
+    struct churn_round *round;
+    int first;
+    int count;
+    int failed;
+    struct bench_hist *create_hist;
+    struct bench_hist *destroy_hist;
+    enum churn_phase phase;
+};
+
+/* Deleted subvolume ids, sorted, whose ROOT_ITEMs are still counted. */
+struct root_poll {
+    __u64 *ids;
+    int count;
+    __u64 left;
+};
+
+struct churn_result {
+    int threads;
+    double create_rate;
+    double create_p99_ms;
+    double destroy_rate;
+    double destroy_p99_ms;
+    double cleanup_s;
+    double reclaimed_mib;
+    const char *cleanup_method;
+    int failed;
+};
+
+static void subvol_path(char *path, const struct churn_round *round, int i)
+{
+    snprintf(path, BENCH_PATH_MAX, "%s/churn-%d/parent-%d/subvol-%d",
+             bench_mnt_path(), round->id, i % round->parents, i);
+}
+
+/* The tree id of a subvolume is the treeid of its root directory. */
+static int create_one(struct churn_round *round, int i)
+{
+    struct btrfs_ioctl_vol_args args = {0};
+    struct btrfs_ioctl_ino_lookup_args lookup = {0};
+    char path[BENCH_PATH_MAX];
+    int fd;
+
+    snprintf(args.name, sizeof(args.name), "subvol-%d", i);
+
+    if (BENCH_IOCTL(round->parent_fds[i % round->parents],
+                    BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+        return -1;
+    }
+
+    subvol_path(path, round, i);
+    fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    lookup.objectid = BTRFS_FIRST_FREE_OBJECTID;
+
+    if (BENCH_IOCTL(fd, BTRFS_IOC_INO_LOOKUP, &lookup) < 0) {
+        perror("ioctl BTRFS_IOC_INO_LOOKUP");
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    round->subvol_ids[i] = lookup.treeid;
+
+    return 0;
+}
+
+static int populate_one(struct churn_round *round, int i)
+{
+    char path[BENCH_PATH_MAX];
+
+    if (round->subvol_ids[i] == 0)
+        return 0;
+
+    subvol_path(path, round, i);
+
+    return bench_populate(path, "data", 1, round->bytes);
+}
+
+static int destroy_one(struct churn_round *round, int i)
+{
+    struct btrfs_ioctl_vol_args_v2 args = {0};
+
+    if (round->subvol_ids[i] == 0)
+        return 0;
+
+    args.flags = BTRFS_SUBVOL_SPEC_BY_ID;
+    args.subvolid = round->subvol_ids[i];
+
+    if (BENCH_IOCTL(round->volume_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args) < 0) {
+        perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+        return -1;
+    }
+
+    round->destroyed[i] = 1;
+
+    return 0;
+}
+
+static void *churn_thread(void *data)
+{
+    struct churn_worker *worker = data;
+    int i;
+
+    for (i = worker->first; i < worker->first + worker->count; i++) {
+        __u64 start = bench_now_ns();
+
+        if (worker->phase == PHASE_CREATE) {
+            if (create_one(worker->round, i) < 0) {
+                worker->failed++;
+                continue;
+            }
+
+            bench_hist_record(worker->create_hist, bench_now_ns() - start);
+        }
+        else if (worker->phase == PHASE_POPULATE) {
+            if (populate_one(worker->round, i) < 0)
+                worker->failed++;
+        }
+        else {
+            if (destroy_one(worker->round, i) < 0) {
+                worker->failed++;
+                continue;
+            }
+
+            bench_hist_record(worker->destroy_hist, bench_now_ns() - start);
+        }
+    }
+
+    return NULL;
+}
+
+/* Run one phase on all workers; returns the wall time. */
+static __u64 run_phase(struct churn_worker *workers, int threads,
+                       enum churn_phase phase)
+{
+    __u64 start = bench_now_ns();
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        workers[i].phase = phase;
+
+        if (pthread_create(&workers[i].thread, NULL, churn_thread,
+                           &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    for (i = 0; i < threads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    return bench_now_ns() - start;
+}
+
+static int compare_id(const void *a, const void *b)
+{
+    __u64 x = *(const __u64 *)a;
+    __u64 y = *(const __u64 *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int count_root(const struct btrfs_ioctl_search_header *hdr,
+                      const void *item, void *data)
+{
+    struct root_poll *poll = data;
+    __u64 id = ts_hdr_objectid(hdr);
+
+    (void)item;
+
+    if (ts_hdr_type(hdr) == BTRFS_ROOT_ITEM_KEY &&
+        bsearch(&id, poll->ids, poll->count, sizeof(id), compare_id) != NULL)
+        poll->left++;
+
+    return 0;
+}
+
+/* Sum of used bytes over all space infos, i.e. data and metadata. */
+static __u64 used_bytes(int volume_fd)
+{
+    struct btrfs_ioctl_space_args *space;
+    struct btrfs_ioctl_space_args probe = {0};
+    __u64 used = 0;
+    __u64 i;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SPACE_INFO, &probe) < 0) {
+        perror("ioctl BTRFS_IOC_SPACE_INFO");
+        return 0;
+    }
+
+    space = calloc(1, sizeof(*space) +
+                   probe.total_spaces * sizeof(space->spaces[0]));
+
+    if (space == NULL) {
+        perror("calloc");
+        return 0;
+    }
+
+    space->space_slots = probe.total_spaces;
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SPACE_INFO, space) < 0)
+        perror("ioctl BTRFS_IOC_SPACE_INFO");
+    else
+        for (i = 0; i < space->total_spaces; i++)
+            used += space->spaces[i].used_bytes;
+
+    free(space);
+
+    return used;
+}
+
+/*
+ * ROOT_ITEMs of deleted subvolumes stay until the cleaner drops them.
+ * Only the ids in @poll are waited for, so a failed delete or a
+ * subvolume created by someone else can't keep the loop going; the
+ * deadline covers a cleaner that never gets there. Returns 1 if roots
+ * were still left when it passed.
+ */
+static int wait_cleaner_poll(int volume_fd, struct root_poll *poll,
+                             __u64 interval_ms, __u64 timeout_s)
+{
+    __u64 deadline = bench_now_ns() + timeout_s * 1000000000ULL;
+    struct tree_search ts;
+    int ret = 0;
+
+    if (tree_search_init(&ts, volume_fd, TREE_SEARCH_DEFAULT_BUF) < 0)
+        return -1;
+
+    for (;;) {
+        poll->left = 0;
+        tree_search_reset(&ts, BTRFS_ROOT_TREE_OBJECTID, poll->ids[0],
+                          poll->ids[poll->count - 1], BTRFS_ROOT_ITEM_KEY,
+                          BTRFS_ROOT_ITEM_KEY, 0);
+
+        if (tree_search_walk(&ts, count_root, poll) < 0) {
+            ret = -1;
+            break;
+        }
+
+        if (poll->left == 0)
+            break;
+
+        if (bench_now_ns() >= deadline) {
+            ret = 1;
+            break;
+        }
+
+        usleep(interval_ms * 1000);
+    }
+
+    tree_search_free(&ts);
+
+    return ret;
+}
+
+static int wait_cleaner(int volume_fd, struct root_poll *poll,
+                        __u64 interval_ms, __u64 timeout_s,
+                        const char **method)
+{
+#ifdef BTRFS_IOC_SUBVOL_SYNC_WAIT
+    struct btrfs_ioctl_subvol_wait wait = {0};
+
+    wait.mode = BTRFS_SUBVOL_SYNC_WAIT_FOR_QUEUED;
+    *method = "sync-wait";
+
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_SYNC_WAIT, &wait) == 0)
+        return 0;
+
+    if (errno != ENOTTY && errno != EINVAL) {
+        perror("ioctl BTRFS_IOC_SUBVOL_SYNC_WAIT");
+        return -1;
+    }
+#endif
+
+    *method = "root-poll";
+
+    return wait_cleaner_poll(volume_fd, poll, interval_ms, timeout_s);
+}
+
+static int run_round(struct churn_round *round, __u64 interval_ms,
+                     __u64 timeout_s, struct churn_result *result)
+{
+    struct churn_worker *workers;
+    struct bench_hist *create_hist = bench_hist_alloc();
+    struct bench_hist *destroy_hist = bench_hist_alloc();
+    char path[BENCH_PATH_MAX];
+    struct root_poll poll = {0};
+    __u64 create_ns, destroy_ns, start, transid = 0;
+    __u64 used_before;
+    int per_thread = round->subvols / round->threads;
+    int extra = round->subvols % round->threads;
+    int first = 0;
+    int ret = 0;
+    int i;
+
+    workers = calloc(round->threads, sizeof(*workers));
+    round->parent_fds = calloc(round->parents, sizeof(int));
+    round->subvol_ids = calloc(round->subvols, sizeof(__u64));
+    round->destroyed = calloc(round->subvols, 1);
+    poll.ids = calloc(round->subvols, sizeof(__u64));
+
+    if (workers == NULL || round->parent_fds == NULL ||
+        round->subvol_ids == NULL || round->destroyed == NULL ||
+        poll.ids == NULL) {
+        perror("calloc");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/churn-%d", bench_mnt_path(), round->id);
+    mkdir(path, 0755);
+
+    for (i = 0; i < round->parents; i++) {
+        snprintf(path, sizeof(path), "%s/churn-%d/parent-%d",
+                 bench_mnt_path(), round->id, i);
+
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+
+        round->parent_fds[i] = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+
+        if (round->parent_fds[i] < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    for (i = 0; i < round->threads; i++) {
+        workers[i].round = round;
+        workers[i].first = first;
+        workers[i].count = per_thread + (i < extra);
+        workers[i].create_hist = create_hist;
+        workers[i].destroy_hist = destroy_hist;
+        first += workers[i].count;
+    }
+
+    create_ns = run_phase(workers, round->threads, PHASE_CREATE);
+
+    if (round->bytes > 0)
+        run_phase(workers, round->threads, PHASE_POPULATE);
+
+    if (syncfs(round->volume_fd) < 0)
+        perror("syncfs");
+
+    used_before = used_bytes(round->volume_fd);
+    destroy_ns = run_phase(workers, round->threads, PHASE_DESTROY);
+
+    for (i = 0; i < round->subvols; i++) {
+        if (round->destroyed[i])
+            poll.ids[poll.count++] = round->subvol_ids[i];
+    }
+
+    qsort(poll.ids, poll.count, sizeof(*poll.ids), compare_id);
+
+    /* The cleaner only picks up roots whose deletion was committed. */
+    start = bench_now_ns();
+
+    if (BENCH_IOCTL(round->volume_fd, BTRFS_IOC_START_SYNC, &transid) < 0 ||
+        BENCH_IOCTL(round->volume_fd, BTRFS_IOC_WAIT_SYNC, &transid) < 0) {
+        perror("ioctl BTRFS_IOC_WAIT_SYNC");
+        ret = -1;
+    }
+    else if (poll.count > 0) {
+        ret = wait_cleaner(round->volume_fd, &poll, interval_ms, timeout_s,
+                           &result->cleanup_method);
+
+        if (ret > 0) {
+            fprintf(stderr, "%llu deleted roots left after %llu s\n",
+                    poll.left, timeout_s);
+            result->cleanup_method = "timeout";
+            ret = 0;
+        }
+    }
+
+    result->cleanup_s = (bench_now_ns() - start) / 1e9;
+
+    /* The freed extents are only accounted once another commit ran. */
+    if (syncfs(round->volume_fd) < 0)
+        perror("syncfs");
+
+    result->reclaimed_mib = ((double)used_before -
+                             (double)used_bytes(round->volume_fd)) /
+                            (1 << 20);
+    result->threads = round->threads;
+    result->create_rate = create_hist->count / (create_ns / 1e9);
+    result->create_p99_ms = bench_hist_percentile(create_hist, 99.0) / 1e6;
+    result->destroy_rate = destroy_hist->count / (destroy_ns / 1e9);
+    result->destroy_p99_ms = bench_hist_percentile(destroy_hist, 99.0) / 1e6;
+
+    for (i = 0; i < round->threads; i++)
+        result->failed += workers[i].failed;
+
+    for (i = 0; i < round->parents; i++) {
+        close(round->parent_fds[i]);
+        snprintf(path, sizeof(path), "%s/churn-%d/parent-%d",
+                 bench_mnt_path(), round->id, i);
+        rmdir(path);
+    }
+
+    snprintf(path, sizeof(path), "%s/churn-%d", bench_mnt_path(), round->id);
+    rmdir(path);
+
+    free(round->parent_fds);
+    free(round->subvol_ids);
+    free(round->destroyed);
+    free(poll.ids);
+    free(workers);
+    free(create_hist);
+    free(destroy_hist);
+
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    int threads[MAX_ROUNDS] = {1, 4};
+    int num_threads = 2;
+    struct churn_result results[MAX_ROUNDS];
+    __u64 interval_ms = 100;
+    __u64 timeout_s = 600;
+    __u64 bytes = 0;
+    int subvols = 1000;
+    int parents = 16;
+    int volume_fd;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "t:n:p:b:i:w:")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = bench_parse_list(optarg, threads, MAX_ROUNDS, 1);
+
+            if (num_threads < 0) {
+                return 1;
+            }
+            break;
+        case 'n':
+            subvols = atoi(optarg);
+            break;
+        case 'p':
+            parents = atoi(optarg);
+            break;
+        case 'b':
+            bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            interval_ms = strtoull(optarg, NULL, 10);
+            break;
+        case 'w':
+            timeout_s = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads,...] [-n subvols] "
+                    "[-p parents] [-b bytes] [-i interval-ms] "
+                    "[-w timeout-s]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (subvols <= 0 || parents <= 0) {
+        fprintf(stderr, "subvolume and parent counts must be positive\n");
+        return 1;
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    memset(results, 0, sizeof(results));
+
+    for (i = 0; i < num_threads; i++) {
+        struct churn_round round = {0};
+
+        round.id = i;
+        round.threads = threads[i];
+        round.subvols = subvols;
+        round.parents = parents;
+        round.bytes = bytes;
+        round.volume_fd = volume_fd;
+        results[i].cleanup_method = "-";
+
+        if (run_round(&round, interval_ms, timeout_s, &results[i]) < 0) {
+            return 1;
+        }
+    }
+
+    printf("%8s %11s %11s %11s %11s %10s %10s %10s %7s\n", "threads",
+           "creates/s", "create-p99", "deletes/s", "delete-p99",
+           "cleanup-s", "freed-MiB", "method", "failed");
+
+    for (i = 0; i < num_threads; i++) {
+        struct churn_result *r = &results[i];
+
+        printf("%8d %11.1f %11.2f %11.1f %11.2f %10.2f %10.1f %10s %7d\n",
+               r->threads, r->create_rate, r->create_p99_ms,
+               r->destroy_rate, r->destroy_p99_ms, r->cleanup_s,
+               r->reclaimed_mib, r->cleanup_method, r->failed);
+    }
+
+    printf("\n%d subvolumes under %d parents per round, %llu bytes each, "
+           "latencies in ms\n", subvols, parents, bytes);
+
+    close(volume_fd);
+
+    return 0;
+}
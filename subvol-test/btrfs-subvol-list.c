@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
+#include <string.h>
+
+#include "../lib/btrfs-bench.h"
+#include "../lib/btrfs-subvol-enum.h"
+#include "../lib/btrfs-tree-search.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-subvol-list btrfs-subvol-list.c \
+ *     ../lib/btrfs-bench.c ../lib/btrfs-path-cache.c ../lib/btrfs-subvol-enum.c \
+ *     ../lib/btrfs-tree-search.c
+ */
+
+/*
+ * Run the following commands before executing the program
+ * to setup a test loop device with btrfs filesystem:
+ *
+ * qemu-img create -f raw test-disk.img 10G
+ * sudo losetup -f test-disk.img
+ * sudo mkfs -t btrfs /dev/loopX
+ * sudo mount /dev/loop0 /mnt
+ *
+ * After finishing with the loop device, run following commands
+ * for cleanup:
+ *
+ * sudo umount /mnt
+ * sudo losetup -d /dev/loop0
+ */
+
+/*
+ * Lists every subvolume below /mnt with the paginated enumeration
+ * engine and reports how long the walk took.
+ *
+ * With -c the program first creates that many subvolumes in a tree
+ * with the given fan-out (-f, default 0 = all flat under /mnt) and
+ * removes them again at the end unless -k is passed. -p prints the
+ * listing, -r repeats the enumeration. -s additionally counts the
+ * subvolumes by scanning ROOT_ITEMs of the root tree with
+ * TREE_SEARCH_V2, which needs root but skips path resolution:
+ *
+ *  ./btrfs-subvol-list  -c 100000  -f 100  -r 3  -s
+ */
+
+struct list_opts {
+    int print;
+};
+
+static int print_subvol(const struct subvol_entry *entry, void *data)
+{
+    struct list_opts *opts = data;
+
+    if (opts->print)
+        printf("ID %llu parent %llu path %s\n", entry->treeid,
+               entry->parent, entry->path);
+
+    return 0;
+}
+
+static int count_root_item(const struct btrfs_ioctl_search_header *hdr,
+                           const void *item, void *data)
+{
+    __u64 *count = data;
+
+    (void)item;
+
+    if (ts_hdr_type(hdr) == BTRFS_ROOT_ITEM_KEY)
+        (*count)++;
+
+    return 0;
+}
+
+static int scan_root_tree(int volume_fd)
+{
+    struct tree_search ts;
+    __u64 count = 0;
+    __u64 start, elapsed;
+
+    if (tree_search_init(&ts, volume_fd, TREE_SEARCH_MAX_BUF) < 0)
+        return -1;
+
+    tree_search_reset(&ts, BTRFS_ROOT_TREE_OBJECTID,
+                      BTRFS_FIRST_FREE_OBJECTID, BTRFS_LAST_FREE_OBJECTID,
+                      BTRFS_ROOT_ITEM_KEY, BTRFS_ROOT_ITEM_KEY, 0);
+    start = bench_now_ns();
+
+    if (tree_search_walk(&ts, count_root_item, &count) < 0) {
+        tree_search_free(&ts);
+        return -1;
+    }
+
+    elapsed = bench_now_ns() - start;
+
+    printf("%6s %10llu %10llu %10s %12.1f %12.2f\n", "scan", count,
+           ts.ioctls, "-", elapsed / 1e6,
+           count ? elapsed / 1e3 / count : 0.0);
+
+    tree_search_free(&ts);
+
+    return 0;
+}
+
+static void free_paths(char **paths, int count)
+{
+    int i;
+
+    for (i = 0; i <= count; i++)
+        free(paths[i]);
+
+    free(paths);
+}
+
+static char **subvol_paths(int count, int fanout)
+{
+    char **paths;
+    int i;
+
+    paths = calloc(count + 1, sizeof(*paths));
+
+    if (paths == NULL) {
+        perror("calloc");
+        return NULL;
+    }
+
+    paths[0] = strdup("");
+
+    if (paths[0] == NULL) {
+        perror("strdup");
+        free(paths);
+        return NULL;
+    }
+
+    for (i = 1; i <= count; i++) {
+        int parent = fanout ? (i - 1) / fanout : 0;
+        char path[BENCH_PATH_MAX];
+        int len;
+
+        len = snprintf(path, sizeof(path), "%s%ss%d", paths[parent],
+                       parent ? "/" : "", i);
+
+        /* A chain this deep can't be created or listed either. */
+        if (len >= (int)sizeof(path)) {
+            fprintf(stderr, "subvolume %d: path too long, use a larger "
+                    "fanout\n", i);
+            free_paths(paths, i - 1);
+            return NULL;
+        }
+
+        paths[i] = strdup(path);
+
+        if (paths[i] == NULL) {
+            perror("strdup");
+            free_paths(paths, i - 1);
+            return NULL;
+        }
+    }
+
+    return paths;
+}
+
+static int create_subvols(int volume_fd, char **paths, int count)
+{
+    struct btrfs_ioctl_vol_args args;
+    int i;
+
+    for (i = 1; i <= count; i++) {
+        char *slash = strrchr(paths[i], '/');
+        int parent_fd = volume_fd;
+
+        memset(&args, 0, sizeof(args));
+
+        if (slash != NULL) {
+            *slash = '\0';
+            parent_fd = openat(volume_fd, paths[i], O_RDONLY|O_NONBLOCK
+                               |O_CLOEXEC|O_DIRECTORY);
+            *slash = '/';
+
+            if (parent_fd < 0) {
+                perror("openat");
+                return -1;
+            }
+
+            strncpy(args.name, slash + 1, BTRFS_PATH_NAME_MAX);
+        }
+        else {
+            strncpy(args.name, paths[i], BTRFS_PATH_NAME_MAX);
+        }
+
+        if (BENCH_IOCTL(parent_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+            perror("ioctl BTRFS_IOC_SUBVOL_CREATE");
+            return -1;
+        }
+
+        if (parent_fd != volume_fd)
+            close(parent_fd);
+    }
+
+    return 0;
+}
+
+/* Children have higher indexes than their parents, so go backwards. */
+static int destroy_subvols(int volume_fd, char **paths, int count)
+{
+    struct btrfs_ioctl_vol_args_v2 args_v2;
+    int i;
+
+    for (i = count; i >= 1; i--) {
+        char *slash = strrchr(paths[i], '/');
+        int parent_fd = volume_fd;
+
+        memset(&args_v2, 0, sizeof(args_v2));
+
+        if (slash != NULL) {
+            *slash = '\0';
+            parent_fd = openat(volume_fd, paths[i], O_RDONLY|O_NONBLOCK
+                               |O_CLOEXEC|O_DIRECTORY);
+            *slash = '/';
+
+            if (parent_fd < 0) {
+                perror("openat");
+                return -1;
+            }
+
+            strncpy(args_v2.name, slash + 1, BTRFS_SUBVOL_NAME_MAX);
+        }
+        else {
+            strncpy(args_v2.name, paths[i], BTRFS_SUBVOL_NAME_MAX);
+        }
+
+        if (BENCH_IOCTL(parent_fd, BTRFS_IOC_SNAP_DESTROY_V2, &args_v2) < 0) {
+            perror("ioctl BTRFS_IOC_SNAP_DESTROY_V2");
+            return -1;
+        }
+
+        if (parent_fd != volume_fd)
+            close(parent_fd);
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int volume_fd;
+    int count = 0;
+    int fanout = 0;
+    int repeats = 1;
+    int keep = 0;
+    int scan = 0;
+    char **paths = NULL;
+    struct list_opts opts = {0};
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "c:f:r:kps")) != -1) {
+        switch (opt) {
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 'f':
+            fanout = atoi(optarg);
+            break;
+        case 'r':
+            repeats = atoi(optarg);
+            break;
+        case 'k':
+            keep = 1;
+            break;
+        case 'p':
+            opts.print = 1;
+            break;
+        case 's':
+            scan = 1;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c count] [-f fanout] [-r repeats] "
+                    "[-k] [-p] [-s]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    volume_fd = bench_open_volume();
+
+    if (volume_fd < 0) {
+        return 1;
+    }
+
+    if (count > 0) {
+        __u64 start = bench_now_ns();
+
+        paths = subvol_paths(count, fanout);
+
+        if (paths == NULL || create_subvols(volume_fd, paths, count) < 0) {
+            return 1;
+        }
+
+        printf("Created %d subvolumes in %.3f s\n\n", count,
+               (bench_now_ns() - start) / 1e9);
+    }
+
+    printf("%6s %10s %10s %10s %12s %12s\n", "run", "subvols", "rootref",
+           "lookups", "time(ms)", "per-subvol(us)");
+
+    for (i = 0; i < repeats; i++) {
+        struct subvol_enum_stats stats = {0};
+        struct path_cache cache;
+        __u64 start, elapsed;
+
+        if (path_cache_init(&cache, count) < 0) {
+            return 1;
+        }
+
+        start = bench_now_ns();
+
+        if (subvol_enum(volume_fd, &cache, print_subvol, &opts, &stats) < 0) {
+            return 1;
+        }
+
+        elapsed = bench_now_ns() - start;
+
+        printf("%6d %10llu %10llu %10llu %12.1f %12.2f\n", i,
+               stats.subvols, stats.rootref_calls, stats.lookup_calls,
+               elapsed / 1e6,
+               stats.subvols ? elapsed / 1e3 / stats.subvols : 0.0);
+
+        path_cache_destroy(&cache);
+    }
+
+    if (scan && scan_root_tree(volume_fd) < 0) {
+        return 1;
+    }
+
+    if (count > 0 && !keep) {
+        if (destroy_subvols(volume_fd, paths, count) < 0) {
+            return 1;
+        }
+    }
+
+    if (paths != NULL)
+        free_paths(paths, count);
+
+    return 0;
+}
@@ -7,6 +7,14 @@
 #include <linux/btrfs_tree.h>
 #include <string.h>
 
+#include "../lib/btrfs-bench.h"
+
+/*
+ * Build the program together with the shared ioctl harness:
+ *
+ * gcc -O2 -pthread -o btrfs-subvol-test btrfs-subvol-test.c ../lib/btrfs-bench.c
+ */
+
 /*
  * Run the following commands before executing the program
  * to setup a test loop device with btrfs filesystem:
@@ -54,23 +62,24 @@ int main(int argc, char **argv)
         return 1;
     }
 
-    volume_fd = openat(AT_FDCWD, "/mnt", O_RDONLY|O_NONBLOCK
-                       |O_CLOEXEC|O_DIRECTORY);
+    volume_fd = bench_open_volume();
 
     if (volume_fd < 0) {
-        perror("open");
         return 1;
     }
 
     strncpy(args.name, argv[1], BTRFS_PATH_NAME_MAX);
 
-    if (ioctl(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE, &args) < 0) {
         perror("ioctl");
         return 1;
     }
 
-    strncpy(subvolume_path, "/mnt/", BTRFS_PATH_NAME_MAX);
-    strncat(subvolume_path, args.name, BTRFS_PATH_NAME_MAX);
+    if (snprintf(subvolume_path, sizeof(subvolume_path), "%s/%s",
+                 bench_mnt_path(), args.name) >= (int)sizeof(subvolume_path)) {
+        fprintf(stderr, "subvolume path too long\n");
+        return 1;
+    }
 
     printf("ioctl BTRFS_SUBVOL_CREATE:\n");
     printf("Successfully created btrfs subvolume: \"%s\"\n\n",subvolume_path);
@@ -83,16 +92,20 @@ int main(int argc, char **argv)
     inherit.num_qgroups = 1;
     args_v2.qgroup_inherit = &inherit;
 
-    strncpy(args_v2.name, argv[2], BTRFS_PATH_NAME_MAX);
+    strncpy(args_v2.name, argv[2], sizeof(args_v2.name) - 1);
 
-    if (ioctl(volume_fd, BTRFS_IOC_SUBVOL_CREATE_V2, &args_v2) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_SUBVOL_CREATE_V2, &args_v2) < 0) {
         perror("ioctl");
         return 1;
     }
 #endif
 
-    strncpy(subvolume_path_v2, "/mnt/", BTRFS_PATH_NAME_MAX);
-    strncat(subvolume_path_v2, args_v2.name, BTRFS_PATH_NAME_MAX);
+    if (snprintf(subvolume_path_v2, sizeof(subvolume_path_v2), "%s/%s",
+                 bench_mnt_path(),
+                 args_v2.name) >= (int)sizeof(subvolume_path_v2)) {
+        fprintf(stderr, "subvolume path too long\n");
+        return 1;
+    }
 
     printf("ioctl BTRFS_SUBVOL_CREATE_V2:\n");
     printf("Successfully created btrfs subvolume: \"%s\"\n\n",subvolume_path_v2);
@@ -100,7 +113,7 @@ int main(int argc, char **argv)
     subvolume_fd = openat(AT_FDCWD, subvolume_path, O_RDONLY|O_NONBLOCK
                           |O_CLOEXEC|O_DIRECTORY);
 
-    if (ioctl(subvolume_fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) < 0) {
+    if (BENCH_IOCTL(subvolume_fd, BTRFS_IOC_SUBVOL_SETFLAGS, &flags) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -108,7 +121,7 @@ int main(int argc, char **argv)
     printf("ioctl BTRFS_SUBVOL_SETFLAGS:\n");
     printf("Subvolume \"%s\" flags set to BTRFS_SUBVOL_RDONLY.\n\n", subvolume_path);
 
-    if (ioctl(subvolume_fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0) {
+    if (BENCH_IOCTL(subvolume_fd, BTRFS_IOC_SUBVOL_GETFLAGS, &flags) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -121,7 +134,7 @@ int main(int argc, char **argv)
         printf("Invalid flags reading!\n\n");
     }
 
-    if (ioctl(subvolume_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
+    if (BENCH_IOCTL(subvolume_fd, BTRFS_IOC_GET_SUBVOL_INFO, &info) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -134,7 +147,7 @@ int main(int argc, char **argv)
 
     default_subvol = info.treeid;
 
-    if (ioctl(volume_fd, BTRFS_IOC_DEFAULT_SUBVOL, &default_subvol) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_DEFAULT_SUBVOL, &default_subvol) < 0) {
         perror("ioctl");
         return 1;
     }
@@ -144,7 +157,7 @@ int main(int argc, char **argv)
 
     rootref_args.min_treeid = BTRFS_FIRST_FREE_OBJECTID;
 
-    if (ioctl(volume_fd, BTRFS_IOC_GET_SUBVOL_ROOTREF, &rootref_args) < 0) {
+    if (BENCH_IOCTL(volume_fd, BTRFS_IOC_GET_SUBVOL_ROOTREF, &rootref_args) < 0) {
         perror("ioctl");
         return 1;
     }